@@ -38,6 +38,18 @@ static void send_signal (App *app, const gchar *signal_name, GVariant *parameter
 		GST_DEBUG ("no dbus connection, can't send signal %s", signal_name);
 }
 
+/* every session signals on its own object, the primary one additionally keeps the legacy signals of the main object */
+static void upstream_signal (DreamTCPupstream *t, const gchar *legacy_name, const gchar *signal_name, GVariant *parameters)
+{
+	App *app = t->app;
+	g_variant_ref_sink (parameters);
+	if (t == app->tcp_upstream)
+		send_signal (app, legacy_name, parameters);
+	if (app->dbus_connection && t->registration_id)
+		g_dbus_connection_emit_signal (app->dbus_connection, NULL, t->object_path, upstream_interface, signal_name, parameters, NULL);
+	g_variant_unref (parameters);
+}
+
 static gboolean gst_set_inputmode(App *app, inputMode input_mode)
 {
 	if (!app->pipeline)
@@ -370,14 +382,11 @@ static gboolean gst_set_level (App *app, gint32 value)
 	return gst_set_int_property(app, app->vsrc, "level", value, TRUE);
 }
 
-gboolean upstream_resume_transmitting(App *app)
+gboolean upstream_resume_transmitting(DreamTCPupstream *t)
 {
-	DreamTCPupstream *t = app->tcp_upstream;
-	GST_INFO_OBJECT (app, "resuming normal transmission...");
+	GST_INFO_OBJECT (t->app, "%s resuming normal transmission...", t->name);
 	t->state = UPSTREAM_STATE_TRANSMITTING;
-	send_signal (app, "upstreamStateChanged", g_variant_new("(i)", UPSTREAM_STATE_TRANSMITTING));
-	t->overrun_counter = 0;
-	t->overrun_period = GST_CLOCK_TIME_NONE;
+	upstream_signal (t, "upstreamStateChanged", "stateChanged", g_variant_new("(i)", UPSTREAM_STATE_TRANSMITTING));
 	t->id_signal_waiting = 0;
 	if (t->id_signal_keepalive)
 		g_source_remove (t->id_signal_keepalive);
@@ -385,6 +394,170 @@ gboolean upstream_resume_transmitting(App *app)
 	return G_SOURCE_REMOVE;
 }
 
+static DreamTCPupstream *upstream_session_new (App *app)
+{
+	DreamTCPupstream *t = g_new0 (DreamTCPupstream, 1);
+	t->app = app;
+	t->id = app->upstream_ids++;
+	t->name = t->id ? g_strdup_printf ("upstream%u", t->id) : g_strdup ("upstream");
+	t->object_path = g_strdup_printf ("%s/upstream%u", object_name, t->id);
+	t->state = t->resume_state = UPSTREAM_STATE_DISABLED;
+	t->auto_bitrate = AUTO_BITRATE;
+	t->spool_size = UPSTREAM_SPOOL_SIZE;
+	t->spool_max_rate = UPSTREAM_SPOOL_MAX_RATE;
+	t->framing = UPSTREAM_FRAMING;
+	t->transport = UPSTREAM_TRANSPORT;
+	t->fec_percentage = UPSTREAM_FEC_PERCENTAGE;
+	t->rtx_time = UPSTREAM_RTX_TIME;
+	t->control = UPSTREAM_CONTROL;
+	frame_queue_init (&t->frames, t->name, FRAME_QUEUE_TS, latency_profiles[app->latency_profile].upstream_age);
+	rate_control_init (&t->rate);
+	app->upstreams = g_list_append (app->upstreams, t);
+	return t;
+}
+
+static void upstream_session_free (DreamTCPupstream *t)
+{
+	App *app = t->app;
+	GST_DEBUG_OBJECT (app, "freeing %s session", t->name);
+	app->upstreams = g_list_remove (app->upstreams, t);
+	if (t->id_signal_waiting)
+		g_source_remove (t->id_signal_waiting);
+	if (t->id_signal_keepalive)
+		g_source_remove (t->id_signal_keepalive);
+	if (t->id_stats)
+		g_source_remove (t->id_stats);
+	if (t->rate.id_tick)
+		g_source_remove (t->rate.id_tick);
+	g_mutex_clear (&t->frames.mutex);
+	g_free (t->name);
+	g_free (t->host);
+	g_free (t->standby_host);
+	g_free (t->spool_location);
+	g_free (t->object_path);
+	g_free (t);
+}
+
+/* a session removed while still linked is freed once its branch is unlinked from the tee */
+static gboolean upstream_session_free_idle (gpointer user_data)
+{
+	upstream_session_free (user_data);
+	return G_SOURCE_REMOVE;
+}
+
+static DreamTCPupstream *upstream_session_find (App *app, GstObject *tcpsink)
+{
+	GList *l;
+	for (l = app->upstreams; l; l = l->next)
+	{
+		DreamTCPupstream *t = l->data;
+		if (t->tcpsink && GST_OBJECT (t->tcpsink) == tcpsink)
+			return t;
+	}
+	return NULL;
+}
+
+static gboolean upstream_active (App *app, DreamTCPupstream *except)
+{
+	GList *l;
+	for (l = app->upstreams; l; l = l->next)
+	{
+		DreamTCPupstream *t = l->data;
+		if (t != except && t->state != UPSTREAM_STATE_DISABLED)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* RTP always carries TS, the compact framing is only understood on the TCP link */
+static gboolean upstream_compact (DreamTCPupstream *t)
+{
+	return t->framing == UPSTREAM_FRAMING_COMPACT && t->transport == UPSTREAM_TRANSPORT_TCP;
+}
+
+/* compact sessions don't need the muxer */
+static gboolean upstream_ts_active (App *app)
+{
+	GList *l;
+	for (l = app->upstreams; l; l = l->next)
+	{
+		DreamTCPupstream *t = l->data;
+		if (t->state != UPSTREAM_STATE_DISABLED && !upstream_compact (t))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* the source may only be paused while every enabled session waits for its peer */
+static gboolean upstream_consuming (App *app, DreamTCPupstream *except)
+{
+	GList *l;
+	for (l = app->upstreams; l; l = l->next)
+	{
+		DreamTCPupstream *t = l->data;
+		if (t != except && t->state != UPSTREAM_STATE_DISABLED && t->state != UPSTREAM_STATE_WAITING)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* secondary sessions only report congestion unless the encoder is configured to follow the slowest link */
+static gboolean upstream_controls_encoder (DreamTCPupstream *t)
+{
+	return t == t->app->tcp_upstream || t->app->rate_slowest_link;
+}
+
+static GVariant *upstream_rate_control_variant (DreamTCPupstream *t)
+{
+	DreamRateController *rc = &t->rate;
+	GVariantBuilder builder;
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{si}"));
+	g_variant_builder_add (&builder, "{si}", "target", rc->target);
+	g_variant_builder_add (&builder, "{si}", "current", rc->current);
+	g_variant_builder_add (&builder, "{si}", "floor", rc->floor);
+	g_variant_builder_add (&builder, "{si}", "throughput", rc->throughput);
+	g_variant_builder_add (&builder, "{si}", "queueDelay", rc->queue_delay);
+	g_variant_builder_add (&builder, "{si}", "rtt", rc->rtt);
+	g_variant_builder_add (&builder, "{si}", "loss", rc->loss);
+	g_variant_builder_add (&builder, "{si}", "decreases", rc->decreases);
+	g_variant_builder_add (&builder, "{si}", "increases", rc->increases);
+	return g_variant_builder_end (&builder);
+}
+
+static GVariant *upstream_socket_stats_variant (DreamTCPupstream *t)
+{
+	DreamSocketStats *st = &t->socket_stats;
+	GVariantBuilder builder;
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{su}"));
+	g_variant_builder_add (&builder, "{su}", "rtt", st->rtt);
+	g_variant_builder_add (&builder, "{su}", "rttVar", st->rttvar);
+	g_variant_builder_add (&builder, "{su}", "minRtt", st->min_rtt);
+	g_variant_builder_add (&builder, "{su}", "cwnd", st->cwnd);
+	g_variant_builder_add (&builder, "{su}", "mss", st->mss);
+	g_variant_builder_add (&builder, "{su}", "retransmits", st->retransmits);
+	g_variant_builder_add (&builder, "{su}", "unacked", st->unacked);
+	g_variant_builder_add (&builder, "{su}", "sendQueue", st->outq);
+	g_variant_builder_add (&builder, "{su}", "deliveryRate", st->delivery_rate);
+	g_variant_builder_add (&builder, "{su}", "spooled", (guint32) st->spooled);
+	g_variant_builder_add (&builder, "{su}", "spoolDropped", (guint32) st->spool_dropped);
+	g_variant_builder_add (&builder, "{su}", "packetsLost", (guint) MAX (st->packets_lost, 0));
+	g_variant_builder_add (&builder, "{su}", "fractionLost", st->fraction_lost);
+	g_variant_builder_add (&builder, "{su}", "warnings", t->warnings);
+	return g_variant_builder_end (&builder);
+}
+
+static GVariant *upstream_reconnects_variant (DreamTCPupstream *t)
+{
+	GVariantBuilder builder;
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{su}"));
+	g_variant_builder_add (&builder, "{su}", "count", t->reconnects);
+	g_variant_builder_add (&builder, "{su}", "attempts", t->reconnect_attempts);
+	g_variant_builder_add (&builder, "{su}", "lastDowntime", (guint32) t->last_downtime);
+	g_variant_builder_add (&builder, "{su}", "maxDowntime", (guint32) t->max_downtime);
+	g_variant_builder_add (&builder, "{su}", "failovers", t->failovers);
+	return g_variant_builder_end (&builder);
+}
+
 static GVariant *handle_get_property (GDBusConnection  *connection,
 				      const gchar      *sender,
 				      const gchar      *object_path,
@@ -416,6 +589,21 @@ static GVariant *handle_get_property (GDBusConnection  *connection,
 		if (app->hls_server)
 			return g_variant_new_int32 (app->hls_server->state);
 	}
+	else if (g_strcmp0 (property_name, "hlsColdStartLatency") == 0)
+	{
+		if (app->hls_server)
+			return g_variant_new_int32 (app->hls_server->cold_start_latency);
+	}
+	else if (g_strcmp0 (property_name, "hlsLowLatency") == 0)
+	{
+		if (app->hls_server)
+			return g_variant_new_boolean (app->hls_server->low_latency);
+	}
+	else if (g_strcmp0 (property_name, "hlsSegmentFormat") == 0)
+	{
+		if (app->hls_server)
+			return g_variant_new_int32 (app->hls_server->format);
+	}
 	else if (g_strcmp0 (property_name, "inputMode") == 0)
 	{
 		inputMode input_mode = -1;
@@ -428,13 +616,38 @@ static GVariant *handle_get_property (GDBusConnection  *connection,
 	else if (g_strcmp0 (property_name, "rtspClientCount") == 0)
 	{
 		if (app->rtsp_server)
-			return g_variant_new_int32 (g_list_length(app->rtsp_server->clients_list));
+			return g_variant_new_int32 (g_atomic_int_get (&app->rtsp_server->clients_count));
 	}
 	else if (g_strcmp0 (property_name, "uriParameters") == 0)
 	{
 		if (app->rtsp_server)
 			return g_variant_new_string (app->rtsp_server->uri_parameters);
 	}
+	else if (g_strcmp0 (property_name, "rtspPacingRate") == 0)
+	{
+		if (app->rtsp_server)
+			return g_variant_new_uint32 (app->rtsp_server->pacing_rate);
+	}
+	else if (g_strcmp0 (property_name, "rtspPacing") == 0)
+	{
+		if (app->rtsp_server)
+			return rtsp_pacing_variant (app->rtsp_server);
+	}
+	else if (g_strcmp0 (property_name, "rtspClientQueueLimit") == 0)
+	{
+		if (app->rtsp_server)
+			return g_variant_new_uint32 (app->rtsp_server->client_queue_limit);
+	}
+	else if (g_strcmp0 (property_name, "rtspClientQueuePolicy") == 0)
+	{
+		if (app->rtsp_server)
+			return g_variant_new_int32 (app->rtsp_server->client_queue_policy);
+	}
+	else if (g_strcmp0 (property_name, "rtspClientQueues") == 0)
+	{
+		if (app->rtsp_server)
+			return rtsp_client_queues_variant (app->rtsp_server);
+	}
 	else if (g_strcmp0 (property_name, "audioBitrate") == 0)
 	{
 		gint rate = 0;
@@ -528,6 +741,115 @@ static GVariant *handle_get_property (GDBusConnection  *connection,
 		if (app->tcp_upstream)
 			return g_variant_new_boolean(app->tcp_upstream->auto_bitrate);
 	}
+	else if (g_strcmp0 (property_name, "upstreamRateControl") == 0)
+	{
+		if (app->tcp_upstream)
+			return upstream_rate_control_variant (app->tcp_upstream);
+	}
+	else if (g_strcmp0 (property_name, "upstreamMinBitrate") == 0)
+	{
+		if (app->tcp_upstream)
+			return g_variant_new_int32 (app->tcp_upstream->rate.floor);
+	}
+	else if (g_strcmp0 (property_name, "upstreamReconnects") == 0)
+	{
+		if (app->tcp_upstream)
+			return upstream_reconnects_variant (app->tcp_upstream);
+	}
+	else if (g_strcmp0 (property_name, "upstreamSocketStats") == 0)
+	{
+		if (app->tcp_upstream)
+			return upstream_socket_stats_variant (app->tcp_upstream);
+	}
+	else if (g_strcmp0 (property_name, "upstreamSessions") == 0)
+	{
+		GVariantBuilder builder;
+		GList *l;
+		g_variant_builder_init (&builder, G_VARIANT_TYPE ("ao"));
+		for (l = app->upstreams; l; l = l->next)
+		{
+			DreamTCPupstream *t = l->data;
+			if (t->registration_id)
+				g_variant_builder_add (&builder, "o", t->object_path);
+		}
+		return g_variant_builder_end (&builder);
+	}
+	else if (g_strcmp0 (property_name, "upstreamRateSlowestLink") == 0)
+	{
+		return g_variant_new_boolean (app->rate_slowest_link);
+	}
+	else if (g_strcmp0 (property_name, "upstreamWaitingPolicy") == 0)
+	{
+		return g_variant_new_int32 (app->waiting_policy);
+	}
+	else if (g_strcmp0 (property_name, "gopCacheLimit") == 0)
+	{
+		return g_variant_new_int32 (app->gop_cache.limit);
+	}
+	else if (g_strcmp0 (property_name, "gopCacheHitRate") == 0)
+	{
+		DreamGOPcache *c = &app->gop_cache;
+		g_mutex_lock (&c->mutex);
+		gint rate = c->lookups ? c->hits * 100 / c->lookups : 0;
+		g_mutex_unlock (&c->mutex);
+		return g_variant_new_int32 (rate);
+	}
+	else if (g_strcmp0 (property_name, "keyframeStats") == 0)
+	{
+		DreamKeyframeArbiter *k = &app->keyframes;
+		GVariantBuilder builder;
+		keyframeReason reason;
+		g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{s(uu)}"));
+		g_mutex_lock (&k->mutex);
+		for (reason = KEYFRAME_REASON_RTSP_JOIN; reason < KEYFRAME_REASON_COUNT; reason++)
+			g_variant_builder_add (&builder, "{s(uu)}", keyframe_reason_names[reason], k->requested[reason], k->granted[reason]);
+		g_mutex_unlock (&k->mutex);
+		return g_variant_builder_end (&builder);
+	}
+	else if (g_strcmp0 (property_name, "frameQueueDrops") == 0)
+	{
+		GVariantBuilder builder;
+		bridgeType type;
+		GList *l;
+		g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{s(uuu)}"));
+		for (l = app->upstreams; l; l = l->next)
+			frame_queue_add_stats (&((DreamTCPupstream *) l->data)->frames, &builder);
+		if (app->hls_server)
+		{
+			frame_queue_add_stats (&app->hls_server->frames, &builder);
+			frame_queue_add_stats (&app->hls_server->fmp4.vframes, &builder);
+			frame_queue_add_stats (&app->hls_server->fmp4.aframes, &builder);
+		}
+		if (app->rtsp_server)
+			for (type = BRIDGE_AUDIO; type < BRIDGE_COUNT; type++)
+				frame_queue_add_stats (&app->rtsp_server->bridge[type].frames, &builder);
+		return g_variant_builder_end (&builder);
+	}
+	else if (g_strcmp0 (property_name, "latencyProfile") == 0)
+	{
+		return g_variant_new_int32 (app->latency_profile);
+	}
+	else if (g_strcmp0 (property_name, "branchLatency") == 0)
+	{
+		GVariantBuilder builder;
+		bridgeType type;
+		GList *l;
+		g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{s(uu)}"));
+		latency_add_source_queue (app->aq, "source-audio", &builder);
+		latency_add_source_queue (app->vq, "source-video", &builder);
+		for (l = app->upstreams; l; l = l->next)
+			frame_queue_add_latency (&((DreamTCPupstream *) l->data)->frames, &builder);
+		if (app->hls_server)
+		{
+			frame_queue_add_latency (&app->hls_server->frames, &builder);
+			frame_queue_add_latency (&app->hls_server->fmp4.vframes, &builder);
+			frame_queue_add_latency (&app->hls_server->fmp4.aframes, &builder);
+		}
+		if (app->rtsp_server)
+			for (type = BRIDGE_AUDIO; type < BRIDGE_COUNT; type++)
+				frame_queue_add_latency (&app->rtsp_server->bridge[type].frames, &builder);
+		return g_variant_builder_end (&builder);
+	}
 	else if (g_strcmp0 (property_name, "path") == 0)
 	{
 		if (app->rtsp_server)
@@ -571,7 +893,18 @@ static gboolean handle_set_property (GDBusConnection  *connection,
 	else if (g_strcmp0 (property_name, "videoBitrate") == 0)
 	{
 		if (gst_set_bitrate (app, app->vsrc, g_variant_get_int32 (value)))
+		{
+			/* the configured bitrate is what the upstream rate control ramps back up to */
+			GList *l;
+			for (l = app->upstreams; l; l = l->next)
+			{
+				DreamTCPupstream *t = l->data;
+				t->rate.target = t->rate.current = g_variant_get_int32 (value);
+			}
+			if (app->upstream_bitrate)
+				app->upstream_bitrate = g_variant_get_int32 (value);
 			return 1;
+		}
 	}
 	else if (g_strcmp0 (property_name, "gopLength") == 0)
 	{
@@ -628,10 +961,122 @@ static gboolean handle_set_property (GDBusConnection  *connection,
 		{
 			gboolean enable = g_variant_get_boolean(value);
 			if (app->tcp_upstream->state == UPSTREAM_STATE_OVERLOAD)
-				upstream_resume_transmitting(app);
+				upstream_resume_transmitting(app->tcp_upstream);
 			app->tcp_upstream->auto_bitrate = enable;
+			rate_control_apply (app, app->tcp_upstream->rate.target);
+			return 1;
+		}
+	}
+	else if (g_strcmp0 (property_name, "upstreamMinBitrate") == 0)
+	{
+		if (app->tcp_upstream && g_variant_get_int32 (value) > 0)
+		{
+			app->tcp_upstream->rate.floor = g_variant_get_int32 (value);
+			return 1;
+		}
+	}
+	else if (g_strcmp0 (property_name, "upstreamRateSlowestLink") == 0)
+	{
+		app->rate_slowest_link = g_variant_get_boolean (value);
+		if (app->tcp_upstream)
+			rate_control_apply (app, app->tcp_upstream->rate.target);
+		return 1;
+	}
+	else if (g_strcmp0 (property_name, "upstreamWaitingPolicy") == 0)
+	{
+		gint32 policy = g_variant_get_int32 (value);
+		if (policy == WAITING_POLICY_PAUSE || policy == WAITING_POLICY_IDLE)
+		{
+			app->waiting_policy = policy;
+			return 1;
+		}
+	}
+	/* the media pacers follow right away, interleaved clients pick the new cap up with their next PLAY */
+	else if (g_strcmp0 (property_name, "rtspPacingRate") == 0 && app->rtsp_server)
+	{
+		DreamRTSPserver *r = app->rtsp_server;
+		GList *l;
+		r->pacing_rate = g_variant_get_uint32 (value);
+		if (r->es_pacer)
+			gst_dream_rtsp_pacer_set_peak_rate (r->es_pacer, r->pacing_rate);
+		if (r->ts_pacer)
+			gst_dream_rtsp_pacer_set_peak_rate (r->ts_pacer, r->pacing_rate);
+		for (l = r->clients_list; l; l = l->next)
+			g_object_set (l->data, "pacing-rate", r->pacing_rate, NULL);
+		return 1;
+	}
+	/* a queue can't be put in front of a client that is already connected, a limit of 0 only lifts the bound */
+	else if (g_strcmp0 (property_name, "rtspClientQueueLimit") == 0 && app->rtsp_server)
+	{
+		DreamRTSPserver *r = app->rtsp_server;
+		GList *l;
+		r->client_queue_limit = g_variant_get_uint32 (value);
+		for (l = r->clients_list; l; l = l->next)
+			g_object_set (l->data, "queue-limit", r->client_queue_limit, NULL);
+		return 1;
+	}
+	else if (g_strcmp0 (property_name, "rtspClientQueuePolicy") == 0 && app->rtsp_server)
+	{
+		DreamRTSPserver *r = app->rtsp_server;
+		gint32 policy = g_variant_get_int32 (value);
+		GList *l;
+		if (policy == DREAM_RTSP_CLIENT_POLICY_SKIP || policy == DREAM_RTSP_CLIENT_POLICY_DISCONNECT)
+		{
+			r->client_queue_policy = policy;
+			for (l = r->clients_list; l; l = l->next)
+				g_object_set (l->data, "queue-policy", r->client_queue_policy, NULL);
+			return 1;
+		}
+	}
+	else if (g_strcmp0 (property_name, "latencyProfile") == 0)
+	{
+		gint32 profile = g_variant_get_int32 (value);
+		if (profile >= LATENCY_PROFILE_ULTRA_LOW && profile < LATENCY_PROFILE_COUNT)
+		{
+			DREAMRTSPSERVER_LOCK (app);
+			app->latency_profile = profile;
+			latency_profile_apply (app);
+			DREAMRTSPSERVER_UNLOCK (app);
+			return 1;
+		}
+	}
+	else if (g_strcmp0 (property_name, "hlsLowLatency") == 0)
+	{
+		if (app->hls_server)
+		{
+			/* takes effect with the next segment */
+			app->hls_server->low_latency = g_variant_get_boolean (value);
+			return 1;
+		}
+	}
+	else if (g_strcmp0 (property_name, "hlsSegmentFormat") == 0)
+	{
+		gint format = g_variant_get_int32 (value);
+		if (app->hls_server && (format == HLS_FORMAT_TS || format == HLS_FORMAT_FMP4))
+		{
+			/* takes effect when the hls pipeline is started the next time */
+			app->hls_server->format = format;
+			return 1;
+		}
+	}
+	else if (g_strcmp0 (property_name, "gopCacheLimit") == 0)
+	{
+		gint32 limit = g_variant_get_int32 (value);
+		if (limit >= 0)
+		{
+			DreamGOPcache *c = &app->gop_cache;
+			bridgeType type;
+			g_mutex_lock (&c->mutex);
+			c->limit = limit;
+			for (type = BRIDGE_AUDIO; type < BRIDGE_COUNT; type++)
+				if (c->bytes[type] > c->limit)
+					gop_cache_clear (c, type);
+			g_mutex_unlock (&c->mutex);
+			GST_INFO_OBJECT (app, "gop cache limit set to %i bytes per stream", limit);
 			return 1;
 		}
+		g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "[RTSPserver] can't set property '%s' to %d", property_name, limit);
+		return 0;
 	}
 	else
 	{
@@ -673,7 +1118,7 @@ static void handle_method_call (GDBusConnection       *connection,
 			else if (state == FALSE && app->rtsp_server->state >= RTSP_STATE_IDLE)
                         {
 				result = disable_rtsp_server(app);
-				if (app->tcp_upstream->state == UPSTREAM_STATE_DISABLED && app->hls_server->state == HLS_STATE_DISABLED)
+				if (!upstream_active (app, NULL) && app->hls_server->state == HLS_STATE_DISABLED)
 				{
 					destroy_pipeline(app);
 					create_source_pipeline(app);
@@ -699,7 +1144,7 @@ static void handle_method_call (GDBusConnection       *connection,
 			else if (state == FALSE && app->hls_server->state >= HLS_STATE_IDLE)
                         {
 				result = disable_hls_server(app);
-				if (app->tcp_upstream->state == UPSTREAM_STATE_DISABLED && app->rtsp_server->state == RTSP_STATE_DISABLED)
+				if (!upstream_active (app, NULL) && app->rtsp_server->state == RTSP_STATE_DISABLED)
 				{
 					destroy_pipeline(app);
 					create_source_pipeline(app);
@@ -708,24 +1153,27 @@ static void handle_method_call (GDBusConnection       *connection,
 		}
 		g_dbus_method_invocation_return_value (invocation,  g_variant_new ("(b)", result));
 	}
-	else if (g_strcmp0 (method_name, "enableUpstream") == 0)
+	else if (g_strcmp0 (method_name, "enableUpstream") == 0 || g_strcmp0 (method_name, "enableUpstreamWithStandby") == 0)
 	{
 		gboolean result = FALSE;
 		if (app->pipeline)
 		{
 			gboolean state;
-			const gchar *upstream_host, *token;
-			guint32 upstream_port;
+			const gchar *upstream_host, *token, *standby_host = NULL;
+			guint32 upstream_port, standby_port = 0;
 
-			g_variant_get (parameters, "(b&su&s)", &state, &upstream_host, &upstream_port, &token);
-			GST_DEBUG("app->pipeline=%p, enableUpstream state=%i host=%s port=%i token=%s (currently in state %u)", app->pipeline, state, upstream_host, upstream_port, token, app->tcp_upstream->state);
+			if (g_strcmp0 (method_name, "enableUpstreamWithStandby") == 0)
+				g_variant_get (parameters, "(b&su&s&su)", &state, &upstream_host, &upstream_port, &token, &standby_host, &standby_port);
+			else
+				g_variant_get (parameters, "(b&su&s)", &state, &upstream_host, &upstream_port, &token);
+			GST_DEBUG("app->pipeline=%p, %s state=%i host=%s port=%i token=%s standby=%s:%u (currently in state %u)", app->pipeline, method_name, state, upstream_host, upstream_port, token, standby_host, standby_port, app->tcp_upstream->state);
 
 			if (state == TRUE && app->tcp_upstream->state == UPSTREAM_STATE_DISABLED)
-				result = enable_tcp_upstream(app, upstream_host, upstream_port, token);
+				result = enable_tcp_upstream(app->tcp_upstream, upstream_host, upstream_port, token, standby_host, standby_port);
 			else if (state == FALSE && app->tcp_upstream->state >= UPSTREAM_STATE_CONNECTING)
 			{
-				result = disable_tcp_upstream(app);
-				if (app->rtsp_server->state == RTSP_STATE_DISABLED)
+				result = disable_tcp_upstream(app->tcp_upstream);
+				if (app->rtsp_server->state == RTSP_STATE_DISABLED && !upstream_active (app, app->tcp_upstream))
 				{
 					destroy_pipeline(app);
 					create_source_pipeline(app);
@@ -734,6 +1182,58 @@ static void handle_method_call (GDBusConnection       *connection,
 		}
 		g_dbus_method_invocation_return_value (invocation,  g_variant_new ("(b)", result));
 	}
+	else if (g_strcmp0 (method_name, "addUpstream") == 0)
+	{
+		const gchar *upstream_host, *token;
+		guint32 upstream_port;
+		DreamTCPupstream *t;
+
+		g_variant_get (parameters, "(&su&s)", &upstream_host, &upstream_port, &token);
+		GST_DEBUG("app->pipeline=%p, addUpstream host=%s port=%i token=%s", app->pipeline, upstream_host, upstream_port, token);
+
+		if (!app->pipeline)
+		{
+			g_dbus_method_invocation_return_error (invocation, G_IO_ERROR, G_IO_ERROR_FAILED, "[RTSPserver] can't add upstream without source pipeline");
+			return;
+		}
+		t = upstream_session_new (app);
+		if (!enable_tcp_upstream (t, upstream_host, upstream_port, token, NULL, 0))
+		{
+			/* a session that got linked before failing is freed by its unlink callback */
+			if (t->state == UPSTREAM_STATE_DISABLED)
+				upstream_session_free (t);
+			else
+				t->removing = TRUE;
+			g_dbus_method_invocation_return_error (invocation, G_IO_ERROR, G_IO_ERROR_FAILED, "[RTSPserver] can't add upstream to %s:%u", upstream_host, upstream_port);
+			return;
+		}
+		upstream_session_register (t, g_dbus_method_invocation_get_connection (invocation));
+		g_dbus_method_invocation_return_value (invocation, g_variant_new ("(o)", t->object_path));
+	}
+	else if (g_strcmp0 (method_name, "removeUpstream") == 0)
+	{
+		const gchar *path;
+		DreamTCPupstream *t = NULL;
+		GList *l;
+
+		g_variant_get (parameters, "(&o)", &path);
+		for (l = app->upstreams; l; l = l->next)
+			if (g_strcmp0 (((DreamTCPupstream *) l->data)->object_path, path) == 0)
+				t = l->data;
+		if (!t || t == app->tcp_upstream || t->removing)
+		{
+			g_dbus_method_invocation_return_error (invocation, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "[RTSPserver] can't remove upstream '%s'", path);
+			return;
+		}
+		GST_DEBUG("removeUpstream %s (currently in state %u)", t->name, t->state);
+		if (t->registration_id)
+			g_dbus_connection_unregister_object (g_dbus_method_invocation_get_connection (invocation), t->registration_id);
+		t->registration_id = 0;
+		t->removing = TRUE;
+		if (!disable_tcp_upstream (t))
+			upstream_session_free (t);
+		g_dbus_method_invocation_return_value (invocation, g_variant_new ("(b)", TRUE));
+	}
 	else if (g_strcmp0 (method_name, "setResolution") == 0)
 	{
 		int width, height;
@@ -750,6 +1250,162 @@ static void handle_method_call (GDBusConnection       *connection,
 	} // if it's an unknown method
 } // handle_method_call
 
+static GVariant *upstream_handle_get_property (GDBusConnection  *connection,
+					       const gchar      *sender,
+					       const gchar      *object_path,
+					       const gchar      *interface_name,
+					       const gchar      *property_name,
+					       GError          **error,
+					       gpointer          user_data)
+{
+	DreamTCPupstream *t = user_data;
+
+	GST_DEBUG("dbus get upstream property %s of %s from %s", property_name, t->name, sender);
+
+	if (g_strcmp0 (property_name, "state") == 0)
+		return g_variant_new_int32 (t->state);
+	else if (g_strcmp0 (property_name, "host") == 0)
+		return g_variant_new_string (t->host ? t->host : "");
+	else if (g_strcmp0 (property_name, "port") == 0)
+		return g_variant_new_uint32 (t->port);
+	else if (g_strcmp0 (property_name, "standbyHost") == 0)
+		return g_variant_new_string (t->standby_host ? t->standby_host : "");
+	else if (g_strcmp0 (property_name, "standbyPort") == 0)
+		return g_variant_new_uint32 (t->standby_port);
+	else if (g_strcmp0 (property_name, "spoolSize") == 0)
+		return g_variant_new_uint32 (t->spool_size);
+	else if (g_strcmp0 (property_name, "spoolLocation") == 0)
+		return g_variant_new_string (t->spool_location ? t->spool_location : "");
+	else if (g_strcmp0 (property_name, "spoolMaxRate") == 0)
+		return g_variant_new_uint32 (t->spool_max_rate);
+	else if (g_strcmp0 (property_name, "framing") == 0)
+		return g_variant_new_int32 (t->framing);
+	else if (g_strcmp0 (property_name, "transport") == 0)
+		return g_variant_new_int32 (t->transport);
+	else if (g_strcmp0 (property_name, "fecPercentage") == 0)
+		return g_variant_new_uint32 (t->fec_percentage);
+	else if (g_strcmp0 (property_name, "rtxTime") == 0)
+		return g_variant_new_uint32 (t->rtx_time);
+	else if (g_strcmp0 (property_name, "controlChannel") == 0)
+		return g_variant_new_boolean (t->control);
+	else if (g_strcmp0 (property_name, "autoBitrate") == 0)
+		return g_variant_new_boolean (t->auto_bitrate);
+	else if (g_strcmp0 (property_name, "minBitrate") == 0)
+		return g_variant_new_int32 (t->rate.floor);
+	else if (g_strcmp0 (property_name, "rateControl") == 0)
+		return upstream_rate_control_variant (t);
+	else if (g_strcmp0 (property_name, "socketStats") == 0)
+		return upstream_socket_stats_variant (t);
+	else if (g_strcmp0 (property_name, "reconnects") == 0)
+		return upstream_reconnects_variant (t);
+	g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "[RTSPserver] Invalid property '%s'", property_name);
+	return NULL;
+} // upstream_handle_get_property
+
+static gboolean upstream_handle_set_property (GDBusConnection  *connection,
+					      const gchar      *sender,
+					      const gchar      *object_path,
+					      const gchar      *interface_name,
+					      const gchar      *property_name,
+					      GVariant         *value,
+					      GError          **error,
+					      gpointer          user_data)
+{
+	DreamTCPupstream *t = user_data;
+
+	GST_DEBUG("dbus set upstream property %s of %s from %s", property_name, t->name, sender);
+
+	if (g_strcmp0 (property_name, "autoBitrate") == 0)
+	{
+		if (t->state == UPSTREAM_STATE_OVERLOAD)
+			upstream_resume_transmitting (t);
+		t->auto_bitrate = g_variant_get_boolean (value);
+		rate_control_apply (t->app, t->rate.target);
+		return 1;
+	}
+	else if (g_strcmp0 (property_name, "minBitrate") == 0 && g_variant_get_int32 (value) > 0)
+	{
+		t->rate.floor = g_variant_get_int32 (value);
+		return 1;
+	}
+	/* the spool is set up when the upstream gets enabled, only its drain rate can change on the fly */
+	else if (g_strcmp0 (property_name, "spoolSize") == 0)
+	{
+		t->spool_size = g_variant_get_uint32 (value);
+		return 1;
+	}
+	else if (g_strcmp0 (property_name, "spoolLocation") == 0)
+	{
+		const gchar *location = g_variant_get_string (value, NULL);
+		g_free (t->spool_location);
+		t->spool_location = *location ? g_strdup (location) : NULL;
+		return 1;
+	}
+	else if (g_strcmp0 (property_name, "spoolMaxRate") == 0)
+	{
+		t->spool_max_rate = g_variant_get_uint32 (value);
+		if (t->tcpsink && t->transport == UPSTREAM_TRANSPORT_TCP)
+			g_object_set (t->tcpsink, "spool-max-rate", t->spool_max_rate, NULL);
+		return 1;
+	}
+	/* the framing decides which tees the session hangs off, so it can't change while enabled */
+	else if (g_strcmp0 (property_name, "framing") == 0 && t->state == UPSTREAM_STATE_DISABLED && g_variant_get_int32 (value) >= UPSTREAM_FRAMING_TS && g_variant_get_int32 (value) <= UPSTREAM_FRAMING_COMPACT)
+	{
+		t->framing = g_variant_get_int32 (value);
+		return 1;
+	}
+	/* so does the sink element */
+	else if (g_strcmp0 (property_name, "transport") == 0 && t->state == UPSTREAM_STATE_DISABLED && g_variant_get_int32 (value) >= UPSTREAM_TRANSPORT_TCP && g_variant_get_int32 (value) <= UPSTREAM_TRANSPORT_RTP)
+	{
+		t->transport = g_variant_get_int32 (value);
+		return 1;
+	}
+	/* FEC overhead and the retransmission window can be tuned while streaming */
+	else if (g_strcmp0 (property_name, "fecPercentage") == 0 && g_variant_get_uint32 (value) <= 100)
+	{
+		t->fec_percentage = g_variant_get_uint32 (value);
+		if (t->tcpsink && t->transport == UPSTREAM_TRANSPORT_RTP)
+			g_object_set (t->tcpsink, "fec-percentage", t->fec_percentage, NULL);
+		return 1;
+	}
+	else if (g_strcmp0 (property_name, "rtxTime") == 0)
+	{
+		t->rtx_time = g_variant_get_uint32 (value);
+		if (t->tcpsink && t->transport == UPSTREAM_TRANSPORT_RTP)
+			g_object_set (t->tcpsink, "rtx-time", t->rtx_time, NULL);
+		return 1;
+	}
+	/* announced in the handshake, so it only takes effect on the next enable */
+	else if (g_strcmp0 (property_name, "controlChannel") == 0)
+	{
+		t->control = g_variant_get_boolean (value);
+		return 1;
+	}
+	g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "[RTSPserver] can't set upstream property '%s'", property_name);
+	return 0;
+} // upstream_handle_set_property
+
+static gboolean upstream_session_register (DreamTCPupstream *t, GDBusConnection *connection)
+{
+	static GDBusInterfaceVTable upstream_vtable =
+	{
+		NULL,
+		upstream_handle_get_property,
+		upstream_handle_set_property,
+		{ 0, }
+	};
+
+	GError *error = NULL;
+	t->registration_id = g_dbus_connection_register_object (connection, t->object_path, upstream_introspection_data->interfaces[0], &upstream_vtable, t, NULL, &error);
+	if (!t->registration_id)
+	{
+		GST_WARNING ("can't register %s: %s", t->object_path, error->message);
+		g_error_free (error);
+		return FALSE;
+	}
+	return TRUE;
+} // upstream_session_register
+
 static void on_bus_acquired (GDBusConnection *connection,
 			     const gchar     *name,
 			     gpointer        user_data)
@@ -765,6 +1421,7 @@ static void on_bus_acquired (GDBusConnection *connection,
 	GError *error = NULL;
 	GST_DEBUG ("aquired dbus (\"%s\" @ %p)", name, connection);
 	g_dbus_connection_register_object (connection, object_name, introspection_data->interfaces[0], &interface_vtable, user_data, NULL, &error);
+	upstream_session_register (((App *) user_data)->tcp_upstream, connection);
 } // on_bus_acquired
 
 static void on_name_acquired (GDBusConnection *connection,
@@ -822,17 +1479,22 @@ static gboolean message_cb (GstBus * bus, GstMessage * message, gpointer user_da
 					GST_INFO ("element %s: %s", name, err->message);
 					send_signal (app, "encoderError", NULL);
 // 					DREAMRTSPSERVER_UNLOCK (app);
-					disable_tcp_upstream(app);
+					GList *l;
+					for (l = app->upstreams; l; l = l->next)
+						disable_tcp_upstream(l->data);
 					destroy_pipeline(app);
 				}
 				if (err->code == GST_RESOURCE_ERROR_WRITE)
 				{
-					send_signal (app, "upstreamStateChanged", g_variant_new("(i)", UPSTREAM_STATE_FAILED));
+					DreamTCPupstream *t = upstream_session_find (app, message->src);
+					if (!t)
+						t = app->tcp_upstream;
+					upstream_signal (t, "upstreamStateChanged", "stateChanged", g_variant_new("(i)", UPSTREAM_STATE_FAILED));
 					GST_INFO ("element %s: %s -> this means PEER DISCONNECTED", name, err->message);
 					GST_DEBUG ("Additional ERROR debug info: %s", debug);
 // 					DREAMRTSPSERVER_UNLOCK (app);
-					disable_tcp_upstream(app);
-					if (app->rtsp_server->state == RTSP_STATE_DISABLED)
+					disable_tcp_upstream(t);
+					if (app->rtsp_server->state == RTSP_STATE_DISABLED && !upstream_active (app, t))
 					{
 						destroy_pipeline(app);
 						create_source_pipeline(app);
@@ -851,6 +1513,19 @@ static gboolean message_cb (GstBus * bus, GstMessage * message, gpointer user_da
 			g_free (name);
 			break;
 		}
+		case GST_MESSAGE_ELEMENT:
+		{
+			DreamTCPupstream *t = upstream_session_find (app, GST_MESSAGE_SRC (message));
+			if (t && gst_message_has_name (message, "dream-tcp-client-sink"))
+			{
+				const GstStructure *s = gst_message_get_structure (message);
+				if (g_strcmp0 (gst_structure_get_string (s, "event"), "control") == 0)
+					upstream_control_event (t, s);
+				else
+					upstream_connection_event (t, s);
+			}
+			break;
+		}
 		case GST_MESSAGE_WARNING:
 		{
 			GError *err = NULL;
@@ -895,16 +1570,20 @@ static void media_unprepare (GstRTSPMedia * media, gpointer user_data)
 	if (media == r->es_media)
 	{
 		r->es_media = NULL;
-		r->es_aappsrc = r->es_vappsrc = NULL;
+		rtsp_bridge_set_appsrc (&r->bridge[BRIDGE_AUDIO], NULL, NULL);
+		rtsp_bridge_set_appsrc (&r->bridge[BRIDGE_VIDEO], NULL, NULL);
+		g_clear_pointer (&r->es_pacer, gst_dream_rtsp_pacer_unref);
 	}
 	else if (media == r->ts_media)
 	{
 		r->ts_media = NULL;
-		r->ts_appsrc = NULL;
+		rtsp_bridge_set_appsrc (&r->bridge[BRIDGE_TS], NULL, NULL);
+		g_clear_pointer (&r->ts_pacer, gst_dream_rtsp_pacer_unref);
 	}
+	update_branch_demand (app);
 	if (!r->es_media && !r->ts_media)
 	{
-		if (app->tcp_upstream->state == UPSTREAM_STATE_DISABLED && app->hls_server->state == HLS_STATE_DISABLED)
+		if (!upstream_active (app, NULL) && app->hls_server->state == HLS_STATE_DISABLED)
 			halt_source_pipeline(app);
 		if (r->state == RTSP_STATE_RUNNING)
 		{
@@ -920,54 +1599,162 @@ static void client_closed (GstRTSPClient * client, gpointer user_data)
 {
 	App *app = user_data;
 	app->rtsp_server->clients_list = g_list_remove(g_list_first (app->rtsp_server->clients_list), client);
-	gint no_clients = g_list_length(app->rtsp_server->clients_list);
+	g_atomic_int_dec_and_test (&app->rtsp_server->clients_count);
+	gint no_clients = g_atomic_int_get (&app->rtsp_server->clients_count);
 	GST_INFO("client_closed  (number of clients: %i)", no_clients);
 	send_signal (app, "rtspClientCountChanged", g_variant_new("(is)", no_clients, ""));
 }
 
+/* the skipped client waits for the next keyframe, so it should come soon */
+static void client_queue_skipped (GstRTSPClient * client, gpointer user_data)
+{
+	App *app = user_data;
+	GST_DEBUG_OBJECT (app, "send queue of %" GST_PTR_FORMAT " overflowed", client);
+	request_keyframe (app, KEYFRAME_REASON_RTSP_SKIP);
+}
+
 static void client_connected (GstRTSPServer * server, GstRTSPClient * client, gpointer user_data)
 {
 	App *app = user_data;
 	app->rtsp_server->clients_list = g_list_append(app->rtsp_server->clients_list, client);
+	g_atomic_int_inc (&app->rtsp_server->clients_count);
 	const gchar *ip = gst_rtsp_connection_get_ip (gst_rtsp_client_get_connection (client));
-	gint no_clients = g_list_length(app->rtsp_server->clients_list);
+	gint no_clients = g_atomic_int_get (&app->rtsp_server->clients_count);
 	GST_INFO("client_connected %" GST_PTR_FORMAT " from %s  (number of clients: %i)", client, ip, no_clients);
+	g_object_set (client, "pacing-rate", app->rtsp_server->pacing_rate, "queue-limit", app->rtsp_server->client_queue_limit, "queue-policy", app->rtsp_server->client_queue_policy, NULL);
 	g_signal_connect (client, "closed", (GCallback) client_closed, app);
+	g_signal_connect (client, "queue-skipped", (GCallback) client_queue_skipped, app);
 	send_signal (app, "rtspClientCountChanged", g_variant_new("(is)", no_clients, ip));
 }
 
-static void media_configure (GstRTSPMediaFactory * factory, GstRTSPMedia * media, gpointer user_data)
+/* the video payloader of a shared media is where keyframes turn into bursts for every client at once,
+ * the transport stream arrives in chunks of packets that say nothing about frames and is paced at its stream rate */
+static GstDreamRTSPPacer *rtsp_pacer_attach (App *app, GstRTSPMedia *media, gboolean frames)
 {
-	App *app = user_data;
-	DreamRTSPserver *r = app->rtsp_server;
-	DREAMRTSPSERVER_LOCK (app);
+	GstElement *element = gst_rtsp_media_get_element (media);
+	GstElement *payloader = gst_bin_get_by_name_recurse_up (GST_BIN (element), "pay0");
+	GstDreamRTSPPacer *pacer = NULL;
+	guint32 framerate = 0;
 
-	if (GST_DREAM_RTSP_MEDIA_FACTORY (factory) == r->es_factory)
+	gst_object_unref (element);
+	if (!payloader)
+		return NULL;
+	if (frames)
+		gst_get_capsprop (app, app->vsrc, "framerate", &framerate);
+	pacer = gst_dream_rtsp_pacer_new (app->rtsp_server->pacing_rate, !frames ? GST_CLOCK_TIME_NONE : framerate ? GST_SECOND / framerate : 0);
+	if (!gst_dream_rtsp_pacer_attach (pacer, payloader))
+		g_clear_pointer (&pacer, gst_dream_rtsp_pacer_unref);
+	gst_object_unref (payloader);
+	return pacer;
+}
+
+static GVariant *rtsp_pacing_variant (DreamRTSPserver *r)
+{
+	GstDreamRTSPPacer *pacers[] = { r->es_pacer, r->ts_pacer };
+	guint64 bytes = 0, packets = 0, delay_max = 0, delay_weighted = 0;
+	GVariantBuilder builder;
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (pacers); i++)
 	{
-		r->es_media = media;
-		GstElement *element = gst_rtsp_media_get_element (media);
-		r->es_aappsrc = gst_bin_get_by_name_recurse_up (GST_BIN (element), ES_AAPPSRC);
-		r->es_vappsrc = gst_bin_get_by_name_recurse_up (GST_BIN (element), ES_VAPPSRC);
-		gst_object_unref(element);
-		g_signal_connect (media, "unprepared", (GCallback) media_unprepare, app);
-		g_object_set (r->es_aappsrc, "format", GST_FORMAT_TIME, NULL);
-		g_object_set (r->es_vappsrc, "format", GST_FORMAT_TIME, NULL);
+		guint64 b, p, d, m;
+		if (!pacers[i])
+			continue;
+		gst_dream_rtsp_pacer_get_stats (pacers[i], &b, &p, &d, &m);
+		bytes += b;
+		packets += p;
+		delay_weighted += d * p;
+		delay_max = MAX (delay_max, m);
 	}
-	else if (GST_DREAM_RTSP_MEDIA_FACTORY (factory) == r->ts_factory)
-	{
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{st}"));
+	g_variant_builder_add (&builder, "{st}", "pacedBytes", bytes);
+	g_variant_builder_add (&builder, "{st}", "pacedPackets", packets);
+	g_variant_builder_add (&builder, "{st}", "queueDelay", packets ? delay_weighted / packets : 0);
+	g_variant_builder_add (&builder, "{st}", "maxQueueDelay", delay_max);
+	return g_variant_builder_end (&builder);
+}
+
+static GVariant *rtsp_client_queues_variant (DreamRTSPserver *r)
+{
+	GVariantBuilder builder;
+	GList *l;
+
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(suttu)"));
+	for (l = r->clients_list; l; l = l->next)
+	{
+		GstRTSPConnection *connection = gst_rtsp_client_get_connection (l->data);
+		GstStructure *s = NULL;
+		guint lag = 0, skips = 0;
+		guint64 queued = 0, dropped = 0;
+		g_object_get (l->data, "queue-stats", &s, NULL);
+		if (!s)
+			continue;
+		gst_structure_get (s, "lag", G_TYPE_UINT, &lag, "queued-bytes", G_TYPE_UINT64, &queued, "dropped", G_TYPE_UINT64, &dropped, "skips", G_TYPE_UINT, &skips, NULL);
+		g_variant_builder_add (&builder, "(suttu)", connection ? gst_rtsp_connection_get_ip (connection) : "", lag, queued, dropped, skips);
+		gst_structure_free (s);
+	}
+	return g_variant_builder_end (&builder);
+}
+
+static void media_configure (GstRTSPMediaFactory * factory, GstRTSPMedia * media, gpointer user_data)
+{
+	App *app = user_data;
+	DreamRTSPserver *r = app->rtsp_server;
+	DREAMRTSPSERVER_LOCK (app);
+
+	rtsp_start_set (r, NULL);
+	if (GST_DREAM_RTSP_MEDIA_FACTORY (factory) == r->es_factory)
+	{
+		r->es_media = media;
+		GstElement *element = gst_rtsp_media_get_element (media);
+		GstElement *aappsrc = gst_bin_get_by_name_recurse_up (GST_BIN (element), ES_AAPPSRC);
+		GstElement *vappsrc = gst_bin_get_by_name_recurse_up (GST_BIN (element), ES_VAPPSRC);
+		gst_object_unref(element);
+		g_signal_connect (media, "unprepared", (GCallback) media_unprepare, app);
+		g_object_set (aappsrc, "format", GST_FORMAT_TIME, "is-live", TRUE, "min-latency", (gint64) latency_profiles[app->latency_profile].appsrc_latency, "max-latency", (gint64) r->bridge[BRIDGE_AUDIO].frames.max_age, NULL);
+		g_object_set (vappsrc, "format", GST_FORMAT_TIME, "is-live", TRUE, "min-latency", (gint64) latency_profiles[app->latency_profile].appsrc_latency, "max-latency", (gint64) r->bridge[BRIDGE_VIDEO].frames.max_age, NULL);
+		/* open the branches before taking the cache snapshot so nothing falls in between */
+		branch_gate_set (&r->bridge[BRIDGE_AUDIO].gate, TRUE);
+		branch_gate_set (&r->bridge[BRIDGE_VIDEO].gate, TRUE);
+		GList *vcache = gop_cache_get (app, BRIDGE_VIDEO);
+		GList *acache = vcache ? gop_cache_get (app, BRIDGE_AUDIO) : NULL;
+		if (vcache)
+			rtsp_start_set (r, gst_sample_get_buffer (vcache->data));
+		rtsp_bridge_set_appsrc (&r->bridge[BRIDGE_AUDIO], aappsrc, acache);
+		rtsp_bridge_set_appsrc (&r->bridge[BRIDGE_VIDEO], vappsrc, vcache);
+		if (r->es_pacer)
+			gst_dream_rtsp_pacer_unref (r->es_pacer);
+		r->es_pacer = rtsp_pacer_attach (app, media, TRUE);
+		GstPad *srcpad = gst_element_get_static_pad (vappsrc, "src");
+		gst_pad_add_probe (srcpad, GST_PAD_PROBE_TYPE_EVENT_UPSTREAM, rtcp_keyframe_probe, app, NULL);
+		gst_object_unref (srcpad);
+	}
+	else if (GST_DREAM_RTSP_MEDIA_FACTORY (factory) == r->ts_factory)
+	{
 		r->ts_media = media;
 		GstElement *element = gst_rtsp_media_get_element (media);
-		r->ts_appsrc = gst_bin_get_by_name_recurse_up (GST_BIN (element), TS_APPSRC);
-		r->ts_appsrc = gst_bin_get_by_name_recurse_up (GST_BIN (element), TS_APPSRC);
+		GstElement *appsrc = gst_bin_get_by_name_recurse_up (GST_BIN (element), TS_APPSRC);
 		gst_object_unref(element);
 		g_signal_connect (media, "unprepared", (GCallback) media_unprepare, app);
-		g_object_set (r->ts_appsrc, "format", GST_FORMAT_TIME, NULL);
+		g_object_set (appsrc, "format", GST_FORMAT_TIME, "is-live", TRUE, "min-latency", (gint64) latency_profiles[app->latency_profile].appsrc_latency, "max-latency", (gint64) r->bridge[BRIDGE_TS].frames.max_age, NULL);
+		update_branch_demand (app);
+		GList *tscache = gop_cache_get (app, BRIDGE_TS);
+		if (tscache)
+			rtsp_start_set (r, gst_sample_get_buffer (tscache->data));
+		rtsp_bridge_set_appsrc (&r->bridge[BRIDGE_TS], appsrc, tscache);
+		if (r->ts_pacer)
+			gst_dream_rtsp_pacer_unref (r->ts_pacer);
+		r->ts_pacer = rtsp_pacer_attach (app, media, FALSE);
+		GstPad *srcpad = gst_element_get_static_pad (appsrc, "src");
+		gst_pad_add_probe (srcpad, GST_PAD_PROBE_TYPE_EVENT_UPSTREAM, rtcp_keyframe_probe, app, NULL);
+		gst_object_unref (srcpad);
 	}
-	r->rtsp_start_pts = r->rtsp_start_dts = GST_CLOCK_TIME_NONE;
 	r->state = RTSP_STATE_RUNNING;
 	send_signal (app, "rtspStateChanged", g_variant_new("(i)", RTSP_STATE_RUNNING));
 	GST_DEBUG ("set RTSP_STATE_RUNNING");
+	update_branch_demand (app);
 	start_rtsp_pipeline(app);
+	request_keyframe (app, KEYFRAME_REASON_RTSP_JOIN);
 	DREAMRTSPSERVER_UNLOCK (app);
 }
 
@@ -981,8 +1768,8 @@ static void uri_parametrized (GstDreamRTSPMediaFactory * factory, gchar *paramet
 
 static GstPadProbeReturn cancel_waiting_probe (GstPad * sinkpad, GstPadProbeInfo * info, gpointer user_data)
 {
-	App *app = user_data;
-	DreamTCPupstream *t = app->tcp_upstream;
+	DreamTCPupstream *t = user_data;
+	App *app = t->app;
 	if (((info->type & GST_PAD_PROBE_TYPE_BUFFER) && GST_IS_BUFFER(GST_PAD_PROBE_INFO_BUFFER(info))) ||
 	     ((info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) && gst_buffer_list_length(GST_PAD_PROBE_INFO_BUFFER_LIST(info))))
 	{
@@ -996,7 +1783,7 @@ static GstPadProbeReturn cancel_waiting_probe (GstPad * sinkpad, GstPadProbeInfo
 			g_source_remove (t->id_signal_keepalive);
 		t->id_signal_keepalive = 0;
 		if (t->id_signal_overrun == 0)
-			t->id_signal_overrun = g_signal_connect (t->tstcpq, "overrun", G_CALLBACK (queue_overrun), app);
+			t->id_signal_overrun = g_signal_connect (t->tstcpq, "overrun", G_CALLBACK (queue_overrun), t);
 		t->id_resume = 0;
 		return GST_PAD_PROBE_REMOVE;
 	}
@@ -1007,8 +1794,8 @@ static GstPadProbeReturn cancel_waiting_probe (GstPad * sinkpad, GstPadProbeInfo
 
 static GstPadProbeReturn bitrate_measure_probe (GstPad * sinkpad, GstPadProbeInfo * info, gpointer user_data)
 {
-	App *app = user_data;
-	DreamTCPupstream *t = app->tcp_upstream;
+	DreamTCPupstream *t = user_data;
+	App *app = t->app;
 	GstClockTime now = gst_clock_get_time (app->clock);
 	GstBuffer *buffer = NULL;
 	guint idx = 0, num_buffers = 1;
@@ -1024,7 +1811,10 @@ static GstPadProbeReturn bitrate_measure_probe (GstPad * sinkpad, GstPadProbeInf
 			buffer = gst_buffer_list_get (bufferlist, idx);
 		}
 		if (GST_IS_BUFFER(buffer))
+		{
 			t->bitrate_sum += gst_buffer_get_size (buffer);
+			g_atomic_int_add (&t->rate.bytes, gst_buffer_get_size (buffer));
+		}
 		idx++;
 	} while (idx < num_buffers);
 
@@ -1034,53 +1824,36 @@ static GstPadProbeReturn bitrate_measure_probe (GstPad * sinkpad, GstPadProbeInf
 	if (now > t->measure_start+BITRATE_AVG_PERIOD)
 	{
 		gint bitrate = t->bitrate_sum*8/GST_TIME_AS_MSECONDS(BITRATE_AVG_PERIOD);
-		t->bitrate_avg ? (t->bitrate_avg = (t->bitrate_avg+bitrate)/2) : (t->bitrate_avg = bitrate);
-		send_signal (app, "tcpBitrate", g_variant_new("(i)", bitrate));
+		upstream_signal (t, "tcpBitrate", "bitrate", g_variant_new("(i)", bitrate));
 		t->measure_start = now;
 		t->bitrate_sum = 0;
 	}
 	return GST_PAD_PROBE_OK;
 }
 
-gboolean upstream_keep_alive (App *app)
+/* while the encoder is paused the sink writes TS null packets straight to the socket, no buffers or state changes involved */
+gboolean upstream_keep_alive (DreamTCPupstream *t)
 {
-	GstBuffer *buf = gst_buffer_new_allocate (NULL, TS_PACK_SIZE, NULL);
-	gst_buffer_memset (buf, 0, 0x00, TS_PACK_SIZE);
-	GstPad * srcpad = gst_element_get_static_pad (app->tcp_upstream->tstcpq, "src");
-
-	GstState state;
-	gst_element_get_state (app->tcp_upstream->tcpsink, &state, NULL, 10*GST_SECOND);
-	GST_INFO_OBJECT(app, "tcpsink's state=%s", gst_element_state_get_name (state));
-	gst_element_get_state (app->tcp_upstream->tstcpq, &state, NULL, 10*GST_SECOND);
-	GST_INFO_OBJECT(app, "tstcpq's state=%s", gst_element_state_get_name (state));
+	gboolean sent = FALSE;
 
-	if ( state == GST_STATE_PAUSED )
+	if (!t->tcpsink)
 	{
-		GstStateChangeReturn sret = gst_element_set_state (app->tcp_upstream->tcpsink, GST_STATE_PLAYING);
-		GST_DEBUG_OBJECT(app, "gst_element_set_state (tcpsink, GST_STATE_PLAYING) = %i", sret);
-		sret = gst_element_set_state (app->tcp_upstream->tstcpq, GST_STATE_PLAYING);
-		GST_DEBUG_OBJECT(app, "gst_element_set_state (tstcpq, GST_STATE_PLAYING) = %i", sret);
-		GST_INFO ("injecting keepalive %" GST_PTR_FORMAT " on pad %s:%s", buf, GST_DEBUG_PAD_NAME (srcpad));
-		gst_pad_push (srcpad, gst_buffer_ref(buf));
-		sret = gst_element_set_state (app->tcp_upstream->tcpsink, GST_STATE_PAUSED);
-		GST_DEBUG_OBJECT(app, "gst_element_set_state (tcpsink, GST_STATE_PAUSED) = %i", sret);
-		sret = gst_element_set_state (app->tcp_upstream->tstcpq, GST_STATE_PAUSED);
-		GST_DEBUG_OBJECT(app, "gst_element_set_state (tstcpq, GST_STATE_PAUSED) = %i", sret);
+		t->id_signal_keepalive = 0;
+		return G_SOURCE_REMOVE;
 	}
-
-	return G_SOURCE_REMOVE;
+	g_signal_emit_by_name (t->tcpsink, "keepalive", &sent);
+	GST_LOG_OBJECT (t->app, "%s keepalive %s", t->name, sent ? "sent" : "skipped");
+	return G_SOURCE_CONTINUE;
 }
 
-gboolean upstream_set_waiting (App *app)
+gboolean upstream_set_waiting (DreamTCPupstream *t)
 {
+	App *app = t->app;
 	DREAMRTSPSERVER_LOCK (app);
-	DreamTCPupstream *t = app->tcp_upstream;
-	t->overrun_counter = 0;
-	t->overrun_period = GST_CLOCK_TIME_NONE;
 	t->state = UPSTREAM_STATE_WAITING;
 	g_object_set (t->tcpsink, "max-lateness", G_GINT64_CONSTANT(1)*GST_SECOND, NULL);
-	send_signal (app, "upstreamStateChanged", g_variant_new("(i)", UPSTREAM_STATE_WAITING));
-	g_signal_connect (t->tstcpq, "underrun", G_CALLBACK (queue_underrun), app);
+	upstream_signal (t, "upstreamStateChanged", "stateChanged", g_variant_new("(i)", UPSTREAM_STATE_WAITING));
+	g_signal_connect (t->tstcpq, "underrun", G_CALLBACK (queue_underrun), t);
 	GstPad *sinkpad = gst_element_get_static_pad (t->tcpsink, "sink");
 	if (t->id_resume)
 	{
@@ -1092,684 +1865,3015 @@ gboolean upstream_set_waiting (App *app)
 		gst_pad_remove_probe (sinkpad, t->id_bitrate_measure);
 		t->id_bitrate_measure = 0;
 	}
-	send_signal (app, "tcpBitrate", g_variant_new("(i)", 0));
+	upstream_signal (t, "tcpBitrate", "bitrate", g_variant_new("(i)", 0));
 	gst_object_unref (sinkpad);
-	pause_source_pipeline(app);
+	/* the other sessions keep the encoder busy */
+	if (!upstream_consuming (app, t))
+		pause_source_pipeline(app);
 	t->id_signal_waiting = 0;
-	t->id_signal_keepalive = g_timeout_add_seconds (5, (GSourceFunc) upstream_keep_alive, app);
+	if (!t->id_signal_keepalive)
+		t->id_signal_keepalive = g_timeout_add_seconds (UPSTREAM_KEEPALIVE_INTERVAL, (GSourceFunc) upstream_keep_alive, t);
 	DREAMRTSPSERVER_UNLOCK (app);
 	return G_SOURCE_REMOVE;
 }
 
+/* the peer takes data again, either the queue drained or the mediator said so */
+static gboolean upstream_resume_waiting (DreamTCPupstream *t)
+{
+	App *app = t->app;
+	if (!unpause_source_pipeline(app))
+		return FALSE;
+	DREAMRTSPSERVER_LOCK (app);
+// 	g_object_set (G_OBJECT (t->tstcpq), "leaky", 2, "max-size-buffers", 0, "max-size-bytes", 0, "max-size-time", G_GINT64_CONSTANT(5)*GST_SECOND, NULL);
+	g_object_set (t->tcpsink, "max-lateness", G_GINT64_CONSTANT(-1), NULL);
+	g_signal_handlers_disconnect_by_func (t->tstcpq, G_CALLBACK (queue_underrun), t);
+	t->id_signal_overrun = g_signal_connect (t->tstcpq, "overrun", G_CALLBACK (queue_overrun), t);
+	if (t->id_signal_keepalive)
+		g_source_remove (t->id_signal_keepalive);
+	t->id_signal_keepalive = 0;
+	t->state = UPSTREAM_STATE_TRANSMITTING;
+	upstream_signal (t, "upstreamStateChanged", "stateChanged", g_variant_new("(i)", UPSTREAM_STATE_TRANSMITTING));
+	request_keyframe (app, KEYFRAME_REASON_UPSTREAM_RESUME);
+	if (t->id_bitrate_measure == 0)
+	{
+		GstPad *sinkpad = gst_element_get_static_pad (t->tcpsink, "sink");
+		t->id_bitrate_measure = gst_pad_add_probe (sinkpad, GST_PAD_PROBE_TYPE_BUFFER|GST_PAD_PROBE_TYPE_BUFFER_LIST, (GstPadProbeCallback) bitrate_measure_probe, t, NULL);
+		gst_object_unref (sinkpad);
+	}
+	t->measure_start = gst_clock_get_time (app->clock);
+	t->bitrate_sum = 0;
+	rate_control_start (t);
+	DREAMRTSPSERVER_UNLOCK (app);
+	return TRUE;
+}
+
 static void queue_underrun (GstElement * queue, gpointer user_data)
 {
-	App *app = user_data;
-	DreamTCPupstream *t = app->tcp_upstream;
+	DreamTCPupstream *t = user_data;
+	App *app = t->app;
 	QUEUE_DEBUG;
 	GST_DEBUG_OBJECT (app, "queue underrun! properties: current-level-bytes=%d current-level-buffers=%d current-level-time=%" GST_TIME_FORMAT "", cur_bytes, cur_buf, GST_TIME_ARGS(cur_time));
-	if (queue == t->tstcpq && app->rtsp_server->state != RTSP_STATE_RUNNING)
-	{
-		if (unpause_source_pipeline(app))
-		{
-			DREAMRTSPSERVER_LOCK (app);
-// 			g_object_set (G_OBJECT (t->tstcpq), "leaky", 2, "max-size-buffers", 0, "max-size-bytes", 0, "max-size-time", G_GINT64_CONSTANT(5)*GST_SECOND, NULL);
-			g_object_set (t->tcpsink, "max-lateness", G_GINT64_CONSTANT(-1), NULL);
-			g_signal_handlers_disconnect_by_func (queue, G_CALLBACK (queue_underrun), app);
-			t->id_signal_overrun = g_signal_connect (queue, "overrun", G_CALLBACK (queue_overrun), app);
-			t->state = UPSTREAM_STATE_TRANSMITTING;
-			send_signal (app, "upstreamStateChanged", g_variant_new("(i)", UPSTREAM_STATE_TRANSMITTING));
-			if (t->id_bitrate_measure == 0)
-			{
-				GstPad *sinkpad = gst_element_get_static_pad (t->tcpsink, "sink");
-				t->id_bitrate_measure = gst_pad_add_probe (sinkpad, GST_PAD_PROBE_TYPE_BUFFER|GST_PAD_PROBE_TYPE_BUFFER_LIST, (GstPadProbeCallback) bitrate_measure_probe, app, NULL);
-				gst_object_unref (sinkpad);
-			}
-			t->measure_start = gst_clock_get_time (app->clock);
-			t->bitrate_sum = t->bitrate_avg = 0;
-			if (t->overrun_period == GST_CLOCK_TIME_NONE)
-				t->overrun_period = gst_clock_get_time (app->clock);
-			DREAMRTSPSERVER_UNLOCK (app);
-		}
-	}
+	/* an idle mediator drains the queue without having viewers, it says when to resume */
+	if (queue == t->tstcpq && app->rtsp_server->state != RTSP_STATE_RUNNING && !t->mediator_idle)
+		upstream_resume_waiting (t);
 }
 
 static void queue_overrun (GstElement * queue, gpointer user_data)
 {
-	App *app = user_data;
-	DreamTCPupstream *t = app->tcp_upstream;
+	DreamTCPupstream *t = user_data;
+	App *app = t->app;
 	DREAMRTSPSERVER_LOCK (app);
 	if (queue == t->tstcpq/* && app->rtsp_server->state != RTSP_STATE_IDLE*/) //!!!TODO
 	{
 		QUEUE_DEBUG;
 		GST_DEBUG_OBJECT(app, "%" GST_PTR_FORMAT " overrun! properties: current-level-bytes=%d current-level-buffers=%d current-level-time=%" GST_TIME_FORMAT " rtsp_server->state=%i", queue, cur_bytes, cur_buf, GST_TIME_ARGS(cur_time), app->rtsp_server->state);
-		GstClockTime now = gst_clock_get_time (app->clock);
 		if (t->state == UPSTREAM_STATE_CONNECTING)
 		{
 			GST_DEBUG_OBJECT (queue, "initial queue overrun after connect");
 // 			g_object_set (G_OBJECT (t->tstcpq), "leaky", 0, "max-size-buffers", 0, "max-size-bytes", 0, "max-size-time", G_GINT64_CONSTANT(5)*GST_SECOND, "min-threshold-buffers", 0, NULL);
-			g_signal_handlers_disconnect_by_func(t->tstcpq, G_CALLBACK (queue_overrun), app);
+			g_signal_handlers_disconnect_by_func(t->tstcpq, G_CALLBACK (queue_overrun), t);
 			t->id_signal_overrun = 0;
 			DREAMRTSPSERVER_UNLOCK (app);
-			upstream_set_waiting (app);
+			upstream_set_waiting (t);
 			return;
 		}
-		else if (t->state == UPSTREAM_STATE_TRANSMITTING)
+		else if (t->state == UPSTREAM_STATE_TRANSMITTING || t->state == UPSTREAM_STATE_ADJUSTING || t->state == UPSTREAM_STATE_OVERLOAD)
 		{
 			if (t->id_signal_waiting)
 			{
-				g_signal_handlers_disconnect_by_func(t->tstcpq, G_CALLBACK (queue_overrun), app);
+				g_signal_handlers_disconnect_by_func(t->tstcpq, G_CALLBACK (queue_overrun), t);
 				t->id_signal_overrun = 0;
 				GST_DEBUG_OBJECT (queue, "disconnect overrun callback and wait for timeout or for buffer flow!");
 				DREAMRTSPSERVER_UNLOCK (app);
 				return;
 			}
-			t->overrun_counter++;
-			GST_DEBUG_OBJECT (queue, "queue overrun during transmit... %i (max %i) overruns within %" GST_TIME_FORMAT "", t->overrun_counter, MAX_OVERRUNS, GST_TIME_ARGS (now-t->overrun_period));
-			if (now > t->overrun_period+OVERRUN_TIME)
-			{
-				t->overrun_counter = 0;
-				t->overrun_period = now;
-			}
-			if (t->overrun_counter >= MAX_OVERRUNS)
-			{
-				if (t->auto_bitrate)
-				{
-					t->state = UPSTREAM_STATE_ADJUSTING;
-					send_signal (app, "upstreamStateChanged", g_variant_new("(i)", UPSTREAM_STATE_OVERLOAD));
-					auto_adjust_bitrate (app);
-					t->overrun_period = now;
-				}
-				else
-				{
-					t->state = UPSTREAM_STATE_OVERLOAD;
-					send_signal (app, "upstreamStateChanged", g_variant_new("(i)", UPSTREAM_STATE_OVERLOAD));
-					GST_DEBUG_OBJECT (queue, "auto overload handling disabled, go into UPSTREAM_STATE_OVERLOAD");
-					if (t->id_signal_waiting)
-						g_source_remove (t->id_signal_waiting);
-					t->id_signal_waiting = g_timeout_add_seconds (RESUME_DELAY, (GSourceFunc) upstream_resume_transmitting, app);
-				}
-			}
-			else
-			{
-				GST_DEBUG_OBJECT (queue, "SET upstream_set_waiting timeout!");
-				GstPad *sinkpad = gst_element_get_static_pad (t->tcpsink, "sink");
-				t->id_resume = gst_pad_add_probe (sinkpad, GST_PAD_PROBE_TYPE_BUFFER|GST_PAD_PROBE_TYPE_BUFFER_LIST, (GstPadProbeCallback) cancel_waiting_probe, app, NULL);
-				gst_object_unref (sinkpad);
-				if (t->id_signal_waiting)
-					g_source_remove (t->id_signal_waiting);
-				t->id_signal_waiting = g_timeout_add_seconds (5, (GSourceFunc) upstream_set_waiting, app);
-			}
-		}
-		else if (t->state == UPSTREAM_STATE_OVERLOAD)
-		{
-			t->overrun_counter++;
-			if (t->id_signal_waiting)
-				g_source_remove (t->id_signal_waiting);
-			t->id_signal_waiting = g_timeout_add_seconds (5, (GSourceFunc) upstream_resume_transmitting, app);
-			GST_DEBUG_OBJECT (queue, "still in UPSTREAM_STATE_OVERLOAD overrun_counter=%i, reset resume transmit timeout!", t->overrun_counter);
-		}
-		else if (t->state == UPSTREAM_STATE_ADJUSTING)
-		{
-			if (now < t->overrun_period+BITRATE_AVG_PERIOD)
-			{
-				GST_DEBUG_OBJECT (queue, "still in grace period, waiting for bitrate adjustment to take effect. %"G_GUINT64_FORMAT" ms remaining", GST_TIME_AS_MSECONDS(t->overrun_period+BITRATE_AVG_PERIOD-now));
-			}
-			else
-			{
-				t->overrun_counter++;
-				if (t->overrun_counter < MAX_OVERRUNS)
-					GST_DEBUG_OBJECT (queue, "still waiting for bitrate adjustment to take effect. overrun_counter=%i", t->overrun_counter);
-				else
-				{
-					GST_DEBUG_OBJECT (queue, "max overruns %i hit again while auto adjusting. -> RE-ADJUST!", t->overrun_counter);
-					t->overrun_counter = 0;
-					auto_adjust_bitrate (app);
-					t->overrun_period = now;
-				}
-			}
+			/* the leaky queue is already dropping, the rate controller backs off on its next tick */
+			t->rate.overruns++;
+			GST_DEBUG_OBJECT (queue, "SET upstream_set_waiting timeout! (%u overruns since last rate control tick)", t->rate.overruns);
+			GstPad *sinkpad = gst_element_get_static_pad (t->tcpsink, "sink");
+			t->id_resume = gst_pad_add_probe (sinkpad, GST_PAD_PROBE_TYPE_BUFFER|GST_PAD_PROBE_TYPE_BUFFER_LIST, (GstPadProbeCallback) cancel_waiting_probe, t, NULL);
+			gst_object_unref (sinkpad);
+			t->id_signal_waiting = g_timeout_add_seconds (5, (GSourceFunc) upstream_set_waiting, t);
 		}
 	}
 	DREAMRTSPSERVER_UNLOCK (app);
 }
 
-static void auto_adjust_bitrate(App *app)
+static void rate_control_init (DreamRateController *rc)
+{
+	rc->target = rc->current = 0;
+	rc->floor = RATE_MIN_VIDEO_BITRATE;
+	rc->throughput = rc->queue_delay = rc->socket_delay = rc->ingest = rc->loss = 0;
+	rc->rtt = rc->min_rtt = -1;
+	rc->bytes = 0;
+	rc->overruns = rc->decreases = rc->increases = 0;
+	rc->last_decision = RATE_DECISION_HOLD;
+	rc->last_change = rc->last_decrease = rc->last_sample = 0;
+	rc->id_tick = 0;
+}
+
+static void rate_control_start (DreamTCPupstream *t)
 {
-	DreamTCPupstream *t = app->tcp_upstream;
+	App *app = t->app;
+	DreamRateController *rc = &t->rate;
+	GList *l;
 	get_source_properties (app);
-	SourceProperties *p = &app->source_properties;
-	GST_DEBUG_OBJECT (app, "auto overload handling: reduce bitrate from audioBitrate=%i videoBitrate=%i to fit network bandwidth=%i kbit/s", p->audioBitrate, p->videoBitrate, t->bitrate_avg);
-	if (p->audioBitrate > 96)
-		p->audioBitrate = p->audioBitrate*0.8;
-	p->videoBitrate = (t->bitrate_avg - p->audioBitrate) * 0.8;
-	GST_INFO_OBJECT (app, "auto overload handling: newAudioBitrate=%i newVideoBitrate=%i newTotalBitrate~%i kbit/s", p->audioBitrate, p->videoBitrate, p->audioBitrate+p->videoBitrate);
-	apply_source_properties(app);
-	if (t->id_signal_waiting)
-		g_source_remove (t->id_signal_waiting);
-	t->id_signal_waiting = g_timeout_add_seconds (RESUME_DELAY, (GSourceFunc) upstream_resume_transmitting, app);
-	t->overrun_counter = 0;
+	rc->current = app->source_properties.videoBitrate;
+	/* while another session holds the encoder down, ramp up to the bitrate it was configured with */
+	if (rc->target <= 0 && app->upstream_bitrate)
+		for (l = app->upstreams; l; l = l->next)
+			rc->target = MAX (rc->target, ((DreamTCPupstream *) l->data)->rate.target);
+	if (rc->target <= 0)
+		rc->target = rc->current;
+	rc->throughput = rc->ingest = rc->loss = 0;
+	rc->overruns = 0;
+	rc->min_rtt = -1;
+	g_atomic_int_set (&rc->bytes, 0);
+	rc->last_change = rc->last_decrease = rc->last_sample = g_get_monotonic_time ();
+	if (!rc->id_tick)
+		rc->id_tick = g_timeout_add (RATE_CONTROL_INTERVAL, rate_control_tick, t);
+	GST_DEBUG_OBJECT (app, "%s rate control started at videoBitrate=%i target=%i kbit/s", t->name, rc->current, rc->target);
 }
 
-static GstFlowReturn handover_payload (GstElement * appsink, gpointer user_data)
+/* hands the encoder back to the remaining sessions, at full rate if none of them controls it */
+static void rate_control_stop (DreamTCPupstream *t)
 {
-	App *app = user_data;
-	DreamRTSPserver *r = app->rtsp_server;
+	DreamRateController *rc = &t->rate;
+	if (rc->id_tick)
+		g_source_remove (rc->id_tick);
+	rc->id_tick = 0;
+	if (rate_control_apply (t->app, rc->target))
+		rc->current = rc->target;
+}
 
-	GstAppSrc *appsrc = NULL;
-	if ( appsink == r->vappsink )
-		appsrc = GST_APP_SRC(r->es_vappsrc);
-	else if ( appsink == r->aappsink )
-		appsrc = GST_APP_SRC(r->es_aappsrc);
-	else if ( appsink == r->tsappsink )
-		appsrc = GST_APP_SRC(r->ts_appsrc);
+/* the encoder runs at the lowest rate any running session that controls it asks for */
+static gboolean rate_control_apply (App *app, gint target)
+{
+	GList *l;
+	gint bitrate = 0;
 
-	GstSample *sample = gst_app_sink_pull_sample (GST_APP_SINK (appsink));
-	if (appsrc && g_list_length(r->clients_list) > 0) {
-		GstBuffer *buffer = gst_sample_get_buffer (sample);
-		GstCaps *caps = gst_sample_get_caps (sample);
+	for (l = app->upstreams; l; l = l->next)
+	{
+		DreamTCPupstream *t = l->data;
+		if (!t->rate.id_tick || !t->auto_bitrate || !upstream_controls_encoder (t))
+			continue;
+		if (!bitrate || t->rate.current < bitrate)
+			bitrate = t->rate.current;
+	}
+	if (!bitrate)
+	{
+		if (app->upstream_bitrate && target > 0 && app->upstream_bitrate != target && !gst_set_bitrate (app, app->vsrc, target))
+			return FALSE;
+		app->upstream_bitrate = 0;
+		return TRUE;
+	}
+	if (bitrate == app->upstream_bitrate)
+		return TRUE;
+	GST_DEBUG_OBJECT (app, "encoder follows the slowest upstream at videoBitrate=%i kbit/s", bitrate);
+	if (!gst_set_bitrate (app, app->vsrc, bitrate))
+		return FALSE;
+	app->upstream_bitrate = bitrate;
+	return TRUE;
+}
 
-		GST_LOG_OBJECT(appsink, "%" GST_PTR_FORMAT" @ %" GST_PTR_FORMAT, buffer, appsrc);
-		if (r->rtsp_start_pts == GST_CLOCK_TIME_NONE) {
-			if (GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT))
-			{
-				GST_LOG("GST_BUFFER_FLAG_DELTA_UNIT dropping!");
-				gst_sample_unref(sample);
-//				DREAMRTSPSERVER_UNLOCK (app);
-				return GST_FLOW_OK;
-			}
-			else if (appsink == r->vappsink || appsink == r->tsappsink)
-			{
-				DREAMRTSPSERVER_LOCK (app);
-				r->rtsp_start_pts = GST_BUFFER_PTS (buffer);
-				r->rtsp_start_dts = GST_BUFFER_DTS (buffer);
-				GST_LOG_OBJECT(appsink, "frame is IFRAME! set rtsp_start_pts=%" GST_TIME_FORMAT " rtsp_start_dts=%" GST_TIME_FORMAT " @ %"GST_PTR_FORMAT"", GST_TIME_ARGS (GST_BUFFER_PTS (buffer)), GST_TIME_ARGS (GST_BUFFER_DTS (buffer)), appsrc);
-				DREAMRTSPSERVER_UNLOCK (app);
-			}
-		}
-		if (GST_BUFFER_PTS (buffer) < r->rtsp_start_pts)
-			GST_BUFFER_PTS (buffer) = 0;
-		else
-			GST_BUFFER_PTS (buffer) -= r->rtsp_start_pts;
-		GST_BUFFER_DTS (buffer) -= r->rtsp_start_dts;
-		//    GST_LOG("new PTS %" GST_TIME_FORMAT " DTS %" GST_TIME_FORMAT "", GST_TIME_ARGS (GST_BUFFER_PTS (buffer)), GST_TIME_ARGS (GST_BUFFER_DTS (buffer)));
+static gboolean rate_control_tick (gpointer user_data)
+{
+	DreamTCPupstream *t = user_data;
+	if (rate_control_evaluate (t))
+		return G_SOURCE_CONTINUE;
+	t->rate.id_tick = 0;
+	return G_SOURCE_REMOVE;
+}
+
+/* runs once per RATE_CONTROL_INTERVAL and additionally whenever the socket telemetry raises a congestion warning */
+static gboolean rate_control_evaluate (DreamTCPupstream *t)
+{
+	App *app = t->app;
+	DreamRateController *rc = &t->rate;
+	gint64 now = g_get_monotonic_time ();
+	gint64 elapsed = (now - rc->last_sample) / 1000;
+	guint64 level_time = 0;
+	gint bitrate;
+	gboolean adapt = t->auto_bitrate && upstream_controls_encoder (t);
+
+	DREAMRTSPSERVER_LOCK (app);
+	if (!t->tstcpq || (t->state != UPSTREAM_STATE_TRANSMITTING && t->state != UPSTREAM_STATE_ADJUSTING && t->state != UPSTREAM_STATE_OVERLOAD))
+	{
+		DREAMRTSPSERVER_UNLOCK (app);
+		return FALSE;
+	}
 
-		GstCaps *oldcaps;
+	/* an early evaluation right after a tick would measure over too short a window */
+	if (elapsed >= RATE_CONTROL_INTERVAL / 4)
+	{
+		gint bytes = g_atomic_int_get (&rc->bytes);
+		g_atomic_int_add (&rc->bytes, -bytes);
+		bitrate = (gint64) bytes * 8 / elapsed;
+		rc->throughput = rc->throughput ? (3 * rc->throughput + bitrate) / 4 : bitrate;
+		rc->last_sample = now;
+	}
+	g_object_get (t->tstcpq, "current-level-time", &level_time, NULL);
+	rc->queue_delay = GST_TIME_AS_MSECONDS (level_time);
+	if (rc->rtt >= 0 && (rc->min_rtt < 0 || rc->rtt < rc->min_rtt))
+		rc->min_rtt = rc->rtt;
+
+	/* the mediator receiving noticeably less than we send means the link is backing up before our own queues show it */
+	gboolean short_ingest = rc->ingest > 0 && rc->throughput > 0 && rc->ingest < rc->throughput * RATE_INGEST_SHORTFALL / 100;
+	gboolean congested = rc->overruns || short_ingest || rc->loss > RATE_LOSS_HIGH || rc->queue_delay > RATE_QUEUE_DELAY_HIGH || rc->socket_delay > UPSTREAM_SENDQ_DELAY_HIGH || (rc->rtt >= 0 && rc->rtt > 2 * rc->min_rtt + RATE_RTT_SLACK);
+	gboolean clear = !congested && rc->loss <= RATE_LOSS_LOW && rc->queue_delay < RATE_QUEUE_DELAY_LOW && rc->socket_delay < RATE_QUEUE_DELAY_LOW;
+	gint ingest = rc->ingest;
+	gint loss = rc->loss;
+	rc->overruns = 0;
+	/* every report counts once */
+	rc->ingest = rc->loss = 0;
+	bitrate = rc->current;
+
+	if (congested && now - rc->last_decrease >= RATE_DECREASE_HOLDOFF * 1000)
+	{
+		bitrate = rc->current * RATE_DECREASE_FACTOR / 100;
+		/* never ask for more than the link has just delivered */
+		if (rc->throughput > app->source_properties.audioBitrate)
+			bitrate = MIN (bitrate, (rc->throughput - app->source_properties.audioBitrate) * 90 / 100);
+		if (short_ingest && ingest > app->source_properties.audioBitrate)
+			bitrate = MIN (bitrate, (ingest - app->source_properties.audioBitrate) * 90 / 100);
+		bitrate = MAX (bitrate, rc->floor);
+		rc->last_decision = RATE_DECISION_DECREASE;
+		rc->last_decrease = rc->last_change = now;
+		rc->decreases++;
+	}
+	else if (clear && rc->current < rc->target && now - rc->last_change >= RATE_PROBE_INTERVAL * 1000)
+	{
+		bitrate = MIN (rc->target, rc->current + MAX (rc->current * RATE_PROBE_STEP / 100, RATE_PROBE_MIN_STEP));
+		rc->last_decision = RATE_DECISION_PROBE;
+		rc->last_change = now;
+		rc->increases++;
+	}
+	else
+		rc->last_decision = RATE_DECISION_HOLD;
 
-		oldcaps = gst_app_src_get_caps (appsrc);
-		if (!oldcaps || !gst_caps_is_equal (oldcaps, caps))
+	if (rc->last_decision != RATE_DECISION_HOLD)
+	{
+		GST_INFO_OBJECT (app, "%s rate control: %s videoBitrate %i -> %i kbit/s (target=%i throughput=%i queue delay=%i ms rtt=%i ms loss=%i/1000)", t->name, rate_decision_names[rc->last_decision],
+				 rc->current, bitrate, rc->target, rc->throughput, rc->queue_delay, rc->rtt, loss);
+		if (adapt && bitrate != rc->current)
 		{
-			GST_DEBUG("CAPS changed! %" GST_PTR_FORMAT " to %" GST_PTR_FORMAT, oldcaps, caps);
-			gst_app_src_set_caps (appsrc, caps);
+			gint previous = rc->current;
+			rc->current = bitrate;
+			if (!rate_control_apply (app, rc->target))
+				rc->current = previous;
 		}
-		gst_app_src_push_buffer (appsrc, gst_buffer_ref(buffer));
+		upstream_signal (t, "upstreamRateDecision", "rateDecision", g_variant_new("(siiii)", rate_decision_names[rc->last_decision], bitrate, rc->throughput, rc->queue_delay, rc->rtt));
 	}
-	else
+
+	/* without auto bitrate the controller only reports, congestion shows up as UPSTREAM_STATE_OVERLOAD */
+	upstreamState state = t->state;
+	if (adapt)
+		state = rc->current < rc->target ? UPSTREAM_STATE_ADJUSTING : UPSTREAM_STATE_TRANSMITTING;
+	else if (rc->last_decision == RATE_DECISION_DECREASE)
+		state = UPSTREAM_STATE_OVERLOAD;
+	else if (clear)
+		state = UPSTREAM_STATE_TRANSMITTING;
+	if (state != t->state)
 	{
-		if ( gst_debug_category_get_threshold (dreamrtspserver_debug) >= GST_LEVEL_LOG)
-			GST_TRACE_OBJECT(appsink, "no rtsp clients, discard payload!");
-// 		else
-// 			g_print (".");
+		t->state = state;
+		upstream_signal (t, "upstreamStateChanged", "stateChanged", g_variant_new("(i)", state));
 	}
-	gst_sample_unref (sample);
+	DREAMRTSPSERVER_UNLOCK (app);
+	return TRUE;
+}
 
-	return GST_FLOW_OK;
+/* samples the kernel's view of the upstream connection, growing send queues and rtt show up here well before the tstcpq overruns */
+static gboolean upstream_socket_stats_tick (gpointer user_data)
+{
+	DreamTCPupstream *t = user_data;
+	App *app = t->app;
+	DreamSocketStats *st = &t->socket_stats;
+	DreamRateController *rc = &t->rate;
+	GstStructure *stats = NULL;
+	guint retransmits, warnings = 0, onset, i;
+	gint packets_lost;
+
+	DREAMRTSPSERVER_LOCK (app);
+	if (!t->tcpsink)
+	{
+		t->id_stats = 0;
+		DREAMRTSPSERVER_UNLOCK (app);
+		return G_SOURCE_REMOVE;
+	}
+	g_object_get (t->tcpsink, "stats", &stats, NULL);
+	if (!stats)
+	{
+		DREAMRTSPSERVER_UNLOCK (app);
+		return G_SOURCE_CONTINUE;
+	}
+
+	retransmits = st->retransmits;
+	packets_lost = st->packets_lost;
+	gst_structure_get (stats, "rtt", G_TYPE_UINT, &st->rtt, "rttvar", G_TYPE_UINT, &st->rttvar, "cwnd", G_TYPE_UINT, &st->cwnd, "mss", G_TYPE_UINT, &st->mss,
+			   "retransmits", G_TYPE_UINT, &st->retransmits, "unacked", G_TYPE_UINT, &st->unacked, "outq", G_TYPE_UINT, &st->outq,
+			   "delivery-rate", G_TYPE_UINT, &st->delivery_rate, "spooled", G_TYPE_UINT64, &st->spooled, "spool-dropped", G_TYPE_UINT64, &st->spool_dropped, NULL);
+	/* only the RTP transport has receiver reports */
+	gst_structure_get_int (stats, "packets-lost", &st->packets_lost);
+	gst_structure_get_uint (stats, "fraction-lost", &st->fraction_lost);
+	gst_structure_free (stats);
+
+	/* a report counts only if it brought new losses, the fraction stays until the next one arrives */
+	if (st->packets_lost > packets_lost)
+		rc->loss = MAX (rc->loss, (gint) (st->fraction_lost * 1000 / 256));
+	if (st->rtt && (!st->min_rtt || st->rtt < st->min_rtt))
+		st->min_rtt = st->rtt;
+	rc->rtt = st->rtt ? (gint) (st->rtt / 1000) : -1;
+	gint rate = rc->throughput ? rc->throughput : (gint) st->delivery_rate;
+	rc->socket_delay = rate > 0 ? (gint64) st->outq * 8 / rate : 0;
+
+	if (st->min_rtt && st->rtt / 1000 > 2 * (st->min_rtt / 1000) + RATE_RTT_SLACK)
+		warnings |= UPSTREAM_WARNING_RTT;
+	if (st->retransmits > retransmits)
+		warnings |= UPSTREAM_WARNING_RETRANSMIT;
+	if (rc->socket_delay > UPSTREAM_SENDQ_DELAY_HIGH)
+		warnings |= UPSTREAM_WARNING_SENDQ;
+	if (rc->loss > RATE_LOSS_HIGH)
+		warnings |= UPSTREAM_WARNING_LOSS;
+
+	onset = warnings & ~t->warnings;
+	t->warnings = warnings;
+	for (i = 0; i < UPSTREAM_WARNING_COUNT; i++)
+	{
+		if (!(onset & (1 << i)))
+			continue;
+		guint value = i == 0 ? st->rtt / 1000 : i == 1 ? st->retransmits - retransmits : i == 2 ? (guint) rc->socket_delay : (guint) rc->loss;
+		GST_INFO_OBJECT (app, "%s congestion warning: %s=%u (rtt=%u us min=%u us cwnd=%u sendq=%u bytes delivery=%u kbit/s)", t->name, upstream_warning_names[i], value,
+				 st->rtt, st->min_rtt, st->cwnd, st->outq, st->delivery_rate);
+		upstream_signal (t, "upstreamCongestionWarning", "congestionWarning", g_variant_new("(su)", upstream_warning_names[i], value));
+	}
+	DREAMRTSPSERVER_UNLOCK (app);
+
+	if (onset && rc->id_tick)
+		rate_control_evaluate (t);
+	return G_SOURCE_CONTINUE;
 }
 
-gboolean assert_state(App *app, GstElement *element, GstState state)
+/* the upstream sink reconnects by itself, the source and the other outputs keep running meanwhile */
+static void upstream_connection_event (DreamTCPupstream *t, const GstStructure *s)
 {
-	GstStateChangeReturn sret;
-	GST_DEBUG_OBJECT(app, "setting %" GST_PTR_FORMAT"'s state to %s", element, gst_element_state_get_name (state));
-	GstState pipeline_state, current_state;
-	sret = gst_element_set_state (element, state);
-	gchar *elementname = gst_element_get_name(element);
-	gchar *dotfilename = g_strdup_printf ("assert_state_%s_to_%s_%i", elementname,gst_element_state_get_name (state), sret);
-	GST_DEBUG_BIN_TO_DOT_FILE(GST_BIN(app->pipeline), GST_DEBUG_GRAPH_SHOW_ALL, dotfilename);
-	g_free (elementname);
-	switch (sret) {
-		case GST_STATE_CHANGE_SUCCESS:
-		{
-			GST_DEBUG_OBJECT(app, "GST_STATE_CHANGE_SUCCESS on setting %" GST_PTR_FORMAT"'s state to %s ", element, gst_element_state_get_name (state));
-			return TRUE;
-		}
-		case GST_STATE_CHANGE_FAILURE:
+	App *app = t->app;
+	const gchar *event = gst_structure_get_string (s, "event");
+	guint attempt = 0;
+	guint64 downtime = 0;
+
+	gst_structure_get_uint (s, "attempt", &attempt);
+	gst_structure_get_uint64 (s, "downtime", &downtime);
+
+	DREAMRTSPSERVER_LOCK (app);
+	if (g_strcmp0 (event, "disconnected") == 0)
+	{
+		GST_INFO_OBJECT (app, "%s connection lost (%s), reconnecting...", t->name, gst_structure_get_string (s, "reason"));
+		if (t->state != UPSTREAM_STATE_RECONNECTING)
+			t->resume_state = t->state;
+		t->state = UPSTREAM_STATE_RECONNECTING;
+		t->reconnect_attempts = 0;
+		t->warnings = 0;
+		upstream_signal (t, "upstreamStateChanged", "stateChanged", g_variant_new("(i)", t->state));
+	}
+	else if (g_strcmp0 (event, "reconnecting") == 0)
+		t->reconnect_attempts = attempt;
+	else if (g_strcmp0 (event, "reconnected") == 0 && t->state == UPSTREAM_STATE_RECONNECTING)
+	{
+		t->reconnects++;
+		t->reconnect_attempts = attempt;
+		t->last_downtime = downtime;
+		t->max_downtime = MAX (t->max_downtime, downtime);
+		GST_INFO_OBJECT (app, "%s reconnected after %u attempts, %" G_GUINT64_FORMAT " ms without connection", t->name, attempt, downtime);
+		upstream_signal (t, "upstreamReconnected", "reconnected", g_variant_new("(uu)", attempt, (guint32) downtime));
+		if (t->resume_state == UPSTREAM_STATE_TRANSMITTING || t->resume_state == UPSTREAM_STATE_ADJUSTING || t->resume_state == UPSTREAM_STATE_OVERLOAD)
 		{
-			GST_ERROR_OBJECT (app, "GST_STATE_CHANGE_FAILURE when trying to change %" GST_PTR_FORMAT"'s state to %s", element, gst_element_state_get_name (state));
-			return FALSE;
+			t->state = UPSTREAM_STATE_TRANSMITTING;
+			request_keyframe (app, KEYFRAME_REASON_UPSTREAM_RESUME);
+			rate_control_start (t);
 		}
-		case GST_STATE_CHANGE_ASYNC:
+		else
+			t->state = t->resume_state;
+		upstream_signal (t, "upstreamStateChanged", "stateChanged", g_variant_new("(i)", t->state));
+	}
+	else if (g_strcmp0 (event, "failover") == 0)
+	{
+		gchar *host = t->host;
+		guint32 port = t->port;
+
+		/* the sink swapped endpoints, the lost one is the new standby */
+		t->failovers++;
+		t->host = t->standby_host;
+		t->port = t->standby_port;
+		t->standby_host = host;
+		t->standby_port = port;
+		t->socket_stats.min_rtt = 0;
+		t->rate.min_rtt = -1;
+		t->warnings = 0;
+		GST_INFO_OBJECT (app, "%s failed over to standby %s:%u (%s)", t->name, t->host, t->port, gst_structure_get_string (s, "reason"));
+		upstream_signal (t, "upstreamFailover", "failover", g_variant_new("(su)", t->host, t->port));
+		request_keyframe (app, KEYFRAME_REASON_UPSTREAM_RESUME);
+		if (t->state == UPSTREAM_STATE_RECONNECTING)
 		{
-			watchdog_ping (app);
-			gboolean fail = FALSE;
-			GST_LOG_OBJECT(app, "GST_STATE_CHANGE_ASYNC %" GST_PTR_FORMAT"", element);
-			GstClockTime timeout = /*(element == app->pipeline) ?*/ 4 * GST_SECOND/* : GST_MSECOND*/;
-			if (element == GST_ELEMENT(app->pipeline))
+			if (t->resume_state == UPSTREAM_STATE_TRANSMITTING || t->resume_state == UPSTREAM_STATE_ADJUSTING || t->resume_state == UPSTREAM_STATE_OVERLOAD)
 			{
-				gst_element_get_state (GST_ELEMENT(app->pipeline), &pipeline_state, NULL, timeout);
-				GST_LOG_OBJECT(app, "GST_STATE_CHANGE_ASYNC got pipeline_state=%s", gst_element_state_get_name (state));
-				if (pipeline_state != state)
-				{
-					GValue item = G_VALUE_INIT;
-					GstIterator* iter = gst_bin_iterate_elements(GST_BIN(app->pipeline));
-					while (GST_ITERATOR_OK == gst_iterator_next(iter, (GValue*)&item))
-					{
-						GstElement *elem = g_value_get_object(&item);
-						GstElementFactory *factory = gst_element_get_factory (elem);
-						gst_element_get_state (elem, &current_state, NULL, GST_MSECOND);
-						if (current_state != state && (element == app->pipeline || element == elem))
-						{
-							if (element == app->pipeline)
-							{
-								if (gst_element_factory_list_is_type (factory, GST_ELEMENT_FACTORY_TYPE_SINK))
-									GST_LOG_OBJECT(app, "GST_STATE_CHANGE_ASYNC %" GST_PTR_FORMAT"'s state=%s (this is a sink element, so don't worry...)", elem, gst_element_state_get_name (current_state));
-								else
-								{
-									GST_WARNING_OBJECT(app, "GST_STATE_CHANGE_ASYNC %" GST_PTR_FORMAT"'s state=%s -> FAIL", elem, gst_element_state_get_name (current_state));
-									fail = TRUE;
-								}
-							}
-						}
-						else
-							GST_LOG_OBJECT(app, "GST_STATE_CHANGE_ASYNC %" GST_PTR_FORMAT"'s state=%s", elem, gst_element_state_get_name (current_state));
-					}
-					gst_iterator_free(iter);
-					if (fail)
-					{
-						GST_ERROR_OBJECT (app, "pipeline didn't complete GST_STATE_CHANGE_ASYNC to %s within %" GST_TIME_FORMAT ", currently in %s", gst_element_state_get_name (state), GST_TIME_ARGS(timeout), gst_element_state_get_name (pipeline_state));
-						return FALSE;
-					}
-				}
+				t->state = UPSTREAM_STATE_TRANSMITTING;
+				rate_control_start (t);
 			}
 			else
-			{
-				gst_element_get_state (element, &current_state, NULL, timeout);
-				if (current_state == state)
-					GST_LOG_OBJECT(app, "GST_STATE_CHANGE_ASYNC on setting %" GST_PTR_FORMAT"'s state to %s SUCCESSFUL!", element, gst_element_state_get_name (state));
-				else
-				{
-					GST_WARNING_OBJECT(app, "GST_STATE_CHANGE_ASYNC on setting %" GST_PTR_FORMAT"'s state to %s failed! now in %s", element, gst_element_state_get_name (state), gst_element_state_get_name (current_state));
-					return FALSE;
-				}
-			}
-			return TRUE;
+				t->state = t->resume_state;
+			upstream_signal (t, "upstreamStateChanged", "stateChanged", g_variant_new("(i)", t->state));
 		}
-		case GST_STATE_CHANGE_NO_PREROLL:
-			GST_WARNING_OBJECT(app, "GST_STATE_CHANGE_NO_PREROLL on setting %" GST_PTR_FORMAT"'s state to %s ", element, gst_element_state_get_name (state));
-			break;
-		default:
-			break;
 	}
-	return TRUE;
+	DREAMRTSPSERVER_UNLOCK (app);
 }
 
-void assert_tsmux(App *app)
+/* what the mediator says back on the upstream connection, so the encoder follows before anything gets lost */
+static void upstream_control_event (DreamTCPupstream *t, const GstStructure *s)
 {
-	if (app->tsmux)
-		return;
+	App *app = t->app;
+	DreamRateController *rc = &t->rate;
+	const gchar *command = gst_structure_get_string (s, "command");
+	guint value = 0;
+	gboolean evaluate = FALSE, wait = FALSE, resume = FALSE;
 
-	GST_DEBUG_OBJECT (app, "inserting tsmux");
-
-	app->tsmux = gst_element_factory_make ("mpegtsmux", NULL);
-	gst_bin_add (GST_BIN (app->pipeline), app->tsmux);
+	gst_structure_get_uint (s, "value", &value);
+	GST_DEBUG_OBJECT (app, "%s control: %s %u", t->name, command, value);
+	upstream_signal (t, "upstreamControl", "control", g_variant_new("(su)", command, value));
 
-	GstPad *sinkpad, *srcpad;
-	GstPadLinkReturn ret;
-
-	srcpad = gst_element_get_static_pad (app->aq, "src");
-	sinkpad = gst_element_get_compatible_pad (app->tsmux, srcpad, NULL);
-	ret = gst_pad_link (srcpad, sinkpad);
-	if (ret != GST_PAD_LINK_OK)
-		g_error ("couldn't link %" GST_PTR_FORMAT " ! %" GST_PTR_FORMAT "", srcpad, sinkpad);
-	gst_object_unref (srcpad);
-	gst_object_unref (sinkpad);
-
-	srcpad = gst_element_get_static_pad (app->vq, "src");
-	sinkpad = gst_element_get_compatible_pad (app->tsmux, srcpad, NULL);
-	ret = gst_pad_link (srcpad, sinkpad);
-	if (ret != GST_PAD_LINK_OK)
-		g_error ("couldn't link %" GST_PTR_FORMAT " ! %" GST_PTR_FORMAT "", srcpad, sinkpad);
-	gst_object_unref (srcpad);
-	gst_object_unref (sinkpad);
+	DREAMRTSPSERVER_LOCK (app);
+	if (g_strcmp0 (command, "rate") == 0 && value)
+	{
+		rc->ingest = MIN (value, G_MAXINT);
+		evaluate = rc->id_tick != 0;
+	}
+	else if (g_strcmp0 (command, "keyframe") == 0)
+		request_keyframe (app, KEYFRAME_REASON_MEDIATOR);
+	else if (g_strcmp0 (command, "bitrate") == 0 && value)
+	{
+		/* the rate control ramps up to it, a lower one applies right away */
+		rc->target = MAX ((gint) MIN (value, G_MAXINT), rc->floor);
+		if (!t->auto_bitrate || !rc->id_tick)
+			gst_set_bitrate (app, app->vsrc, rc->target);
+		else if (rc->current > rc->target)
+		{
+			gint previous = rc->current;
+			rc->current = rc->target;
+			if (!rate_control_apply (app, rc->target))
+				rc->current = previous;
+		}
+	}
+	else if (g_strcmp0 (command, "idle") == 0 && !t->mediator_idle)
+	{
+		/* no viewers, the session waits just like for a peer that stopped reading */
+		t->mediator_idle = TRUE;
+		wait = t->state == UPSTREAM_STATE_CONNECTING || t->state == UPSTREAM_STATE_TRANSMITTING || t->state == UPSTREAM_STATE_ADJUSTING || t->state == UPSTREAM_STATE_OVERLOAD;
+		if (wait)
+		{
+			g_signal_handlers_disconnect_by_func (t->tstcpq, G_CALLBACK (queue_overrun), t);
+			t->id_signal_overrun = 0;
+			if (t->id_signal_waiting)
+				g_source_remove (t->id_signal_waiting);
+			t->id_signal_waiting = 0;
+		}
+	}
+	else if (g_strcmp0 (command, "active") == 0 && t->mediator_idle)
+	{
+		t->mediator_idle = FALSE;
+		resume = t->state == UPSTREAM_STATE_WAITING;
+	}
+	DREAMRTSPSERVER_UNLOCK (app);
 
-	if (!gst_element_link (app->tsmux, app->tstee))
-		g_error ("couldn't link %" GST_PTR_FORMAT " ! %" GST_PTR_FORMAT "", app->tsmux, app->tstee);
+	if (evaluate)
+		rate_control_evaluate (t);
+	if (wait)
+		upstream_set_waiting (t);
+	if (resume)
+		upstream_resume_waiting (t);
 }
 
-gboolean create_source_pipeline(App *app)
+static void gop_cache_init (DreamGOPcache *c)
 {
-	GST_INFO_OBJECT(app, "create_source_pipeline");
-	DREAMRTSPSERVER_LOCK (app);
-	app->pipeline = gst_pipeline_new ("dreamrtspserver_source_pipeline");
-
-	GstBus *bus = gst_pipeline_get_bus (GST_PIPELINE (app->pipeline));
-	gst_bus_add_signal_watch (bus);
-	g_signal_connect (G_OBJECT (bus), "message", G_CALLBACK (message_cb), app);
-	gst_object_unref (GST_OBJECT (bus));
-
-	app->asrc = gst_element_factory_make ("dreamaudiosource", "dreamaudiosource0");
-	app->vsrc = gst_element_factory_make ("dreamvideosource", "dreamvideosource0");
+	bridgeType type;
+	for (type = BRIDGE_AUDIO; type < BRIDGE_COUNT; type++)
+	{
+		g_queue_init (&c->samples[type]);
+		c->bytes[type] = 0;
+		c->complete[type] = FALSE;
+	}
+	c->limit = GOP_CACHE_LIMIT;
+	c->lookups = c->hits = 0;
+	g_mutex_init (&c->mutex);
+}
 
-	app->aparse = gst_element_factory_make ("aacparse", NULL);
-	app->vparse = gst_element_factory_make ("h264parse", NULL);
+static void gop_cache_clear (DreamGOPcache *c, bridgeType type)
+{
+	GstSample *sample;
+	while ((sample = g_queue_pop_head (&c->samples[type])))
+		gst_sample_unref (sample);
+	c->bytes[type] = 0;
+	c->complete[type] = FALSE;
+}
 
-	app->atee = gst_element_factory_make ("tee", "atee");
-	app->vtee = gst_element_factory_make ("tee", "vtee");
-	app->tstee = gst_element_factory_make ("tee", "tstee");
+static void gop_cache_flush (DreamGOPcache *c)
+{
+	bridgeType type;
+	g_mutex_lock (&c->mutex);
+	for (type = BRIDGE_AUDIO; type < BRIDGE_COUNT; type++)
+		gop_cache_clear (c, type);
+	g_mutex_unlock (&c->mutex);
+}
 
-	app->aq = gst_element_factory_make ("queue", "aqueue");
-	app->vq = gst_element_factory_make ("queue", "vqueue");
+static void gop_cache_pop_head (DreamGOPcache *c, bridgeType type)
+{
+	GstSample *sample = g_queue_pop_head (&c->samples[type]);
+	c->bytes[type] -= gst_buffer_get_size (gst_sample_get_buffer (sample));
+	gst_sample_unref (sample);
+}
 
-	app->tsmux = gst_element_factory_make ("mpegtsmux", NULL);
-        app->tstee = gst_element_factory_make ("tee", "tstee");
+static void gop_cache_add (DreamGOPcache *c, bridgeType type, GstBuffer *buffer, GstCaps *caps)
+{
+	gsize size = gst_buffer_get_size (buffer);
 
-	if (!(app->asrc && app->vsrc && app->aparse && app->vparse && app->aq && app->vq && app->atee && app->vtee && app->tsmux && app->tstee))
+	if (type == BRIDGE_AUDIO)
 	{
-		g_error ("Failed to create source pipeline element(s):%s%s%s%s%s%s%s%s%s", app->asrc?"":" dreamaudiosource", app->vsrc?"":" dreamvideosource", app->aparse?"":" aacparse",
-			app->vparse?"":" h264parse", app->aq?"":" aqueue", app->vq?"":" vqueue", app->atee?"":" atee", app->vtee?"":" vtee", app->tsmux?"":"  mpegtsmux");
+		c->complete[type] = TRUE;
+		while (c->bytes[type] && c->bytes[type] + size > c->limit)
+			gop_cache_pop_head (c, type);
 	}
-	gst_object_unref(app->tsmux);
-	app->tsmux = NULL;
-
-	if (!(app->asrc && app->vsrc && app->aparse && app->vparse))
+	else
 	{
-		g_error ("Failed to create source pipeline element(s):%s%s%s%s", app->asrc?"":" dreamaudiosource", app->vsrc?"":" dreamvideosource", app->aparse?"":" aacparse", app->vparse?"":" h264parse");
+		if (!GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+		{
+			gop_cache_clear (c, type);
+			c->complete[type] = TRUE;
+			if (type == BRIDGE_VIDEO && GST_BUFFER_PTS_IS_VALID (buffer))
+			{
+				GstSample *head;
+				/* audio before the keyframe can't be played back, keep both streams aligned */
+				while ((head = g_queue_peek_head (&c->samples[BRIDGE_AUDIO])) && GST_BUFFER_PTS (gst_sample_get_buffer (head)) < GST_BUFFER_PTS (buffer))
+					gop_cache_pop_head (c, BRIDGE_AUDIO);
+			}
+		}
+		if (!c->complete[type])
+			return;
+		if (c->bytes[type] + size > c->limit)
+		{
+			GST_DEBUG ("GOP exceeds cache limit of %" G_GSIZE_FORMAT " bytes, dropping it", c->limit);
+			gop_cache_clear (c, type);
+			return;
+		}
 	}
+	g_queue_push_tail (&c->samples[type], gst_sample_new (buffer, caps, NULL, NULL));
+	c->bytes[type] += size;
+}
 
-	GstElement *appsink, *appsrc, *vpay, *apay, *udpsrc;
-	appsink = gst_element_factory_make ("appsink", NULL);
-	appsrc = gst_element_factory_make ("appsrc", NULL);
-	vpay = gst_element_factory_make ("rtph264pay", NULL);
-	apay = gst_element_factory_make ("rtpmp4apay", NULL);
-	udpsrc = gst_element_factory_make ("udpsrc", NULL);
-
-	if (!(appsink && appsrc && vpay && apay && udpsrc))
-		g_error ("Failed to create rtsp element(s):%s%s%s%s%s", appsink?"":" appsink", appsrc?"":" appsrc", vpay?"": "rtph264pay", apay?"":" rtpmp4apay", udpsrc?"":" udpsrc" );
+static GstPadProbeReturn gop_cache_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+	App *app = user_data;
+	DreamGOPcache *c = &app->gop_cache;
+	GstObject *tee = GST_OBJECT_PARENT (pad);
+	bridgeType type;
+
+	if (tee == GST_OBJECT (app->vtee))
+		type = BRIDGE_VIDEO;
+	else if (tee == GST_OBJECT (app->atee))
+		type = BRIDGE_AUDIO;
 	else
+		type = BRIDGE_TS;
+
+	g_mutex_lock (&c->mutex);
+	if (c->limit)
 	{
-		gst_object_unref (appsink);
-		gst_object_unref (appsrc);
-		gst_object_unref (vpay);
-		gst_object_unref (apay);
-		gst_object_unref (udpsrc);
+		GstCaps *caps = gst_pad_get_current_caps (pad);
+		if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+		{
+			GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST (info);
+			guint i, len = gst_buffer_list_length (list);
+			for (i = 0; i < len; i++)
+				gop_cache_add (c, type, gst_buffer_list_get (list, i), caps);
+		}
+		else
+			gop_cache_add (c, type, GST_PAD_PROBE_INFO_BUFFER (info), caps);
+		if (caps)
+			gst_caps_unref (caps);
 	}
+	g_mutex_unlock (&c->mutex);
+	return GST_PAD_PROBE_OK;
+}
 
-	gst_bin_add_many (GST_BIN (app->pipeline), app->asrc, app->aparse, app->atee, app->aq, NULL);
-	gst_bin_add_many (GST_BIN (app->pipeline), app->vsrc, app->vparse, app->vtee, app->vq, NULL);
-	gst_bin_add (GST_BIN (app->pipeline), app->tstee);
-	gst_element_link_many (app->asrc, app->aparse, app->atee, NULL);
-	gst_element_link_many (app->vsrc, app->vparse, app->vtee, NULL);
-
-	GstPad *teepad, *sinkpad;
-	GstPadLinkReturn ret;
-
-	teepad = gst_element_get_request_pad (app->atee, "src_%u");
-	sinkpad = gst_element_get_static_pad (app->aq, "sink");
-	ret = gst_pad_link (teepad, sinkpad);
-	if (ret != GST_PAD_LINK_OK)
+static GList *gop_cache_get (App *app, bridgeType type)
+{
+	DreamGOPcache *c = &app->gop_cache;
+	GList *samples = NULL;
 
-	if (ret != GST_PAD_LINK_OK)
+	g_mutex_lock (&c->mutex);
+	if (c->complete[type])
+		samples = g_list_copy_deep (c->samples[type].head, (GCopyFunc) gst_sample_ref, NULL);
+	if (type != BRIDGE_AUDIO)
 	{
-		GST_ERROR_OBJECT (app, "couldn't link %" GST_PTR_FORMAT " ! %" GST_PTR_FORMAT "", teepad, sinkpad);
-		return FALSE;
+		c->lookups++;
+		if (samples)
+			c->hits++;
 	}
-	gst_object_unref (teepad);
-	gst_object_unref (sinkpad);
+	GST_DEBUG_OBJECT (app, "gop cache lookup type %i: %u samples, %" G_GSIZE_FORMAT " bytes (%u/%u hits)", type, g_list_length (samples), c->bytes[type], c->hits, c->lookups);
+	g_mutex_unlock (&c->mutex);
+	return samples;
+}
 
-	teepad = gst_element_get_request_pad (app->vtee, "src_%u");
-	sinkpad = gst_element_get_static_pad (app->vq, "sink");
-	ret = gst_pad_link (teepad, sinkpad);
+static void keyframe_arbiter_init (DreamKeyframeArbiter *k)
+{
+	memset (k->requested, 0, sizeof (k->requested));
+	memset (k->granted, 0, sizeof (k->granted));
+	k->inflight = k->deferred = 0;
+	k->last_sent = 0;
+	k->id_deferred = 0;
+	g_mutex_init (&k->mutex);
+}
 
-	if (ret != GST_PAD_LINK_OK)
-	{
-		GST_ERROR_OBJECT (app, "couldn't link %" GST_PTR_FORMAT " ! %" GST_PTR_FORMAT "", teepad, sinkpad);
-		return FALSE;
-	}
+static void send_keyframe_request (App *app, guint reasons)
+{
+	GstPad *srcpad = gst_element_get_static_pad (app->vsrc, "src");
+	if (!srcpad)
+		return;
+	GST_DEBUG_OBJECT (app, "requesting keyframe from %" GST_PTR_FORMAT " (reasons 0x%x)", app->vsrc, reasons);
+	if (!gst_pad_send_event (srcpad, gst_video_event_new_upstream_force_key_unit (GST_CLOCK_TIME_NONE, TRUE, 0)))
+		GST_INFO_OBJECT (app, "%" GST_PTR_FORMAT " didn't handle the force-key-unit event", app->vsrc);
+	gst_object_unref (srcpad);
+}
 
-	gst_object_unref (teepad);
-	gst_object_unref (sinkpad);
+static void request_keyframe (App *app, keyframeReason reason)
+{
+	DreamKeyframeArbiter *k = &app->keyframes;
+	guint reasons = 0;
+	gint64 now = g_get_monotonic_time ();
+	gint64 wait_ms;
 
-	app->clock = gst_system_clock_obtain();
-	gst_pipeline_use_clock(GST_PIPELINE (app->pipeline), app->clock);
+	if (!app->vsrc)
+		return;
 
-	apply_source_properties(app);
+	g_mutex_lock (&k->mutex);
+	k->requested[reason]++;
+	wait_ms = k->last_sent ? KEYFRAME_REQUEST_INTERVAL - (now - k->last_sent) / 1000 : 0;
+	if (wait_ms <= 0)
+	{
+		reasons = k->inflight = k->inflight | k->deferred | (1 << reason);
+		k->deferred = 0;
+		k->last_sent = now;
+		if (k->id_deferred)
+		{
+			g_source_remove (k->id_deferred);
+			k->id_deferred = 0;
+		}
+	}
+	else if (k->inflight)
+	{
+		/* a keyframe is already on its way, it serves this consumer too */
+		k->inflight |= 1 << reason;
+	}
+	else
+	{
+		k->deferred |= 1 << reason;
+		if (!k->id_deferred)
+			k->id_deferred = g_timeout_add (wait_ms, keyframe_request_deferred, app);
+	}
+	g_mutex_unlock (&k->mutex);
 
-	g_signal_connect (app->asrc, "signal-lost", G_CALLBACK (encoder_signal_lost), app);
+	if (reasons)
+		send_keyframe_request (app, reasons);
+	else
+		GST_LOG_OBJECT (app, "keyframe request for %s coalesced", keyframe_reason_names[reason]);
+}
 
-	GST_DEBUG_BIN_TO_DOT_FILE(GST_BIN(app->pipeline),GST_DEBUG_GRAPH_SHOW_ALL,"create_source_pipeline");
-	DREAMRTSPSERVER_UNLOCK (app);
-	return TRUE;
+static gboolean keyframe_request_deferred (gpointer user_data)
+{
+	App *app = user_data;
+	DreamKeyframeArbiter *k = &app->keyframes;
+	guint reasons;
+
+	g_mutex_lock (&k->mutex);
+	reasons = k->deferred;
+	k->inflight |= reasons;
+	k->deferred = 0;
+	k->last_sent = g_get_monotonic_time ();
+	k->id_deferred = 0;
+	g_mutex_unlock (&k->mutex);
+
+	if (reasons)
+		send_keyframe_request (app, reasons);
+	return FALSE;
 }
 
-static void encoder_signal_lost (GstElement *dreamaudiosource, gpointer user_data)
+static GstPadProbeReturn keyframe_granted_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
 {
-	GST_INFO_OBJECT (dreamaudiosource, "lost encoder signal!");
+	App *app = user_data;
+	DreamKeyframeArbiter *k = &app->keyframes;
+	GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+
+	if (GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+		return GST_PAD_PROBE_OK;
+
+	g_mutex_lock (&k->mutex);
+	if (k->inflight)
+	{
+		keyframeReason reason;
+		for (reason = KEYFRAME_REASON_RTSP_JOIN; reason < KEYFRAME_REASON_COUNT; reason++)
+			if (k->inflight & (1 << reason))
+				k->granted[reason]++;
+		k->inflight = 0;
+	}
+	g_mutex_unlock (&k->mutex);
+	return GST_PAD_PROBE_OK;
 }
 
-static GstPadProbeReturn inject_authorization (GstPad * sinkpad, GstPadProbeInfo * info, gpointer user_data)
+static GstPadProbeReturn rtcp_keyframe_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
 {
 	App *app = user_data;
+	GstEvent *event = GST_PAD_PROBE_INFO_EVENT (info);
 
-	GstBuffer *token_buf = gst_buffer_new_wrapped (app->tcp_upstream->token, TOKEN_LEN);
-	GstPad * srcpad = gst_element_get_static_pad (app->tcp_upstream->tstcpq, "src");
+	if (gst_video_event_is_force_key_unit (event))
+	{
+		GST_DEBUG_OBJECT (pad, "RTCP keyframe feedback from client");
+		request_keyframe (app, KEYFRAME_REASON_RTCP_FEEDBACK);
+		return GST_PAD_PROBE_DROP;
+	}
+	return GST_PAD_PROBE_OK;
+}
 
-	GST_INFO ("injecting authorization on pad %s:%s, created token_buf %" GST_PTR_FORMAT "", GST_DEBUG_PAD_NAME (sinkpad), token_buf);
-	gst_pad_remove_probe (sinkpad, info->id);
-	gst_pad_push (srcpad, gst_buffer_ref(token_buf));
+static const gchar *rtsp_bridge_queue_names[BRIDGE_COUNT] = { "rtspaudioqueue", "rtspvideoqueue", "tsrtspqueue" };
+static const gchar *rtsp_bridge_appsink_names[BRIDGE_COUNT] = { AAPPSINK, VAPPSINK, TSAPPSINK };
 
-	return GST_PAD_PROBE_REMOVE;
+static void rtsp_bridge_init (App *app, DreamRTSPbridge *b, bridgeType type)
+{
+	b->app = app;
+	b->type = type;
+	b->queue = b->appsink = NULL;
+	b->appsrc = NULL;
+	b->caps = NULL;
+	b->replayed_until = GST_CLOCK_TIME_NONE;
+	branch_gate_init (&b->gate, FALSE);
+	frame_queue_init (&b->frames, rtsp_bridge_queue_names[type], type == BRIDGE_TS ? FRAME_QUEUE_TS : type == BRIDGE_VIDEO ? FRAME_QUEUE_VIDEO : FRAME_QUEUE_AUDIO, latency_profiles[app->latency_profile].rtsp_age);
+	g_mutex_init (&b->mutex);
 }
 
-gboolean enable_tcp_upstream(App *app, const gchar *upstream_host, guint32 upstream_port, const gchar *token)
+static gboolean rtsp_bridge_create (App *app, DreamRTSPbridge *b, GstElement *tee)
 {
-	GST_DEBUG_OBJECT(app, "enable_tcp_upstream host=%s port=%i token=%s", upstream_host, upstream_port, token);
+	GstAppSinkCallbacks callbacks = { .new_sample = rtsp_bridge_new_sample };
 
-	if (!app->pipeline)
+	b->queue = gst_element_factory_make ("queue", rtsp_bridge_queue_names[b->type]);
+	b->appsink = gst_element_factory_make ("appsink", rtsp_bridge_appsink_names[b->type]);
+	if (!(b->queue && b->appsink))
 	{
-		GST_ERROR_OBJECT (app, "failed to enable upstream because source pipeline is NULL!");
-		goto fail;
+		GST_ERROR_OBJECT (app, "Failed to create rtsp bridge element(s):%s%s", b->queue?"":" queue", b->appsink?"":" appsink");
+		if (b->queue)
+			gst_object_unref (b->queue);
+		if (b->appsink)
+			gst_object_unref (b->appsink);
+		b->queue = b->appsink = NULL;
+		return FALSE;
 	}
 
-	DreamTCPupstream *t = app->tcp_upstream;
+	g_object_set (G_OBJECT (b->queue), "leaky", 2, "max-size-buffers", 0, "max-size-bytes", 0, "max-size-time", 2*b->frames.max_age, NULL);
+	g_object_set (G_OBJECT (b->appsink), "emit-signals", FALSE, "enable-last-sample", FALSE, NULL);
+	frame_queue_attach (&b->frames, b->queue);
+	gst_app_sink_set_callbacks (GST_APP_SINK (b->appsink), &callbacks, b, NULL);
 
-	if (t->state == UPSTREAM_STATE_DISABLED)
-	{
-		assert_tsmux (app);
-		DREAMRTSPSERVER_LOCK (app);
+	gst_bin_add_many (GST_BIN (app->pipeline), b->queue, b->appsink, NULL);
+	gst_element_link (b->queue, b->appsink);
 
-		t->id_signal_overrun = 0;
-		t->id_signal_waiting = 0;
-		t->id_signal_keepalive = 0;
-		t->id_bitrate_measure = 0;
-		t->id_resume = 0;
-		t->state = UPSTREAM_STATE_CONNECTING;
-		send_signal (app, "upstreamStateChanged", g_variant_new("(i)", t->state));
+	if (!assert_state (app, b->appsink, GST_STATE_READY) || !assert_state (app, b->queue, GST_STATE_READY))
+		return FALSE;
 
-		t->tstcpq  = gst_element_factory_make ("queue", "tstcpqueue");
-		t->tcpsink = gst_element_factory_make ("tcpclientsink", NULL);
+	GstPad *teepad, *sinkpad;
+	GstPadLinkReturn ret;
+	teepad = gst_element_get_request_pad (tee, "src_%u");
+	sinkpad = gst_element_get_static_pad (b->queue, "sink");
+	ret = gst_pad_link (teepad, sinkpad);
+	if (ret != GST_PAD_LINK_OK)
+		GST_ERROR_OBJECT (app, "couldn't link %" GST_PTR_FORMAT " ! %" GST_PTR_FORMAT "", teepad, sinkpad);
+	else
+		branch_gate_attach (&b->gate, teepad);
+	gst_object_unref (teepad);
+	gst_object_unref (sinkpad);
+	return ret == GST_PAD_LINK_OK;
+}
 
-		if (!(t->tstcpq && t->tcpsink ))
-			g_error ("Failed to create tcp upstream element(s):%s%s", t->tstcpq?"":"  ts queue", t->tcpsink?"":"  tcpclientsink" );
+/* the start timestamps have a lock of their own that is taken last, the bridges hold theirs while rebasing
+ * and media_configure holds the server lock while it sets the appsrcs */
+static void rtsp_start_set (DreamRTSPserver *r, GstBuffer *keyframe)
+{
+	g_mutex_lock (&r->start_mutex);
+	r->rtsp_start_pts = keyframe ? GST_BUFFER_PTS (keyframe) : GST_CLOCK_TIME_NONE;
+	r->rtsp_start_dts = keyframe ? GST_BUFFER_DTS (keyframe) : GST_CLOCK_TIME_NONE;
+	g_mutex_unlock (&r->start_mutex);
+}
 
-		g_object_set (G_OBJECT (t->tstcpq), "leaky", 2, "max-size-buffers", 400, "max-size-bytes", 0, "max-size-time", G_GINT64_CONSTANT(0), NULL);
+static GstBuffer *rtsp_bridge_rebase (DreamRTSPserver *r, GstBuffer *buffer)
+{
+	/* the buffer is shared with the other tee branches, rebase the timestamps on a metadata-only copy */
+	GstBuffer *rebased = gst_buffer_copy_region (buffer, GST_BUFFER_COPY_METADATA | GST_BUFFER_COPY_MEMORY, 0, -1);
+	g_mutex_lock (&r->start_mutex);
+	if (GST_BUFFER_PTS_IS_VALID (rebased) && GST_CLOCK_TIME_IS_VALID (r->rtsp_start_pts))
+		GST_BUFFER_PTS (rebased) = GST_BUFFER_PTS (rebased) > r->rtsp_start_pts ? GST_BUFFER_PTS (rebased) - r->rtsp_start_pts : 0;
+	if (GST_BUFFER_DTS_IS_VALID (rebased) && GST_CLOCK_TIME_IS_VALID (r->rtsp_start_dts))
+		GST_BUFFER_DTS (rebased) = GST_BUFFER_DTS (rebased) > r->rtsp_start_dts ? GST_BUFFER_DTS (rebased) - r->rtsp_start_dts : 0;
+	g_mutex_unlock (&r->start_mutex);
+	return rebased;
+}
 
-		t->id_signal_overrun = g_signal_connect (t->tstcpq, "overrun", G_CALLBACK (queue_overrun), app);
-		GST_TRACE_OBJECT(app, "installed %" GST_PTR_FORMAT " overrun handler id=%u", t->tstcpq, t->id_signal_overrun);
+static void rtsp_bridge_set_appsrc (DreamRTSPbridge *b, GstElement *appsrc, GList *replay)
+{
+	GList *l;
 
-		g_object_set (t->tcpsink, "max-lateness", G_GINT64_CONSTANT(3)*GST_SECOND, NULL);
-		g_object_set (t->tcpsink, "blocksize", BLOCK_SIZE, NULL);
+	g_mutex_lock (&b->mutex);
+	if (b->appsrc)
+		gst_object_unref (b->appsrc);
+	b->appsrc = appsrc ? GST_APP_SRC (appsrc) : NULL;
+	/* a fresh appsrc has no caps yet, forget what was set on the previous one */
+	gst_caps_replace (&b->caps, NULL);
+	b->replayed_until = GST_CLOCK_TIME_NONE;
 
-		g_object_set (t->tcpsink, "host", upstream_host, NULL);
-		g_object_set (t->tcpsink, "port", upstream_port, NULL);
-		gchar *check_host;
-		guint32 check_port;
-		g_object_get (t->tcpsink, "host", &check_host, NULL);
-		g_object_get (t->tcpsink, "port", &check_port, NULL);
-		if (g_strcmp0 (upstream_host, check_host))
-		{
-			g_free (check_host);
-			GST_ERROR_OBJECT (app, "couldn't set upstream_host %s", upstream_host);
-			goto fail;
-		}
-		if (upstream_port != check_port)
+	for (l = replay; l && b->appsrc; l = l->next)
+	{
+		GstBuffer *buffer = gst_sample_get_buffer (l->data);
+		GstCaps *caps = gst_sample_get_caps (l->data);
+		if (caps && (!b->caps || !gst_caps_is_equal (b->caps, caps)))
 		{
-			GST_ERROR_OBJECT (app, "couldn't set upstream_port %d", upstream_port);
-			goto fail;
+			gst_app_src_set_caps (b->appsrc, caps);
+			gst_caps_replace (&b->caps, caps);
 		}
-		g_free (check_host);
+		gst_app_src_push_buffer (b->appsrc, rtsp_bridge_rebase (b->app->rtsp_server, buffer));
+		b->replayed_until = GST_BUFFER_DTS_OR_PTS (buffer);
+	}
+	if (replay)
+		GST_DEBUG_OBJECT (b->appsrc, "replayed %u cached buffers up to %" GST_TIME_FORMAT, g_list_length (replay), GST_TIME_ARGS (b->replayed_until));
+	g_list_free_full (replay, (GDestroyNotify) gst_sample_unref);
+	g_mutex_unlock (&b->mutex);
+}
 
-		GstStateChangeReturn sret = gst_element_set_state (t->tcpsink, GST_STATE_READY);
-		if (sret == GST_STATE_CHANGE_FAILURE)
-		{
-			GST_ERROR_OBJECT (app, "failed to set tcpsink to GST_STATE_READY. %s:%d probably refused connection", upstream_host, upstream_port);
-			gst_object_unref (t->tstcpq);
-			gst_object_unref (t->tcpsink);
-			t->state = UPSTREAM_STATE_DISABLED;
-			send_signal (app, "upstreamStateChanged", g_variant_new("(i)", t->state));
-			DREAMRTSPSERVER_UNLOCK (app);
-			return FALSE;
-		}
+static void rtsp_bridge_push (DreamRTSPbridge *b, GstBufferList *list)
+{
+	if (gst_buffer_list_length (list) == 1)
+		gst_app_src_push_buffer (b->appsrc, gst_buffer_ref (gst_buffer_list_get (list, 0)));
+	else if (gst_buffer_list_length (list) > 1)
+		gst_app_src_push_buffer_list (b->appsrc, gst_buffer_list_ref (list));
+	gst_buffer_list_unref (list);
+}
 
-		gst_bin_add_many (GST_BIN(app->pipeline), t->tstcpq, t->tcpsink, NULL);
-		if (!gst_element_link (t->tstcpq, t->tcpsink)) {
-			GST_ERROR_OBJECT (app, "couldn't link %" GST_PTR_FORMAT " ! %" GST_PTR_FORMAT "", t->tstcpq, t->tcpsink);
-			goto fail;
-		}
+static GstFlowReturn rtsp_bridge_new_sample (GstAppSink *appsink, gpointer user_data)
+{
+	DreamRTSPbridge *b = user_data;
+	App *app = b->app;
+	DreamRTSPserver *r = app->rtsp_server;
+	GstBufferList *list = NULL;
+	GstSample *sample;
 
-// 		if (!assert_state (app, t->tcpsink, GST_STATE_PLAYING) || !assert_state (app, t->tstcpq, GST_STATE_PLAYING))
-// 			goto fail;
+	g_mutex_lock (&b->mutex);
+	/* drain whatever else the appsink already holds so it can be handed over in one list */
+	for (sample = gst_app_sink_pull_sample (appsink); sample; sample = gst_app_sink_try_pull_sample (appsink, 0))
+	{
+		GstBuffer *buffer = gst_sample_get_buffer (sample);
+		GstCaps *caps = gst_sample_get_caps (sample);
 
-		GstPadLinkReturn ret;
-		GstPad *srcpad, *sinkpad;
-		srcpad = gst_element_get_request_pad (app->tstee, "src_%u");
-		sinkpad = gst_element_get_static_pad (t->tstcpq, "sink");
-		ret = gst_pad_link (srcpad, sinkpad);
-		gst_object_unref (srcpad);
-		gst_object_unref (sinkpad);
-		if (ret != GST_PAD_LINK_OK)
+		if (!b->appsrc || g_atomic_int_get (&r->clients_count) == 0 || !buffer)
 		{
-			GST_ERROR_OBJECT (app, "couldn't link %" GST_PTR_FORMAT " ! %" GST_PTR_FORMAT "", srcpad, sinkpad);
-			goto fail;
+			GST_TRACE_OBJECT (appsink, "no rtsp clients, discard payload!");
+			gst_sample_unref (sample);
+			continue;
 		}
 
-		if (strlen(token))
+		if (GST_CLOCK_TIME_IS_VALID (b->replayed_until))
 		{
-			sinkpad = gst_element_get_static_pad (t->tcpsink, "sink");
-			strcpy(t->token, token);
-			gst_pad_add_probe (sinkpad, GST_PAD_PROBE_TYPE_BUFFER|GST_PAD_PROBE_TYPE_BUFFER_LIST, (GstPadProbeCallback) inject_authorization, app, NULL);
-			gst_object_unref (sinkpad);
+			/* the queue in front of the appsink may still hold what was replayed from the gop cache */
+			if (GST_BUFFER_DTS_OR_PTS (buffer) <= b->replayed_until)
+			{
+				gst_sample_unref (sample);
+				continue;
+			}
+			b->replayed_until = GST_CLOCK_TIME_NONE;
+		}
+
+		g_mutex_lock (&r->start_mutex);
+		if (r->rtsp_start_pts == GST_CLOCK_TIME_NONE)
+		{
+			if (GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+			{
+				g_mutex_unlock (&r->start_mutex);
+				GST_LOG_OBJECT (appsink, "GST_BUFFER_FLAG_DELTA_UNIT dropping!");
+				gst_sample_unref (sample);
+				continue;
+			}
+			else if (b->type == BRIDGE_VIDEO || b->type == BRIDGE_TS)
+			{
+				r->rtsp_start_pts = GST_BUFFER_PTS (buffer);
+				r->rtsp_start_dts = GST_BUFFER_DTS (buffer);
+				GST_LOG_OBJECT (appsink, "frame is IFRAME! set rtsp_start_pts=%" GST_TIME_FORMAT " rtsp_start_dts=%" GST_TIME_FORMAT " @ %" GST_PTR_FORMAT "", GST_TIME_ARGS (r->rtsp_start_pts), GST_TIME_ARGS (r->rtsp_start_dts), b->appsrc);
+			}
+		}
+		g_mutex_unlock (&r->start_mutex);
+
+		if (caps && caps != b->caps)
+		{
+			if (!b->caps || !gst_caps_is_equal (b->caps, caps))
+			{
+				GST_DEBUG_OBJECT (appsink, "CAPS changed! %" GST_PTR_FORMAT " to %" GST_PTR_FORMAT, b->caps, caps);
+				if (list)
+				{
+					rtsp_bridge_push (b, list);
+					list = NULL;
+				}
+				gst_app_src_set_caps (b->appsrc, caps);
+			}
+			gst_caps_replace (&b->caps, caps);
+		}
+
+		GstBuffer *rebased = rtsp_bridge_rebase (r, buffer);
+		GST_LOG_OBJECT (appsink, "%" GST_PTR_FORMAT " @ %" GST_PTR_FORMAT, rebased, b->appsrc);
+
+		if (!list)
+			list = gst_buffer_list_new ();
+		gst_buffer_list_add (list, rebased);
+		gst_sample_unref (sample);
+	}
+	if (list)
+	{
+		if (b->appsrc)
+			rtsp_bridge_push (b, list);
+		else
+			gst_buffer_list_unref (list);
+	}
+	g_mutex_unlock (&b->mutex);
+
+	return GST_FLOW_OK;
+}
+
+gboolean assert_state(App *app, GstElement *element, GstState state)
+{
+	GstStateChangeReturn sret;
+	GST_DEBUG_OBJECT(app, "setting %" GST_PTR_FORMAT"'s state to %s", element, gst_element_state_get_name (state));
+	GstState pipeline_state, current_state;
+	sret = gst_element_set_state (element, state);
+	gchar *elementname = gst_element_get_name(element);
+	gchar *dotfilename = g_strdup_printf ("assert_state_%s_to_%s_%i", elementname,gst_element_state_get_name (state), sret);
+	GST_DEBUG_BIN_TO_DOT_FILE(GST_BIN(app->pipeline), GST_DEBUG_GRAPH_SHOW_ALL, dotfilename);
+	g_free (elementname);
+	switch (sret) {
+		case GST_STATE_CHANGE_SUCCESS:
+		{
+			GST_DEBUG_OBJECT(app, "GST_STATE_CHANGE_SUCCESS on setting %" GST_PTR_FORMAT"'s state to %s ", element, gst_element_state_get_name (state));
+			return TRUE;
+		}
+		case GST_STATE_CHANGE_FAILURE:
+		{
+			GST_ERROR_OBJECT (app, "GST_STATE_CHANGE_FAILURE when trying to change %" GST_PTR_FORMAT"'s state to %s", element, gst_element_state_get_name (state));
+			return FALSE;
+		}
+		case GST_STATE_CHANGE_ASYNC:
+		{
+			watchdog_ping (app);
+			gboolean fail = FALSE;
+			GST_LOG_OBJECT(app, "GST_STATE_CHANGE_ASYNC %" GST_PTR_FORMAT"", element);
+			GstClockTime timeout = /*(element == app->pipeline) ?*/ 4 * GST_SECOND/* : GST_MSECOND*/;
+			if (element == GST_ELEMENT(app->pipeline))
+			{
+				gst_element_get_state (GST_ELEMENT(app->pipeline), &pipeline_state, NULL, timeout);
+				GST_LOG_OBJECT(app, "GST_STATE_CHANGE_ASYNC got pipeline_state=%s", gst_element_state_get_name (state));
+				if (pipeline_state != state)
+				{
+					GValue item = G_VALUE_INIT;
+					GstIterator* iter = gst_bin_iterate_elements(GST_BIN(app->pipeline));
+					while (GST_ITERATOR_OK == gst_iterator_next(iter, (GValue*)&item))
+					{
+						GstElement *elem = g_value_get_object(&item);
+						GstElementFactory *factory = gst_element_get_factory (elem);
+						gst_element_get_state (elem, &current_state, NULL, GST_MSECOND);
+						if (current_state != state && (element == app->pipeline || element == elem))
+						{
+							if (element == app->pipeline)
+							{
+								if (gst_element_factory_list_is_type (factory, GST_ELEMENT_FACTORY_TYPE_SINK))
+									GST_LOG_OBJECT(app, "GST_STATE_CHANGE_ASYNC %" GST_PTR_FORMAT"'s state=%s (this is a sink element, so don't worry...)", elem, gst_element_state_get_name (current_state));
+								else
+								{
+									GST_WARNING_OBJECT(app, "GST_STATE_CHANGE_ASYNC %" GST_PTR_FORMAT"'s state=%s -> FAIL", elem, gst_element_state_get_name (current_state));
+									fail = TRUE;
+								}
+							}
+						}
+						else
+							GST_LOG_OBJECT(app, "GST_STATE_CHANGE_ASYNC %" GST_PTR_FORMAT"'s state=%s", elem, gst_element_state_get_name (current_state));
+					}
+					gst_iterator_free(iter);
+					if (fail)
+					{
+						GST_ERROR_OBJECT (app, "pipeline didn't complete GST_STATE_CHANGE_ASYNC to %s within %" GST_TIME_FORMAT ", currently in %s", gst_element_state_get_name (state), GST_TIME_ARGS(timeout), gst_element_state_get_name (pipeline_state));
+						return FALSE;
+					}
+				}
+			}
+			else
+			{
+				gst_element_get_state (element, &current_state, NULL, timeout);
+				if (current_state == state)
+					GST_LOG_OBJECT(app, "GST_STATE_CHANGE_ASYNC on setting %" GST_PTR_FORMAT"'s state to %s SUCCESSFUL!", element, gst_element_state_get_name (state));
+				else
+				{
+					GST_WARNING_OBJECT(app, "GST_STATE_CHANGE_ASYNC on setting %" GST_PTR_FORMAT"'s state to %s failed! now in %s", element, gst_element_state_get_name (state), gst_element_state_get_name (current_state));
+					return FALSE;
+				}
+			}
+			return TRUE;
+		}
+		case GST_STATE_CHANGE_NO_PREROLL:
+			GST_WARNING_OBJECT(app, "GST_STATE_CHANGE_NO_PREROLL on setting %" GST_PTR_FORMAT"'s state to %s ", element, gst_element_state_get_name (state));
+			break;
+		default:
+			break;
+	}
+	return TRUE;
+}
+
+static void branch_gate_init (DreamBranchGate *g, gboolean wait_keyframe)
+{
+	g->teepad = NULL;
+	g->probe_id = 0;
+	g->open = FALSE;
+	g->wait_keyframe = wait_keyframe;
+	g_mutex_init (&g->mutex);
+}
+
+static GstPadProbeReturn branch_gate_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+	DreamBranchGate *g = user_data;
+	GstPadProbeReturn ret = GST_PAD_PROBE_REMOVE;
+
+	g_mutex_lock (&g->mutex);
+	if (!g->open)
+		ret = GST_PAD_PROBE_DROP;
+	else if (g->wait_keyframe)
+	{
+		GstBuffer *buffer = (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) ? gst_buffer_list_get (GST_PAD_PROBE_INFO_BUFFER_LIST (info), 0) : GST_PAD_PROBE_INFO_BUFFER (info);
+		if (GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+			ret = GST_PAD_PROBE_DROP;
+	}
+	if (ret == GST_PAD_PROBE_REMOVE)
+	{
+		GST_DEBUG_OBJECT (pad, "branch gate opened");
+		g->probe_id = 0;
+	}
+	g_mutex_unlock (&g->mutex);
+	return ret;
+}
+
+static void branch_gate_attach (DreamBranchGate *g, GstPad *teepad)
+{
+	g_mutex_lock (&g->mutex);
+	g->teepad = gst_object_ref (teepad);
+	g->open = FALSE;
+	g->probe_id = gst_pad_add_probe (teepad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST, branch_gate_probe, g, NULL);
+	g_mutex_unlock (&g->mutex);
+}
+
+static void branch_gate_detach (DreamBranchGate *g)
+{
+	g_mutex_lock (&g->mutex);
+	if (g->teepad)
+	{
+		if (g->probe_id)
+			gst_pad_remove_probe (g->teepad, g->probe_id);
+		gst_object_unref (g->teepad);
+	}
+	g->teepad = NULL;
+	g->probe_id = 0;
+	g->open = FALSE;
+	g_mutex_unlock (&g->mutex);
+}
+
+static void branch_gate_set (DreamBranchGate *g, gboolean open)
+{
+	g_mutex_lock (&g->mutex);
+	if (g->teepad && g->open != open)
+	{
+		GST_DEBUG_OBJECT (g->teepad, "%s branch", open ? "opening" : "closing");
+		g->open = open;
+		if (!open && !g->probe_id)
+			g->probe_id = gst_pad_add_probe (g->teepad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST, branch_gate_probe, g, NULL);
+		else if (open && g->probe_id && !g->wait_keyframe)
+		{
+			gst_pad_remove_probe (g->teepad, g->probe_id);
+			g->probe_id = 0;
+		}
+	}
+	g_mutex_unlock (&g->mutex);
+}
+
+static void frame_queue_init (DreamFrameQueue *fq, const gchar *name, frameQueueMode mode, GstClockTime max_age)
+{
+	fq->name = name;
+	fq->mode = mode;
+	fq->queue = NULL;
+	fq->max_age = max_age;
+	fq->last_in = GST_CLOCK_TIME_NONE;
+	fq->latency = 0;
+	fq->video_pid = -1;
+	fq->dropping = fq->skip_gop = fq->src_dropping = fq->src_skip_gop = FALSE;
+	memset (fq->dropped, 0, sizeof (fq->dropped));
+	fq->aged = 0;
+	g_mutex_init (&fq->mutex);
+}
+
+/* the queue itself stays leaky at twice the age limit as a last resort */
+static void frame_queue_attach (DreamFrameQueue *fq, GstElement *queue)
+{
+	GstPad *pad;
+
+	g_mutex_lock (&fq->mutex);
+	fq->queue = queue;
+	fq->last_in = GST_CLOCK_TIME_NONE;
+	fq->latency = 0;
+	fq->video_pid = -1;
+	fq->dropping = fq->skip_gop = fq->src_dropping = fq->src_skip_gop = FALSE;
+	memset (fq->dropped, 0, sizeof (fq->dropped));
+	fq->aged = 0;
+	g_mutex_unlock (&fq->mutex);
+
+	pad = gst_element_get_static_pad (queue, "sink");
+	gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST, frame_queue_sink_probe, fq, NULL);
+	gst_object_unref (pad);
+	pad = gst_element_get_static_pad (queue, "src");
+	gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST, frame_queue_src_probe, fq, NULL);
+	gst_object_unref (pad);
+}
+
+/* nal_ref_idc and type of the first slice in an annex b byte stream */
+static framePriority frame_priority_from_nal (const guint8 *data, gsize size, framePriority fallback)
+{
+	gsize i;
+	for (i = 0; i + 3 < size; i++)
+	{
+		if (data[i] || data[i+1] || data[i+2] != 1)
+			continue;
+		switch (data[i+3] & 0x1f) {
+			case 5:
+				return FRAME_PRIORITY_KEY;
+			case 1:
+				return (data[i+3] & 0x60) ? FRAME_PRIORITY_REF : FRAME_PRIORITY_NONREF;
+		}
+		i += 3;
+	}
+	return fallback;
+}
+
+/* which kind of frame starts in this buffer, for transport streams the video pid is learned from the first video pes */
+static framePriority frame_queue_classify (DreamFrameQueue *fq, GstBuffer *buffer)
+{
+	framePriority fallback = GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT) ? FRAME_PRIORITY_REF : FRAME_PRIORITY_KEY;
+	framePriority priority = FRAME_PRIORITY_OTHER;
+	GstMapInfo map;
+
+	if (fq->mode == FRAME_QUEUE_AUDIO)
+		return FRAME_PRIORITY_OTHER;
+	if (!gst_buffer_map (buffer, &map, GST_MAP_READ))
+		return fallback;
+
+	if (fq->mode == FRAME_QUEUE_VIDEO)
+		priority = frame_priority_from_nal (map.data, map.size, fallback);
+	else if (fq->mode == FRAME_QUEUE_COMPACT)
+	{
+		/* keyframes start with the configuration frames */
+		if (map.size > DREAM_COMPACT_HEADER_SIZE && map.data[0] == DREAM_COMPACT_VIDEO)
+			priority = frame_priority_from_nal (map.data + DREAM_COMPACT_HEADER_SIZE, map.size - DREAM_COMPACT_HEADER_SIZE, fallback);
+		else if (map.size && map.data[0] != DREAM_COMPACT_AUDIO)
+			priority = fallback;
+	}
+	gst_buffer_unmap (buffer, &map);
+	return priority;
+}
+
+/* the fuller the queue, the more important a frame has to be to get in, a dropped reference frame takes the rest of its gop along */
+static gboolean frame_queue_decide_incoming (DreamFrameQueue *fq, framePriority priority, GstClockTime level)
+{
+	if (priority == FRAME_PRIORITY_OTHER)
+		return FALSE;
+	if (priority == FRAME_PRIORITY_CONTINUATION)
+		return fq->dropping;
+
+	if (fq->skip_gop && priority != FRAME_PRIORITY_KEY)
+		fq->dropping = TRUE;
+	else
+	{
+		fq->skip_gop = priority == FRAME_PRIORITY_REF && level >= fq->max_age * 3 / 4;
+		fq->dropping = fq->skip_gop || (priority == FRAME_PRIORITY_NONREF && level >= fq->max_age / 2);
+		if (fq->skip_gop)
+			GST_DEBUG_OBJECT (fq->queue, "%s queue level %" GST_TIME_FORMAT ", dropping until next keyframe", fq->name, GST_TIME_ARGS (level));
+	}
+	if (fq->dropping)
+		fq->dropped[priority]++;
+	return fq->dropping;
+}
+
+/* frames that waited longer than max_age are dropped on the way out, a stale reference frame again takes the rest of its gop along */
+static gboolean frame_queue_decide_outgoing (DreamFrameQueue *fq, framePriority priority, GstClockTime ts, gboolean stale)
+{
+	if (priority == FRAME_PRIORITY_CONTINUATION)
+		return fq->src_dropping;
+	if (priority == FRAME_PRIORITY_OTHER)
+		return stale;
+
+	if (fq->src_skip_gop && priority != FRAME_PRIORITY_KEY)
+		fq->src_dropping = TRUE;
+	else
+	{
+		fq->src_skip_gop = stale && priority != FRAME_PRIORITY_NONREF;
+		fq->src_dropping = stale;
+		if (stale)
+			GST_DEBUG_OBJECT (fq->queue, "%s %s frame %" GST_TIME_FORMAT " exceeded max age", fq->name, frame_priority_names[priority], GST_TIME_ARGS (ts));
+	}
+	if (fq->src_dropping)
+		fq->aged++;
+	return fq->src_dropping;
+}
+
+/* transport streams are decided packet by packet, audio and psi sharing a buffer with a dropped frame go on in a copy without it */
+static GstBuffer *frame_queue_filter_ts (DreamFrameQueue *fq, GstBuffer *buffer, GstClockTime level, gboolean incoming, gboolean stale)
+{
+	framePriority fallback = GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT) ? FRAME_PRIORITY_REF : FRAME_PRIORITY_KEY;
+	GByteArray *kept = NULL;
+	GstBuffer *filtered;
+	gboolean aged = FALSE;
+	GstMapInfo map;
+	gsize offset, size;
+
+	if (!gst_buffer_map (buffer, &map, GST_MAP_READ))
+		return buffer;
+	for (offset = 0; offset < map.size; offset += TS_PACK_SIZE)
+	{
+		const guint8 *p = map.data + offset;
+		gsize len = MIN (TS_PACK_SIZE, map.size - offset);
+		framePriority priority = FRAME_PRIORITY_OTHER;
+		gboolean drop;
+
+		if (len == TS_PACK_SIZE && p[0] == 0x47 && (p[3] & 0x10))
+		{
+			gint pid = ((p[1] & 0x1f) << 8) | p[2];
+			gsize payload = 4;
+			if (p[3] & 0x20)
+				payload += 1 + p[4];
+			if ((p[1] & 0x40) && payload + 9 <= TS_PACK_SIZE && !p[payload] && !p[payload+1] && p[payload+2] == 1 && (p[payload+3] & 0xf0) == 0xe0)
+			{
+				gsize es = payload + 9 + p[payload+8];
+				fq->video_pid = pid;
+				priority = es < TS_PACK_SIZE ? frame_priority_from_nal (p + es, TS_PACK_SIZE - es, fallback) : fallback;
+			}
+			else if (pid == fq->video_pid)
+				priority = FRAME_PRIORITY_CONTINUATION;
+		}
+
+		if (incoming)
+			drop = frame_queue_decide_incoming (fq, priority, level);
+		else
+			drop = frame_queue_decide_outgoing (fq, priority, GST_BUFFER_DTS_OR_PTS (buffer), stale);
+		aged |= drop && priority == FRAME_PRIORITY_OTHER;
+
+		if (drop && !kept)
+			kept = g_byte_array_append (g_byte_array_sized_new (map.size), map.data, offset);
+		else if (!drop && kept)
+			g_byte_array_append (kept, p, len);
+	}
+	gst_buffer_unmap (buffer, &map);
+	if (aged)
+		fq->aged++;
+
+	if (!kept)
+		return buffer;
+	size = kept->len;
+	if (!size)
+	{
+		g_byte_array_unref (kept);
+		return NULL;
+	}
+	filtered = gst_buffer_new_wrapped (g_byte_array_free (kept, FALSE), size);
+	gst_buffer_copy_into (filtered, buffer, GST_BUFFER_COPY_METADATA, 0, -1);
+	return filtered;
+}
+
+/* returns the buffer itself, a copy of it without the dropped packets or NULL if all of it is dropped */
+static GstBuffer *frame_queue_filter (DreamFrameQueue *fq, GstBuffer *buffer, GstClockTime level, gboolean incoming)
+{
+	GstClockTime ts = GST_BUFFER_DTS_OR_PTS (buffer);
+	gboolean stale = FALSE, drop;
+	framePriority priority;
+
+	if (incoming && GST_CLOCK_TIME_IS_VALID (ts))
+		fq->last_in = ts;
+	else if (!incoming && GST_CLOCK_TIME_IS_VALID (ts) && GST_CLOCK_TIME_IS_VALID (fq->last_in))
+	{
+		stale = fq->last_in > ts + fq->max_age;
+		/* how far the newest frame in is ahead of this one is what it spent in the queue */
+		fq->latency = fq->last_in > ts ? fq->last_in - ts : 0;
+	}
+
+	if (fq->mode == FRAME_QUEUE_TS)
+		return frame_queue_filter_ts (fq, buffer, level, incoming, stale);
+
+	priority = frame_queue_classify (fq, buffer);
+	if (incoming)
+		drop = frame_queue_decide_incoming (fq, priority, level);
+	else
+	{
+		drop = frame_queue_decide_outgoing (fq, priority, ts, stale);
+		if (drop && priority == FRAME_PRIORITY_OTHER)
+			fq->aged++;
+	}
+	return drop ? NULL : buffer;
+}
+
+static GstPadProbeReturn frame_queue_probe (DreamFrameQueue *fq, GstPadProbeInfo * info, gboolean incoming)
+{
+	GstClockTime level = 0;
+	gboolean drop;
+
+	if (incoming)
+		g_object_get (fq->queue, "current-level-time", &level, NULL);
+
+	g_mutex_lock (&fq->mutex);
+	if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+	{
+		GstBufferList *list = gst_buffer_list_make_writable (GST_PAD_PROBE_INFO_BUFFER_LIST (info));
+		guint i = 0;
+		GST_PAD_PROBE_INFO_DATA (info) = list;
+		while (i < gst_buffer_list_length (list))
+		{
+			GstBuffer *buffer = gst_buffer_list_get (list, i);
+			GstBuffer *filtered = frame_queue_filter (fq, buffer, level, incoming);
+			if (filtered != buffer)
+				gst_buffer_list_remove (list, i, 1);
+			if (filtered && filtered != buffer)
+				gst_buffer_list_insert (list, i, filtered);
+			if (filtered)
+				i++;
+		}
+		drop = gst_buffer_list_length (list) == 0;
+	}
+	else
+	{
+		GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+		GstBuffer *filtered = frame_queue_filter (fq, buffer, level, incoming);
+		drop = !filtered;
+		if (filtered && filtered != buffer)
+		{
+			gst_buffer_unref (buffer);
+			GST_PAD_PROBE_INFO_DATA (info) = filtered;
+		}
+	}
+	g_mutex_unlock (&fq->mutex);
+	return drop ? GST_PAD_PROBE_DROP : GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn frame_queue_sink_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+	return frame_queue_probe (user_data, info, TRUE);
+}
+
+static GstPadProbeReturn frame_queue_src_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+	return frame_queue_probe (user_data, info, FALSE);
+}
+
+static void frame_queue_add_stats (DreamFrameQueue *fq, GVariantBuilder *builder)
+{
+	g_mutex_lock (&fq->mutex);
+	g_variant_builder_add (builder, "{s(uuu)}", fq->name, fq->dropped[FRAME_PRIORITY_NONREF], fq->dropped[FRAME_PRIORITY_REF], fq->aged);
+	g_mutex_unlock (&fq->mutex);
+}
+
+/* the queue limits are set by the owners of the queues, the frame queue may outlive its element */
+static void frame_queue_set_max_age (DreamFrameQueue *fq, GstClockTime max_age)
+{
+	g_mutex_lock (&fq->mutex);
+	fq->max_age = max_age;
+	g_mutex_unlock (&fq->mutex);
+}
+
+static void frame_queue_add_latency (DreamFrameQueue *fq, GVariantBuilder *builder)
+{
+	g_mutex_lock (&fq->mutex);
+	g_variant_builder_add (builder, "{s(uu)}", fq->name, (guint32) (fq->latency / GST_MSECOND), (guint32) (fq->max_age / GST_MSECOND));
+	g_mutex_unlock (&fq->mutex);
+}
+
+static void latency_add_source_queue (GstElement *queue, const gchar *name, GVariantBuilder *builder)
+{
+	guint64 level = 0, limit = 0;
+	if (queue)
+		g_object_get (queue, "current-level-time", &level, "max-size-time", &limit, NULL);
+	g_variant_builder_add (builder, "{s(uu)}", name, (guint32) (level / GST_MSECOND), (guint32) (limit / GST_MSECOND));
+}
+
+/* retunes whatever is running, rtsp media and hls sessions created later pick the profile up themselves */
+static void latency_profile_apply (App *app)
+{
+	const DreamLatencyProfile *p = &latency_profiles[app->latency_profile];
+	DreamRTSPserver *r = app->rtsp_server;
+	DreamHLSserver *h = app->hls_server;
+	GList *l;
+	bridgeType type;
+
+	GST_INFO_OBJECT (app, "applying latency profile %s", p->name);
+	if (app->aq)
+		g_object_set (G_OBJECT (app->aq), "max-size-buffers", 0, "max-size-bytes", 0, "max-size-time", p->source_queue, NULL);
+	if (app->vq)
+		g_object_set (G_OBJECT (app->vq), "max-size-buffers", 0, "max-size-bytes", 0, "max-size-time", p->source_queue, NULL);
+	if (app->tsmux)
+		g_object_set (app->tsmux, "latency", p->mux_latency, NULL);
+
+	for (l = app->upstreams; l; l = l->next)
+	{
+		DreamTCPupstream *t = l->data;
+		frame_queue_set_max_age (&t->frames, p->upstream_age);
+		if (t->tstcpq)
+			g_object_set (G_OBJECT (t->tstcpq), "max-size-time", 2*p->upstream_age, NULL);
+	}
+
+	if (r)
+	{
+		for (type = BRIDGE_AUDIO; type < BRIDGE_COUNT; type++)
+		{
+			frame_queue_set_max_age (&r->bridge[type].frames, p->rtsp_age);
+			if (r->bridge[type].queue)
+				g_object_set (G_OBJECT (r->bridge[type].queue), "max-size-time", 2*p->rtsp_age, NULL);
+		}
+		if (r->state != RTSP_STATE_DISABLED && r->ts_factory)
+			gst_rtsp_media_factory_set_launch (GST_RTSP_MEDIA_FACTORY (r->ts_factory), p->ts_queue ? TS_LAUNCH_QUEUED : TS_LAUNCH_DIRECT);
+	}
+
+	if (h)
+	{
+		frame_queue_set_max_age (&h->frames, p->hls_age);
+		frame_queue_set_max_age (&h->fmp4.vframes, p->hls_age);
+		frame_queue_set_max_age (&h->fmp4.aframes, p->hls_age);
+		if (h->state == HLS_STATE_RUNNING && h->session_format == HLS_FORMAT_TS && h->queue)
+			g_object_set (G_OBJECT (h->queue), "max-size-time", 2*p->hls_age, NULL);
+		else if (h->state == HLS_STATE_RUNNING && h->session_format == HLS_FORMAT_FMP4)
+		{
+			GstElement *queue;
+			if (h->fmp4.vbin && (queue = gst_bin_get_by_name (GST_BIN (h->fmp4.vbin), HLS_VQUEUE)))
+			{
+				g_object_set (G_OBJECT (queue), "max-size-time", 2*p->hls_age, NULL);
+				gst_object_unref (queue);
+			}
+			if (h->fmp4.abin && (queue = gst_bin_get_by_name (GST_BIN (h->fmp4.abin), HLS_AQUEUE)))
+			{
+				g_object_set (G_OBJECT (queue), "max-size-time", 2*p->hls_age, NULL);
+				gst_object_unref (queue);
+			}
+		}
+	}
+}
+
+static void update_branch_demand (App *app)
+{
+	DreamRTSPserver *r = app->rtsp_server;
+	gboolean ts_demand = FALSE;
+
+	if (!app->pipeline)
+		return;
+
+	if (upstream_ts_active (app))
+		ts_demand = TRUE;
+	if (app->hls_server && app->hls_server->queue)
+		ts_demand = TRUE;
+	if (r)
+	{
+		if (r->ts_media)
+			ts_demand = TRUE;
+		branch_gate_set (&r->bridge[BRIDGE_AUDIO].gate, r->es_media != NULL);
+		branch_gate_set (&r->bridge[BRIDGE_VIDEO].gate, r->es_media != NULL);
+		branch_gate_set (&r->bridge[BRIDGE_TS].gate, r->ts_media != NULL);
+	}
+
+	GST_DEBUG_OBJECT (app, "update_branch_demand: ts_demand=%i es_media=%p ts_media=%p", ts_demand, r ? r->es_media : NULL, r ? r->ts_media : NULL);
+	if (ts_demand)
+		assert_tsmux (app);
+	branch_gate_set (&app->agate, ts_demand);
+	branch_gate_set (&app->vgate, ts_demand);
+}
+
+void assert_tsmux(App *app)
+{
+	if (app->tsmux)
+		return;
+
+	GST_DEBUG_OBJECT (app, "inserting tsmux");
+
+	app->tsmux = gst_element_factory_make ("mpegtsmux", NULL);
+	g_object_set (app->tsmux, "latency", latency_profiles[app->latency_profile].mux_latency, NULL);
+	gst_bin_add (GST_BIN (app->pipeline), app->tsmux);
+
+	GstPad *sinkpad, *srcpad;
+	GstPadLinkReturn ret;
+
+	srcpad = gst_element_get_static_pad (app->aq, "src");
+	sinkpad = gst_element_get_compatible_pad (app->tsmux, srcpad, NULL);
+	ret = gst_pad_link (srcpad, sinkpad);
+	if (ret != GST_PAD_LINK_OK)
+		g_error ("couldn't link %" GST_PTR_FORMAT " ! %" GST_PTR_FORMAT "", srcpad, sinkpad);
+	gst_object_unref (srcpad);
+	gst_object_unref (sinkpad);
+
+	srcpad = gst_element_get_static_pad (app->vq, "src");
+	sinkpad = gst_element_get_compatible_pad (app->tsmux, srcpad, NULL);
+	ret = gst_pad_link (srcpad, sinkpad);
+	if (ret != GST_PAD_LINK_OK)
+		g_error ("couldn't link %" GST_PTR_FORMAT " ! %" GST_PTR_FORMAT "", srcpad, sinkpad);
+	gst_object_unref (srcpad);
+	gst_object_unref (sinkpad);
+
+	if (!gst_element_link (app->tsmux, app->tstee))
+		g_error ("couldn't link %" GST_PTR_FORMAT " ! %" GST_PTR_FORMAT "", app->tsmux, app->tstee);
+}
+
+gboolean create_source_pipeline(App *app)
+{
+	GST_INFO_OBJECT(app, "create_source_pipeline");
+	DREAMRTSPSERVER_LOCK (app);
+	app->pipeline = gst_pipeline_new ("dreamrtspserver_source_pipeline");
+
+	GstBus *bus = gst_pipeline_get_bus (GST_PIPELINE (app->pipeline));
+	gst_bus_add_signal_watch (bus);
+	g_signal_connect (G_OBJECT (bus), "message", G_CALLBACK (message_cb), app);
+	gst_object_unref (GST_OBJECT (bus));
+
+	if (app->source_backend == SOURCE_BACKEND_SOFTWARE)
+	{
+		app->asrc = gst_element_factory_make ("dreamsoftaudiosource", "dreamaudiosource0");
+		app->vsrc = gst_element_factory_make ("dreamsoftvideosource", "dreamvideosource0");
+	}
+	else
+	{
+		app->asrc = gst_element_factory_make ("dreamaudiosource", "dreamaudiosource0");
+		app->vsrc = gst_element_factory_make ("dreamvideosource", "dreamvideosource0");
+		if (!(app->asrc && app->vsrc))
+			g_printerr ("dreamaudiosource/dreamvideosource are missing, use --source=software to run without encoder hardware\n");
+	}
+
+	app->aparse = gst_element_factory_make ("aacparse", NULL);
+	app->vparse = gst_element_factory_make ("h264parse", NULL);
+
+	app->atee = gst_element_factory_make ("tee", "atee");
+	app->vtee = gst_element_factory_make ("tee", "vtee");
+	app->tstee = gst_element_factory_make ("tee", "tstee");
+
+	app->aq = gst_element_factory_make ("queue", "aqueue");
+	app->vq = gst_element_factory_make ("queue", "vqueue");
+
+	app->tsmux = gst_element_factory_make ("mpegtsmux", NULL);
+        app->tstee = gst_element_factory_make ("tee", "tstee");
+
+	if (!(app->asrc && app->vsrc && app->aparse && app->vparse && app->aq && app->vq && app->atee && app->vtee && app->tsmux && app->tstee))
+	{
+		g_error ("Failed to create source pipeline element(s):%s%s%s%s%s%s%s%s%s", app->asrc?"":" dreamaudiosource", app->vsrc?"":" dreamvideosource", app->aparse?"":" aacparse",
+			app->vparse?"":" h264parse", app->aq?"":" aqueue", app->vq?"":" vqueue", app->atee?"":" atee", app->vtee?"":" vtee", app->tsmux?"":"  mpegtsmux");
+	}
+	gst_object_unref(app->tsmux);
+	app->tsmux = NULL;
+
+	if (!(app->asrc && app->vsrc && app->aparse && app->vparse))
+	{
+		g_error ("Failed to create source pipeline element(s):%s%s%s%s", app->asrc?"":" dreamaudiosource", app->vsrc?"":" dreamvideosource", app->aparse?"":" aacparse", app->vparse?"":" h264parse");
+	}
+
+	GstElement *appsink, *appsrc, *vpay, *apay, *udpsrc;
+	appsink = gst_element_factory_make ("appsink", NULL);
+	appsrc = gst_element_factory_make ("appsrc", NULL);
+	vpay = gst_element_factory_make ("rtph264pay", NULL);
+	apay = gst_element_factory_make ("rtpmp4apay", NULL);
+	udpsrc = gst_element_factory_make ("udpsrc", NULL);
+
+	if (!(appsink && appsrc && vpay && apay && udpsrc))
+		g_error ("Failed to create rtsp element(s):%s%s%s%s%s", appsink?"":" appsink", appsrc?"":" appsrc", vpay?"": "rtph264pay", apay?"":" rtpmp4apay", udpsrc?"":" udpsrc" );
+	else
+	{
+		gst_object_unref (appsink);
+		gst_object_unref (appsrc);
+		gst_object_unref (vpay);
+		gst_object_unref (apay);
+		gst_object_unref (udpsrc);
+	}
+
+	g_object_set (G_OBJECT (app->aq), "max-size-buffers", 0, "max-size-bytes", 0, "max-size-time", latency_profiles[app->latency_profile].source_queue, NULL);
+	g_object_set (G_OBJECT (app->vq), "max-size-buffers", 0, "max-size-bytes", 0, "max-size-time", latency_profiles[app->latency_profile].source_queue, NULL);
+
+	gst_bin_add_many (GST_BIN (app->pipeline), app->asrc, app->aparse, app->atee, app->aq, NULL);
+	gst_bin_add_many (GST_BIN (app->pipeline), app->vsrc, app->vparse, app->vtee, app->vq, NULL);
+	gst_bin_add (GST_BIN (app->pipeline), app->tstee);
+	gst_element_link_many (app->asrc, app->aparse, app->atee, NULL);
+	gst_element_link_many (app->vsrc, app->vparse, app->vtee, NULL);
+
+	GstPad *teepad, *sinkpad;
+	GstPadLinkReturn ret;
+
+	teepad = gst_element_get_request_pad (app->atee, "src_%u");
+	sinkpad = gst_element_get_static_pad (app->aq, "sink");
+	ret = gst_pad_link (teepad, sinkpad);
+	if (ret != GST_PAD_LINK_OK)
+
+	if (ret != GST_PAD_LINK_OK)
+	{
+		GST_ERROR_OBJECT (app, "couldn't link %" GST_PTR_FORMAT " ! %" GST_PTR_FORMAT "", teepad, sinkpad);
+		return FALSE;
+	}
+	branch_gate_attach (&app->agate, teepad);
+	gst_object_unref (teepad);
+	gst_object_unref (sinkpad);
+
+	teepad = gst_element_get_request_pad (app->vtee, "src_%u");
+	sinkpad = gst_element_get_static_pad (app->vq, "sink");
+	ret = gst_pad_link (teepad, sinkpad);
+
+	if (ret != GST_PAD_LINK_OK)
+	{
+		GST_ERROR_OBJECT (app, "couldn't link %" GST_PTR_FORMAT " ! %" GST_PTR_FORMAT "", teepad, sinkpad);
+		return FALSE;
+	}
+
+	branch_gate_attach (&app->vgate, teepad);
+	gst_object_unref (teepad);
+	gst_object_unref (sinkpad);
+
+	/* ahead of the gop cache, so that nothing encoded while idling gets cached */
+	sinkpad = gst_element_get_static_pad (app->atee, "sink");
+	gst_pad_add_probe (sinkpad, GST_PAD_PROBE_TYPE_BUFFER, idle_audio_probe, app, NULL);
+	gst_object_unref (sinkpad);
+	sinkpad = gst_element_get_static_pad (app->vtee, "sink");
+	gst_pad_add_probe (sinkpad, GST_PAD_PROBE_TYPE_BUFFER, idle_video_probe, app, NULL);
+	gst_object_unref (sinkpad);
+
+	GstElement *tees[] = { app->atee, app->vtee, app->tstee };
+	guint i;
+	for (i = 0; i < G_N_ELEMENTS (tees); i++)
+	{
+		sinkpad = gst_element_get_static_pad (tees[i], "sink");
+		gst_pad_add_probe (sinkpad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST, gop_cache_probe, app, NULL);
+		gst_object_unref (sinkpad);
+	}
+
+	sinkpad = gst_element_get_static_pad (app->vtee, "sink");
+	gst_pad_add_probe (sinkpad, GST_PAD_PROBE_TYPE_BUFFER, keyframe_granted_probe, app, NULL);
+	gst_object_unref (sinkpad);
+
+	app->clock = gst_system_clock_obtain();
+	gst_pipeline_use_clock(GST_PIPELINE (app->pipeline), app->clock);
+
+	if (app->source_idle)
+		app->source_properties = app->idle_restore;
+	app->source_idle = app->idle_wait_keyframe = FALSE;
+	apply_source_properties(app);
+
+	g_signal_connect (app->asrc, "signal-lost", G_CALLBACK (encoder_signal_lost), app);
+
+	GST_DEBUG_BIN_TO_DOT_FILE(GST_BIN(app->pipeline),GST_DEBUG_GRAPH_SHOW_ALL,"create_source_pipeline");
+	DREAMRTSPSERVER_UNLOCK (app);
+	return TRUE;
+}
+
+static void encoder_signal_lost (GstElement *dreamaudiosource, gpointer user_data)
+{
+	GST_INFO_OBJECT (dreamaudiosource, "lost encoder signal!");
+}
+
+static gboolean upstream_link_tee (App *app, GstElement *tee, GstElement *element, const gchar *padname)
+{
+	GstPadLinkReturn ret;
+	GstPad *srcpad, *sinkpad;
+	srcpad = gst_element_get_request_pad (tee, "src_%u");
+	sinkpad = gst_element_get_static_pad (element, padname);
+	ret = gst_pad_link (srcpad, sinkpad);
+	if (ret != GST_PAD_LINK_OK)
+	{
+		GST_ERROR_OBJECT (app, "couldn't link %" GST_PTR_FORMAT " ! %" GST_PTR_FORMAT "", srcpad, sinkpad);
+		gst_element_release_request_pad (tee, srcpad);
+	}
+	gst_object_unref (srcpad);
+	gst_object_unref (sinkpad);
+	return ret == GST_PAD_LINK_OK;
+}
+
+static void upstream_unlink_tee (GstPad *pad)
+{
+	GstPad *teepad = gst_pad_get_peer (pad);
+	GstElement *tee;
+
+	if (!teepad)
+		return;
+	gst_pad_unlink (teepad, pad);
+	tee = gst_pad_get_parent_element (teepad);
+	gst_element_release_request_pad (tee, teepad);
+	gst_object_unref (teepad);
+	gst_object_unref (tee);
+}
+
+gboolean enable_tcp_upstream(DreamTCPupstream *t, const gchar *upstream_host, guint32 upstream_port, const gchar *token, const gchar *standby_host, guint32 standby_port)
+{
+	App *app = t->app;
+	GST_DEBUG_OBJECT(app, "enable_tcp_upstream %s host=%s port=%i token=%s standby=%s:%u transport=%s", t->name, upstream_host, upstream_port, token, standby_host, standby_port, t->transport == UPSTREAM_TRANSPORT_RTP ? "rtp" : "tcp");
+
+	if (!app->pipeline)
+	{
+		GST_ERROR_OBJECT (app, "failed to enable upstream because source pipeline is NULL!");
+		goto fail;
+	}
+
+	if (t->state == UPSTREAM_STATE_DISABLED)
+	{
+		DREAMRTSPSERVER_LOCK (app);
+
+		t->id_signal_overrun = 0;
+		t->id_signal_waiting = 0;
+		t->id_signal_keepalive = 0;
+		t->id_bitrate_measure = 0;
+		t->id_resume = 0;
+		t->state = UPSTREAM_STATE_CONNECTING;
+		upstream_signal (t, "upstreamStateChanged", "stateChanged", g_variant_new("(i)", t->state));
+		update_branch_demand (app);
+
+		g_free (t->host);
+		t->host = g_strdup (upstream_host);
+		t->port = upstream_port;
+		g_free (t->standby_host);
+		t->standby_host = standby_host && *standby_host ? g_strdup (standby_host) : NULL;
+		t->standby_port = standby_port;
+
+		gchar *queuename = t->id ? g_strdup_printf ("tstcpqueue%u", t->id) : g_strdup ("tstcpqueue");
+		t->tstcpq  = gst_element_factory_make ("queue", queuename);
+		t->tcpsink = gst_element_factory_make (t->transport == UPSTREAM_TRANSPORT_RTP ? "dreamrtpclientsink" : "dreamtcpclientsink", NULL);
+		g_free (queuename);
+
+		/* compact framing takes the elementary streams straight off the source tees, upstream doesn't need the muxer then */
+		t->compactmux = NULL;
+		if (upstream_compact (t))
+		{
+			gchar *muxname = t->id ? g_strdup_printf ("compactmux%u", t->id) : g_strdup ("compactmux");
+			t->compactmux = gst_element_factory_make ("dreamcompactmux", muxname);
+			g_free (muxname);
+			if (!t->compactmux)
+				g_error ("Failed to create tcp upstream element(s):  dreamcompactmux");
+		}
+
+		if (!(t->tstcpq && t->tcpsink ))
+			g_error ("Failed to create tcp upstream element(s):%s%s", t->tstcpq?"":"  ts queue", t->tcpsink?"":(t->transport == UPSTREAM_TRANSPORT_RTP ? "  dreamrtpclientsink" : "  dreamtcpclientsink"));
+
+		g_object_set (G_OBJECT (t->tstcpq), "leaky", 2, "max-size-buffers", 0, "max-size-bytes", 0, "max-size-time", 2*t->frames.max_age, NULL);
+		t->frames.mode = t->compactmux ? FRAME_QUEUE_COMPACT : FRAME_QUEUE_TS;
+		frame_queue_attach (&t->frames, t->tstcpq);
+
+		g_object_set (t->tcpsink, "max-lateness", G_GINT64_CONSTANT(3)*GST_SECOND, NULL);
+		t->mediator_idle = FALSE;
+
+		/* the receiver authenticates by the SDES note and never stops reading, there's no handshake to wait for */
+		if (t->transport == UPSTREAM_TRANSPORT_RTP)
+		{
+			if (strlen(token))
+				g_strlcpy (t->token, token, sizeof (t->token));
+			g_object_set (t->tcpsink, "token", strlen(token) ? t->token : NULL, "fec-percentage", t->fec_percentage, "rtx-time", t->rtx_time, NULL);
+			if (t->standby_host || t->spool_size || t->control)
+				GST_WARNING_OBJECT (app, "%s: standby, spool and control channel are only supported over TCP", t->name);
+		}
+		else
+		{
+			t->id_signal_overrun = g_signal_connect (t->tstcpq, "overrun", G_CALLBACK (queue_overrun), t);
+			GST_TRACE_OBJECT(app, "installed %" GST_PTR_FORMAT " overrun handler id=%u", t->tstcpq, t->id_signal_overrun);
+
+			g_object_set (t->tcpsink, "zerocopy", UPSTREAM_ZEROCOPY, NULL);
+			g_object_set (t->tcpsink, "reconnect", UPSTREAM_RECONNECT, NULL);
+
+			/* the sink keeps an authenticated idle connection to the standby and switches over on its own */
+			if (t->standby_host)
+				g_object_set (t->tcpsink, "standby-host", t->standby_host, "standby-port", (gint) t->standby_port, "stall-timeout", UPSTREAM_STALL_TIMEOUT, NULL);
+
+			/* with a spool the sink keeps taking the stream during an outage, so the encoder isn't paused and the mediator gets the backlog afterwards */
+			if (t->spool_size)
+				g_object_set (t->tcpsink, "spool-size", t->spool_size, "spool-location", t->spool_location, "spool-max-rate", t->spool_max_rate, NULL);
+
+			/* the sink sends the token ahead of the stream on every (re)connect, always TOKEN_LEN bytes as the mediator reads it */
+			GByteArray *preamble = g_byte_array_new ();
+			memset (t->token, 0, sizeof (t->token));
+			if (strlen(token))
+			{
+				g_strlcpy (t->token, token, sizeof (t->token));
+				g_byte_array_append (preamble, (const guint8 *) t->token, TOKEN_LEN);
+			}
+			else
+				GST_DEBUG_OBJECT (app, "no token specified!");
+
+			/* compact framing and the control channel are announced by magics right after the token, older mediators never see them */
+			if (t->compactmux)
+				g_byte_array_append (preamble, (const guint8 *) DREAM_COMPACT_MAGIC, strlen (DREAM_COMPACT_MAGIC));
+			if (t->control)
+			{
+				g_byte_array_append (preamble, (const guint8 *) DREAM_CONTROL_MAGIC, strlen (DREAM_CONTROL_MAGIC));
+				g_object_set (t->tcpsink, "control", TRUE, NULL);
+			}
+			if (preamble->len)
+			{
+				GBytes *bytes = g_byte_array_free_to_bytes (preamble);
+				g_object_set (t->tcpsink, "preamble", bytes, NULL);
+				g_bytes_unref (bytes);
+			}
+			else
+				g_byte_array_unref (preamble);
+
+			/* keepalives become empty frames */
+			if (t->compactmux)
+			{
+				GBytes *keepalive = gst_dream_compact_mux_keepalive_frame ();
+				g_object_set (t->tcpsink, "keepalive-frame", keepalive, NULL);
+				g_bytes_unref (keepalive);
+			}
+		}
+
+		g_object_set (t->tcpsink, "host", upstream_host, NULL);
+		g_object_set (t->tcpsink, "port", upstream_port, NULL);
+		gchar *check_host;
+		guint32 check_port;
+		g_object_get (t->tcpsink, "host", &check_host, NULL);
+		g_object_get (t->tcpsink, "port", &check_port, NULL);
+		if (g_strcmp0 (upstream_host, check_host))
+		{
+			g_free (check_host);
+			GST_ERROR_OBJECT (app, "couldn't set upstream_host %s", upstream_host);
+			goto fail;
+		}
+		if (upstream_port != check_port)
+		{
+			GST_ERROR_OBJECT (app, "couldn't set upstream_port %d", upstream_port);
+			goto fail;
+		}
+		g_free (check_host);
+
+		GstStateChangeReturn sret = gst_element_set_state (t->tcpsink, GST_STATE_READY);
+		if (sret == GST_STATE_CHANGE_FAILURE)
+		{
+			GST_ERROR_OBJECT (app, "failed to set tcpsink to GST_STATE_READY. %s:%d probably refused connection", upstream_host, upstream_port);
+			gst_object_unref (t->tstcpq);
+			gst_object_unref (t->tcpsink);
+			if (t->compactmux)
+				gst_object_unref (t->compactmux);
+			t->compactmux = t->tstcpq = t->tcpsink = NULL;
+			t->state = UPSTREAM_STATE_DISABLED;
+			upstream_signal (t, "upstreamStateChanged", "stateChanged", g_variant_new("(i)", t->state));
+			update_branch_demand (app);
+			DREAMRTSPSERVER_UNLOCK (app);
+			return FALSE;
+		}
+
+		gst_bin_add_many (GST_BIN(app->pipeline), t->tstcpq, t->tcpsink, NULL);
+		if (!gst_element_link (t->tstcpq, t->tcpsink)) {
+			GST_ERROR_OBJECT (app, "couldn't link %" GST_PTR_FORMAT " ! %" GST_PTR_FORMAT "", t->tstcpq, t->tcpsink);
+			goto fail;
+		}
+
+// 		if (!assert_state (app, t->tcpsink, GST_STATE_PLAYING) || !assert_state (app, t->tstcpq, GST_STATE_PLAYING))
+// 			goto fail;
+
+		if (t->compactmux)
+		{
+			gst_bin_add (GST_BIN(app->pipeline), t->compactmux);
+			if (!gst_element_link (t->compactmux, t->tstcpq))
+			{
+				GST_ERROR_OBJECT (app, "couldn't link %" GST_PTR_FORMAT " ! %" GST_PTR_FORMAT "", t->compactmux, t->tstcpq);
+				goto fail;
+			}
+			if (!upstream_link_tee (app, app->atee, t->compactmux, "audio") || !upstream_link_tee (app, app->vtee, t->compactmux, "video"))
+				goto fail;
+		}
+		else if (!upstream_link_tee (app, app->tstee, t->tstcpq, "sink"))
+			goto fail;
+
+		memset (&t->socket_stats, 0, sizeof (t->socket_stats));
+		t->warnings = 0;
+		if (!t->id_stats)
+			t->id_stats = g_timeout_add (UPSTREAM_STATS_INTERVAL, upstream_socket_stats_tick, t);
+
+		if (!assert_state (app, app->pipeline, GST_STATE_PLAYING))
+		{
+			GST_ERROR_OBJECT (app, "GST_STATE_CHANGE_FAILURE for TCP upstream");
+			goto fail;
+		}
+		GST_INFO_OBJECT(app, "enabled %s %s to %s:%u! upstreamState = UPSTREAM_STATE_CONNECTING", t->transport == UPSTREAM_TRANSPORT_RTP ? "RTP" : "TCP", t->name, upstream_host, upstream_port);
+		DREAMRTSPSERVER_UNLOCK (app);
+		if (t->transport == UPSTREAM_TRANSPORT_RTP)
+			upstream_resume_waiting (t);
+		return TRUE;
+	}
+	else
+		GST_INFO_OBJECT (app, "tcp upstream already enabled! (upstreamState = %i)", t->state);
+	return FALSE;
+
+fail:
+	DREAMRTSPSERVER_UNLOCK (app);
+	disable_tcp_upstream(t);
+	return FALSE;
+}
+
+/* response headers are built once when an object is published and copied into every response for it */
+static SoupMessageHeaders *hls_store_headers (const gchar *content_type, const gchar *cache_control, GBytes *bytes)
+{
+	SoupMessageHeaders *headers = soup_message_headers_new (SOUP_MESSAGE_HEADERS_RESPONSE);
+	soup_message_headers_set_content_type (headers, content_type, NULL);
+	soup_message_headers_replace (headers, "Cache-Control", cache_control);
+	soup_message_headers_set_content_length (headers, g_bytes_get_size (bytes));
+	return headers;
+}
+
+static void hls_store_copy_header (const char *name, const char *value, gpointer user_data)
+{
+	soup_message_headers_replace ((SoupMessageHeaders *) user_data, name, value);
+}
+
+static void hls_part_free (DreamHLSpart *part)
+{
+	g_bytes_unref (part->data);
+	soup_message_headers_free (part->headers);
+	g_free (part);
+}
+
+static void hls_segment_free (DreamHLSsegment *segment)
+{
+	g_bytes_unref (segment->data);
+	soup_message_headers_free (segment->headers);
+	if (segment->parts)
+		g_ptr_array_unref (segment->parts);
+	g_free (segment);
+}
+
+static void hls_store_clear (DreamHLSserver *h)
+{
+	DreamHLSsegment *segment;
+	g_mutex_lock (&h->mutex);
+	while ((segment = g_queue_pop_head (&h->segments)))
+		hls_segment_free (segment);
+	if (h->playlist)
+	{
+		g_bytes_unref (h->playlist);
+		soup_message_headers_free (h->playlist_headers);
+	}
+	h->playlist = NULL;
+	h->playlist_headers = NULL;
+	g_ptr_array_set_size (h->parts, 0);
+	if (h->init)
+	{
+		g_bytes_unref (h->init);
+		soup_message_headers_free (h->init_headers);
+	}
+	h->init = NULL;
+	h->init_headers = NULL;
+	g_list_free_full (h->prime, (GDestroyNotify) gst_sample_unref);
+	h->prime = NULL;
+	h->priming = FALSE;
+	g_mutex_unlock (&h->mutex);
+	h->primed_until = GST_CLOCK_TIME_NONE;
+	if (h->pending)
+		g_byte_array_unref (h->pending);
+	h->pending = NULL;
+	h->pending_start = h->part_start = GST_CLOCK_TIME_NONE;
+	h->part_offset = 0;
+	h->have_pat = h->have_pmt = FALSE;
+	h->pmt_pid = 0;
+	hls_fmp4_clear (&h->fmp4);
+}
+
+/* must be called with the hls mutex held */
+static GPtrArray *hls_store_find_parts (DreamHLSserver *h, guint sequence)
+{
+	GList *l;
+	if (sequence == h->sequence)
+		return h->parts;
+	for (l = h->segments.head; l; l = l->next)
+		if (((DreamHLSsegment *) l->data)->sequence == sequence)
+			return ((DreamHLSsegment *) l->data)->parts;
+	return NULL;
+}
+
+/* only the extension the session is segmented in is served */
+static gboolean hls_store_parse_segment (DreamHLSserver *h, const gchar *name, guint *sequence)
+{
+	int ext = 0;
+
+	if (sscanf (name, HLS_FRAGMENT_SCAN, sequence, &ext) != 1 || !ext)
+		return FALSE;
+	return g_strcmp0 (name + ext, h->session_format == HLS_FORMAT_FMP4 ? "m4s" : "ts") == 0;
+}
+
+/* fills response_headers with the stored headers of the object if it is found */
+static GBytes *hls_store_lookup (DreamHLSserver *h, const gchar *name, SoupMessageHeaders *response_headers)
+{
+	GBytes *bytes = NULL;
+	SoupMessageHeaders *headers = NULL;
+	guint sequence, index;
+
+	g_mutex_lock (&h->mutex);
+	if (g_strcmp0 (name, HLS_PLAYLIST_NAME) == 0)
+	{
+		bytes = h->playlist;
+		headers = h->playlist_headers;
+	}
+	else if (g_strcmp0 (name, HLS_INIT_NAME) == 0)
+	{
+		bytes = h->init;
+		headers = h->init_headers;
+	}
+	else if (sscanf (name, HLS_PART_SCAN, &sequence, &index) == 2)
+	{
+		GPtrArray *parts = hls_store_find_parts (h, sequence);
+		if (parts && index < parts->len)
+		{
+			DreamHLSpart *part = g_ptr_array_index (parts, index);
+			bytes = part->data;
+			headers = part->headers;
+		}
+	}
+	else if (hls_store_parse_segment (h, name, &sequence))
+	{
+		GList *l;
+		for (l = h->segments.head; l; l = l->next)
+		{
+			DreamHLSsegment *segment = l->data;
+			if (segment->sequence == sequence)
+			{
+				bytes = segment->data;
+				headers = segment->headers;
+				break;
+			}
+		}
+	}
+	if (bytes)
+	{
+		g_bytes_ref (bytes);
+		soup_message_headers_foreach (headers, hls_store_copy_header, response_headers);
+	}
+	g_mutex_unlock (&h->mutex);
+	return bytes;
+}
+
+static void hls_playlist_add_parts (GString *playlist, guint sequence, GPtrArray *parts)
+{
+	guint i;
+	for (i = 0; parts && i < parts->len; i++)
+	{
+		DreamHLSpart *part = g_ptr_array_index (parts, i);
+		g_string_append_printf (playlist, "#EXT-X-PART:DURATION=%.3f,URI=\"" HLS_PART_NAME "\"%s\n", (gdouble) part->duration / GST_SECOND, sequence, i, part->independent ? ",INDEPENDENT=YES" : "");
+	}
+}
+
+/* must be called with the hls mutex held */
+static void hls_update_playlist (DreamHLSserver *h)
+{
+	gboolean ll = h->segment_low_latency;
+	gboolean fmp4 = h->session_format == HLS_FORMAT_FMP4;
+	GString *playlist = g_string_new (NULL);
+	guint first = h->segments.length > HLS_PLAYLIST_LENGTH ? h->segments.length - HLS_PLAYLIST_LENGTH : 0;
+	GstClockTime target = HLS_FRAGMENT_DURATION * GST_SECOND;
+	guint index;
+	GList *l;
+
+	for (l = g_queue_peek_nth_link (&h->segments, first); l; l = l->next)
+		target = MAX (target, ((DreamHLSsegment *) l->data)->duration);
+
+	l = g_queue_peek_nth_link (&h->segments, first);
+	g_string_append_printf (playlist, "#EXTM3U\n#EXT-X-VERSION:%u\n#EXT-X-TARGETDURATION:%u\n", fmp4 ? 7 : ll ? 6 : 3, (guint) ((target + GST_SECOND - 1) / GST_SECOND));
+	if (fmp4)
+		g_string_append (playlist, "#EXT-X-MAP:URI=\"" HLS_INIT_NAME "\"\n");
+	if (ll)
+		g_string_append_printf (playlist, "#EXT-X-SERVER-CONTROL:CAN-BLOCK-RELOAD=YES,PART-HOLD-BACK=%.3f\n#EXT-X-PART-INF:PART-TARGET=%.3f\n", 3 * HLS_PART_TARGET / 1000.0, HLS_PART_TARGET / 1000.0);
+	g_string_append_printf (playlist, "#EXT-X-MEDIA-SEQUENCE:%u\n", l ? ((DreamHLSsegment *) l->data)->sequence : h->sequence);
+	for (index = first; l; l = l->next, index++)
+	{
+		DreamHLSsegment *segment = l->data;
+		if (ll && index + HLS_PART_HISTORY >= h->segments.length)
+			hls_playlist_add_parts (playlist, segment->sequence, segment->parts);
+		g_string_append_printf (playlist, "#EXTINF:%.3f,\n" HLS_FRAGMENT_NAME "\n", (gdouble) segment->duration / GST_SECOND, segment->sequence, fmp4 ? "m4s" : "ts");
+	}
+	if (ll)
+	{
+		hls_playlist_add_parts (playlist, h->sequence, h->parts);
+		g_string_append_printf (playlist, "#EXT-X-PRELOAD-HINT:TYPE=PART,URI=\"" HLS_PART_NAME "\"\n", h->sequence, h->parts->len);
+	}
+
+	if (h->playlist)
+	{
+		g_bytes_unref (h->playlist);
+		soup_message_headers_free (h->playlist_headers);
+	}
+	h->playlist = g_string_free_to_bytes (playlist);
+	h->playlist_headers = hls_store_headers ("application/x-mpegURL", "no-cache", h->playlist);
+}
+
+static void hls_finish_part (App *app, GstClockTime end)
+{
+	DreamHLSserver *h = app->hls_server;
+
+	if (h->pending->len <= h->part_offset)
+		return;
+
+	DreamHLSpart *part = g_new0 (DreamHLSpart, 1);
+	part->data = g_bytes_new (h->pending->data + h->part_offset, h->pending->len - h->part_offset);
+	part->headers = hls_store_headers ("video/MP2T", "max-age=60", part->data);
+	part->duration = end - h->part_start;
+	part->independent = h->part_independent;
+	h->part_offset = h->pending->len;
+
+	g_mutex_lock (&h->mutex);
+	GST_LOG ("hls part %u.%u finished: %" GST_TIME_FORMAT, h->sequence, h->parts->len, GST_TIME_ARGS (part->duration));
+	g_ptr_array_add (h->parts, part);
+	hls_update_playlist (h);
+	if (!h->id_resume)
+		h->id_resume = g_idle_add (hls_resume_requests, app);
+	g_mutex_unlock (&h->mutex);
+}
+
+/* publishes a complete segment, takes ownership of data */
+static void hls_store_segment (App *app, GBytes *data, GstClockTime duration)
+{
+	DreamHLSserver *h = app->hls_server;
+
+	DreamHLSsegment *segment = g_new0 (DreamHLSsegment, 1);
+	segment->duration = duration;
+	segment->data = data;
+	segment->headers = hls_store_headers (h->session_format == HLS_FORMAT_FMP4 ? "video/iso.segment" : "video/MP2T", "max-age=60", data);
+
+	g_mutex_lock (&h->mutex);
+	segment->sequence = h->sequence++;
+	if (h->segment_low_latency)
+	{
+		segment->parts = h->parts;
+		h->parts = g_ptr_array_new_with_free_func ((GDestroyNotify) hls_part_free);
+	}
+	GST_DEBUG ("hls segment %u finished: %" GST_TIME_FORMAT ", %" G_GSIZE_FORMAT " bytes", segment->sequence, GST_TIME_ARGS (segment->duration), g_bytes_get_size (segment->data));
+	g_queue_push_tail (&h->segments, segment);
+	while (h->segments.length > HLS_SEGMENT_COUNT)
+		hls_segment_free (g_queue_pop_head (&h->segments));
+	hls_update_playlist (h);
+	if (!h->id_resume)
+		h->id_resume = g_idle_add (hls_resume_requests, app);
+	g_mutex_unlock (&h->mutex);
+}
+
+static void hls_finish_segment (App *app, GstClockTime end)
+{
+	DreamHLSserver *h = app->hls_server;
+
+	if (h->segment_low_latency)
+		hls_finish_part (app, end);
+
+	hls_store_segment (app, g_byte_array_free_to_bytes (h->pending), end - h->pending_start);
+	h->pending = NULL;
+}
+
+/* remember the latest PAT and PMT so that every segment can start with them */
+static void hls_parse_psi (DreamHLSserver *h, const guint8 *data, gsize size)
+{
+	gsize offset;
+	for (offset = 0; offset + TS_PACK_SIZE <= size; offset += TS_PACK_SIZE)
+	{
+		const guint8 *packet = data + offset;
+		guint16 pid = ((packet[1] & 0x1f) << 8) | packet[2];
+		if (packet[0] != 0x47 || !(packet[1] & 0x40))
+			continue;
+		if (pid == 0)
+		{
+			guint payload = 4 + ((packet[3] & 0x20) ? 1 + packet[4] : 0);
+			guint section = payload + 1 + packet[payload];
+			/* first program_map_PID behind the 8 byte section header */
+			if (section + 12 <= TS_PACK_SIZE)
+			{
+				h->pmt_pid = ((packet[section + 10] & 0x1f) << 8) | packet[section + 11];
+				memcpy (h->pat, packet, TS_PACK_SIZE);
+				h->have_pat = TRUE;
+			}
+		}
+		else if (h->pmt_pid && pid == h->pmt_pid)
+		{
+			memcpy (h->pmt, packet, TS_PACK_SIZE);
+			h->have_pmt = TRUE;
+		}
+	}
+}
+
+static void hls_process_buffer (App *app, GstBuffer *buffer)
+{
+	DreamHLSserver *h = app->hls_server;
+	GstMapInfo map;
+
+	if (!gst_buffer_map (buffer, &map, GST_MAP_READ))
+		return;
+
+	GstClockTime ts = GST_BUFFER_DTS_OR_PTS (buffer);
+	gboolean keyframe = !GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT) && GST_CLOCK_TIME_IS_VALID (ts);
+
+	if (keyframe && h->pending && GST_CLOCK_TIME_IS_VALID (h->pending_start) && ts >= h->pending_start + HLS_FRAGMENT_DURATION * GST_SECOND)
+		hls_finish_segment (app, ts);
+	else if (h->pending && h->segment_low_latency && GST_CLOCK_TIME_IS_VALID (ts) && ts >= h->part_start + HLS_PART_DURATION * GST_MSECOND)
+	{
+		hls_finish_part (app, ts);
+		h->part_start = ts;
+		h->part_independent = keyframe;
+	}
+
+	if (keyframe && !h->pending)
+	{
+		h->pending = g_byte_array_sized_new (map.size * 64);
+		h->pending_start = h->part_start = ts;
+		h->part_offset = 0;
+		h->part_independent = TRUE;
+		h->segment_low_latency = h->low_latency;
+		guint16 first_pid = map.size >= 3 ? ((map.data[1] & 0x1f) << 8) | map.data[2] : 0;
+		if (first_pid != 0 && h->have_pat && h->have_pmt)
+		{
+			g_byte_array_append (h->pending, h->pat, TS_PACK_SIZE);
+			g_byte_array_append (h->pending, h->pmt, TS_PACK_SIZE);
+		}
+	}
+
+	hls_parse_psi (h, map.data, map.size);
+	if (h->pending)
+		g_byte_array_append (h->pending, map.data, map.size);
+
+	gst_buffer_unmap (buffer, &map);
+}
+
+static GstFlowReturn hls_new_sample (GstAppSink *appsink, gpointer user_data)
+{
+	App *app = user_data;
+	DreamHLSserver *h = app->hls_server;
+	GstSample *sample = gst_app_sink_pull_sample (appsink);
+	GList *prime, *l;
+
+	if (!sample)
+		return GST_FLOW_OK;
+
+	g_mutex_lock (&h->mutex);
+	if (h->priming)
+	{
+		/* start_hls_pipeline() is about to hand over the cached GOP, which already contains this buffer */
+		g_mutex_unlock (&h->mutex);
+		gst_sample_unref (sample);
+		return GST_FLOW_OK;
+	}
+	prime = h->prime;
+	h->prime = NULL;
+	g_mutex_unlock (&h->mutex);
+
+	for (l = prime; l; l = l->next)
+	{
+		GstBuffer *buffer = gst_sample_get_buffer (l->data);
+		hls_process_buffer (app, buffer);
+		h->primed_until = GST_BUFFER_DTS_OR_PTS (buffer);
+	}
+	if (prime)
+		GST_DEBUG_OBJECT (appsink, "primed hls segmenter with %u cached buffers", g_list_length (prime));
+	g_list_free_full (prime, (GDestroyNotify) gst_sample_unref);
+
+	GstBuffer *buffer = gst_sample_get_buffer (sample);
+	if (buffer)
+	{
+		GstClockTime ts = GST_BUFFER_DTS_OR_PTS (buffer);
+		if (GST_CLOCK_TIME_IS_VALID (h->primed_until) && GST_CLOCK_TIME_IS_VALID (ts) && ts <= h->primed_until)
+			GST_TRACE_OBJECT (appsink, "dropping %" GST_PTR_FORMAT ", already primed", buffer);
+		else
+		{
+			h->primed_until = GST_CLOCK_TIME_NONE;
+			hls_process_buffer (app, buffer);
+		}
+	}
+	gst_sample_unref (sample);
+	return GST_FLOW_OK;
+}
+
+static void mp4_put_u8 (GByteArray *a, guint8 v)
+{
+	g_byte_array_append (a, &v, 1);
+}
+
+static void mp4_put_u16 (GByteArray *a, guint16 v)
+{
+	guint8 b[2];
+	GST_WRITE_UINT16_BE (b, v);
+	g_byte_array_append (a, b, sizeof (b));
+}
+
+static void mp4_put_u32 (GByteArray *a, guint32 v)
+{
+	guint8 b[4];
+	GST_WRITE_UINT32_BE (b, v);
+	g_byte_array_append (a, b, sizeof (b));
+}
+
+static void mp4_put_u64 (GByteArray *a, guint64 v)
+{
+	guint8 b[8];
+	GST_WRITE_UINT64_BE (b, v);
+	g_byte_array_append (a, b, sizeof (b));
+}
+
+static void mp4_put_zeros (GByteArray *a, guint n)
+{
+	guint len = a->len;
+	g_byte_array_set_size (a, len + n);
+	memset (a->data + len, 0, n);
+}
+
+static void mp4_put_fourcc (GByteArray *a, const gchar *fourcc)
+{
+	g_byte_array_append (a, (const guint8 *) fourcc, 4);
+}
+
+static void mp4_put_matrix (GByteArray *a)
+{
+	static const guint32 unity[9] = { 0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000 };
+	guint i;
+	for (i = 0; i < G_N_ELEMENTS (unity); i++)
+		mp4_put_u32 (a, unity[i]);
+}
+
+static void mp4_put_buffer (GByteArray *a, GstBuffer *buffer)
+{
+	GstMapInfo map;
+	if (buffer && gst_buffer_map (buffer, &map, GST_MAP_READ))
+	{
+		g_byte_array_append (a, map.data, map.size);
+		gst_buffer_unmap (buffer, &map);
+	}
+}
+
+/* writes a box header with a size placeholder, returns its offset for mp4_box_close() */
+static guint mp4_box_open (GByteArray *a, const gchar *type)
+{
+	guint offset = a->len;
+	mp4_put_u32 (a, 0);
+	mp4_put_fourcc (a, type);
+	return offset;
+}
+
+static guint mp4_full_box_open (GByteArray *a, const gchar *type, guint8 version, guint32 flags)
+{
+	guint offset = mp4_box_open (a, type);
+	mp4_put_u32 (a, (version << 24) | flags);
+	return offset;
+}
+
+static void mp4_box_close (GByteArray *a, guint offset)
+{
+	GST_WRITE_UINT32_BE (a->data + offset, a->len - offset);
+}
+
+static guint64 mp4_scale (GstClockTime ts, guint32 timescale)
+{
+	return gst_util_uint64_scale (ts, timescale, GST_SECOND);
+}
+
+static void mp4_put_trak (GByteArray *a, guint32 track_id, GstCaps *caps)
+{
+	GstStructure *s = gst_caps_get_structure (caps, 0);
+	gboolean video = gst_structure_has_name (s, "video/x-h264");
+	const GValue *value = gst_structure_get_value (s, "codec_data");
+	GstBuffer *codec_data = value ? gst_value_get_buffer (value) : NULL;
+	gint width = 0, height = 0, rate = 48000, channels = 2;
+	static const gchar *tables[] = { "stts", "stsc", "stco" };
+	guint trak, mdia, minf, dinf, stbl, stsd, entry, box, i;
+
+	gst_structure_get_int (s, "width", &width);
+	gst_structure_get_int (s, "height", &height);
+	gst_structure_get_int (s, "rate", &rate);
+	gst_structure_get_int (s, "channels", &channels);
+
+	trak = mp4_box_open (a, "trak");
+	box = mp4_full_box_open (a, "tkhd", 0, 0x000003);
+	mp4_put_zeros (a, 8);			/* creation and modification time */
+	mp4_put_u32 (a, track_id);
+	mp4_put_zeros (a, 20);			/* reserved, duration, reserved, layer, alternate group */
+	mp4_put_u16 (a, video ? 0 : 0x0100);
+	mp4_put_u16 (a, 0);
+	mp4_put_matrix (a);
+	mp4_put_u32 (a, width << 16);
+	mp4_put_u32 (a, height << 16);
+	mp4_box_close (a, box);
+
+	mdia = mp4_box_open (a, "mdia");
+	box = mp4_full_box_open (a, "mdhd", 0, 0);
+	mp4_put_zeros (a, 8);
+	mp4_put_u32 (a, video ? MP4_VIDEO_TIMESCALE : rate);
+	mp4_put_u32 (a, 0);
+	mp4_put_u16 (a, 0x55c4);		/* "und" */
+	mp4_put_u16 (a, 0);
+	mp4_box_close (a, box);
+
+	box = mp4_full_box_open (a, "hdlr", 0, 0);
+	mp4_put_u32 (a, 0);
+	mp4_put_fourcc (a, video ? "vide" : "soun");
+	mp4_put_zeros (a, 12);
+	g_byte_array_append (a, (const guint8 *) (video ? "VideoHandler" : "SoundHandler"), 13);
+	mp4_box_close (a, box);
+
+	minf = mp4_box_open (a, "minf");
+	if (video)
+	{
+		box = mp4_full_box_open (a, "vmhd", 0, 0x000001);
+		mp4_put_zeros (a, 8);
+	}
+	else
+	{
+		box = mp4_full_box_open (a, "smhd", 0, 0);
+		mp4_put_zeros (a, 4);
+	}
+	mp4_box_close (a, box);
+
+	dinf = mp4_box_open (a, "dinf");
+	box = mp4_full_box_open (a, "dref", 0, 0);
+	mp4_put_u32 (a, 1);
+	mp4_box_close (a, mp4_full_box_open (a, "url ", 0, 0x000001));
+	mp4_box_close (a, box);
+	mp4_box_close (a, dinf);
+
+	stbl = mp4_box_open (a, "stbl");
+	stsd = mp4_full_box_open (a, "stsd", 0, 0);
+	mp4_put_u32 (a, 1);
+	if (video)
+	{
+		entry = mp4_box_open (a, "avc1");
+		mp4_put_zeros (a, 6);
+		mp4_put_u16 (a, 1);			/* data reference index */
+		mp4_put_zeros (a, 16);
+		mp4_put_u16 (a, width);
+		mp4_put_u16 (a, height);
+		mp4_put_u32 (a, 0x00480000);		/* 72 dpi */
+		mp4_put_u32 (a, 0x00480000);
+		mp4_put_u32 (a, 0);
+		mp4_put_u16 (a, 1);			/* frame count */
+		mp4_put_zeros (a, 32);			/* compressor name */
+		mp4_put_u16 (a, 0x0018);
+		mp4_put_u16 (a, 0xffff);
+		box = mp4_box_open (a, "avcC");
+		mp4_put_buffer (a, codec_data);
+		mp4_box_close (a, box);
+	}
+	else
+	{
+		guint8 asc = codec_data ? gst_buffer_get_size (codec_data) : 0;
+		entry = mp4_box_open (a, "mp4a");
+		mp4_put_zeros (a, 6);
+		mp4_put_u16 (a, 1);			/* data reference index */
+		mp4_put_zeros (a, 8);
+		mp4_put_u16 (a, channels);
+		mp4_put_u16 (a, 16);
+		mp4_put_zeros (a, 4);
+		mp4_put_u32 (a, rate << 16);
+		box = mp4_full_box_open (a, "esds", 0, 0);
+		mp4_put_u8 (a, 0x03);			/* ES_Descriptor */
+		mp4_put_u8 (a, 3 + 2 + 13 + 2 + asc + 2 + 1);
+		mp4_put_u16 (a, track_id);
+		mp4_put_u8 (a, 0);
+		mp4_put_u8 (a, 0x04);			/* DecoderConfigDescriptor */
+		mp4_put_u8 (a, 13 + 2 + asc);
+		mp4_put_u8 (a, 0x40);			/* MPEG-4 audio */
+		mp4_put_u8 (a, 0x15);			/* audio stream */
+		mp4_put_zeros (a, 11);			/* buffer size, max and average bitrate */
+		mp4_put_u8 (a, 0x05);			/* DecoderSpecificInfo */
+		mp4_put_u8 (a, asc);
+		mp4_put_buffer (a, codec_data);
+		mp4_put_u8 (a, 0x06);			/* SLConfigDescriptor */
+		mp4_put_u8 (a, 1);
+		mp4_put_u8 (a, 0x02);
+		mp4_box_close (a, box);
+	}
+	mp4_box_close (a, entry);
+	mp4_box_close (a, stsd);
+
+	/* the sample tables stay empty, all samples are described by the fragments */
+	for (i = 0; i < G_N_ELEMENTS (tables); i++)
+	{
+		box = mp4_full_box_open (a, tables[i], 0, 0);
+		mp4_put_u32 (a, 0);
+		mp4_box_close (a, box);
+	}
+	box = mp4_full_box_open (a, "stsz", 0, 0);
+	mp4_put_zeros (a, 8);
+	mp4_box_close (a, box);
+
+	mp4_box_close (a, stbl);
+	mp4_box_close (a, minf);
+	mp4_box_close (a, mdia);
+	mp4_box_close (a, trak);
+}
+
+static GBytes *mp4_build_init (GstCaps *vcaps, GstCaps *acaps)
+{
+	GByteArray *a = g_byte_array_new ();
+	guint moov, mvex, box, track;
+
+	box = mp4_box_open (a, "ftyp");
+	mp4_put_fourcc (a, "iso6");
+	mp4_put_u32 (a, 0);
+	mp4_put_fourcc (a, "iso6");
+	mp4_put_fourcc (a, "cmfc");
+	mp4_put_fourcc (a, "mp41");
+	mp4_box_close (a, box);
+
+	moov = mp4_box_open (a, "moov");
+	box = mp4_full_box_open (a, "mvhd", 0, 0);
+	mp4_put_zeros (a, 8);
+	mp4_put_u32 (a, 1000);
+	mp4_put_u32 (a, 0);
+	mp4_put_u32 (a, 0x00010000);		/* rate 1.0 */
+	mp4_put_u16 (a, 0x0100);		/* volume 1.0 */
+	mp4_put_zeros (a, 10);
+	mp4_put_matrix (a);
+	mp4_put_zeros (a, 24);
+	mp4_put_u32 (a, acaps ? MP4_AUDIO_TRACK + 1 : MP4_VIDEO_TRACK + 1);
+	mp4_box_close (a, box);
+
+	mp4_put_trak (a, MP4_VIDEO_TRACK, vcaps);
+	if (acaps)
+		mp4_put_trak (a, MP4_AUDIO_TRACK, acaps);
+
+	mvex = mp4_box_open (a, "mvex");
+	for (track = MP4_VIDEO_TRACK; track <= (acaps ? MP4_AUDIO_TRACK : MP4_VIDEO_TRACK); track++)
+	{
+		box = mp4_full_box_open (a, "trex", 0, 0);
+		mp4_put_u32 (a, track);
+		mp4_put_u32 (a, 1);			/* sample description index */
+		mp4_put_zeros (a, 12);
+		mp4_box_close (a, box);
+	}
+	mp4_box_close (a, mvex);
+	mp4_box_close (a, moov);
+
+	return g_byte_array_free_to_bytes (a);
+}
+
+/* one moof with a traf per track followed by a single mdat */
+static GBytes *mp4_build_fragment (guint32 sequence, DreamMP4track *tracks, guint count)
+{
+	GByteArray *a = g_byte_array_new ();
+	guint data_offset[MP4_TRACK_COUNT];
+	gsize track_size[MP4_TRACK_COUNT];
+	guint moof, traf, trun, box, i;
+	gsize offset;
+	GList *l;
+
+	moof = mp4_box_open (a, "moof");
+	box = mp4_full_box_open (a, "mfhd", 0, 0);
+	mp4_put_u32 (a, sequence);
+	mp4_box_close (a, box);
+
+	for (i = 0; i < count; i++)
+	{
+		DreamMP4track *t = &tracks[i];
+		track_size[i] = 0;
+		if (!t->samples)
+			continue;
+
+		traf = mp4_box_open (a, "traf");
+		box = mp4_full_box_open (a, "tfhd", 0, 0x020000);	/* default-base-is-moof */
+		mp4_put_u32 (a, t->track_id);
+		mp4_box_close (a, box);
+
+		box = mp4_full_box_open (a, "tfdt", 1, 0);
+		mp4_put_u64 (a, mp4_scale (GST_BUFFER_DTS_OR_PTS (gst_sample_get_buffer (t->samples->data)), t->timescale));
+		mp4_box_close (a, box);
+
+		/* data offset, sample duration, size, flags and signed composition time offset */
+		trun = mp4_full_box_open (a, "trun", 1, 0x000f01);
+		mp4_put_u32 (a, g_list_length (t->samples));
+		data_offset[i] = a->len;
+		mp4_put_u32 (a, 0);
+		for (l = t->samples; l; l = l->next)
+		{
+			GstBuffer *buffer = gst_sample_get_buffer (l->data);
+			GstClockTime dts = GST_BUFFER_DTS_OR_PTS (buffer), pts = GST_BUFFER_PTS (buffer), next;
+			guint64 scaled = mp4_scale (dts, t->timescale);
+
+			if (l->next)
+				next = GST_BUFFER_DTS_OR_PTS (gst_sample_get_buffer (l->next->data));
+			else if (GST_CLOCK_TIME_IS_VALID (t->end))
+				next = t->end;
+			else
+				next = dts + (GST_BUFFER_DURATION_IS_VALID (buffer) ? GST_BUFFER_DURATION (buffer) : t->default_duration);
+
+			mp4_put_u32 (a, next > dts ? mp4_scale (next, t->timescale) - scaled : 0);
+			mp4_put_u32 (a, gst_buffer_get_size (buffer));
+			mp4_put_u32 (a, GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT) ? MP4_SAMPLE_DEPENDS : MP4_SAMPLE_SYNC);
+			mp4_put_u32 (a, GST_CLOCK_TIME_IS_VALID (pts) ? (guint32) (mp4_scale (pts, t->timescale) - scaled) : 0);
+			track_size[i] += gst_buffer_get_size (buffer);
 		}
+		mp4_box_close (a, trun);
+		mp4_box_close (a, traf);
+	}
+	mp4_box_close (a, moof);
+
+	offset = a->len + 8;
+	for (i = 0; i < count; i++)
+	{
+		if (!tracks[i].samples)
+			continue;
+		GST_WRITE_UINT32_BE (a->data + data_offset[i], offset - moof);
+		offset += track_size[i];
+	}
+
+	mp4_put_u32 (a, offset - a->len);
+	mp4_put_fourcc (a, "mdat");
+	for (i = 0; i < count; i++)
+		for (l = tracks[i].samples; l; l = l->next)
+			mp4_put_buffer (a, gst_sample_get_buffer (l->data));
+
+	return g_byte_array_free_to_bytes (a);
+}
+
+static void hls_fmp4_clear (DreamHLSfmp4 *f)
+{
+	GstSample *sample;
+	g_mutex_lock (&f->mutex);
+	while ((sample = g_queue_pop_head (&f->vsamples)))
+		gst_sample_unref (sample);
+	while ((sample = g_queue_pop_head (&f->asamples)))
+		gst_sample_unref (sample);
+	gst_caps_replace (&f->vcaps, NULL);
+	gst_caps_replace (&f->acaps, NULL);
+	f->start = GST_CLOCK_TIME_NONE;
+	f->fragment_sequence = 0;
+	f->audio_track = FALSE;
+	g_mutex_unlock (&f->mutex);
+}
+
+/* turns the collected GOP(s) into a segment ending at the keyframe at end, called with the fmp4 mutex held */
+static void hls_fmp4_cut (App *app, GstClockTime end)
+{
+	DreamHLSserver *h = app->hls_server;
+	DreamHLSfmp4 *f = &h->fmp4;
+	DreamMP4track tracks[MP4_TRACK_COUNT];
+	GList *vsamples = f->vsamples.head, *asamples = NULL;
+	GstSample *sample;
+	guint count = 1;
+	gint rate = 48000;
+
+	g_queue_init (&f->vsamples);
+	while ((sample = g_queue_peek_head (&f->asamples)))
+	{
+		GstClockTime ts = GST_BUFFER_DTS_OR_PTS (gst_sample_get_buffer (sample));
+		if (ts >= end)
+			break;
+		g_queue_pop_head (&f->asamples);
+		if (ts < f->start)
+			gst_sample_unref (sample);
 		else
-			GST_DEBUG_OBJECT (app, "no token specified!");
+			asamples = g_list_prepend (asamples, sample);
+	}
+	asamples = g_list_reverse (asamples);
+
+	g_mutex_lock (&h->mutex);
+	if (!h->init)
+	{
+		f->audio_track = f->acaps != NULL;
+		h->init = mp4_build_init (f->vcaps, f->audio_track ? f->acaps : NULL);
+		h->init_headers = hls_store_headers ("video/mp4", "max-age=60", h->init);
+		GST_DEBUG ("hls init segment: %" G_GSIZE_FORMAT " bytes, audio track=%i", g_bytes_get_size (h->init), f->audio_track);
+	}
+	g_mutex_unlock (&h->mutex);
+
+	tracks[0] = (DreamMP4track) { MP4_VIDEO_TRACK, MP4_VIDEO_TIMESCALE, vsamples, end, GST_CLOCK_TIME_NONE };
+	if (f->audio_track && asamples)
+	{
+		gst_structure_get_int (gst_caps_get_structure (f->acaps, 0), "rate", &rate);
+		tracks[count++] = (DreamMP4track) { MP4_AUDIO_TRACK, rate, asamples, GST_CLOCK_TIME_NONE, gst_util_uint64_scale_int (1024, GST_SECOND, rate) };
+	}
+
+	hls_store_segment (app, mp4_build_fragment (++f->fragment_sequence, tracks, count), end - f->start);
+
+	g_list_free_full (vsamples, (GDestroyNotify) gst_sample_unref);
+	g_list_free_full (asamples, (GDestroyNotify) gst_sample_unref);
+}
+
+static GstFlowReturn hls_fmp4_new_video_sample (GstAppSink *appsink, gpointer user_data)
+{
+	App *app = user_data;
+	DreamHLSfmp4 *f = &app->hls_server->fmp4;
+	GstSample *sample = gst_app_sink_pull_sample (appsink);
+	GstBuffer *buffer;
+
+	if (!sample)
+		return GST_FLOW_OK;
+
+	buffer = gst_sample_get_buffer (sample);
+	if (!buffer || !GST_CLOCK_TIME_IS_VALID (GST_BUFFER_DTS_OR_PTS (buffer)))
+	{
+		gst_sample_unref (sample);
+		return GST_FLOW_OK;
+	}
+
+	GstClockTime ts = GST_BUFFER_DTS_OR_PTS (buffer);
+	gboolean keyframe = !GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+
+	g_mutex_lock (&f->mutex);
+	gst_caps_replace (&f->vcaps, gst_sample_get_caps (sample));
+	if (keyframe && f->vsamples.length && ts >= f->start + HLS_FRAGMENT_DURATION * GST_SECOND)
+		hls_fmp4_cut (app, ts);
+	if (keyframe && !f->vsamples.length)
+		f->start = ts;
+	if (f->vsamples.length || keyframe)
+		g_queue_push_tail (&f->vsamples, sample);
+	else
+		gst_sample_unref (sample);
+	g_mutex_unlock (&f->mutex);
+	return GST_FLOW_OK;
+}
+
+static GstFlowReturn hls_fmp4_new_audio_sample (GstAppSink *appsink, gpointer user_data)
+{
+	App *app = user_data;
+	DreamHLSfmp4 *f = &app->hls_server->fmp4;
+	GstSample *sample = gst_app_sink_pull_sample (appsink);
+	GstBuffer *buffer;
+
+	if (!sample)
+		return GST_FLOW_OK;
+
+	buffer = gst_sample_get_buffer (sample);
+	g_mutex_lock (&f->mutex);
+	gst_caps_replace (&f->acaps, gst_sample_get_caps (sample));
+	/* audio is only collected once the first segment has its keyframe */
+	if (buffer && GST_CLOCK_TIME_IS_VALID (GST_BUFFER_DTS_OR_PTS (buffer)) && f->vsamples.length)
+	{
+		GstClockTime ts = GST_BUFFER_DTS_OR_PTS (buffer);
+		g_queue_push_tail (&f->asamples, sample);
+		sample = NULL;
+		/* audio ahead of the pending fragment is never muxed, past that only stalled video lets the backlog grow */
+		while (f->asamples.length)
+		{
+			GstClockTime head = GST_BUFFER_DTS_OR_PTS (gst_sample_get_buffer (g_queue_peek_head (&f->asamples)));
+			if (head >= f->start && head + HLS_FMP4_AUDIO_BACKLOG >= ts)
+				break;
+			gst_sample_unref (g_queue_pop_head (&f->asamples));
+		}
+	}
+	g_mutex_unlock (&f->mutex);
+	if (sample)
+		gst_sample_unref (sample);
+	return GST_FLOW_OK;
+}
+
+gboolean hls_client_timeout (gpointer user_data)
+{
+	App *app = user_data;
+	if (app->hls_server)
+	{
+		app->hls_server->id_timeout = 0;
+		GST_INFO_OBJECT(app, "HLS clients stopped downloading, stopping hls pipeline!");
+		stop_hls_pipeline (app);
+	}
+	return FALSE;
+}
+
+static void
+hls_respond (App *app, SoupMessage *msg, const char *path, GBytes *bytes)
+{
+	GST_INFO_OBJECT (app->hls_server->soupserver, "client requests '%s', serving %" G_GSIZE_FORMAT " bytes from memory...", path, g_bytes_get_size (bytes));
+
+	/* the response headers were copied from the store by hls_store_lookup */
+	if (g_strcmp0 (path+1, HLS_PLAYLIST_NAME) == 0)
+	{
+		GstState state;
+		gst_element_get_state (app->asrc, &state, NULL, GST_MSECOND);
+		if (state != GST_STATE_PLAYING)
+		{
+			update_branch_demand (app);
+			if (!assert_state (app, app->pipeline, GST_STATE_PLAYING))
+			{
+				soup_message_headers_clear (msg->response_headers);
+				soup_message_set_status (msg, SOUP_STATUS_BAD_GATEWAY);
+				return;
+			}
+		}
+	}
+
+	if (app->hls_server->id_timeout)
+		g_source_remove (app->hls_server->id_timeout);
+	app->hls_server->id_timeout = g_timeout_add_seconds (5*HLS_FRAGMENT_DURATION, (GSourceFunc) hls_client_timeout, app);
+
+	if (msg->method == SOUP_METHOD_GET)
+	{
+		SoupBuffer *buffer = soup_buffer_new_with_owner (g_bytes_get_data (bytes, NULL), g_bytes_get_size (bytes), g_bytes_ref (bytes), (GDestroyNotify) g_bytes_unref);
+		soup_message_body_append_buffer (msg->response_body, buffer);
+		soup_buffer_free (buffer);
+	}
+	soup_message_set_status (msg, SOUP_STATUS_OK);
+}
+
+static void
+hls_request_free (DreamHLSrequest *request)
+{
+	if (request->id_timeout)
+		g_source_remove (request->id_timeout);
+	g_free (request->path);
+	g_free (request);
+}
+
+static void
+hls_request_finished (SoupMessage *msg, gpointer user_data)
+{
+	DreamHLSrequest *request = user_data;
+	DreamHLSserver *h = request->app->hls_server;
+	GST_DEBUG_OBJECT (h->soupserver, "waiting client for '%s' went away", request->path);
+	h->pending_requests = g_list_remove (h->pending_requests, request);
+	g_signal_handlers_disconnect_by_func (msg, hls_request_finished, request);
+	g_object_unref (msg);
+	hls_request_free (request);
+}
+
+static void
+hls_pause_request (App *app, SoupServer *server, SoupMessage *msg, const char *path, gint msn, gint part, guint timeout)
+{
+	DreamHLSserver *h = app->hls_server;
+	DreamHLSrequest *request = g_new0 (DreamHLSrequest, 1);
+	request->app = app;
+	request->msg = g_object_ref (msg);
+	request->path = g_strdup (path);
+	request->msn = msn;
+	request->part = part;
+	request->playlist = g_strcmp0 (path+1, HLS_PLAYLIST_NAME) == 0;
+	request->id_timeout = g_timeout_add_seconds (timeout, hls_request_timeout, request);
+	GST_DEBUG_OBJECT (server, "holding request for '%s' (msn=%i part=%i)", path, msn, part);
+	h->pending_requests = g_list_append (h->pending_requests, request);
+	g_signal_connect (msg, "finished", G_CALLBACK (hls_request_finished), request);
+	soup_server_pause_message (server, msg);
+}
+
+/* answers and releases a paused request, the caller has already taken it off the pending list */
+static void
+hls_unpause_request (DreamHLSrequest *request, GBytes *bytes, guint status_code)
+{
+	App *app = request->app;
+	if (bytes)
+		hls_respond (app, request->msg, request->path, bytes);
+	else
+		soup_message_set_status (request->msg, status_code);
+	g_signal_handlers_disconnect_by_func (request->msg, hls_request_finished, request);
+	soup_server_unpause_message (app->hls_server->soupserver, request->msg);
+	g_object_unref (request->msg);
+	hls_request_free (request);
+}
+
+/* must be called with the hls mutex held */
+static gboolean hls_store_has (DreamHLSserver *h, gint msn, gint part)
+{
+	if (msn < 0)
+		return h->playlist != NULL;
+	if ((guint) msn < h->sequence)
+		return TRUE;
+	return part >= 0 && (guint) msn == h->sequence && (guint) part < h->parts->len;
+}
+
+static gboolean
+hls_resume_requests (gpointer user_data)
+{
+	App *app = user_data;
+	DreamHLSserver *h = app->hls_server;
+	GList *l, *next;
+
+	g_mutex_lock (&h->mutex);
+	h->id_resume = 0;
+	g_mutex_unlock (&h->mutex);
+
+	if (h->cold_start_begin)
+	{
+		h->cold_start_latency = (g_get_monotonic_time () - h->cold_start_begin) / 1000;
+		h->cold_start_begin = 0;
+		GST_INFO_OBJECT (app, "first hls segment available after %i ms", h->cold_start_latency);
+	}
 
-		if (!assert_state (app, app->pipeline, GST_STATE_PLAYING))
+	for (l = h->pending_requests; l; l = next)
+	{
+		DreamHLSrequest *request = l->data;
+		GBytes *bytes = NULL;
+		guint status_code = SOUP_STATUS_NONE;
+		next = l->next;
+
+		g_mutex_lock (&h->mutex);
+		gboolean ready = request->playlist ? hls_store_has (h, request->msn, request->part) : TRUE;
+		/* a hinted part that didn't make it into its segment before the next keyframe will never exist */
+		gboolean gone = !request->playlist && (guint) request->msn < h->sequence;
+		g_mutex_unlock (&h->mutex);
+
+		if (ready)
+			bytes = hls_store_lookup (h, request->path+1, request->msg->response_headers);
+		if (!bytes && gone)
+			status_code = SOUP_STATUS_NOT_FOUND;
+		if (bytes || status_code)
 		{
-			GST_ERROR_OBJECT (app, "GST_STATE_CHANGE_FAILURE for TCP upstream");
-			return FALSE;
+			h->pending_requests = g_list_delete_link (h->pending_requests, l);
+			hls_unpause_request (request, bytes, status_code);
 		}
-		GST_INFO_OBJECT(app, "enabled TCP upstream! upstreamState = UPSTREAM_STATE_CONNECTING");
-		DREAMRTSPSERVER_UNLOCK (app);
-		return TRUE;
+		if (bytes)
+			g_bytes_unref (bytes);
 	}
-	else
-		GST_INFO_OBJECT (app, "tcp upstream already enabled! (upstreamState = %i)", t->state);
-	return FALSE;
-
-fail:
-	DREAMRTSPSERVER_UNLOCK (app);
-	disable_tcp_upstream(app);
 	return FALSE;
 }
 
-gboolean
-_delete_dir_recursively (GFile *directory, GError **error)
+static void
+hls_fail_requests (App *app, guint status_code)
 {
-	GFileEnumerator *children = NULL;
-	GFileInfo *info;
-	gboolean ret = FALSE;
-	children = g_file_enumerate_children (directory, G_FILE_ATTRIBUTE_STANDARD_NAME "," G_FILE_ATTRIBUTE_STANDARD_TYPE, 0, NULL, error);
-	if (children == NULL || error)
-		goto out;
-	info = g_file_enumerator_next_file (children, NULL, error);
-	while (info || error) {
-		GFile *child;
-		const char *name;
-		GFileType type;
-		if (error)
-			goto out;
-		name = g_file_info_get_name (info);
-		child = g_file_get_child (directory, name);
-		type = g_file_info_get_file_type (info);
-		GST_LOG ("delete %s", name);
-		if (type == G_FILE_TYPE_DIRECTORY)
-			ret = _delete_dir_recursively (child, error);
-		else if (type == G_FILE_TYPE_REGULAR)
-			ret = g_file_delete (child, NULL, error);
-		g_object_unref (info);
-		g_object_unref (child);
-		if (!ret)
-			goto out;
-		info = g_file_enumerator_next_file (children, NULL, error);
+	DreamHLSserver *h = app->hls_server;
+	GList *requests = h->pending_requests;
+	h->pending_requests = NULL;
+	while (requests)
+	{
+		hls_unpause_request (requests->data, NULL, status_code);
+		requests = g_list_delete_link (requests, requests);
 	}
-	ret = TRUE;
-	g_file_delete (directory, NULL, error);
-
-out:
-	if (children)
-		g_object_unref (children);
-	return ret;
 }
 
-gboolean hls_client_timeout (gpointer user_data)
+static gboolean
+hls_request_timeout (gpointer user_data)
 {
-	App *app = user_data;
-	if (app->hls_server)
-	{
-		GST_INFO_OBJECT(app, "HLS clients stopped downloading, stopping hls pipeline!");
-		stop_hls_pipeline (app);
-	}
+	DreamHLSrequest *request = user_data;
+	DreamHLSserver *h = request->app->hls_server;
+	GST_WARNING_OBJECT (h->soupserver, "request for '%s' (msn=%i part=%i) timed out", request->path, request->msn, request->part);
+	request->id_timeout = 0;
+	h->pending_requests = g_list_remove (h->pending_requests, request);
+	hls_unpause_request (request, NULL, SOUP_STATUS_SERVICE_UNAVAILABLE);
 	return FALSE;
 }
 
 static void
-soup_do_get (SoupServer *server, SoupMessage *msg, const char *path, App *app)
+soup_do_get (SoupServer *server, SoupMessage *msg, const char *path, GHashTable *query, App *app)
 {
-	gchar *hlspath = NULL;
+	DreamHLSserver *h = app->hls_server;
 	guint status_code = SOUP_STATUS_NONE;
-	struct stat st;
-
-	if (path)
-	{
-		if (strlen(path) < 1)
-			status_code = SOUP_STATUS_BAD_REQUEST;
-		if (strlen(path) == 1)
-			status_code = SOUP_STATUS_MOVED_PERMANENTLY;
-		else
-			hlspath = g_strdup_printf ("%s%s", HLS_PATH, path);
-	}
-	if (app->hls_server->state == HLS_STATE_IDLE && g_strcmp0 (path+1, HLS_PLAYLIST_NAME) == 0)
+	GBytes *bytes = NULL;
+	gint msn = -1, part = -1;
+	gboolean playlist = path && g_strcmp0 (path+1, HLS_PLAYLIST_NAME) == 0;
+
+	if (!path || strlen(path) < 1)
+		status_code = SOUP_STATUS_BAD_REQUEST;
+	else if (strlen(path) == 1)
+		status_code = SOUP_STATUS_MOVED_PERMANENTLY;
+	else if (h->state == HLS_STATE_IDLE && playlist)
 	{
 		DREAMRTSPSERVER_LOCK (app);
 		GST_INFO_OBJECT (server, "client requested '%s' but we're idle... start pipeline!", path+1);
+		h->cold_start_begin = g_get_monotonic_time ();
 		if (!start_hls_pipeline (app))
 			status_code = SOUP_STATUS_INTERNAL_SERVER_ERROR;
 		else
 		{
-			GstState state;
-			gst_element_get_state (GST_ELEMENT(app->pipeline), &state, NULL, HLS_FRAGMENT_DURATION);
-			g_usleep (G_USEC_PER_SEC * (HLS_FRAGMENT_DURATION+1));
-			app->hls_server->state = HLS_STATE_RUNNING;
+			h->state = HLS_STATE_RUNNING;
 			send_signal (app, "hlsStateChanged", g_variant_new("(i)", HLS_STATE_RUNNING));
 		}
 		DREAMRTSPSERVER_UNLOCK (app);
 	}
-	else if (status_code == SOUP_STATUS_NONE && stat (hlspath, &st) == -1) {
-		if (errno == EPERM)
-			status_code = SOUP_STATUS_FORBIDDEN;
-		else if (errno == ENOENT)
+
+	if (status_code == SOUP_STATUS_NONE && playlist && query && h->low_latency)
+	{
+		const gchar *value;
+		if ((value = g_hash_table_lookup (query, "_HLS_msn")))
+			msn = g_ascii_strtoll (value, NULL, 10);
+		if ((value = g_hash_table_lookup (query, "_HLS_part")))
+			part = g_ascii_strtoll (value, NULL, 10);
+		g_mutex_lock (&h->mutex);
+		if ((part >= 0 && msn < 0) || (msn >= 0 && (guint) msn > h->sequence + 1))
+			status_code = SOUP_STATUS_BAD_REQUEST;
+		else if (msn >= 0 && !hls_store_has (h, msn, part))
+			status_code = SOUP_STATUS_ACCEPTED;
+		g_mutex_unlock (&h->mutex);
+		if (status_code == SOUP_STATUS_ACCEPTED)
+		{
+			hls_pause_request (app, server, msg, path, msn, part, 3*HLS_FRAGMENT_DURATION);
+			return;
+		}
+	}
+
+	if (status_code == SOUP_STATUS_NONE)
+	{
+		guint sequence, index;
+		bytes = hls_store_lookup (h, path+1, msg->response_headers);
+		if (!bytes && h->state == HLS_STATE_RUNNING && playlist)
+		{
+			hls_pause_request (app, server, msg, path, -1, -1, HLS_COLD_START_TIMEOUT);
+			return;
+		}
+		else if (!bytes && sscanf (path+1, HLS_PART_SCAN, &sequence, &index) == 2)
+		{
+			/* blocking preload hint request for the part that is being assembled */
+			g_mutex_lock (&h->mutex);
+			gboolean hinted = sequence == h->sequence && index == h->parts->len;
+			g_mutex_unlock (&h->mutex);
+			if (hinted)
+			{
+				hls_pause_request (app, server, msg, path, sequence, index, 3*HLS_FRAGMENT_DURATION);
+				return;
+			}
+		}
+		if (!bytes)
 			status_code = SOUP_STATUS_NOT_FOUND;
-		else
-			status_code = SOUP_STATUS_INTERNAL_SERVER_ERROR;
 	}
-	else if (S_ISDIR (st.st_mode))
-		status_code = SOUP_STATUS_SERVICE_UNAVAILABLE;
 
 	if (status_code == SOUP_STATUS_MOVED_PERMANENTLY)
 	{
@@ -1779,54 +4883,13 @@ soup_do_get (SoupServer *server, SoupMessage *msg, const char *path, App *app)
 	}
 	else if (status_code != SOUP_STATUS_NONE)
 	{
-		GST_WARNING_OBJECT (server, "client requested '%s', error serving '%s', http status code %i", path, hlspath ? hlspath : "", status_code);
-		g_free (hlspath);
+		GST_WARNING_OBJECT (server, "client requested '%s', http status code %i", path ? path : "", status_code);
 		soup_message_set_status (msg, status_code);
 		return;
 	}
 
-	GST_INFO_OBJECT (server, "client requests '%s', serving '%s'...", path, hlspath);
-
-	if (msg->method == SOUP_METHOD_GET) {
-		GMappedFile *mapping;
-		SoupBuffer *buffer;
-
-		mapping = g_mapped_file_new (hlspath, FALSE, NULL);
-		if (!mapping) {
-			soup_message_set_status (msg, SOUP_STATUS_INTERNAL_SERVER_ERROR);
-			return;
-		}
-
-		if (g_strrstr (hlspath, ".ts"))
-			soup_message_headers_set_content_type (msg->response_headers, "video/MP2T", NULL);
-		else
-		{
-			GstState state;
-			gst_element_get_state (app->asrc, &state, NULL, GST_MSECOND);
-			if (state != GST_STATE_PLAYING)
-			{
-				assert_tsmux (app);
-				if (!assert_state (app, app->pipeline, GST_STATE_PLAYING))
-				{
-					soup_message_set_status (msg, SOUP_STATUS_BAD_GATEWAY);
-					g_free (hlspath);
-					return;
-				}
-			}
-			soup_message_headers_set_content_type (msg->response_headers, "application/x-mpegURL", NULL);
-		}
-		if (app->hls_server->id_timeout)
-			g_source_remove (app->hls_server->id_timeout);
-		app->hls_server->id_timeout = g_timeout_add_seconds (5*HLS_FRAGMENT_DURATION, (GSourceFunc) hls_client_timeout, app);
-
-		buffer = soup_buffer_new_with_owner (g_mapped_file_get_contents (mapping),
-						     g_mapped_file_get_length (mapping),
-						     mapping, (GDestroyNotify)g_mapped_file_unref);
-		soup_message_body_append_buffer (msg->response_body, buffer);
-		soup_buffer_free (buffer);
-	}
-	g_free (hlspath);
-	soup_message_set_status (msg, SOUP_STATUS_OK);
+	hls_respond (app, msg, path, bytes);
+	g_bytes_unref (bytes);
 }
 
 static gboolean
@@ -1849,12 +4912,29 @@ soup_server_callback (SoupServer *server, SoupMessage *msg, const char *path, GH
 {
 	GST_TRACE_OBJECT (server, "%s %s HTTP/1.%d", msg->method, path, soup_message_get_http_version (msg));
 	if (msg->method == SOUP_METHOD_GET)
-		soup_do_get (server, msg, path, (App *) data);
+		soup_do_get (server, msg, path, query, (App *) data);
 	else
 		soup_message_set_status (msg, SOUP_STATUS_NOT_IMPLEMENTED);
 	GST_TRACE_OBJECT (server, "  -> %d %s", msg->status_code, msg->reason_phrase);
 }
 
+static void hls_branch_removed (App *app)
+{
+	DreamHLSserver *h = app->hls_server;
+
+	hls_store_clear (h);
+	update_branch_demand (app);
+
+	if (h->id_timeout)
+		g_source_remove (h->id_timeout);
+	h->id_timeout = 0;
+
+	if (!upstream_active (app, NULL) && g_list_length (app->rtsp_server->clients_list) == 0)
+		halt_source_pipeline(app);
+
+	GST_INFO ("HLS server unlinked!");
+}
+
 static GstPadProbeReturn hls_pad_probe_unlink_cb (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
 {
 	App *app = user_data;
@@ -1862,7 +4942,7 @@ static GstPadProbeReturn hls_pad_probe_unlink_cb (GstPad * pad, GstPadProbeInfo
 
 	GstElement *element = gst_pad_get_parent_element(pad);
 
-	GST_DEBUG_OBJECT(pad, "unlink... %" GST_PTR_FORMAT " and %" GST_PTR_FORMAT, element, h->hlssink);
+	GST_DEBUG_OBJECT(pad, "unlink... %" GST_PTR_FORMAT " and %" GST_PTR_FORMAT, element, h->appsink);
 
 	GstPad *teepad;
 	teepad = gst_pad_get_peer(pad);
@@ -1873,50 +4953,100 @@ static GstPadProbeReturn hls_pad_probe_unlink_cb (GstPad * pad, GstPadProbeInfo
 	gst_object_unref (teepad);
 	gst_object_unref (tee);
 
-	gst_element_unlink (element, h->hlssink);
+	gst_element_unlink (element, h->appsink);
 
-	GST_DEBUG_OBJECT(pad, "remove... %" GST_PTR_FORMAT " and %" GST_PTR_FORMAT, element, h->hlssink);
+	GST_DEBUG_OBJECT(pad, "remove... %" GST_PTR_FORMAT " and %" GST_PTR_FORMAT, element, h->appsink);
 
-	gst_bin_remove_many (GST_BIN (app->pipeline), element, h->hlssink, NULL);
+	gst_bin_remove_many (GST_BIN (app->pipeline), element, h->appsink, NULL);
 
-	GST_DEBUG_OBJECT(pad, "set state null %" GST_PTR_FORMAT " and %" GST_PTR_FORMAT, element, h->hlssink);
+	GST_DEBUG_OBJECT(pad, "set state null %" GST_PTR_FORMAT " and %" GST_PTR_FORMAT, element, h->appsink);
 
-	gst_element_set_state (h->hlssink, GST_STATE_NULL);
+	gst_element_set_state (h->appsink, GST_STATE_NULL);
 	gst_element_set_state (element, GST_STATE_NULL);
 
-	GST_DEBUG_OBJECT(pad, "unref.... %" GST_PTR_FORMAT " and %" GST_PTR_FORMAT, element, h->hlssink);
+	GST_DEBUG_OBJECT(pad, "unref.... %" GST_PTR_FORMAT " and %" GST_PTR_FORMAT, element, h->appsink);
 
 	gst_object_unref (element);
-	gst_object_unref (h->hlssink);
+	gst_object_unref (h->appsink);
 	h->queue = NULL;
-	h->hlssink = NULL;
+	h->appsink = NULL;
+	hls_branch_removed (app);
 
-	if (h->id_timeout)
-		g_source_remove (h->id_timeout);
+	return GST_PAD_PROBE_REMOVE;
+}
 
-	if (app->tcp_upstream->state == UPSTREAM_STATE_DISABLED && g_list_length (app->rtsp_server->clients_list) == 0)
-		halt_source_pipeline(app);
+static GstPadProbeReturn hls_fmp4_unlink_cb (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+	App *app = user_data;
+	DreamHLSfmp4 *f = &app->hls_server->fmp4;
+	GstElement *bin = gst_pad_get_parent_element (pad);
 
-	GST_INFO ("HLS server unlinked!");
+	GST_DEBUG_OBJECT (pad, "unlink and remove %" GST_PTR_FORMAT, bin);
+
+	GstPad *teepad = gst_pad_get_peer (pad);
+	gst_pad_unlink (teepad, pad);
+	GstElement *tee = gst_pad_get_parent_element (teepad);
+	gst_element_release_request_pad (tee, teepad);
+	gst_object_unref (teepad);
+	gst_object_unref (tee);
+
+	gst_bin_remove (GST_BIN (app->pipeline), bin);
+	gst_element_set_state (bin, GST_STATE_NULL);
+
+	/* video and audio branch go idle in their own streaming threads, the last one cleans up */
+	g_mutex_lock (&f->mutex);
+	if (bin == f->vbin)
+		f->vbin = NULL;
+	else
+		f->abin = NULL;
+	gboolean last = !f->vbin && !f->abin;
+	g_mutex_unlock (&f->mutex);
+
+	gst_object_unref (bin);
+	gst_object_unref (bin);
+	if (last)
+		hls_branch_removed (app);
 
 	return GST_PAD_PROBE_REMOVE;
 }
 
+static void hls_fmp4_unlink (App *app, GstElement *bin)
+{
+	GstPad *sinkpad = gst_element_get_static_pad (bin, "sink");
+	gst_object_ref (bin);
+	gst_pad_add_probe (sinkpad, GST_PAD_PROBE_TYPE_IDLE, hls_fmp4_unlink_cb, app, NULL);
+	gst_object_unref (sinkpad);
+}
+
 gboolean stop_hls_pipeline(App *app)
 {
 	GST_INFO_OBJECT(app, "stop_hls_pipeline");
 	DreamHLSserver *h = app->hls_server;
 	if (h->state == HLS_STATE_RUNNING)
 	{
+		hls_fail_requests (app, SOUP_STATUS_SERVICE_UNAVAILABLE);
 		DREAMRTSPSERVER_LOCK (app);
 		h->state = HLS_STATE_IDLE;
 		send_signal (app, "hlsStateChanged", g_variant_new("(i)", HLS_STATE_IDLE));
-		gst_object_ref (h->queue);
-		gst_object_ref (h->hlssink);
-		GstPad *sinkpad;
-		sinkpad = gst_element_get_static_pad (h->queue, "sink");
-		gst_pad_add_probe (sinkpad, GST_PAD_PROBE_TYPE_IDLE, hls_pad_probe_unlink_cb, app, NULL);
-		gst_object_unref (sinkpad);
+		if (h->session_format == HLS_FORMAT_FMP4)
+		{
+			/* after a failed start there may be one branch or none at all */
+			if (h->fmp4.vbin)
+				hls_fmp4_unlink (app, h->fmp4.vbin);
+			if (h->fmp4.abin)
+				hls_fmp4_unlink (app, h->fmp4.abin);
+			if (!h->fmp4.vbin && !h->fmp4.abin)
+				hls_branch_removed (app);
+		}
+		else
+		{
+			gst_object_ref (h->queue);
+			gst_object_ref (h->appsink);
+			GstPad *sinkpad;
+			sinkpad = gst_element_get_static_pad (h->queue, "sink");
+			gst_pad_add_probe (sinkpad, GST_PAD_PROBE_TYPE_IDLE, hls_pad_probe_unlink_cb, app, NULL);
+			gst_object_unref (sinkpad);
+		}
 		DREAMRTSPSERVER_UNLOCK (app);
 		GST_INFO("hls server pipeline stopped, set HLS_STATE_IDLE");
 		return TRUE;
@@ -1943,9 +5073,7 @@ gboolean disable_hls_server(App *app)
 			g_free(h->hls_pass);
 		}
 		g_object_unref (h->soupserver);
-		GFile *tmp_dir_file = g_file_new_for_path (HLS_PATH);
-		_delete_dir_recursively (tmp_dir_file, NULL);
-		g_object_unref (tmp_dir_file);
+		hls_store_clear (h);
 		h->state = HLS_STATE_DISABLED;
 		send_signal (app, "hlsStateChanged", g_variant_new("(i)", HLS_STATE_DISABLED));
 		DREAMRTSPSERVER_UNLOCK (app);
@@ -1996,13 +5124,6 @@ gboolean enable_hls_server(App *app, guint port, const gchar *user, const gchar
 
 	if (h->state == HLS_STATE_DISABLED)
 	{
-		int r = mkdir (HLS_PATH, DEFFILEMODE);
-		if (r == -1 && errno != EEXIST)
-		{
-			g_error ("Failed to create HLS server directory '%s': %s (%i)", HLS_PATH, strerror(errno), errno);
-			goto fail;
-		}
-
 		h->port = port;
 
 #if SOUP_CHECK_VERSION(2,48,0)
@@ -2065,6 +5186,81 @@ fail:
 
 }
 
+static gboolean hls_fmp4_link (App *app, GstElement *tee, GstElement **bin, const gchar *description, const gchar *sinkname, GstAppSinkCallbacks *callbacks, const gchar *queuename, DreamFrameQueue *frames)
+{
+	GError *error = NULL;
+
+	*bin = gst_parse_bin_from_description (description, TRUE, &error);
+	if (!*bin)
+	{
+		GST_ERROR_OBJECT (app, "couldn't create hls branch '%s': %s", description, error ? error->message : "");
+		g_clear_error (&error);
+		return FALSE;
+	}
+
+	GstElement *appsink = gst_bin_get_by_name (GST_BIN (*bin), sinkname);
+	gst_app_sink_set_callbacks (GST_APP_SINK (appsink), callbacks, app, NULL);
+	gst_object_unref (appsink);
+	GstElement *queue = gst_bin_get_by_name (GST_BIN (*bin), queuename);
+	frame_queue_attach (frames, queue);
+	gst_object_unref (queue);
+
+	gst_bin_add (GST_BIN (app->pipeline), *bin);
+	gst_element_set_state (*bin, GST_STATE_PLAYING);
+
+	GstPad *teepad, *sinkpad;
+	GstPadLinkReturn ret;
+	teepad = gst_element_get_request_pad (tee, "src_%u");
+	sinkpad = gst_element_get_static_pad (*bin, "sink");
+	ret = gst_pad_link (teepad, sinkpad);
+	gst_object_unref (sinkpad);
+	if (ret != GST_PAD_LINK_OK)
+	{
+		GST_ERROR_OBJECT (app, "couldn't link %" GST_PTR_FORMAT " to hls branch %" GST_PTR_FORMAT, tee, *bin);
+		gst_element_release_request_pad (tee, teepad);
+		gst_object_unref (teepad);
+		gst_element_set_state (*bin, GST_STATE_NULL);
+		gst_bin_remove (GST_BIN (app->pipeline), *bin);
+		*bin = NULL;
+		return FALSE;
+	}
+	gst_object_unref (teepad);
+	return TRUE;
+}
+
+/* fragmented mp4 segments are muxed from the elementary streams, the transport stream muxer isn't needed for them */
+static gboolean start_hls_fmp4_pipeline (App *app)
+{
+	DreamHLSserver *h = app->hls_server;
+	GstAppSinkCallbacks vcallbacks = { .new_sample = hls_fmp4_new_video_sample };
+	GstAppSinkCallbacks acallbacks = { .new_sample = hls_fmp4_new_audio_sample };
+
+	h->segment_low_latency = FALSE;
+	gchar *vdesc = g_strdup_printf ("queue name=" HLS_VQUEUE " leaky=2 max-size-buffers=0 max-size-bytes=0 max-size-time=%" G_GUINT64_FORMAT " ! h264parse ! video/x-h264,stream-format=avc,alignment=au ! appsink name=" HLS_VAPPSINK " enable-last-sample=false sync=false", 2*h->fmp4.vframes.max_age);
+	gchar *adesc = g_strdup_printf ("queue name=" HLS_AQUEUE " leaky=2 max-size-buffers=0 max-size-bytes=0 max-size-time=%" G_GUINT64_FORMAT " ! aacparse ! audio/mpeg,mpegversion=4,stream-format=raw ! appsink name=" HLS_AAPPSINK " enable-last-sample=false sync=false", 2*h->fmp4.aframes.max_age);
+	gboolean linked = hls_fmp4_link (app, app->vtee, &h->fmp4.vbin, vdesc, HLS_VAPPSINK, &vcallbacks, HLS_VQUEUE, &h->fmp4.vframes) &&
+			  hls_fmp4_link (app, app->atee, &h->fmp4.abin, adesc, HLS_AAPPSINK, &acallbacks, HLS_AQUEUE, &h->fmp4.aframes);
+	g_free (vdesc);
+	g_free (adesc);
+	if (!linked)
+		return FALSE;
+
+	update_branch_demand (app);
+
+	if (upstream_active (app, NULL) && !upstream_consuming (app, NULL))
+		unpause_source_pipeline(app);
+
+	if (!assert_state (app, app->pipeline, GST_STATE_PLAYING))
+	{
+		GST_ERROR_OBJECT (app, "GST_STATE_CHANGE_FAILURE for hls pipeline");
+		return FALSE;
+	}
+
+	request_keyframe (app, KEYFRAME_REASON_HLS_START);
+	GST_DEBUG_BIN_TO_DOT_FILE(GST_BIN(app->pipeline),GST_DEBUG_GRAPH_SHOW_ALL,"start_hls_server");
+	return TRUE;
+}
+
 gboolean start_hls_pipeline(App* app)
 {
 	GST_DEBUG_OBJECT (app, "start_hls_pipeline");
@@ -2076,31 +5272,38 @@ gboolean start_hls_pipeline(App* app)
 		return FALSE;
 	}
 
-	assert_tsmux (app);
+	if (app->source_idle)
+		resume_idle_source (app, KEYFRAME_REASON_HLS_START);
+
+	h->session_format = h->format;
+	if (h->session_format == HLS_FORMAT_FMP4)
+		return start_hls_fmp4_pipeline (app);
 
 	h->queue = gst_element_factory_make ("queue", "hlsqueue");
-	h->hlssink = gst_element_factory_make ("hlssink", "hlssink");
-	if (!(h->hlssink && h->queue))
+	h->appsink = gst_element_factory_make ("appsink", HLS_APPSINK);
+	if (!(h->appsink && h->queue))
 	{
-		g_error ("Failed to create HLS pipeline element(s):%s%s", h->hlssink?"":" hlssink", h->queue?"":" queue");
+		g_error ("Failed to create HLS pipeline element(s):%s%s", h->appsink?"":" appsink", h->queue?"":" queue");
 		return FALSE;
 	}
 
-	gchar *frag_location, *playlist_location;
-	frag_location = g_strdup_printf ("%s/%s", HLS_PATH, HLS_FRAGMENT_NAME);
-	playlist_location = g_strdup_printf ("%s/%s", HLS_PATH, HLS_PLAYLIST_NAME);
-
-	g_object_set (G_OBJECT (h->hlssink), "target-duration", HLS_FRAGMENT_DURATION, NULL);
-	g_object_set (G_OBJECT (h->hlssink), "location", frag_location, NULL);
-	g_object_set (G_OBJECT (h->hlssink), "playlist-location", playlist_location, NULL);
-	g_object_set (G_OBJECT (h->queue), "leaky", 2, "max-size-buffers", 0, "max-size-bytes", 0, "max-size-time", G_GINT64_CONSTANT(5)*GST_SECOND, NULL);
+	GstAppSinkCallbacks callbacks = { .new_sample = hls_new_sample };
+	g_object_set (G_OBJECT (h->appsink), "emit-signals", FALSE, "enable-last-sample", FALSE, "sync", FALSE, NULL);
+	gst_app_sink_set_callbacks (GST_APP_SINK (h->appsink), &callbacks, app, NULL);
+	g_object_set (G_OBJECT (h->queue), "leaky", 2, "max-size-buffers", 0, "max-size-bytes", 0, "max-size-time", 2*h->frames.max_age, NULL);
+	frame_queue_attach (&h->frames, h->queue);
 
-	gst_bin_add_many (GST_BIN (app->pipeline), h->queue, h->hlssink,  NULL);
-	gst_element_link (h->queue, h->hlssink);
+	gst_bin_add_many (GST_BIN (app->pipeline), h->queue, h->appsink,  NULL);
+	gst_element_link (h->queue, h->appsink);
 
-	if (!assert_state (app, h->hlssink, GST_STATE_READY) || !assert_state (app, h->queue, GST_STATE_PLAYING))
+	if (!assert_state (app, h->appsink, GST_STATE_READY) || !assert_state (app, h->queue, GST_STATE_PLAYING))
 		return FALSE;
 
+	g_mutex_lock (&h->mutex);
+	h->priming = TRUE;
+	h->primed_until = GST_CLOCK_TIME_NONE;
+	g_mutex_unlock (&h->mutex);
+
 	GstPad *teepad, *sinkpad;
 	GstPadLinkReturn ret;
 	teepad = gst_element_get_request_pad (app->tstee, "src_%u");
@@ -2114,11 +5317,20 @@ gboolean start_hls_pipeline(App* app)
 	gst_object_unref (teepad);
 	gst_object_unref (sinkpad);
 
-	if (app->tcp_upstream->state == UPSTREAM_STATE_WAITING)
+	update_branch_demand (app);
+
+	/* start the first segment from the cached GOP instead of waiting for the next keyframe */
+	GList *cached = gop_cache_get (app, BRIDGE_TS);
+	g_mutex_lock (&h->mutex);
+	h->prime = cached;
+	h->priming = FALSE;
+	g_mutex_unlock (&h->mutex);
+
+	if (upstream_active (app, NULL) && !upstream_consuming (app, NULL))
 		unpause_source_pipeline(app);
 
-	GstStateChangeReturn sret = gst_element_set_state (h->hlssink, GST_STATE_PLAYING);
-	GST_DEBUG_OBJECT(app, "explicitely bring hlssink to GST_STATE_PLAYING = %i", sret);
+	GstStateChangeReturn sret = gst_element_set_state (h->appsink, GST_STATE_PLAYING);
+	GST_DEBUG_OBJECT(app, "explicitely bring hls appsink to GST_STATE_PLAYING = %i", sret);
 
 	if (!assert_state (app, app->pipeline, GST_STATE_PLAYING))
 	{
@@ -2126,6 +5338,7 @@ gboolean start_hls_pipeline(App* app)
 		return FALSE;
 	}
 
+	request_keyframe (app, KEYFRAME_REASON_HLS_START);
 	GST_DEBUG_BIN_TO_DOT_FILE(GST_BIN(app->pipeline),GST_DEBUG_GRAPH_SHOW_ALL,"start_hls_server");
 	return TRUE;
 }
@@ -2136,7 +5349,43 @@ DreamHLSserver *create_hls_server(App *app)
 	send_signal (app, "hlsStateChanged", g_variant_new("(i)", HLS_STATE_DISABLED));
 	h->state = HLS_STATE_DISABLED;
 	h->queue = NULL;
-	h->hlssink = NULL;
+	h->appsink = NULL;
+	frame_queue_init (&h->frames, "hls", FRAME_QUEUE_TS, latency_profiles[app->latency_profile].hls_age);
+	h->format = h->session_format = HLS_FORMAT_TS;
+	h->fmp4.vbin = h->fmp4.abin = NULL;
+	frame_queue_init (&h->fmp4.vframes, "hls-video", FRAME_QUEUE_VIDEO, latency_profiles[app->latency_profile].hls_age);
+	frame_queue_init (&h->fmp4.aframes, "hls-audio", FRAME_QUEUE_AUDIO, latency_profiles[app->latency_profile].hls_age);
+	h->fmp4.vcaps = h->fmp4.acaps = NULL;
+	g_queue_init (&h->fmp4.vsamples);
+	g_queue_init (&h->fmp4.asamples);
+	h->fmp4.start = GST_CLOCK_TIME_NONE;
+	h->fmp4.fragment_sequence = 0;
+	h->fmp4.audio_track = FALSE;
+	g_mutex_init (&h->fmp4.mutex);
+	h->init = NULL;
+	h->init_headers = NULL;
+	g_queue_init (&h->segments);
+	h->playlist = NULL;
+	h->playlist_headers = NULL;
+	g_mutex_init (&h->mutex);
+	h->pending = NULL;
+	h->pending_start = GST_CLOCK_TIME_NONE;
+	h->sequence = 0;
+	h->pmt_pid = 0;
+	h->have_pat = h->have_pmt = FALSE;
+	h->prime = NULL;
+	h->priming = FALSE;
+	h->primed_until = GST_CLOCK_TIME_NONE;
+	h->pending_requests = NULL;
+	h->id_resume = 0;
+	h->parts = g_ptr_array_new_with_free_func ((GDestroyNotify) hls_part_free);
+	h->part_offset = 0;
+	h->part_start = GST_CLOCK_TIME_NONE;
+	h->part_independent = FALSE;
+	h->low_latency = h->segment_low_latency = FALSE;
+	h->id_timeout = 0;
+	h->cold_start_begin = 0;
+	h->cold_start_latency = -1;
 	return h;
 }
 
@@ -2148,8 +5397,17 @@ DreamRTSPserver *create_rtsp_server(App *app)
 	r->server = NULL;
 	r->ts_factory = r->es_factory = NULL;
 	r->ts_media = r->es_media = NULL;
-	r->ts_appsrc = r->es_aappsrc = r->es_vappsrc = NULL;
+	r->ts_pacer = r->es_pacer = NULL;
+	r->pacing_rate = RTSP_PACING_RATE;
+	r->client_queue_limit = RTSP_CLIENT_QUEUE_LIMIT;
+	r->client_queue_policy = RTSP_CLIENT_QUEUE_POLICY;
+	rtsp_bridge_init (app, &r->bridge[BRIDGE_AUDIO], BRIDGE_AUDIO);
+	rtsp_bridge_init (app, &r->bridge[BRIDGE_VIDEO], BRIDGE_VIDEO);
+	rtsp_bridge_init (app, &r->bridge[BRIDGE_TS], BRIDGE_TS);
 	r->clients_list = NULL;
+	g_mutex_init (&r->start_mutex);
+	r->rtsp_start_pts = r->rtsp_start_dts = GST_CLOCK_TIME_NONE;
+	r->clients_count = 0;
 	return r;
 }
 
@@ -2168,80 +5426,13 @@ gboolean enable_rtsp_server(App *app, const gchar *path, guint32 port, const gch
 
 	if (r->state == RTSP_STATE_DISABLED)
 	{
-		r->artspq = gst_element_factory_make ("queue", "rtspaudioqueue");
-		r->vrtspq = gst_element_factory_make ("queue", "rtspvideoqueue");
-		r->aappsink = gst_element_factory_make ("appsink", AAPPSINK);
-		r->vappsink = gst_element_factory_make ("appsink", VAPPSINK);
-
-		g_object_set (G_OBJECT (r->artspq), "leaky", 2, "max-size-buffers", 0, "max-size-bytes", 0, "max-size-time", G_GINT64_CONSTANT(5)*GST_SECOND, NULL);
-		g_object_set (G_OBJECT (r->vrtspq), "leaky", 2, "max-size-buffers", 0, "max-size-bytes", 0, "max-size-time", G_GINT64_CONSTANT(5)*GST_SECOND, NULL);
-
-		g_object_set (G_OBJECT (r->aappsink), "emit-signals", TRUE, NULL);
-		g_object_set (G_OBJECT (r->aappsink), "enable-last-sample", FALSE, NULL);
-		g_signal_connect (r->aappsink, "new-sample", G_CALLBACK (handover_payload), app);
-
-		g_object_set (G_OBJECT (r->vappsink), "emit-signals", TRUE, NULL);
-		g_object_set (G_OBJECT (r->vappsink), "enable-last-sample", FALSE, NULL);
-		g_signal_connect (r->vappsink, "new-sample", G_CALLBACK (handover_payload), app);
-
-		r->tsrtspq = gst_element_factory_make ("queue", "tsrtspqueue");
-		r->tsappsink = gst_element_factory_make ("appsink", TSAPPSINK);
-
-		g_object_set (G_OBJECT (r->tsrtspq), "leaky", 2, "max-size-buffers", 0, "max-size-bytes", 0, "max-size-time", G_GINT64_CONSTANT(5)*GST_SECOND, NULL);
-
-		g_object_set (G_OBJECT (r->tsappsink), "emit-signals", TRUE, NULL);
-		g_object_set (G_OBJECT (r->tsappsink), "enable-last-sample", FALSE, NULL);
-		g_signal_connect (r->tsappsink, "new-sample", G_CALLBACK (handover_payload), app);
-
-		gst_bin_add_many (GST_BIN (app->pipeline), r->artspq, r->vrtspq, r->aappsink, r->vappsink,  NULL);
-		gst_element_link (r->artspq, r->aappsink);
-		gst_element_link (r->vrtspq, r->vappsink);
-
-		gst_bin_add_many (GST_BIN (app->pipeline), r->tsrtspq, r->tsappsink,  NULL);
-		gst_element_link (r->tsrtspq, r->tsappsink);
-
-		GstState targetstate = GST_STATE_READY;
-
-		if (!assert_state (app, r->tsappsink, targetstate) || !assert_state (app, r->aappsink, targetstate) || !assert_state (app, r->vappsink, targetstate))
-			goto fail;
-
-		if (!assert_state (app, r->tsrtspq, targetstate) || !assert_state (app, r->artspq, targetstate) || !assert_state (app, r->vrtspq, targetstate))
-			goto fail;
-
-		GstPad *teepad, *sinkpad;
-		GstPadLinkReturn ret;
-		teepad = gst_element_get_request_pad (app->atee, "src_%u");
-		sinkpad = gst_element_get_static_pad (r->artspq, "sink");
-		ret = gst_pad_link (teepad, sinkpad);
-		if (ret != GST_PAD_LINK_OK)
-		{
-			GST_ERROR_OBJECT (app, "couldn't link %" GST_PTR_FORMAT " ! %" GST_PTR_FORMAT "", teepad, sinkpad);
-			goto fail;
-		}
-		gst_object_unref (teepad);
-		gst_object_unref (sinkpad);
-		teepad = gst_element_get_request_pad (app->vtee, "src_%u");
-		sinkpad = gst_element_get_static_pad (r->vrtspq, "sink");
-		ret = gst_pad_link (teepad, sinkpad);
-		if (ret != GST_PAD_LINK_OK)
-		{
-			GST_ERROR_OBJECT (app, "couldn't link %" GST_PTR_FORMAT " ! %" GST_PTR_FORMAT "", teepad, sinkpad);
-			goto fail;
-		}
-		gst_object_unref (teepad);
-		gst_object_unref (sinkpad);
-		teepad = gst_element_get_request_pad (app->tstee, "src_%u");
-		sinkpad = gst_element_get_static_pad (r->tsrtspq, "sink");
-		ret = gst_pad_link (teepad, sinkpad);
-		if (ret != GST_PAD_LINK_OK)
-		{
-			GST_ERROR_OBJECT (app, "couldn't link %" GST_PTR_FORMAT " ! %" GST_PTR_FORMAT "", teepad, sinkpad);
+		if (!rtsp_bridge_create (app, &r->bridge[BRIDGE_AUDIO], app->atee) ||
+		    !rtsp_bridge_create (app, &r->bridge[BRIDGE_VIDEO], app->vtee) ||
+		    !rtsp_bridge_create (app, &r->bridge[BRIDGE_TS], app->tstee))
 			goto fail;
-		}
-		gst_object_unref (teepad);
-		gst_object_unref (sinkpad);
 
-		if (app->tcp_upstream->state != UPSTREAM_STATE_DISABLED || app->hls_server->state != HLS_STATE_DISABLED)
+		GstState targetstate = GST_STATE_READY;
+		if (upstream_active (app, NULL) || app->hls_server->state != HLS_STATE_DISABLED)
 			targetstate = GST_STATE_PLAYING;
 
 		if (!assert_state (app, app->pipeline, targetstate))
@@ -2257,7 +5448,7 @@ gboolean enable_rtsp_server(App *app, const gchar *path, guint32 port, const gch
 		g_signal_connect (r->es_factory, "media-configure", (GCallback) media_configure, app);
 
 		r->ts_factory = gst_dream_rtsp_media_factory_new ();
-		gst_rtsp_media_factory_set_launch (GST_RTSP_MEDIA_FACTORY (r->ts_factory), "( appsrc name=" TS_APPSRC " ! queue ! rtpmp2tpay name=pay0 pt=96 )");
+		gst_rtsp_media_factory_set_launch (GST_RTSP_MEDIA_FACTORY (r->ts_factory), latency_profiles[app->latency_profile].ts_queue ? TS_LAUNCH_QUEUED : TS_LAUNCH_DIRECT);
 		gst_rtsp_media_factory_set_shared (GST_RTSP_MEDIA_FACTORY (r->ts_factory), TRUE);
 
 		g_signal_connect (r->ts_factory, "media-configure", (GCallback) media_configure, app);
@@ -2335,7 +5526,10 @@ gboolean start_rtsp_pipeline(App* app)
 		return FALSE;
 	}
 
-	assert_tsmux (app);
+	/* an idled encoder only trickles and its output is dropped, every new consumer needs it back */
+	if (app->source_idle)
+		resume_idle_source (app, KEYFRAME_REASON_RTSP_JOIN);
+
 	if (!assert_state (app, app->pipeline, GST_STATE_PLAYING))
 	{
 		GST_ERROR_OBJECT (app, "GST_STATE_CHANGE_FAILURE for rtsp pipeline");
@@ -2439,6 +5633,9 @@ gboolean halt_source_pipeline(App* app)
 {
 	GST_INFO_OBJECT(app, "halt_source_pipeline...");
 	GST_DEBUG_BIN_TO_DOT_FILE(GST_BIN(app->pipeline),GST_DEBUG_GRAPH_SHOW_ALL,"halt_source_pipeline_pre");
+	gop_cache_flush (&app->gop_cache);
+	branch_gate_set (&app->agate, FALSE);
+	branch_gate_set (&app->vgate, FALSE);
 	GstPad *sinkpad;
 	gst_object_ref (app->aq);
 	sinkpad = gst_element_get_static_pad (app->aq, "sink");
@@ -2447,10 +5644,68 @@ gboolean halt_source_pipeline(App* app)
 	return TRUE;
 }
 
+static GstPadProbeReturn idle_audio_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+	App *app = user_data;
+	return app->source_idle ? GST_PAD_PROBE_DROP : GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn idle_video_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+	App *app = user_data;
+	if (app->source_idle)
+		return GST_PAD_PROBE_DROP;
+	if (app->idle_wait_keyframe)
+	{
+		if (GST_BUFFER_FLAG_IS_SET (GST_PAD_PROBE_INFO_BUFFER (info), GST_BUFFER_FLAG_DELTA_UNIT))
+			return GST_PAD_PROBE_DROP;
+		GST_DEBUG_OBJECT (app, "first keyframe after idling");
+		app->idle_wait_keyframe = FALSE;
+	}
+	return GST_PAD_PROBE_OK;
+}
+
+/* WAITING_POLICY_IDLE keeps the encoders running at a trickle and discards their output instead of pausing them, resuming then only takes a keyframe */
+static gboolean idle_source_pipeline (App *app)
+{
+	if (app->source_idle)
+		return TRUE;
+	get_source_properties (app);
+	app->idle_restore = app->source_properties;
+	app->source_idle = TRUE;
+	GST_INFO_OBJECT (app, "idling encoder at %i kbit/s and %i fps instead of pausing (configured %i kbit/s, %u fps)", SOURCE_IDLE_VIDEO_BITRATE, SOURCE_IDLE_FRAMERATE,
+			 app->idle_restore.videoBitrate, app->idle_restore.framerate);
+	g_object_set (G_OBJECT (app->vsrc), "bitrate", SOURCE_IDLE_VIDEO_BITRATE, NULL);
+	if (app->idle_restore.framerate > SOURCE_IDLE_FRAMERATE)
+		gst_set_framerate (app, SOURCE_IDLE_FRAMERATE);
+	return TRUE;
+}
+
+static void resume_idle_source (App *app, keyframeReason reason)
+{
+	gint32 bitrate = 0;
+	guint32 framerate = 0;
+
+	/* whatever was changed over dbus meanwhile stays */
+	g_object_get (G_OBJECT (app->vsrc), "bitrate", &bitrate, NULL);
+	gst_get_capsprop (app, app->vsrc, "framerate", &framerate);
+	GST_INFO_OBJECT (app, "resuming idle encoder at %i kbit/s and %u fps", app->idle_restore.videoBitrate, app->idle_restore.framerate);
+	if (bitrate == SOURCE_IDLE_VIDEO_BITRATE && app->idle_restore.videoBitrate)
+		g_object_set (G_OBJECT (app->vsrc), "bitrate", app->idle_restore.videoBitrate, NULL);
+	if (framerate == SOURCE_IDLE_FRAMERATE && app->idle_restore.framerate > SOURCE_IDLE_FRAMERATE)
+		gst_set_framerate (app, app->idle_restore.framerate);
+	get_source_properties (app);
+	app->idle_wait_keyframe = TRUE;
+	app->source_idle = FALSE;
+	request_keyframe (app, reason);
+}
+
 gboolean pause_source_pipeline(App* app)
 {
 	if (app->rtsp_server->state <= RTSP_STATE_IDLE && app->hls_server->state == HLS_STATE_DISABLED)
 	{
+		if (app->waiting_policy == WAITING_POLICY_IDLE)
+			return idle_source_pipeline (app);
 		GST_INFO_OBJECT(app, "pause_source_pipeline... setting sources to GST_STATE_PAUSED rtsp_server->state=%i hls_server->state=%i", app->rtsp_server->state, app->hls_server->state);
 		if (gst_element_set_state (app->asrc, GST_STATE_PAUSED) != GST_STATE_CHANGE_NO_PREROLL || gst_element_set_state (app->vsrc, GST_STATE_PAUSED) != GST_STATE_CHANGE_NO_PREROLL)
 		{
@@ -2465,6 +5720,11 @@ gboolean pause_source_pipeline(App* app)
 
 gboolean unpause_source_pipeline(App* app)
 {
+	if (app->source_idle)
+	{
+		resume_idle_source (app, KEYFRAME_REASON_UPSTREAM_RESUME);
+		return TRUE;
+	}
 	GST_INFO_OBJECT(app, "unpause_source_pipeline... setting sources to GST_STATE_PLAYING");
 	if (gst_element_set_state (app->asrc, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE || gst_element_set_state (app->vsrc, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE)
 	{
@@ -2509,6 +5769,7 @@ GstRTSPFilterResult remove_client_filter_func (GstRTSPServer *server, GstRTSPCli
 	GList *session_filter_res;
 	GstRTSPFilterResult res = GST_RTSP_FILTER_KEEP;
 	int ret = g_signal_handlers_disconnect_by_func(client, (GCallback) client_closed, app);
+	g_signal_handlers_disconnect_by_func(client, (GCallback) client_queue_skipped, app);
 	GST_INFO("client_filter_func %" GST_PTR_FORMAT "  (number of clients: %i). disconnected %i callback handlers", client, g_list_length(app->rtsp_server->clients_list), ret);
 	session_filter_res = gst_rtsp_client_session_filter (client, remove_session_filter_func, app);
 	if (g_list_length (session_filter_res) == 0) {
@@ -2521,20 +5782,16 @@ GstRTSPFilterResult remove_client_filter_func (GstRTSPServer *server, GstRTSPCli
 
 static GstPadProbeReturn rtsp_pad_probe_unlink_cb (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
 {
-	App *app = user_data;
-	DreamRTSPserver *r = app->rtsp_server;
+	DreamRTSPbridge *b = user_data;
+	App *app = b->app;
 
-	GstElement *element = gst_pad_get_parent_element(pad);
-	GstElement *appsink = NULL;
-	if (element == r->vrtspq)
-		appsink = r->vappsink;
-	else if (element == r->artspq)
-		appsink = r->aappsink;
-	else if (element == r->tsrtspq)
-		appsink = r->tsappsink;
+	GstElement *element = b->queue;
+	GstElement *appsink = b->appsink;
 
 	GST_DEBUG_OBJECT(pad, "unlink... %" GST_PTR_FORMAT " and %" GST_PTR_FORMAT, element, appsink);
 
+	branch_gate_detach (&b->gate);
+
 	GstPad *teepad;
 	teepad = gst_pad_get_peer(pad);
 	gst_pad_unlink (teepad, pad);
@@ -2559,13 +5816,16 @@ static GstPadProbeReturn rtsp_pad_probe_unlink_cb (GstPad * pad, GstPadProbeInfo
 
 	gst_object_unref (element);
 	gst_object_unref (appsink);
-	element = NULL;
-	appsink = NULL;
+	b->queue = NULL;
+	b->appsink = NULL;
+	rtsp_bridge_set_appsrc (b, NULL, NULL);
+
+	GST_INFO("rtsp bridge %s disabled!", rtsp_bridge_queue_names[b->type]);
 
-	if (!r->tsappsink && !r->aappsink && !r->vappsink)
+	DreamRTSPserver *r = app->rtsp_server;
+	if (!r->bridge[BRIDGE_AUDIO].queue && !r->bridge[BRIDGE_VIDEO].queue && !r->bridge[BRIDGE_TS].queue)
 	{
-		GST_INFO("!r->tsappsink && !r->aappsink && !r->vappsink");
-		if (app->tcp_upstream->state == UPSTREAM_STATE_DISABLED && app->hls_server->state == HLS_STATE_DISABLED)
+		if (!upstream_active (app, NULL) && app->hls_server->state == HLS_STATE_DISABLED)
 			halt_source_pipeline(app);
 		GST_INFO("local rtsp server disabled!");
 	}
@@ -2600,23 +5860,18 @@ gboolean disable_rtsp_server(App *app)
 		send_signal (app, "rtspStateChanged", g_variant_new("(i)", RTSP_STATE_DISABLED));
 		r->state = RTSP_STATE_DISABLED;
 
-		gst_object_ref (r->tsrtspq);
-		gst_object_ref (r->artspq);
-		gst_object_ref (r->vrtspq);
-		gst_object_ref (r->tsappsink);
-		gst_object_ref (r->aappsink);
-		gst_object_ref (r->vappsink);
-
-		GstPad *sinkpad;
-		sinkpad = gst_element_get_static_pad (r->tsrtspq, "sink");
-		gst_pad_add_probe (sinkpad, GST_PAD_PROBE_TYPE_IDLE, rtsp_pad_probe_unlink_cb, app, NULL);
-		gst_object_unref (sinkpad);
-		sinkpad = gst_element_get_static_pad (r->artspq, "sink");
-		gst_pad_add_probe (sinkpad, GST_PAD_PROBE_TYPE_IDLE, rtsp_pad_probe_unlink_cb, app, NULL);
-		gst_object_unref (sinkpad);
-		sinkpad = gst_element_get_static_pad (r->vrtspq, "sink");
-		gst_pad_add_probe (sinkpad, GST_PAD_PROBE_TYPE_IDLE, rtsp_pad_probe_unlink_cb, app, NULL);
-		gst_object_unref (sinkpad);
+		bridgeType type;
+		for (type = BRIDGE_AUDIO; type < BRIDGE_COUNT; type++)
+		{
+			DreamRTSPbridge *b = &r->bridge[type];
+			if (!b->queue)
+				continue;
+			gst_object_ref (b->queue);
+			gst_object_ref (b->appsink);
+			GstPad *sinkpad = gst_element_get_static_pad (b->queue, "sink");
+			gst_pad_add_probe (sinkpad, GST_PAD_PROBE_TYPE_IDLE, rtsp_pad_probe_unlink_cb, b, NULL);
+			gst_object_unref (sinkpad);
+		}
 
 		DREAMRTSPSERVER_UNLOCK (app);
 		GST_INFO("rtsp_server disabled! set RTSP_STATE_DISABLED");
@@ -2627,8 +5882,8 @@ gboolean disable_rtsp_server(App *app)
 
 static GstPadProbeReturn upstream_pad_probe_unlink_cb (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
 {
-	App *app = user_data;
-	DreamTCPupstream *t = app->tcp_upstream;
+	DreamTCPupstream *t = user_data;
+	App *app = t->app;
 
 	GstElement *element = gst_pad_get_parent_element(pad);
 
@@ -2644,12 +5899,27 @@ static GstPadProbeReturn upstream_pad_probe_unlink_cb (GstPad * pad, GstPadProbe
 			return GST_PAD_PROBE_REMOVE;
 		}
 		GST_DEBUG_OBJECT (pad, "GST_PAD_PROBE_TYPE_IDLE -> unlink and remove tcpsink");
-		gst_pad_unlink (teepad, pad);
-
-		GstElement *tee = gst_pad_get_parent_element(teepad);
-		gst_element_release_request_pad (tee, teepad);
 		gst_object_unref (teepad);
-		gst_object_unref (tee);
+
+		/* a compact session hangs off the audio and video tees through its muxer */
+		if (t->compactmux)
+		{
+			GstPad *muxpad;
+			gst_element_unlink (t->compactmux, t->tstcpq);
+			muxpad = gst_element_get_static_pad (t->compactmux, "audio");
+			upstream_unlink_tee (muxpad);
+			gst_object_unref (muxpad);
+			muxpad = gst_element_get_static_pad (t->compactmux, "video");
+			upstream_unlink_tee (muxpad);
+			gst_object_unref (muxpad);
+			gst_object_ref (t->compactmux);
+			gst_bin_remove (GST_BIN (app->pipeline), t->compactmux);
+			gst_element_set_state (t->compactmux, GST_STATE_NULL);
+			gst_object_unref (t->compactmux);
+			t->compactmux = NULL;
+		}
+		else
+			upstream_unlink_tee (pad);
 
 		gst_object_ref (t->tcpsink);
 		gst_element_unlink (t->tstcpq, t->tcpsink);
@@ -2663,25 +5933,35 @@ static GstPadProbeReturn upstream_pad_probe_unlink_cb (GstPad * pad, GstPadProbe
 		t->tstcpq = NULL;
 		t->tcpsink = NULL;
 
-		if (app->rtsp_server->state < RTSP_STATE_RUNNING && app->hls_server->state == HLS_STATE_DISABLED)
+		if (app->rtsp_server->state < RTSP_STATE_RUNNING && app->hls_server->state == HLS_STATE_DISABLED && !upstream_active (app, t))
 			halt_source_pipeline(app);
-		GST_INFO("tcp_upstream disabled!");
+		GST_INFO("%s disabled!", t->name);
 		t->state = UPSTREAM_STATE_DISABLED;
-		send_signal (app, "upstreamStateChanged", g_variant_new("(i)", t->state));
+		upstream_signal (t, "upstreamStateChanged", "stateChanged", g_variant_new("(i)", t->state));
+		update_branch_demand (app);
+		if (t->removing)
+			g_idle_add (upstream_session_free_idle, t);
 	}
 	GST_DEBUG_OBJECT (pad, "upstream_pad_probe_unlink_cb returns GST_PAD_PROBE_REMOVE");
 	return GST_PAD_PROBE_REMOVE;
 }
 
-gboolean disable_tcp_upstream(App *app)
+gboolean disable_tcp_upstream(DreamTCPupstream *t)
 {
+	App *app = t->app;
 	GstState state;
 	gst_element_get_state (GST_ELEMENT(app->pipeline), &state, NULL, 3*GST_SECOND);
-	GST_DEBUG("disable_tcp_upstream (current pipeline state=%s)", gst_element_state_get_name (state));
-	DreamTCPupstream *t = app->tcp_upstream;
+	GST_DEBUG("disable_tcp_upstream %s (current pipeline state=%s)", t->name, gst_element_state_get_name (state));
 	if (t->state >= UPSTREAM_STATE_CONNECTING)
 	{
 		GstPad *sinkpad;
+		rate_control_stop (t);
+		if (t->id_stats)
+			g_source_remove (t->id_stats);
+		t->id_stats = 0;
+		if (t->id_signal_keepalive)
+			g_source_remove (t->id_signal_keepalive);
+		t->id_signal_keepalive = 0;
 		if (t->id_bitrate_measure)
 		{
 			sinkpad = gst_element_get_static_pad (t->tcpsink, "sink");
@@ -2691,7 +5971,7 @@ gboolean disable_tcp_upstream(App *app)
 		}
 		gst_object_ref (t->tstcpq);
 		sinkpad = gst_element_get_static_pad (t->tstcpq, "sink");
-		gulong probe_id = gst_pad_add_probe (sinkpad, GST_PAD_PROBE_TYPE_IDLE, upstream_pad_probe_unlink_cb, app, NULL);
+		gulong probe_id = gst_pad_add_probe (sinkpad, GST_PAD_PROBE_TYPE_IDLE, upstream_pad_probe_unlink_cb, t, NULL);
 		GST_DEBUG("added upstream_pad_probe_unlink_cb with probe_id = %lu on %" GST_PTR_FORMAT"", probe_id, sinkpad);
 		gst_object_unref (sinkpad);
 		return TRUE;
@@ -2713,8 +5993,11 @@ gboolean destroy_pipeline(App *app)
 			if (state != GST_STATE_NULL)
 				GST_INFO_OBJECT(app, "%" GST_PTR_FORMAT"'s state=%s", app->pipeline, gst_element_state_get_name (state));
 		}
+		branch_gate_detach (&app->agate);
+		branch_gate_detach (&app->vgate);
 		gst_object_unref (app->pipeline);
 		gst_object_unref (app->clock);
+		gop_cache_flush (&app->gop_cache);
 		GST_INFO_OBJECT(app, "source pipeline destroyed");
 		app->pipeline = NULL;
 		return TRUE;
@@ -2752,8 +6035,26 @@ int main (int argc, char *argv[])
 {
 	App app;
 	guint owner_id;
+	gchar *source = NULL;
+	gboolean session_bus = FALSE;
+	GError *error = NULL;
 
-	gst_init (0, NULL);
+	GOptionEntry entries[] = {
+		{ "source", 's', 0, G_OPTION_ARG_STRING, &source, "Source backend: 'dream' (encoder hardware, default) or 'software' (test sources with software encoders)", "BACKEND" },
+		{ "session-bus", 0, 0, G_OPTION_ARG_NONE, &session_bus, "Own the D-Bus name on the session bus instead of the system bus", NULL },
+		{ NULL }
+	};
+	GOptionContext *context = g_option_context_new ("- Dreambox RTSP server daemon");
+	g_option_context_add_main_entries (context, entries, NULL);
+	g_option_context_add_group (context, gst_init_get_option_group ());
+	if (!g_option_context_parse (context, &argc, &argv, &error))
+	{
+		g_printerr ("%s\n", error->message);
+		g_error_free (error);
+		g_option_context_free (context);
+		return 1;
+	}
+	g_option_context_free (context);
 
 	GST_DEBUG_CATEGORY_INIT (dreamrtspserver_debug, "dreamrtspserver",
 			GST_DEBUG_BOLD | GST_DEBUG_FG_YELLOW | GST_DEBUG_BG_BLUE,
@@ -2767,12 +6068,41 @@ int main (int argc, char *argv[])
 	app.source_properties.bFrames = 2; //default
 	app.source_properties.pFrames = 1; //default
 	app.source_properties.profile = 0; //main
+	app.latency_profile = LATENCY_PROFILE;
 	g_mutex_init (&app.rtsp_mutex);
+	gop_cache_init (&app.gop_cache);
+	keyframe_arbiter_init (&app.keyframes);
+	branch_gate_init (&app.agate, FALSE);
+	branch_gate_init (&app.vgate, TRUE);
+
+	if (g_strcmp0 (source, "software") == 0)
+	{
+		if (!gst_dream_soft_source_register ())
+			g_error ("Failed to register software source elements");
+		app.source_backend = SOURCE_BACKEND_SOFTWARE;
+		GST_INFO ("using software source backend");
+	}
+	else if (source && g_strcmp0 (source, "dream") != 0)
+	{
+		g_printerr ("unknown source backend '%s'\n", source);
+		return 1;
+	}
+	else
+		app.source_backend = SOURCE_BACKEND_DREAM;
+	g_free (source);
+
+	if (!gst_dream_tcp_client_sink_register ())
+		g_error ("Failed to register dreamtcpclientsink element");
+	if (!gst_dream_compact_mux_register ())
+		g_error ("Failed to register dreamcompactmux element");
+	if (!gst_dream_rtp_client_sink_register ())
+		g_error ("Failed to register dreamrtpclientsink element");
 
 	introspection_data = g_dbus_node_info_new_for_xml (introspection_xml, NULL);
+	upstream_introspection_data = g_dbus_node_info_new_for_xml (upstream_introspection_xml, NULL);
 	app.dbus_connection = NULL;
 
-	owner_id = g_bus_own_name (G_BUS_TYPE_SYSTEM,
+	owner_id = g_bus_own_name (session_bus ? G_BUS_TYPE_SESSION : G_BUS_TYPE_SYSTEM,
 				   service,
 			    G_BUS_NAME_OWNER_FLAGS_NONE,
 			    on_bus_acquired,
@@ -2788,9 +6118,9 @@ int main (int argc, char *argv[])
 	g_timeout_add_seconds (WATCHDOG_TIMEOUT, watchdog_ping, &app);
 #endif
 
-	app.tcp_upstream = malloc(sizeof(DreamTCPupstream));
-	app.tcp_upstream->state = UPSTREAM_STATE_DISABLED;
-	app.tcp_upstream->auto_bitrate = AUTO_BITRATE;
+	app.rate_slowest_link = UPSTREAM_RATE_SLOWEST_LINK;
+	app.waiting_policy = WAITING_POLICY;
+	app.tcp_upstream = upstream_session_new (&app);
 
 	app.hls_server = create_hls_server(&app);
 
@@ -2802,8 +6132,10 @@ int main (int argc, char *argv[])
 
 	g_main_loop_run (app.loop);
 
-	if (app.tcp_upstream->state > UPSTREAM_STATE_DISABLED)
-		disable_tcp_upstream(&app);
+	GList *l;
+	for (l = app.upstreams; l; l = l->next)
+		if (((DreamTCPupstream *) l->data)->state > UPSTREAM_STATE_DISABLED)
+			disable_tcp_upstream(l->data);
 	if (app.rtsp_server->state >= RTSP_STATE_IDLE)
 		disable_rtsp_server(&app);
 	if (app.rtsp_server->clients_list)
@@ -2813,17 +6145,23 @@ int main (int argc, char *argv[])
 		disable_hls_server(&app);
 
 	free(app.hls_server);
+	g_mutex_clear (&app.rtsp_server->start_mutex);
 	free(app.rtsp_server);
-	free(app.tcp_upstream);
+	while (app.upstreams)
+		upstream_session_free (app.upstreams->data);
+	app.tcp_upstream = NULL;
 
 	destroy_pipeline(&app);
 
 	g_main_loop_unref (app.loop);
 
 	g_mutex_clear (&app.rtsp_mutex);
+	g_mutex_clear (&app.gop_cache.mutex);
+	g_mutex_clear (&app.keyframes.mutex);
 
 	g_bus_unown_name (owner_id);
 	g_dbus_node_info_unref (introspection_data);
+	g_dbus_node_info_unref (upstream_introspection_data);
 
 	return 0;
 }
@@ -27,6 +27,7 @@
 #include <glib-unix.h>
 #include <gst/gst.h>
 #include <gst/app/app.h>
+#include <gst/video/video.h>
 #include <gst/rtsp-server/rtsp-server.h>
 #include <libsoup/soup.h>
 #include "gstdreamrtsp.h"
@@ -38,10 +39,32 @@ GST_DEBUG_CATEGORY (dreamrtspserver_debug);
 #define DEFAULT_RTSP_PATH "/stream"
 #define RTSP_ES_PATH_SUFX "-es"
 
-#define HLS_PATH "/tmp/hls"
 #define HLS_FRAGMENT_DURATION 2
-#define HLS_FRAGMENT_NAME "segment%05d.ts"
+#define HLS_FRAGMENT_NAME "segment%05u.%s"
+#define HLS_FRAGMENT_SCAN "segment%u.%n"
+#define HLS_INIT_NAME "init.mp4"
 #define HLS_PLAYLIST_NAME "dream.m3u8"
+#define HLS_PLAYLIST_LENGTH 5
+#define HLS_SEGMENT_COUNT 7
+#define HLS_APPSINK "hlsappsink"
+#define HLS_COLD_START_TIMEOUT 10
+#define HLS_PART_NAME "segment%05u.%u.ts"
+#define HLS_PART_SCAN "segment%u.%u.ts"
+#define HLS_PART_DURATION 200
+#define HLS_PART_TARGET 333
+#define HLS_PART_HISTORY 2
+#define HLS_VAPPSINK "hlsvappsink"
+#define HLS_AAPPSINK "hlsaappsink"
+#define HLS_VQUEUE "hlsvqueue"
+#define HLS_AQUEUE "hlsaqueue"
+#define HLS_FMP4_AUDIO_BACKLOG (30*GST_SECOND)
+
+#define MP4_VIDEO_TRACK 1
+#define MP4_AUDIO_TRACK 2
+#define MP4_TRACK_COUNT 2
+#define MP4_VIDEO_TIMESCALE 90000
+#define MP4_SAMPLE_SYNC 0x02000000
+#define MP4_SAMPLE_DEPENDS 0x01010000
 
 #define TOKEN_LEN 36
 
@@ -52,22 +75,66 @@ GST_DEBUG_CATEGORY (dreamrtspserver_debug);
 #define ES_AAPPSRC "es_aappsrc"
 #define ES_VAPPSRC "es_vappsrc"
 #define TS_APPSRC "ts_appsrc"
+#define TS_LAUNCH_QUEUED "( appsrc name=" TS_APPSRC " ! queue ! rtpmp2tpay name=pay0 pt=96 )"
+#define TS_LAUNCH_DIRECT "( appsrc name=" TS_APPSRC " ! rtpmp2tpay name=pay0 pt=96 )"
 
 #define TS_PACK_SIZE 188
 #define TS_PER_FRAME 7
 #define BLOCK_SIZE   TS_PER_FRAME*188
 #define TOKEN_LEN    36
 
-#define MAX_OVERRUNS 5
-#define OVERRUN_TIME G_GINT64_CONSTANT(15)*GST_SECOND
 #define BITRATE_AVG_PERIOD G_GINT64_CONSTANT(6)*GST_SECOND
 
+#define RATE_CONTROL_INTERVAL 1000
+#define RATE_QUEUE_DELAY_HIGH 400
+#define RATE_QUEUE_DELAY_LOW 100
+#define RATE_RTT_SLACK 50
+#define RATE_DECREASE_FACTOR 70
+#define RATE_DECREASE_HOLDOFF 2000
+#define RATE_PROBE_INTERVAL 4000
+#define RATE_PROBE_STEP 8
+#define RATE_PROBE_MIN_STEP 50
+#define RATE_MIN_VIDEO_BITRATE 300
+#define RATE_INGEST_SHORTFALL 90
+#define RATE_LOSS_HIGH 20
+#define RATE_LOSS_LOW 5
+
+#define LATENCY_PROFILE LATENCY_PROFILE_BALANCED
+
+#define UPSTREAM_STATS_INTERVAL 250
+#define UPSTREAM_SENDQ_DELAY_HIGH 200
+
 #define RESUME_DELAY 20
 
+#define RTSP_PACING_RATE 0
+#define RTSP_CLIENT_QUEUE_LIMIT (4*1024*1024)
+#define RTSP_CLIENT_QUEUE_POLICY DREAM_RTSP_CLIENT_POLICY_SKIP
+
 #define AUTO_BITRATE TRUE
+#define UPSTREAM_RATE_SLOWEST_LINK FALSE
+
+#define UPSTREAM_ZEROCOPY FALSE
+#define UPSTREAM_RECONNECT TRUE
+#define UPSTREAM_STALL_TIMEOUT 1000
+#define UPSTREAM_SPOOL_SIZE 0
+#define UPSTREAM_SPOOL_MAX_RATE 0
+#define UPSTREAM_KEEPALIVE_INTERVAL 5
+#define UPSTREAM_FRAMING UPSTREAM_FRAMING_TS
+#define UPSTREAM_CONTROL FALSE
+#define UPSTREAM_TRANSPORT UPSTREAM_TRANSPORT_TCP
+#define UPSTREAM_FEC_PERCENTAGE 0
+#define UPSTREAM_RTX_TIME 500
+
+#define WAITING_POLICY WAITING_POLICY_PAUSE
+#define SOURCE_IDLE_VIDEO_BITRATE 100
+#define SOURCE_IDLE_FRAMERATE 5
 
 #define WATCHDOG_TIMEOUT 5
 
+#define GOP_CACHE_LIMIT (8*1024*1024)
+
+#define KEYFRAME_REQUEST_INTERVAL 1000
+
 #if HAVE_UPSTREAM
 	#pragma message("building with mediator upstream feature")
 #else
@@ -93,12 +160,19 @@ GST_DEBUG_CATEGORY (dreamrtspserver_debug);
 
 G_BEGIN_DECLS
 
+typedef struct _App App;
+
 typedef enum {
         INPUT_MODE_LIVE = 0,
         INPUT_MODE_HDMI_IN = 1,
         INPUT_MODE_BACKGROUND = 2
 } inputMode;
 
+typedef enum {
+        SOURCE_BACKEND_DREAM = 0,
+        SOURCE_BACKEND_SOFTWARE = 1
+} sourceBackend;
+
 typedef enum {
         UPSTREAM_STATE_DISABLED = 0,
         UPSTREAM_STATE_CONNECTING = 1,
@@ -106,9 +180,48 @@ typedef enum {
         UPSTREAM_STATE_TRANSMITTING = 3,
         UPSTREAM_STATE_OVERLOAD = 4,
         UPSTREAM_STATE_ADJUSTING = 5,
+	UPSTREAM_STATE_RECONNECTING = 6,
 	UPSTREAM_STATE_FAILED = 9
 } upstreamState;
 
+typedef enum {
+	UPSTREAM_FRAMING_TS = 0,
+	UPSTREAM_FRAMING_COMPACT = 1
+} upstreamFraming;
+
+typedef enum {
+	UPSTREAM_TRANSPORT_TCP = 0,
+	UPSTREAM_TRANSPORT_RTP = 1
+} upstreamTransport;
+
+typedef enum {
+	LATENCY_PROFILE_ULTRA_LOW = 0,
+	LATENCY_PROFILE_LOW = 1,
+	LATENCY_PROFILE_BALANCED = 2,
+	LATENCY_PROFILE_ROBUST = 3,
+	LATENCY_PROFILE_COUNT = 4
+} latencyProfile;
+
+/* how much every branch may buffer, the frame ages are also what the leaky queues hold twice of */
+typedef struct {
+	const gchar *name;
+	GstClockTime source_queue, mux_latency, appsrc_latency;
+	GstClockTime rtsp_age, hls_age, upstream_age;
+	gboolean ts_queue;
+} DreamLatencyProfile;
+
+static const DreamLatencyProfile latency_profiles[LATENCY_PROFILE_COUNT] = {
+	{ "ultra-low", 100*GST_MSECOND, 0, 0, 300*GST_MSECOND, 2*GST_SECOND, 500*GST_MSECOND, FALSE },
+	{ "low", 300*GST_MSECOND, 0, 40*GST_MSECOND, 1*GST_SECOND, 3*GST_SECOND, 1*GST_SECOND, FALSE },
+	{ "balanced", 1*GST_SECOND, 0, 100*GST_MSECOND, 3*GST_SECOND, 5*GST_SECOND, 2*GST_SECOND, TRUE },
+	{ "robust", 3*GST_SECOND, 200*GST_MSECOND, 500*GST_MSECOND, 6*GST_SECOND, 10*GST_SECOND, 5*GST_SECOND, TRUE }
+};
+
+typedef enum {
+	WAITING_POLICY_PAUSE = 0,
+	WAITING_POLICY_IDLE = 1
+} waitingPolicy;
+
 typedef enum {
         RTSP_STATE_DISABLED = 0,
         RTSP_STATE_IDLE = 1,
@@ -121,31 +234,164 @@ typedef enum {
 	HLS_STATE_RUNNING = 2
 } hlsState;
 
+typedef enum {
+	HLS_FORMAT_TS = 0,
+	HLS_FORMAT_FMP4 = 1
+} hlsSegmentFormat;
+
+typedef enum {
+	RATE_DECISION_HOLD = 0,
+	RATE_DECISION_DECREASE = 1,
+	RATE_DECISION_PROBE = 2,
+	RATE_DECISION_COUNT = 3
+} rateDecision;
+
+static const gchar *rate_decision_names[RATE_DECISION_COUNT] = { "hold", "decrease", "probe" };
+
+/* AIMD video bitrate control of the upstream, all rates in kbit/s, delays in ms and loss in per mille */
 typedef struct {
-	GstElement *tstcpq, *tcpsink;
+	gint target, current, floor;
+	gint throughput, queue_delay, socket_delay, rtt, min_rtt, ingest, loss;
+	gint bytes;
+	guint overruns, decreases, increases;
+	rateDecision last_decision;
+	gint64 last_change, last_decrease, last_sample;
+	guint id_tick;
+} DreamRateController;
+
+typedef enum {
+	UPSTREAM_WARNING_RTT = 1 << 0,
+	UPSTREAM_WARNING_RETRANSMIT = 1 << 1,
+	UPSTREAM_WARNING_SENDQ = 1 << 2,
+	UPSTREAM_WARNING_LOSS = 1 << 3,
+	UPSTREAM_WARNING_COUNT = 4
+} upstreamWarning;
+
+static const gchar *upstream_warning_names[UPSTREAM_WARNING_COUNT] = { "rtt", "retransmit", "sendqueue", "loss" };
+
+typedef enum {
+	FRAME_PRIORITY_NONREF = 0,
+	FRAME_PRIORITY_REF = 1,
+	FRAME_PRIORITY_KEY = 2,
+	FRAME_PRIORITY_OTHER = 3,
+	FRAME_PRIORITY_CONTINUATION = 4,
+	FRAME_PRIORITY_COUNT = 5
+} framePriority;
+
+static const gchar *frame_priority_names[FRAME_PRIORITY_COUNT] = { "non-reference", "reference", "key", "other", "continuation" };
+
+typedef enum {
+	FRAME_QUEUE_TS = 0,
+	FRAME_QUEUE_VIDEO = 1,
+	FRAME_QUEUE_AUDIO = 2,
+	FRAME_QUEUE_COMPACT = 3
+} frameQueueMode;
+
+/* drops whole frames in front of a leaky queue by priority as it fills, and behind it once they are older than max_age */
+typedef struct {
+	const gchar *name;
+	frameQueueMode mode;
+	GstElement *queue;
+	GstClockTime max_age, last_in, latency;
+	gint video_pid;
+	gboolean dropping, skip_gop, src_dropping, src_skip_gop;
+	guint dropped[FRAME_PRIORITY_COUNT], aged;
+	GMutex mutex;
+} DreamFrameQueue;
+
+/* last TCP_INFO/SIOCOUTQ sample of the upstream socket, times in us, queues in bytes, rate in kbit/s, loss only from RTP receiver reports */
+typedef struct {
+	guint rtt, rttvar, min_rtt, cwnd, mss;
+	guint retransmits, unacked, outq;
+	guint delivery_rate;
+	guint64 spooled, spool_dropped;
+	gint packets_lost;
+	guint fraction_lost;
+} DreamSocketStats;
+
+/* one mediator connection hanging off the tstee, the first one is driven by enableUpstream */
+typedef struct {
+	App *app;
+	guint id;
+	gchar *name, *host, *standby_host, *object_path, *spool_location;
+	guint32 port, standby_port;
+	guint spool_size, spool_max_rate;
+	guint registration_id;
+	gboolean removing;
+	upstreamFraming framing;
+	upstreamTransport transport;
+	guint fec_percentage, rtx_time;
+	gboolean control, mediator_idle;
+	GstElement *compactmux, *tstcpq, *tcpsink;
 	char token[TOKEN_LEN+1];
 	upstreamState state;
-	guint overrun_counter;
-	GstClockTime overrun_period, measure_start;
+	GstClockTime measure_start;
 	guint id_signal_overrun, id_signal_waiting, id_signal_keepalive;
 	gulong id_resume, id_bitrate_measure;
 	gsize bitrate_sum;
-	gint bitrate_avg;
 	gboolean auto_bitrate;
+	DreamRateController rate;
+	DreamSocketStats socket_stats;
+	guint warnings, id_stats;
+	DreamFrameQueue frames;
+	upstreamState resume_state;
+	guint reconnects, reconnect_attempts, failovers;
+	guint64 last_downtime, max_downtime;
 } DreamTCPupstream;
 
+typedef enum {
+	BRIDGE_AUDIO = 0,
+	BRIDGE_VIDEO = 1,
+	BRIDGE_TS = 2,
+	BRIDGE_COUNT = 3
+} bridgeType;
+
+/* drops buffers on a tee src pad while nobody consumes that branch */
+typedef struct {
+	GstPad *teepad;
+	gulong probe_id;
+	gboolean open, wait_keyframe;
+	GMutex mutex;
+} DreamBranchGate;
+
+/* hands one tee branch of the source pipeline over to the appsrc of a GstRTSPMedia */
+typedef struct {
+	App *app;
+	bridgeType type;
+	DreamBranchGate gate;
+	DreamFrameQueue frames;
+	GstElement *queue, *appsink;
+	GstAppSrc *appsrc;
+	GstCaps *caps;
+	GstClockTime replayed_until;
+	GMutex mutex;
+} DreamRTSPbridge;
+
+/* most recent GOP of every tee, starting at the last keyframe */
+typedef struct {
+	GQueue samples[BRIDGE_COUNT];
+	gsize bytes[BRIDGE_COUNT];
+	gboolean complete[BRIDGE_COUNT];
+	gsize limit;
+	guint lookups, hits;
+	GMutex mutex;
+} DreamGOPcache;
+
 typedef struct {
 	GstDreamRTSPServer *server;
 	GstRTSPMountPoints *mounts;
 	GstDreamRTSPMediaFactory *es_factory, *ts_factory;
 	GstRTSPMedia *es_media, *ts_media;
-	GstElement *artspq, *vrtspq, *tsrtspq;
-	GstElement *es_aappsrc, *es_vappsrc;
-	GstElement *ts_appsrc;
-	GstElement *aappsink, *vappsink, *tsappsink;
+	GstDreamRTSPPacer *es_pacer, *ts_pacer;
+	guint pacing_rate;
+	guint client_queue_limit;
+	gint client_queue_policy;
+	DreamRTSPbridge bridge[BRIDGE_COUNT];
 	GstClockTime rtsp_start_pts, rtsp_start_dts;
+	GMutex start_mutex;
 	gchar *rtsp_user, *rtsp_pass;
 	GList *clients_list;
+	gint clients_count;
 	gchar *rtsp_port;
 	gchar *rtsp_ts_path, *rtsp_es_path;
 	guint source_id;
@@ -159,9 +405,80 @@ typedef struct {
 	gboolean gopOnSceneChange, openGop;
 } SourceProperties;
 
+typedef struct {
+	GBytes *data;
+	SoupMessageHeaders *headers;
+	GstClockTime duration;
+	gboolean independent;
+} DreamHLSpart;
+
+typedef struct {
+	guint sequence;
+	GstClockTime duration;
+	GBytes *data;
+	SoupMessageHeaders *headers;
+	GPtrArray *parts;
+} DreamHLSsegment;
+
+/* http request paused until the playlist, segment or part it waits for exists */
+typedef struct {
+	App *app;
+	SoupMessage *msg;
+	gchar *path;
+	gint msn, part;
+	gboolean playlist;
+	guint id_timeout;
+} DreamHLSrequest;
+
+/* one traf of a moof, end is the decode time following the last sample if known */
+typedef struct {
+	guint32 track_id, timescale;
+	GList *samples;
+	GstClockTime end, default_duration;
+} DreamMP4track;
+
+/* sample collection of the fragmented mp4 segmenter, fed by the video and audio appsink threads */
+typedef struct {
+	GstElement *vbin, *abin;
+	DreamFrameQueue vframes, aframes;
+	GstCaps *vcaps, *acaps;
+	GQueue vsamples, asamples;
+	GstClockTime start;
+	guint fragment_sequence;
+	gboolean audio_track;
+	GMutex mutex;
+} DreamHLSfmp4;
+
 typedef struct {
 	GstElement *queue;
-	GstElement *hlssink;
+	GstElement *appsink;
+	DreamFrameQueue frames;
+	hlsSegmentFormat format, session_format;
+	DreamHLSfmp4 fmp4;
+	GBytes *init;
+	SoupMessageHeaders *init_headers;
+	GQueue segments;
+	GBytes *playlist;
+	SoupMessageHeaders *playlist_headers;
+	GMutex mutex;
+	GByteArray *pending;
+	GstClockTime pending_start;
+	guint sequence;
+	GPtrArray *parts;
+	gsize part_offset;
+	GstClockTime part_start;
+	gboolean part_independent;
+	gboolean low_latency, segment_low_latency;
+	guint8 pat[TS_PACK_SIZE], pmt[TS_PACK_SIZE];
+	guint16 pmt_pid;
+	gboolean have_pat, have_pmt;
+	GList *prime;
+	gboolean priming;
+	GstClockTime primed_until;
+	GList *pending_requests;
+	guint id_resume;
+	gint64 cold_start_begin;
+	gint cold_start_latency;
 	hlsState state;
 	SoupServer *soupserver;
 	SoupAuthDomain *soupauthdomain;
@@ -170,7 +487,28 @@ typedef struct {
 	guint id_timeout;
 } DreamHLSserver;
 
+typedef enum {
+	KEYFRAME_REASON_RTSP_JOIN = 0,
+	KEYFRAME_REASON_HLS_START = 1,
+	KEYFRAME_REASON_UPSTREAM_RESUME = 2,
+	KEYFRAME_REASON_RTCP_FEEDBACK = 3,
+	KEYFRAME_REASON_MEDIATOR = 4,
+	KEYFRAME_REASON_RTSP_SKIP = 5,
+	KEYFRAME_REASON_COUNT = 6
+} keyframeReason;
+
+static const gchar *keyframe_reason_names[KEYFRAME_REASON_COUNT] = { "rtsp", "hls", "upstream", "rtcp", "mediator", "rtsp-skip" };
+
+/* rate limits force-key-unit requests of all consumers to one per KEYFRAME_REQUEST_INTERVAL */
 typedef struct {
+	guint requested[KEYFRAME_REASON_COUNT], granted[KEYFRAME_REASON_COUNT];
+	guint inflight, deferred;
+	gint64 last_sent;
+	guint id_deferred;
+	GMutex mutex;
+} DreamKeyframeArbiter;
+
+struct _App {
 	GDBusConnection *dbus_connection;
 	GMainLoop *loop;
 	GstElement *pipeline;
@@ -178,17 +516,31 @@ typedef struct {
 	GstElement *tsmux, *tstee;
 	GstElement *aq, *vq;
 	GstElement *atee, *vtee;
+	DreamBranchGate agate, vgate;
 	DreamTCPupstream *tcp_upstream;
+	GList *upstreams;
+	guint upstream_ids;
+	gboolean rate_slowest_link;
+	gint upstream_bitrate;
 	DreamRTSPserver *rtsp_server;
 	DreamHLSserver *hls_server;
 	GMutex rtsp_mutex;
+	DreamGOPcache gop_cache;
+	DreamKeyframeArbiter keyframes;
 	GstClock *clock;
 	SourceProperties source_properties;
-} App;
+	sourceBackend source_backend;
+	waitingPolicy waiting_policy;
+	latencyProfile latency_profile;
+	gboolean source_idle, idle_wait_keyframe;
+	SourceProperties idle_restore;
+};
 
 static const gchar service[] = "com.dreambox.RTSPserver";
 static const gchar object_name[] = "/com/dreambox/RTSPserver";
+static const gchar upstream_interface[] = "com.dreambox.RTSPserver.Upstream";
 static GDBusNodeInfo *introspection_data = NULL;
+static GDBusNodeInfo *upstream_introspection_data = NULL;
 
 static const gchar introspection_xml[] =
   "<node>"
@@ -227,6 +579,9 @@ static const gchar introspection_xml[] =
   "      <arg type='i' name='state' direction='out'/>"
   "    </signal>"
   "    <property type='i' name='hlsState' access='read'/>"
+  "    <property type='i' name='hlsColdStartLatency' access='read'/>"
+  "    <property type='b' name='hlsLowLatency' access='readwrite'/>"
+  "    <property type='i' name='hlsSegmentFormat' access='readwrite'/>"
   #if HAVE_UPSTREAM
   "    <method name='enableUpstream'>"
   "      <arg type='b' name='state' direction='in'/>"
@@ -242,6 +597,55 @@ static const gchar introspection_xml[] =
   "    <signal name='tcpBitrate'>"
   "      <arg type='i' name='kbps' direction='out'/>"
   "    </signal>"
+  "    <signal name='upstreamRateDecision'>"
+  "      <arg type='s' name='decision' direction='out'/>"
+  "      <arg type='i' name='videoBitrate' direction='out'/>"
+  "      <arg type='i' name='throughput' direction='out'/>"
+  "      <arg type='i' name='queueDelay' direction='out'/>"
+  "      <arg type='i' name='rtt' direction='out'/>"
+  "    </signal>"
+  "    <property type='a{si}' name='upstreamRateControl' access='read'/>"
+  "    <property type='i' name='upstreamMinBitrate' access='readwrite'/>"
+  "    <signal name='upstreamCongestionWarning'>"
+  "      <arg type='s' name='reason' direction='out'/>"
+  "      <arg type='u' name='value' direction='out'/>"
+  "    </signal>"
+  "    <property type='a{su}' name='upstreamSocketStats' access='read'/>"
+  "    <signal name='upstreamReconnected'>"
+  "      <arg type='u' name='attempts' direction='out'/>"
+  "      <arg type='u' name='downtime' direction='out'/>"
+  "    </signal>"
+  "    <property type='a{su}' name='upstreamReconnects' access='read'/>"
+  "    <method name='enableUpstreamWithStandby'>"
+  "      <arg type='b' name='state' direction='in'/>"
+  "      <arg type='s' name='host' direction='in'/>"
+  "      <arg type='u' name='port' direction='in'/>"
+  "      <arg type='s' name='token' direction='in'/>"
+  "      <arg type='s' name='standbyHost' direction='in'/>"
+  "      <arg type='u' name='standbyPort' direction='in'/>"
+  "      <arg type='b' name='result' direction='out'/>"
+  "    </method>"
+  "    <signal name='upstreamFailover'>"
+  "      <arg type='s' name='host' direction='out'/>"
+  "      <arg type='u' name='port' direction='out'/>"
+  "    </signal>"
+  "    <signal name='upstreamControl'>"
+  "      <arg type='s' name='command' direction='out'/>"
+  "      <arg type='u' name='value' direction='out'/>"
+  "    </signal>"
+  "    <method name='addUpstream'>"
+  "      <arg type='s' name='host' direction='in'/>"
+  "      <arg type='u' name='port' direction='in'/>"
+  "      <arg type='s' name='token' direction='in'/>"
+  "      <arg type='o' name='path' direction='out'/>"
+  "    </method>"
+  "    <method name='removeUpstream'>"
+  "      <arg type='o' name='path' direction='in'/>"
+  "      <arg type='b' name='result' direction='out'/>"
+  "    </method>"
+  "    <property type='ao' name='upstreamSessions' access='read'/>"
+  "    <property type='b' name='upstreamRateSlowestLink' access='readwrite'/>"
+  "    <property type='i' name='upstreamWaitingPolicy' access='readwrite'/>"
 #endif
   "    <method name='enableRTSP'>"
   "      <arg type='b' name='state' direction='in'/>"
@@ -263,12 +667,76 @@ static const gchar introspection_xml[] =
   "      <arg type='i' name='state' direction='out'/>"
   "    </signal>"
   "    <property type='i' name='rtspState' access='read'/>"
+  "    <property type='u' name='rtspPacingRate' access='readwrite'/>"
+  "    <property type='a{st}' name='rtspPacing' access='read'/>"
+  "    <property type='u' name='rtspClientQueueLimit' access='readwrite'/>"
+  "    <property type='i' name='rtspClientQueuePolicy' access='readwrite'/>"
+  "    <property type='a(suttu)' name='rtspClientQueues' access='read'/>"
   "    <property type='s' name='uriParameters' access='read'/>"
   "    <property type='b' name='autoBitrate' access='readwrite'/>"
+  "    <property type='i' name='gopCacheLimit' access='readwrite'/>"
+  "    <property type='i' name='gopCacheHitRate' access='read'/>"
+  "    <property type='a{s(uu)}' name='keyframeStats' access='read'/>"
+  "    <property type='a{s(uuu)}' name='frameQueueDrops' access='read'/>"
+  "    <property type='i' name='latencyProfile' access='readwrite'/>"
+  "    <property type='a{s(uu)}' name='branchLatency' access='read'/>"
   "    <signal name='encoderError'/>"
   "  </interface>"
   "</node>";
 
+static const gchar upstream_introspection_xml[] =
+  "<node>"
+  "  <interface name='com.dreambox.RTSPserver.Upstream'>"
+  "    <signal name='stateChanged'>"
+  "      <arg type='i' name='state' direction='out'/>"
+  "    </signal>"
+  "    <signal name='bitrate'>"
+  "      <arg type='i' name='kbps' direction='out'/>"
+  "    </signal>"
+  "    <signal name='rateDecision'>"
+  "      <arg type='s' name='decision' direction='out'/>"
+  "      <arg type='i' name='videoBitrate' direction='out'/>"
+  "      <arg type='i' name='throughput' direction='out'/>"
+  "      <arg type='i' name='queueDelay' direction='out'/>"
+  "      <arg type='i' name='rtt' direction='out'/>"
+  "    </signal>"
+  "    <signal name='congestionWarning'>"
+  "      <arg type='s' name='reason' direction='out'/>"
+  "      <arg type='u' name='value' direction='out'/>"
+  "    </signal>"
+  "    <signal name='reconnected'>"
+  "      <arg type='u' name='attempts' direction='out'/>"
+  "      <arg type='u' name='downtime' direction='out'/>"
+  "    </signal>"
+  "    <signal name='failover'>"
+  "      <arg type='s' name='host' direction='out'/>"
+  "      <arg type='u' name='port' direction='out'/>"
+  "    </signal>"
+  "    <signal name='control'>"
+  "      <arg type='s' name='command' direction='out'/>"
+  "      <arg type='u' name='value' direction='out'/>"
+  "    </signal>"
+  "    <property type='i' name='state' access='read'/>"
+  "    <property type='s' name='host' access='read'/>"
+  "    <property type='u' name='port' access='read'/>"
+  "    <property type='s' name='standbyHost' access='read'/>"
+  "    <property type='u' name='standbyPort' access='read'/>"
+  "    <property type='u' name='spoolSize' access='readwrite'/>"
+  "    <property type='s' name='spoolLocation' access='readwrite'/>"
+  "    <property type='u' name='spoolMaxRate' access='readwrite'/>"
+  "    <property type='i' name='framing' access='readwrite'/>"
+  "    <property type='i' name='transport' access='readwrite'/>"
+  "    <property type='u' name='fecPercentage' access='readwrite'/>"
+  "    <property type='u' name='rtxTime' access='readwrite'/>"
+  "    <property type='b' name='controlChannel' access='readwrite'/>"
+  "    <property type='b' name='autoBitrate' access='readwrite'/>"
+  "    <property type='i' name='minBitrate' access='readwrite'/>"
+  "    <property type='a{si}' name='rateControl' access='read'/>"
+  "    <property type='a{su}' name='socketStats' access='read'/>"
+  "    <property type='a{su}' name='reconnects' access='read'/>"
+  "  </interface>"
+  "</node>";
+
 static gboolean gst_get_capsprop(App *app, GstElement *element, const gchar* prop_name, guint32 *value);
 static gboolean gst_set_inputmode(App *app, inputMode input_mode);
 static gboolean gst_set_framerate(App *app, int value);
@@ -286,39 +754,119 @@ static void handle_method_call (GDBusConnection *, const gchar *, const gchar *,
 static void send_signal (App *app, const gchar *signal_name, GVariant *parameters);
 
 void assert_tsmux(App *app);
+static void branch_gate_init (DreamBranchGate *g, gboolean wait_keyframe);
+static void branch_gate_attach (DreamBranchGate *g, GstPad *teepad);
+static void branch_gate_detach (DreamBranchGate *g);
+static void branch_gate_set (DreamBranchGate *g, gboolean open);
+static GstPadProbeReturn branch_gate_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data);
+static void update_branch_demand (App *app);
 gboolean assert_state(App *app, GstElement *element, GstState targetstate);
 
 static gboolean message_cb (GstBus * bus, GstMessage * message, gpointer user_data);
 static GstPadProbeReturn cancel_waiting_probe (GstPad * sinkpad, GstPadProbeInfo * info, gpointer user_data);
 static GstPadProbeReturn bitrate_measure_probe (GstPad * sinkpad, GstPadProbeInfo * info, gpointer user_data);
-gboolean upstream_keep_alive(App *app);
-gboolean upstream_set_waiting(App *app);
-gboolean upstream_resume_transmitting(App *app);
-static GstPadProbeReturn inject_authorization (GstPad * sinkpad, GstPadProbeInfo * info, gpointer user_data);
+gboolean upstream_keep_alive(DreamTCPupstream *t);
+gboolean upstream_set_waiting(DreamTCPupstream *t);
+gboolean upstream_resume_transmitting(DreamTCPupstream *t);
+static void upstream_connection_event (DreamTCPupstream *t, const GstStructure *s);
+static void upstream_control_event (DreamTCPupstream *t, const GstStructure *s);
 static void queue_underrun (GstElement *, gpointer);
 static void queue_overrun (GstElement *, gpointer);
-static void auto_adjust_bitrate(App *app);
+static gboolean upstream_resume_waiting (DreamTCPupstream *t);
+static void rate_control_init (DreamRateController *rc);
+static void rate_control_start (DreamTCPupstream *t);
+static void rate_control_stop (DreamTCPupstream *t);
+static gboolean rate_control_apply (App *app, gint target);
+static gboolean rate_control_tick (gpointer user_data);
+static gboolean rate_control_evaluate (DreamTCPupstream *t);
+static gboolean upstream_socket_stats_tick (gpointer user_data);
+
+static DreamTCPupstream *upstream_session_new (App *app);
+static void upstream_session_free (DreamTCPupstream *t);
+static gboolean upstream_session_register (DreamTCPupstream *t, GDBusConnection *connection);
+static DreamTCPupstream *upstream_session_find (App *app, GstObject *tcpsink);
+static gboolean upstream_active (App *app, DreamTCPupstream *except);
+static gboolean upstream_consuming (App *app, DreamTCPupstream *except);
+static gboolean upstream_ts_active (App *app);
+static gboolean upstream_link_tee (App *app, GstElement *tee, GstElement *element, const gchar *padname);
+static void upstream_unlink_tee (GstPad *pad);
+static gboolean upstream_controls_encoder (DreamTCPupstream *t);
+static void upstream_signal (DreamTCPupstream *t, const gchar *legacy_name, const gchar *signal_name, GVariant *parameters);
+static GVariant *upstream_rate_control_variant (DreamTCPupstream *t);
+static GVariant *upstream_socket_stats_variant (DreamTCPupstream *t);
+static GVariant *upstream_reconnects_variant (DreamTCPupstream *t);
+
+static void frame_queue_init (DreamFrameQueue *fq, const gchar *name, frameQueueMode mode, GstClockTime max_age);
+static void frame_queue_attach (DreamFrameQueue *fq, GstElement *queue);
+static framePriority frame_queue_classify (DreamFrameQueue *fq, GstBuffer *buffer);
+static GstBuffer *frame_queue_filter (DreamFrameQueue *fq, GstBuffer *buffer, GstClockTime level, gboolean incoming);
+static GstPadProbeReturn frame_queue_sink_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data);
+static GstPadProbeReturn frame_queue_src_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data);
+static void frame_queue_add_stats (DreamFrameQueue *fq, GVariantBuilder *builder);
+static void frame_queue_set_max_age (DreamFrameQueue *fq, GstClockTime max_age);
+static void frame_queue_add_latency (DreamFrameQueue *fq, GVariantBuilder *builder);
+
+static void latency_profile_apply (App *app);
+
+static GstDreamRTSPPacer *rtsp_pacer_attach (App *app, GstRTSPMedia *media, gboolean frames);
+static GVariant *rtsp_pacing_variant (DreamRTSPserver *r);
+static GVariant *rtsp_client_queues_variant (DreamRTSPserver *r);
+static void latency_add_source_queue (GstElement *queue, const gchar *name, GVariantBuilder *builder);
+
+static void gop_cache_init (DreamGOPcache *c);
+static void gop_cache_clear (DreamGOPcache *c, bridgeType type);
+static void gop_cache_flush (DreamGOPcache *c);
+static GstPadProbeReturn gop_cache_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data);
+static GList *gop_cache_get (App *app, bridgeType type);
+
+static void keyframe_arbiter_init (DreamKeyframeArbiter *k);
+static void request_keyframe (App *app, keyframeReason reason);
+static gboolean keyframe_request_deferred (gpointer user_data);
+static GstPadProbeReturn keyframe_granted_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data);
+static GstPadProbeReturn rtcp_keyframe_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data);
+
+static void rtsp_bridge_init (App *app, DreamRTSPbridge *b, bridgeType type);
+static gboolean rtsp_bridge_create (App *app, DreamRTSPbridge *b, GstElement *tee);
+static void rtsp_bridge_set_appsrc (DreamRTSPbridge *b, GstElement *appsrc, GList *replay);
+static GstFlowReturn rtsp_bridge_new_sample (GstAppSink *appsink, gpointer user_data);
+static void rtsp_start_set (DreamRTSPserver *r, GstBuffer *keyframe);
 
 gboolean create_source_pipeline(App *app);
 gboolean halt_source_pipeline(App *app);
 gboolean pause_source_pipeline(App *app);
 gboolean unpause_source_pipeline(App *app);
+static gboolean idle_source_pipeline (App *app);
+static void resume_idle_source (App *app, keyframeReason reason);
+static GstPadProbeReturn idle_audio_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data);
+static GstPadProbeReturn idle_video_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data);
 gboolean destroy_pipeline(App *app);
 gboolean watchdog_ping(gpointer user_data);
 gboolean quit_signal(gpointer loop);
 gboolean get_dot_graph (gpointer user_data);
 
+static GstFlowReturn hls_new_sample (GstAppSink *appsink, gpointer user_data);
+static GstFlowReturn hls_fmp4_new_video_sample (GstAppSink *appsink, gpointer user_data);
+static GstFlowReturn hls_fmp4_new_audio_sample (GstAppSink *appsink, gpointer user_data);
+static void hls_fmp4_clear (DreamHLSfmp4 *f);
+static gboolean start_hls_fmp4_pipeline (App *app);
+static void hls_store_clear (DreamHLSserver *h);
+static SoupMessageHeaders *hls_store_headers (const gchar *content_type, const gchar *cache_control, GBytes *bytes);
+static GBytes *hls_store_lookup (DreamHLSserver *h, const gchar *name, SoupMessageHeaders *response_headers);
+static gboolean hls_resume_requests (gpointer user_data);
+static gboolean hls_request_timeout (gpointer user_data);
+static void hls_fail_requests (App *app, guint status_code);
+
 DreamHLSserver *create_hls_server(App *app);
 gboolean enable_hls_server(App *app, guint port, const gchar *user, const gchar *pass);
 gboolean start_hls_pipeline(App *app);
 gboolean stop_hls_pipeline(App *app);
 gboolean disable_hls_server(App *app);
 gboolean hls_client_timeout (gpointer user_data);
-static void soup_do_get (SoupServer *server, SoupMessage *msg, const char *path, App *app);
+static void soup_do_get (SoupServer *server, SoupMessage *msg, const char *path, GHashTable *query, App *app);
 static void soup_server_callback (SoupServer *server, SoupMessage *msg, const char *path, GHashTable *query, SoupClientContext *context, gpointer data);
 
-gboolean enable_tcp_upstream(App *app, const gchar *upstream_host, guint32 upstream_port, const gchar *token);
-gboolean disable_tcp_upstream(App *app);
+gboolean enable_tcp_upstream(DreamTCPupstream *t, const gchar *upstream_host, guint32 upstream_port, const gchar *token, const gchar *standby_host, guint32 standby_port);
+gboolean disable_tcp_upstream(DreamTCPupstream *t);
 
 DreamRTSPserver *create_rtsp_server(App *app);
 gboolean enable_rtsp_server(App *app, const gchar *path, guint32 port, const gchar *user, const gchar *pass);
@@ -17,16 +17,572 @@
  */
 
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/sockios.h>
+#include <linux/errqueue.h>
 
 #include "gstdreamrtsp.h"
 
-G_DEFINE_TYPE (GstDreamRTSPClient, gst_dream_rtsp_client, GST_TYPE_RTSP_CLIENT);
+struct _GstDreamRTSPClientPrivate
+{
+	guint pacing_rate;
+
+	/* bounded send queue, drained by a thread of its own so that a slow connection never blocks the shared media,
+	 * it writes on a connection of its own over a duplicate of the client socket so closing the client can't pull it away */
+	GMutex lock;
+	GCond cond;
+	GQueue queue;
+	GThread *sender;
+	GstRTSPConnection *connection;
+	gboolean stopping, closing, skipping;
+	guint8 keyframe_channels[32];
+	guint queue_limit;
+	gint queue_policy;
+	gsize queued_bytes;
+	guint64 sent_bytes, dropped;
+	guint skips;
+};
+
+typedef struct {
+	GstRTSPMessage *message;
+	gsize size;
+	gint64 queued;
+	guint8 channel;
+	guint32 rtptime;
+	gboolean close, rtp, keyframe;
+} GstDreamRTSPClientItem;
+
+G_DEFINE_TYPE_WITH_PRIVATE (GstDreamRTSPClient, gst_dream_rtsp_client, GST_TYPE_RTSP_CLIENT);
 
 GST_DEBUG_CATEGORY_STATIC (rtsp_server_debug);
 #define GST_CAT_DEFAULT rtsp_server_debug
 
+enum
+{
+	PROP_CLIENT_0,
+	PROP_CLIENT_PACING_RATE,
+	PROP_CLIENT_QUEUE_LIMIT,
+	PROP_CLIENT_QUEUE_POLICY,
+	PROP_CLIENT_QUEUE_STATS
+};
+
+enum
+{
+	CLIENT_SIGNAL_QUEUE_SKIPPED,
+	CLIENT_SIGNAL_LAST
+};
+
+static guint gst_dream_rtsp_client_signals[CLIENT_SIGNAL_LAST] = { 0 };
+
+/* a keyframe starts with parameter sets or an idr slice, in a transport stream with the random access indicator */
+static gboolean gst_dream_rtsp_client_is_keyframe (const guint8 *data, gsize size)
+{
+	gsize offset;
+
+	if (size < 12 || (data[0] >> 6) != 2)
+		return FALSE;
+	offset = 12 + (data[0] & 0x0f) * 4;
+	if ((data[0] & 0x10) && offset + 4 <= size)
+		offset += 4 + ((data[offset+2] << 8) | data[offset+3]) * 4;
+	if (offset >= size)
+		return FALSE;
+	data += offset;
+	size -= offset;
+
+	if (data[0] == 0x47 && size % 188 == 0)
+	{
+		for (offset = 0; offset + 188 <= size; offset += 188)
+			if ((data[offset+3] & 0x20) && data[offset+4] && (data[offset+5] & 0x40))
+				return TRUE;
+		return FALSE;
+	}
+	switch (data[0] & 0x1f) {
+		case 5:
+		case 7:
+			return TRUE;
+		case 24:
+			return size > 3 && (data[3] & 0x1f) == 7;
+		case 28:
+			return size > 1 && (data[1] & 0x80) && (data[1] & 0x1f) == 5;
+	}
+	return FALSE;
+}
+
+static void gst_dream_rtsp_client_item_parse (GstDreamRTSPClientItem *item, const guint8 *data, gsize size)
+{
+	item->size += size;
+	if (size >= 8)
+		item->rtptime = GST_READ_UINT32_BE (data + 4);
+	item->keyframe = gst_dream_rtsp_client_is_keyframe (data, size);
+}
+
+static GstDreamRTSPClientItem *gst_dream_rtsp_client_item_new (GstRTSPMessage *message, gboolean close)
+{
+	GstDreamRTSPClientItem *item = g_new0 (GstDreamRTSPClientItem, 1);
+	guint8 channel = 0;
+
+	gst_rtsp_message_copy (message, &item->message);
+	item->close = close;
+	item->queued = g_get_monotonic_time ();
+	item->size = 4;
+	/* interleaved rtcp goes on the odd channels and is never dropped */
+	if (gst_rtsp_message_get_type (message) == GST_RTSP_MESSAGE_DATA && gst_rtsp_message_parse_data (message, &channel) == GST_RTSP_OK)
+	{
+		guint8 *data = NULL;
+		guint size = 0;
+#if GST_CHECK_VERSION(1,16,0)
+		if (gst_rtsp_message_has_body_buffer (message))
+		{
+			GstBuffer *buffer = NULL;
+			GstMapInfo map;
+			gst_rtsp_message_get_body_buffer (message, &buffer);
+			if (buffer && gst_buffer_map (buffer, &map, GST_MAP_READ))
+			{
+				gst_dream_rtsp_client_item_parse (item, map.data, map.size);
+				gst_buffer_unmap (buffer, &map);
+			}
+		}
+		else
+#endif
+		if (gst_rtsp_message_get_body (message, &data, &size) == GST_RTSP_OK && data)
+			gst_dream_rtsp_client_item_parse (item, data, size);
+		item->channel = channel;
+		item->rtp = !(channel & 1);
+	}
+	return item;
+}
+
+static void gst_dream_rtsp_client_item_free (GstDreamRTSPClientItem *item)
+{
+	gst_rtsp_message_free (item->message);
+	g_free (item);
+}
+
+static gboolean gst_dream_rtsp_client_close_idle (gpointer user_data)
+{
+	GST_DEBUG_OBJECT (user_data, "closing client connection");
+	gst_rtsp_client_close (GST_RTSP_CLIENT (user_data));
+	return G_SOURCE_REMOVE;
+}
+
+/* the connection is closed from the main context, never from a streaming thread that the teardown might wait for */
+static void gst_dream_rtsp_client_schedule_close (GstDreamRTSPClient *self)
+{
+	GstDreamRTSPClientPrivate *priv = self->priv;
+	GstDreamRTSPClientItem *item;
+
+	if (priv->closing)
+		return;
+	priv->closing = TRUE;
+	while ((item = g_queue_pop_head (&priv->queue)))
+		gst_dream_rtsp_client_item_free (item);
+	priv->queued_bytes = 0;
+	g_idle_add_full (G_PRIORITY_DEFAULT, gst_dream_rtsp_client_close_idle, g_object_ref (self), g_object_unref);
+	g_cond_signal (&priv->cond);
+}
+
+#define KEYFRAME_CHANNEL_IS_SET(priv, channel) ((priv)->keyframe_channels[(channel) >> 3] & (1 << ((channel) & 7)))
+#define KEYFRAME_CHANNEL_SET(priv, channel) ((priv)->keyframe_channels[(channel) >> 3] |= (1 << ((channel) & 7)))
+
+static void gst_dream_rtsp_client_drop_until (GstDreamRTSPClientPrivate *priv, GList *keep)
+{
+	GList *l = priv->queue.head;
+
+	while (l && l != keep)
+	{
+		GList *next = l->next;
+		GstDreamRTSPClientItem *item = l->data;
+		if (item->rtp)
+		{
+			priv->queued_bytes -= item->size;
+			priv->dropped++;
+			gst_dream_rtsp_client_item_free (item);
+			g_queue_delete_link (&priv->queue, l);
+		}
+		l = next;
+	}
+}
+
+/* drops the queued rtp in front of the access unit of the newest keyframe; when that frees nothing or not enough,
+ * all of it goes and the channels that carry keyframes wait for the next one. returns whether anything was dropped */
+static gboolean gst_dream_rtsp_client_skip (GstDreamRTSPClient *self)
+{
+	GstDreamRTSPClientPrivate *priv = self->priv;
+	guint64 dropped = priv->dropped;
+	GList *l, *keep = NULL;
+	guint i;
+
+	for (l = priv->queue.tail; l && !keep; l = l->prev)
+	{
+		GstDreamRTSPClientItem *item = l->data;
+		if (item->rtp && item->keyframe)
+			keep = l;
+	}
+	/* parameter sets go out with the timestamp of the idr slice they belong to, other channels and rtcp in between are left alone */
+	if (keep)
+	{
+		GstDreamRTSPClientItem *keyframe = keep->data;
+		for (l = keep->prev; l; l = l->prev)
+		{
+			GstDreamRTSPClientItem *prev = l->data;
+			if (!prev->rtp || prev->channel != keyframe->channel)
+				continue;
+			if (prev->rtptime != keyframe->rtptime)
+				break;
+			keep = l;
+		}
+	}
+	if (keep)
+		gst_dream_rtsp_client_drop_until (priv, keep);
+
+	if (priv->dropped == dropped || priv->queued_bytes > priv->queue_limit)
+	{
+		gst_dream_rtsp_client_drop_until (priv, NULL);
+		for (i = 0; i < G_N_ELEMENTS (priv->keyframe_channels); i++)
+			if (priv->keyframe_channels[i])
+				priv->skipping = TRUE;
+		GST_DEBUG_OBJECT (self, "send queue overflow, dropped %" G_GUINT64_FORMAT " packets%s", priv->dropped - dropped, priv->skipping ? " and waiting for the next keyframe" : "");
+	}
+	else
+		GST_DEBUG_OBJECT (self, "send queue overflow, skipped %" G_GUINT64_FORMAT " packets to the newest queued keyframe", priv->dropped - dropped);
+
+	if (priv->dropped == dropped)
+		return FALSE;
+	priv->skips++;
+	return TRUE;
+}
+
+static gboolean gst_dream_rtsp_client_enqueue (GstRTSPClient * client, GstRTSPMessage * message, gboolean close, gpointer user_data)
+{
+	GstDreamRTSPClient *self = GST_DREAM_RTSP_CLIENT (client);
+	GstDreamRTSPClientPrivate *priv = self->priv;
+	GstDreamRTSPClientItem *item = gst_dream_rtsp_client_item_new (message, close);
+	gboolean skipped = FALSE;
+
+	g_mutex_lock (&priv->lock);
+	if (priv->closing || priv->stopping)
+	{
+		g_mutex_unlock (&priv->lock);
+		gst_dream_rtsp_client_item_free (item);
+		return FALSE;
+	}
+	if (item->rtp && item->keyframe)
+		KEYFRAME_CHANNEL_SET (priv, item->channel);
+	/* channels that never carried a keyframe, like audio, aren't held back */
+	if (item->rtp && priv->skipping && KEYFRAME_CHANNEL_IS_SET (priv, item->channel))
+	{
+		if (!item->keyframe)
+		{
+			priv->dropped++;
+			g_mutex_unlock (&priv->lock);
+			gst_dream_rtsp_client_item_free (item);
+			return TRUE;
+		}
+		priv->skipping = FALSE;
+	}
+	g_queue_push_tail (&priv->queue, item);
+	priv->queued_bytes += item->size;
+	if (priv->queue_limit && priv->queued_bytes > priv->queue_limit)
+	{
+		if (priv->queue_policy == DREAM_RTSP_CLIENT_POLICY_DISCONNECT)
+		{
+			GST_WARNING_OBJECT (self, "send queue exceeded %u bytes, disconnecting", priv->queue_limit);
+			gst_dream_rtsp_client_schedule_close (self);
+		}
+		else
+			skipped = gst_dream_rtsp_client_skip (self);
+	}
+	g_cond_signal (&priv->cond);
+	g_mutex_unlock (&priv->lock);
+
+	if (skipped)
+		g_signal_emit (self, gst_dream_rtsp_client_signals[CLIENT_SIGNAL_QUEUE_SKIPPED], 0);
+	return TRUE;
+}
+
+#if GST_CHECK_VERSION(1,16,0)
+static gboolean gst_dream_rtsp_client_enqueue_messages (GstRTSPClient * client, GstRTSPMessage * messages, guint n_messages, gboolean close, gpointer user_data)
+{
+	guint i;
+	for (i = 0; i < n_messages; i++)
+		if (!gst_dream_rtsp_client_enqueue (client, &messages[i], close && i == n_messages - 1, user_data))
+			return FALSE;
+	return TRUE;
+}
+#endif
+
+static gpointer gst_dream_rtsp_client_sender_thread (gpointer user_data)
+{
+	GstDreamRTSPClient *self = user_data;
+	GstDreamRTSPClientPrivate *priv = self->priv;
+	GstRTSPConnection *connection = priv->connection;
+	GstDreamRTSPClientItem *item;
+	GstRTSPResult res;
+#if !GST_CHECK_VERSION(1,18,0)
+	GTimeVal timeout = { DREAM_RTSP_CLIENT_SEND_TIMEOUT / G_USEC_PER_SEC, 0 };
+#endif
+
+	g_mutex_lock (&priv->lock);
+	while (!priv->stopping)
+	{
+		if (priv->closing || !(item = g_queue_pop_head (&priv->queue)))
+		{
+			g_cond_wait (&priv->cond, &priv->lock);
+			continue;
+		}
+		priv->queued_bytes -= item->size;
+		g_mutex_unlock (&priv->lock);
+
+#if GST_CHECK_VERSION(1,18,0)
+		res = gst_rtsp_connection_send_usec (connection, item->message, DREAM_RTSP_CLIENT_SEND_TIMEOUT);
+#else
+		res = gst_rtsp_connection_send (connection, item->message, &timeout);
+#endif
+
+		g_mutex_lock (&priv->lock);
+		if (res != GST_RTSP_OK && !priv->stopping)
+		{
+			gchar *err = gst_rtsp_strresult (res);
+			GST_WARNING_OBJECT (self, "couldn't send to client: %s", err);
+			g_free (err);
+			gst_dream_rtsp_client_schedule_close (self);
+		}
+		else if (res == GST_RTSP_OK)
+		{
+			priv->sent_bytes += item->size;
+			if (item->close)
+				gst_dream_rtsp_client_schedule_close (self);
+		}
+		gst_dream_rtsp_client_item_free (item);
+	}
+	g_mutex_unlock (&priv->lock);
+	return NULL;
+}
+
+/* takes over the writing from the watch, called once the client is attached to its connection */
+static void gst_dream_rtsp_client_start_queue (GstDreamRTSPClient *self)
+{
+	GstDreamRTSPClientPrivate *priv = self->priv;
+	GstRTSPConnection *connection = gst_rtsp_client_get_connection (GST_RTSP_CLIENT (self));
+	GSocket *socket = NULL;
+	GstRTSPResult res;
+	int fd;
+
+	if (!priv->queue_limit || !connection || priv->connection || gst_rtsp_connection_is_tunneled (connection))
+		return;
+
+	fd = dup (g_socket_get_fd (gst_rtsp_connection_get_write_socket (connection)));
+	if (fd >= 0)
+		socket = g_socket_new_from_fd (fd, NULL);
+	if (!socket)
+	{
+		GST_WARNING_OBJECT (self, "couldn't duplicate client socket, no send queue: %s", g_strerror (errno));
+		if (fd >= 0)
+			close (fd);
+		return;
+	}
+	res = gst_rtsp_connection_create_from_socket (socket, gst_rtsp_connection_get_ip (connection), 0, NULL, &priv->connection);
+	g_object_unref (socket);
+	if (res != GST_RTSP_OK)
+	{
+		GST_WARNING_OBJECT (self, "couldn't create send connection, no send queue");
+		priv->connection = NULL;
+		return;
+	}
+	priv->sender = g_thread_new ("dreamrtspclient", gst_dream_rtsp_client_sender_thread, self);
+
+	gst_rtsp_client_set_send_func (GST_RTSP_CLIENT (self), gst_dream_rtsp_client_enqueue, NULL, NULL);
+#if GST_CHECK_VERSION(1,16,0)
+	gst_rtsp_client_set_send_messages_func (GST_RTSP_CLIENT (self), gst_dream_rtsp_client_enqueue_messages, NULL, NULL);
+#endif
+	GST_DEBUG_OBJECT (self, "send queue of %u bytes, on overflow %s", priv->queue_limit, priv->queue_policy == DREAM_RTSP_CLIENT_POLICY_DISCONNECT ? "disconnect" : "skip to keyframe");
+}
+
+/* cancels a send in progress and joins the sender before the connection goes away */
+static void gst_dream_rtsp_client_stop_queue (GstDreamRTSPClient *self)
+{
+	GstDreamRTSPClientPrivate *priv = self->priv;
+	GstDreamRTSPClientItem *item;
+	GThread *sender;
+
+	g_mutex_lock (&priv->lock);
+	priv->stopping = TRUE;
+	sender = priv->sender;
+	priv->sender = NULL;
+	g_cond_signal (&priv->cond);
+	g_mutex_unlock (&priv->lock);
+
+	if (priv->connection)
+		gst_rtsp_connection_flush (priv->connection, TRUE);
+	if (sender)
+		g_thread_join (sender);
+	if (priv->connection)
+	{
+		gst_rtsp_connection_free (priv->connection);
+		priv->connection = NULL;
+	}
+
+	g_mutex_lock (&priv->lock);
+	while ((item = g_queue_pop_head (&priv->queue)))
+		gst_dream_rtsp_client_item_free (item);
+	priv->queued_bytes = 0;
+	g_mutex_unlock (&priv->lock);
+}
+
+static void gst_dream_rtsp_client_closed (GstRTSPClient * client)
+{
+	gst_dream_rtsp_client_stop_queue (GST_DREAM_RTSP_CLIENT (client));
+	if (GST_RTSP_CLIENT_CLASS (gst_dream_rtsp_client_parent_class)->closed)
+		GST_RTSP_CLIENT_CLASS (gst_dream_rtsp_client_parent_class)->closed (client);
+}
+
+static GstStructure *gst_dream_rtsp_client_get_queue_stats (GstDreamRTSPClient *self)
+{
+	GstDreamRTSPClientPrivate *priv = self->priv;
+	GstDreamRTSPClientItem *head;
+	GstStructure *s;
+	guint lag = 0;
+
+	g_mutex_lock (&priv->lock);
+	head = g_queue_peek_head (&priv->queue);
+	if (head)
+		lag = (g_get_monotonic_time () - head->queued) / 1000;
+	s = gst_structure_new ("dream-rtsp-client-queue",
+		"lag", G_TYPE_UINT, lag,
+		"queued-bytes", G_TYPE_UINT64, (guint64) priv->queued_bytes,
+		"queued-messages", G_TYPE_UINT, g_queue_get_length (&priv->queue),
+		"sent-bytes", G_TYPE_UINT64, priv->sent_bytes,
+		"dropped", G_TYPE_UINT64, priv->dropped,
+		"skips", G_TYPE_UINT, priv->skips,
+		"skipping", G_TYPE_BOOLEAN, priv->skipping, NULL);
+	g_mutex_unlock (&priv->lock);
+	return s;
+}
+
+/* shared media send the same packets to every client, so the kernel paces the interleaved connection of each one on its own */
+static void gst_dream_rtsp_client_play_request (GstRTSPClient * client, GstRTSPContext * ctx)
+{
+	GstDreamRTSPClient *self = GST_DREAM_RTSP_CLIENT (client);
+	GstRTSPConnection *connection = gst_rtsp_client_get_connection (client);
+	gboolean interleaved = FALSE;
+	guint i, n;
+
+	if (GST_RTSP_CLIENT_CLASS (gst_dream_rtsp_client_parent_class)->play_request)
+		GST_RTSP_CLIENT_CLASS (gst_dream_rtsp_client_parent_class)->play_request (client, ctx);
+
+	if (!self->priv->pacing_rate || !ctx->sessmedia || !connection)
+		return;
+
+	n = gst_rtsp_media_n_streams (gst_rtsp_session_media_get_media (ctx->sessmedia));
+	for (i = 0; i < n; i++)
+	{
+		GstRTSPStreamTransport *trans = gst_rtsp_session_media_get_transport (ctx->sessmedia, i);
+		if (trans && gst_rtsp_stream_transport_get_transport (trans)->lower_transport == GST_RTSP_LOWER_TRANS_TCP)
+			interleaved = TRUE;
+	}
+	if (!interleaved)
+		return;
+
+#ifdef SO_MAX_PACING_RATE
+	guint32 rate = self->priv->pacing_rate * 125;
+	int fd = g_socket_get_fd (gst_rtsp_connection_get_write_socket (connection));
+	if (setsockopt (fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof (rate)) < 0)
+		GST_WARNING_OBJECT (client, "couldn't set SO_MAX_PACING_RATE: %s", g_strerror (errno));
+	else
+		GST_DEBUG_OBJECT (client, "pacing interleaved connection to %u kbit/s", self->priv->pacing_rate);
+#endif
+}
+
+static void gst_dream_rtsp_client_set_property (GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec)
+{
+	GstDreamRTSPClient *self = GST_DREAM_RTSP_CLIENT (object);
+
+	switch (prop_id) {
+		case PROP_CLIENT_PACING_RATE:
+			self->priv->pacing_rate = g_value_get_uint (value);
+			break;
+		case PROP_CLIENT_QUEUE_LIMIT:
+			g_mutex_lock (&self->priv->lock);
+			self->priv->queue_limit = g_value_get_uint (value);
+			g_mutex_unlock (&self->priv->lock);
+			break;
+		case PROP_CLIENT_QUEUE_POLICY:
+			g_mutex_lock (&self->priv->lock);
+			self->priv->queue_policy = g_value_get_int (value);
+			g_mutex_unlock (&self->priv->lock);
+			break;
+		default:
+			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+			break;
+	}
+}
+
+static void gst_dream_rtsp_client_get_property (GObject *object, guint prop_id, GValue *value, GParamSpec *pspec)
+{
+	GstDreamRTSPClient *self = GST_DREAM_RTSP_CLIENT (object);
+
+	switch (prop_id) {
+		case PROP_CLIENT_PACING_RATE:
+			g_value_set_uint (value, self->priv->pacing_rate);
+			break;
+		case PROP_CLIENT_QUEUE_LIMIT:
+			g_value_set_uint (value, self->priv->queue_limit);
+			break;
+		case PROP_CLIENT_QUEUE_POLICY:
+			g_value_set_int (value, self->priv->queue_policy);
+			break;
+		case PROP_CLIENT_QUEUE_STATS:
+			g_value_take_boxed (value, gst_dream_rtsp_client_get_queue_stats (self));
+			break;
+		default:
+			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+			break;
+	}
+}
+
+static void gst_dream_rtsp_client_finalize (GObject * object)
+{
+	GstDreamRTSPClient *self = GST_DREAM_RTSP_CLIENT (object);
+	GstDreamRTSPClientPrivate *priv = self->priv;
+
+	gst_dream_rtsp_client_stop_queue (self);
+	g_mutex_clear (&priv->lock);
+	g_cond_clear (&priv->cond);
+	G_OBJECT_CLASS (gst_dream_rtsp_client_parent_class)->finalize (object);
+}
+
 static void gst_dream_rtsp_client_class_init (GstDreamRTSPClientClass * klass)
 {
+	GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+	GstRTSPClientClass *client_class = GST_RTSP_CLIENT_CLASS (klass);
+
+	gobject_class->set_property = gst_dream_rtsp_client_set_property;
+	gobject_class->get_property = gst_dream_rtsp_client_get_property;
+	gobject_class->finalize = gst_dream_rtsp_client_finalize;
+	client_class->play_request = gst_dream_rtsp_client_play_request;
+	client_class->closed = gst_dream_rtsp_client_closed;
+
+	g_object_class_install_property (gobject_class, PROP_CLIENT_PACING_RATE,
+		g_param_spec_uint ("pacing-rate", "Pacing rate", "Peak rate in kbit/s interleaved RTP is paced to, applied on PLAY (0 = unpaced)", 0, G_MAXUINT / 125, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_CLIENT_QUEUE_LIMIT,
+		g_param_spec_uint ("queue-limit", "Queue limit", "Bytes the send queue of the client may hold, must be set before the client connects to take effect (0 = the connection's own backlog)", 0, G_MAXUINT, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_CLIENT_QUEUE_POLICY,
+		g_param_spec_int ("queue-policy", "Queue policy", "What to do when the send queue overflows (0 = skip to the latest keyframe, 1 = disconnect)", DREAM_RTSP_CLIENT_POLICY_SKIP, DREAM_RTSP_CLIENT_POLICY_DISCONNECT, DREAM_RTSP_CLIENT_POLICY_SKIP, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_CLIENT_QUEUE_STATS,
+		g_param_spec_boxed ("queue-stats", "Queue stats", "Lag, fill level and drops of the send queue", GST_TYPE_STRUCTURE, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+	gst_dream_rtsp_client_signals[CLIENT_SIGNAL_QUEUE_SKIPPED] =
+		g_signal_new ("queue-skipped", G_TYPE_FROM_CLASS (klass),
+		G_SIGNAL_RUN_LAST, 0, NULL, NULL, NULL,
+		G_TYPE_NONE, 0);
+
 	GST_DEBUG_CATEGORY_INIT (rtsp_server_debug, "dreamrtspserver",
 			GST_DEBUG_BOLD | GST_DEBUG_FG_YELLOW | GST_DEBUG_BG_BLUE,
 			"Dreambox RTSP server daemon");
@@ -34,15 +590,211 @@ static void gst_dream_rtsp_client_class_init (GstDreamRTSPClientClass * klass)
 
 static void gst_dream_rtsp_client_init (GstDreamRTSPClient * client)
 {
+	client->priv = gst_dream_rtsp_client_get_instance_private (client);
+	client->priv->pacing_rate = 0;
+	g_mutex_init (&client->priv->lock);
+	g_cond_init (&client->priv->cond);
+	g_queue_init (&client->priv->queue);
+	client->priv->sender = NULL;
+	client->priv->connection = NULL;
+	client->priv->stopping = client->priv->closing = client->priv->skipping = FALSE;
+	memset (client->priv->keyframe_channels, 0, sizeof (client->priv->keyframe_channels));
+	client->priv->queue_limit = 0;
+	client->priv->queue_policy = DREAM_RTSP_CLIENT_POLICY_SKIP;
+	client->priv->queued_bytes = 0;
+	client->priv->sent_bytes = client->priv->dropped = 0;
+	client->priv->skips = 0;
 	GST_DEBUG_OBJECT (client, "Client is initialized");
 }
 
+GstDreamRTSPPacer *gst_dream_rtsp_pacer_new (guint peak_rate, GstClockTime frame_interval)
+{
+	GstDreamRTSPPacer *pacer = g_new0 (GstDreamRTSPPacer, 1);
+	pacer->refcount = 1;
+	g_mutex_init (&pacer->lock);
+	pacer->peak_rate = peak_rate;
+	pacer->frame_interval = frame_interval ? frame_interval : DREAM_RTSP_PACER_FRAME_INTERVAL;
+	pacer->au_pts = GST_CLOCK_TIME_NONE;
+	pacer->tokens = DREAM_RTSP_PACER_BURST;
+	return pacer;
+}
+
+GstDreamRTSPPacer *gst_dream_rtsp_pacer_ref (GstDreamRTSPPacer *pacer)
+{
+	g_atomic_int_inc (&pacer->refcount);
+	return pacer;
+}
+
+void gst_dream_rtsp_pacer_unref (GstDreamRTSPPacer *pacer)
+{
+	if (!g_atomic_int_dec_and_test (&pacer->refcount))
+		return;
+	g_mutex_clear (&pacer->lock);
+	g_free (pacer);
+}
+
+void gst_dream_rtsp_pacer_set_peak_rate (GstDreamRTSPPacer *pacer, guint peak_rate)
+{
+	g_mutex_lock (&pacer->lock);
+	pacer->peak_rate = peak_rate;
+	g_mutex_unlock (&pacer->lock);
+}
+
+void gst_dream_rtsp_pacer_get_stats (GstDreamRTSPPacer *pacer, guint64 *paced_bytes, guint64 *paced_packets, guint64 *queue_delay, guint64 *max_queue_delay)
+{
+	g_mutex_lock (&pacer->lock);
+	*paced_bytes = pacer->paced_bytes;
+	*paced_packets = pacer->paced_packets;
+	*queue_delay = pacer->paced_packets ? pacer->delay_sum / pacer->paced_packets : 0;
+	*max_queue_delay = pacer->delay_max;
+	g_mutex_unlock (&pacer->lock);
+}
+
+/* buffers with the same timestamp make up one access unit, the pacer is called with the lock held */
+static gboolean gst_dream_rtsp_pacer_add_input (GstBuffer **buffer, guint idx, gpointer user_data)
+{
+	GstDreamRTSPPacer *pacer = user_data;
+	gsize size = gst_buffer_get_size (*buffer);
+	gint64 now = g_get_monotonic_time ();
+
+	if (!GST_BUFFER_PTS_IS_VALID (*buffer) || GST_BUFFER_PTS (*buffer) == pacer->au_pts)
+		pacer->au_bytes += size;
+	else
+	{
+		pacer->au_pts = GST_BUFFER_PTS (*buffer);
+		pacer->au_bytes = size;
+		pacer->frame_arrival = now;
+	}
+
+	pacer->window_bytes += size;
+	if (!pacer->window_start)
+		pacer->window_start = now;
+	else if (now - pacer->window_start >= DREAM_RTSP_PACER_RATE_WINDOW)
+	{
+		pacer->stream_rate = (gdouble) pacer->window_bytes * G_USEC_PER_SEC / (now - pacer->window_start);
+		pacer->window_start = now;
+		pacer->window_bytes = 0;
+	}
+	return TRUE;
+}
+
+/* what goes into the payloader sets the rate its packets leave at: the access unit spread over the frame interval,
+ * and never less than the stream rate, both with some headroom so the pacer can't fall behind the encoder */
+static GstPadProbeReturn gst_dream_rtsp_pacer_frame_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+	GstDreamRTSPPacer *pacer = user_data;
+
+	g_mutex_lock (&pacer->lock);
+	if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+		gst_buffer_list_foreach (GST_PAD_PROBE_INFO_BUFFER_LIST (info), gst_dream_rtsp_pacer_add_input, pacer);
+	else
+		gst_dream_rtsp_pacer_add_input (&GST_PAD_PROBE_INFO_BUFFER (info), 0, pacer);
+
+	pacer->rate = pacer->stream_rate;
+	if (GST_CLOCK_TIME_IS_VALID (pacer->frame_interval))
+		pacer->rate = MAX (pacer->rate, (gdouble) pacer->au_bytes * GST_SECOND / pacer->frame_interval);
+	pacer->rate *= DREAM_RTSP_PACER_HEADROOM;
+	if (pacer->rate > pacer->peak_rate * 125.0)
+		pacer->rate = pacer->peak_rate * 125.0;
+	g_mutex_unlock (&pacer->lock);
+	return GST_PAD_PROBE_OK;
+}
+
+/* token bucket in bytes, a packet that runs it into debt waits until that is paid off */
+static void gst_dream_rtsp_pacer_wait (GstDreamRTSPPacer *pacer, gsize size)
+{
+	gint64 now, wait = 0;
+
+	g_mutex_lock (&pacer->lock);
+	if (!pacer->peak_rate || pacer->rate <= 0)
+	{
+		g_mutex_unlock (&pacer->lock);
+		return;
+	}
+	now = g_get_monotonic_time ();
+	if (pacer->refill)
+		pacer->tokens = MIN (pacer->tokens + (now - pacer->refill) * pacer->rate / G_USEC_PER_SEC, DREAM_RTSP_PACER_BURST);
+	pacer->refill = now;
+	pacer->tokens -= size;
+	if (pacer->tokens < 0)
+		wait = -pacer->tokens * G_USEC_PER_SEC / pacer->rate;
+	pacer->paced_bytes += size;
+	pacer->paced_packets++;
+	if (pacer->frame_arrival && now + wait > pacer->frame_arrival)
+	{
+		guint64 delay = now + wait - pacer->frame_arrival;
+		pacer->delay_sum += delay;
+		pacer->delay_max = MAX (pacer->delay_max, delay);
+	}
+	g_mutex_unlock (&pacer->lock);
+
+	if (wait)
+		g_usleep (wait);
+}
+
+/* sleeping here holds the payloader back, packet lists are pushed one by one so that a keyframe doesn't leave as one burst */
+static GstPadProbeReturn gst_dream_rtsp_pacer_packet_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+	GstDreamRTSPPacer *pacer = user_data;
+	GstBufferList *list;
+	GstFlowReturn ret = GST_FLOW_OK;
+	gboolean paced;
+	guint i;
+
+	if (info->type & GST_PAD_PROBE_TYPE_BUFFER)
+	{
+		gst_dream_rtsp_pacer_wait (pacer, gst_buffer_get_size (GST_PAD_PROBE_INFO_BUFFER (info)));
+		return GST_PAD_PROBE_OK;
+	}
+
+	g_mutex_lock (&pacer->lock);
+	paced = pacer->peak_rate != 0;
+	g_mutex_unlock (&pacer->lock);
+	if (!paced)
+		return GST_PAD_PROBE_OK;
+
+	/* every single buffer comes through this probe again and waits for its turn there */
+	list = GST_PAD_PROBE_INFO_BUFFER_LIST (info);
+	for (i = 0; i < gst_buffer_list_length (list) && ret == GST_FLOW_OK; i++)
+		ret = gst_pad_push (pad, gst_buffer_ref (gst_buffer_list_get (list, i)));
+	gst_buffer_list_unref (list);
+	GST_PAD_PROBE_INFO_FLOW_RETURN (info) = ret;
+	return GST_PAD_PROBE_HANDLED;
+}
+
+gboolean gst_dream_rtsp_pacer_attach (GstDreamRTSPPacer *pacer, GstElement *payloader)
+{
+	GstPad *sinkpad = gst_element_get_static_pad (payloader, "sink");
+	GstPad *srcpad = gst_element_get_static_pad (payloader, "src");
+
+	if (!sinkpad || !srcpad)
+	{
+		if (sinkpad)
+			gst_object_unref (sinkpad);
+		if (srcpad)
+			gst_object_unref (srcpad);
+		return FALSE;
+	}
+	gst_pad_add_probe (sinkpad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST, gst_dream_rtsp_pacer_frame_probe, gst_dream_rtsp_pacer_ref (pacer), (GDestroyNotify) gst_dream_rtsp_pacer_unref);
+	gst_pad_add_probe (srcpad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST, gst_dream_rtsp_pacer_packet_probe, gst_dream_rtsp_pacer_ref (pacer), (GDestroyNotify) gst_dream_rtsp_pacer_unref);
+	gst_object_unref (sinkpad);
+	gst_object_unref (srcpad);
+	return TRUE;
+}
+
 #define gst_dream_rtsp_server_parent_class parent_class
 G_DEFINE_TYPE (GstDreamRTSPServer, gst_dream_rtsp_server, GST_TYPE_RTSP_SERVER);
 
 static GstRTSPClient *gst_dream_rtsp_create_client (GstRTSPServer * server);
 static void gst_dream_rtsp_server_finalize (GObject * object);
 
+/* runs after the server attached the client, so the send queue can take over from the watch */
+static void gst_dream_rtsp_server_client_connected (GstRTSPServer * server, GstRTSPClient * client)
+{
+	if (GST_IS_DREAM_RTSP_CLIENT (client))
+		gst_dream_rtsp_client_start_queue (GST_DREAM_RTSP_CLIENT (client));
+}
+
 static void gst_dream_rtsp_server_init (GstDreamRTSPServer *server)
 {
 	GST_DEBUG_OBJECT (server, "dream_rtsp_server_init GstDreamRTSPServer@%p", server);
@@ -54,6 +806,7 @@ static void gst_dream_rtsp_server_class_init (GstDreamRTSPServerClass * klass)
 	GstRTSPServerClass *parent_class = GST_RTSP_SERVER_CLASS (klass);
 
 	parent_class->create_client = gst_dream_rtsp_create_client;
+	parent_class->client_connected = gst_dream_rtsp_server_client_connected;
 	gobject_class->finalize = gst_dream_rtsp_server_finalize;
 
 	GST_DEBUG_CATEGORY_INIT (rtsp_server_debug, "dreamrtspserver",
@@ -228,3 +981,2844 @@ gst_dream_rtsp_media_factory_new ()
 
 	return result;
 }
+
+enum
+{
+	PROP_0,
+	PROP_INPUT_MODE,
+	PROP_BITRATE,
+	PROP_GOP_LENGTH,
+	PROP_GOP_SCENE,
+	PROP_OPEN_GOP,
+	PROP_BFRAMES,
+	PROP_PFRAMES,
+	PROP_SLICES,
+	PROP_LEVEL,
+	PROP_CAPS
+};
+
+#define SOFT_SOURCE_DEFAULT_WIDTH 1280
+#define SOFT_SOURCE_DEFAULT_HEIGHT 720
+#define SOFT_SOURCE_DEFAULT_FRAMERATE 25
+#define SOFT_SOURCE_DEFAULT_VIDEO_BITRATE 2048
+#define SOFT_SOURCE_DEFAULT_AUDIO_BITRATE 128
+#define SOFT_SOURCE_AUDIO_RATE 48000
+
+static const gchar *soft_source_aac_encoders[] = { "fdkaacenc", "avenc_aac", "voaacenc", "faac", NULL };
+
+/* the encoders disagree on integer widths (avenc_aac uses gint64), so let GValue transform it */
+static void soft_source_set_int (GstElement *element, const gchar *key, gint value)
+{
+	GValue val = G_VALUE_INIT;
+	if (!element || !g_object_class_find_property (G_OBJECT_GET_CLASS (element), key))
+		return;
+	g_value_init (&val, G_TYPE_INT);
+	g_value_set_int (&val, value);
+	g_object_set_property (G_OBJECT (element), key, &val);
+	g_value_unset (&val);
+}
+
+static gint soft_source_caps_get_int (const GstStructure *structure, const gchar *field)
+{
+	gint ivalue = 0;
+	guint uvalue = 0;
+	if (gst_structure_get_int (structure, field, &ivalue))
+		return ivalue;
+	if (gst_structure_get_uint (structure, field, &uvalue))
+		return (gint) uvalue;
+	return 0;
+}
+
+G_DEFINE_TYPE (GstDreamSoftVideoSource, gst_dream_soft_video_source, GST_TYPE_BIN);
+
+static void gst_dream_soft_video_source_apply_encoder (GstDreamSoftVideoSource *self)
+{
+	if (!self->encoder)
+		return;
+
+	soft_source_set_int (self->encoder, "bitrate", self->bitrate);
+	soft_source_set_int (self->encoder, "key-int-max", self->gop_length);
+	soft_source_set_int (self->encoder, "bframes", self->bframes);
+
+	gchar *options = g_strdup_printf ("scenecut=%d:open-gop=%d:slices=%d", self->gop_scene ? 40 : 0, self->open_gop ? 1 : 0, self->slices);
+	g_object_set (G_OBJECT (self->encoder), "option-string", options, NULL);
+	GST_DEBUG_OBJECT (self, "bitrate=%d key-int-max=%d bframes=%d option-string='%s'", self->bitrate, self->gop_length, self->bframes, options);
+	g_free (options);
+}
+
+static void gst_dream_soft_video_source_apply_caps (GstDreamSoftVideoSource *self)
+{
+	const GstStructure *structure;
+	GstCaps *rawcaps, *enccaps;
+	const GValue *framerate;
+	const gchar *profile;
+	gint width, height;
+
+	if (!self->caps || gst_caps_is_empty (self->caps))
+		return;
+
+	structure = gst_caps_get_structure (self->caps, 0);
+	width = soft_source_caps_get_int (structure, "width");
+	height = soft_source_caps_get_int (structure, "height");
+	framerate = gst_structure_get_value (structure, "framerate");
+	profile = gst_structure_get_string (structure, "profile");
+
+	rawcaps = gst_caps_new_empty_simple ("video/x-raw");
+	if (width && height)
+		gst_caps_set_simple (rawcaps, "width", G_TYPE_INT, width, "height", G_TYPE_INT, height, NULL);
+	if (framerate && GST_VALUE_HOLDS_FRACTION (framerate))
+		gst_caps_set_value (rawcaps, "framerate", framerate);
+
+	enccaps = gst_caps_new_simple ("video/x-h264", "stream-format", G_TYPE_STRING, "byte-stream", "alignment", G_TYPE_STRING, "au", NULL);
+	if (profile)
+		gst_caps_set_simple (enccaps, "profile", G_TYPE_STRING, profile, NULL);
+
+	GST_DEBUG_OBJECT (self, "raw caps %" GST_PTR_FORMAT " encoder caps %" GST_PTR_FORMAT, rawcaps, enccaps);
+	g_object_set (G_OBJECT (self->rawfilter), "caps", rawcaps, NULL);
+	g_object_set (G_OBJECT (self->encfilter), "caps", enccaps, NULL);
+	gst_caps_unref (rawcaps);
+	gst_caps_unref (enccaps);
+}
+
+static void gst_dream_soft_video_source_set_property (GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec)
+{
+	GstDreamSoftVideoSource *self = GST_DREAM_SOFT_VIDEO_SOURCE (object);
+
+	switch (prop_id) {
+		case PROP_INPUT_MODE:
+			self->input_mode = g_value_get_int (value);
+			return;
+		case PROP_BITRATE:
+			self->bitrate = g_value_get_int (value);
+			break;
+		case PROP_GOP_LENGTH:
+			self->gop_length = g_value_get_int (value);
+			break;
+		case PROP_GOP_SCENE:
+			self->gop_scene = g_value_get_boolean (value);
+			break;
+		case PROP_OPEN_GOP:
+			self->open_gop = g_value_get_boolean (value);
+			break;
+		case PROP_BFRAMES:
+			self->bframes = g_value_get_int (value);
+			break;
+		case PROP_PFRAMES:
+			self->pframes = g_value_get_int (value);
+			return;
+		case PROP_SLICES:
+			self->slices = g_value_get_int (value);
+			break;
+		case PROP_LEVEL:
+			self->level = g_value_get_int (value);
+			return;
+		case PROP_CAPS:
+			if (self->caps)
+				gst_caps_unref (self->caps);
+			self->caps = g_value_dup_boxed (value);
+			gst_dream_soft_video_source_apply_caps (self);
+			return;
+		default:
+			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+			return;
+	}
+	gst_dream_soft_video_source_apply_encoder (self);
+}
+
+static void gst_dream_soft_video_source_get_property (GObject *object, guint prop_id, GValue *value, GParamSpec *pspec)
+{
+	GstDreamSoftVideoSource *self = GST_DREAM_SOFT_VIDEO_SOURCE (object);
+
+	switch (prop_id) {
+		case PROP_INPUT_MODE:
+			g_value_set_int (value, self->input_mode);
+			break;
+		case PROP_BITRATE:
+			g_value_set_int (value, self->bitrate);
+			break;
+		case PROP_GOP_LENGTH:
+			g_value_set_int (value, self->gop_length);
+			break;
+		case PROP_GOP_SCENE:
+			g_value_set_boolean (value, self->gop_scene);
+			break;
+		case PROP_OPEN_GOP:
+			g_value_set_boolean (value, self->open_gop);
+			break;
+		case PROP_BFRAMES:
+			g_value_set_int (value, self->bframes);
+			break;
+		case PROP_PFRAMES:
+			g_value_set_int (value, self->pframes);
+			break;
+		case PROP_SLICES:
+			g_value_set_int (value, self->slices);
+			break;
+		case PROP_LEVEL:
+			g_value_set_int (value, self->level);
+			break;
+		case PROP_CAPS:
+			g_value_set_boxed (value, self->caps);
+			break;
+		default:
+			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+			break;
+	}
+}
+
+static GstStateChangeReturn gst_dream_soft_video_source_change_state (GstElement *element, GstStateChange transition)
+{
+	GstDreamSoftVideoSource *self = GST_DREAM_SOFT_VIDEO_SOURCE (element);
+
+	if (transition == GST_STATE_CHANGE_NULL_TO_READY && !self->encoder)
+	{
+		GST_ELEMENT_ERROR (self, CORE, MISSING_PLUGIN, ("x264enc is not available"), (NULL));
+		return GST_STATE_CHANGE_FAILURE;
+	}
+	return GST_ELEMENT_CLASS (gst_dream_soft_video_source_parent_class)->change_state (element, transition);
+}
+
+static void gst_dream_soft_video_source_finalize (GObject *object)
+{
+	GstDreamSoftVideoSource *self = GST_DREAM_SOFT_VIDEO_SOURCE (object);
+	if (self->caps)
+		gst_caps_unref (self->caps);
+	G_OBJECT_CLASS (gst_dream_soft_video_source_parent_class)->finalize (object);
+}
+
+static void gst_dream_soft_video_source_class_init (GstDreamSoftVideoSourceClass * klass)
+{
+	GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+	GstElementClass *element_class = GST_ELEMENT_CLASS (klass);
+
+	gobject_class->set_property = gst_dream_soft_video_source_set_property;
+	gobject_class->get_property = gst_dream_soft_video_source_get_property;
+	gobject_class->finalize = gst_dream_soft_video_source_finalize;
+	element_class->change_state = gst_dream_soft_video_source_change_state;
+
+	g_object_class_install_property (gobject_class, PROP_INPUT_MODE,
+		g_param_spec_int ("input_mode", "Input mode", "Accepted for compatibility, the test pattern ignores it", 0, 2, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_BITRATE,
+		g_param_spec_int ("bitrate", "Bitrate", "Video bitrate in kbit/s", 0, G_MAXINT, SOFT_SOURCE_DEFAULT_VIDEO_BITRATE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_GOP_LENGTH,
+		g_param_spec_int ("gop-length", "GOP length", "Maximum distance between keyframes in frames (0 = auto)", 0, G_MAXINT, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_GOP_SCENE,
+		g_param_spec_boolean ("gop-scene", "GOP on scene change", "Insert keyframes on scene cuts", FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_OPEN_GOP,
+		g_param_spec_boolean ("open-gop", "Open GOP", "Use open GOPs", FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_BFRAMES,
+		g_param_spec_int ("bframes", "B-frames", "Number of consecutive B-frames", 0, 16, 2, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_PFRAMES,
+		g_param_spec_int ("pframes", "P-frames", "Accepted for compatibility, x264 has no equivalent", 0, G_MAXINT, 1, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_SLICES,
+		g_param_spec_int ("slices", "Slices", "Number of slices per frame (0 = auto)", 0, 32, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_LEVEL,
+		g_param_spec_int ("level", "Level", "Accepted for compatibility, x264 derives the level itself", 0, G_MAXINT, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_CAPS,
+		g_param_spec_boxed ("caps", "Caps", "Resolution, framerate and profile of the encoded stream", GST_TYPE_CAPS, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	gst_element_class_set_static_metadata (element_class, "Dreambox software video source", "Source/Video",
+		"Test pattern encoded with x264enc, stands in for dreamvideosource", "Andreas Frisch <fraxinas@opendreambox.org>");
+
+	GST_DEBUG_CATEGORY_INIT (rtsp_server_debug, "dreamrtspserver",
+		GST_DEBUG_BOLD | GST_DEBUG_FG_YELLOW | GST_DEBUG_BG_BLUE,
+		"Dreambox RTSP server daemon");
+}
+
+static void gst_dream_soft_video_source_init (GstDreamSoftVideoSource * self)
+{
+	GstPad *srcpad, *ghostpad;
+
+	self->bitrate = SOFT_SOURCE_DEFAULT_VIDEO_BITRATE;
+	self->bframes = 2;
+	self->pframes = 1;
+	self->caps = gst_caps_new_simple ("video/x-raw",
+		"width", G_TYPE_UINT, SOFT_SOURCE_DEFAULT_WIDTH,
+		"height", G_TYPE_UINT, SOFT_SOURCE_DEFAULT_HEIGHT,
+		"framerate", GST_TYPE_FRACTION, SOFT_SOURCE_DEFAULT_FRAMERATE, 1,
+		"profile", G_TYPE_STRING, "main", NULL);
+
+	self->testsrc = gst_element_factory_make ("videotestsrc", NULL);
+	self->rawfilter = gst_element_factory_make ("capsfilter", NULL);
+	self->encoder = gst_element_factory_make ("x264enc", NULL);
+	self->encfilter = gst_element_factory_make ("capsfilter", NULL);
+
+	if (!(self->testsrc && self->rawfilter && self->encoder && self->encfilter))
+	{
+		GST_ERROR_OBJECT (self, "missing element(s):%s%s%s", self->testsrc?"":" videotestsrc", self->rawfilter&&self->encfilter?"":" capsfilter", self->encoder?"":" x264enc");
+		if (self->testsrc)
+			gst_object_unref (self->testsrc);
+		if (self->rawfilter)
+			gst_object_unref (self->rawfilter);
+		if (self->encoder)
+			gst_object_unref (self->encoder);
+		if (self->encfilter)
+			gst_object_unref (self->encfilter);
+		self->testsrc = self->rawfilter = self->encoder = self->encfilter = NULL;
+		return;
+	}
+
+	g_object_set (G_OBJECT (self->testsrc), "is-live", TRUE, NULL);
+	gst_util_set_object_arg (G_OBJECT (self->testsrc), "pattern", "smpte");
+	gst_util_set_object_arg (G_OBJECT (self->encoder), "speed-preset", "ultrafast");
+	g_object_set (G_OBJECT (self->encoder), "byte-stream", TRUE, "rc-lookahead", 0, "sync-lookahead", 0, NULL);
+
+	gst_bin_add_many (GST_BIN (self), self->testsrc, self->rawfilter, self->encoder, self->encfilter, NULL);
+	gst_element_link_many (self->testsrc, self->rawfilter, self->encoder, self->encfilter, NULL);
+
+	srcpad = gst_element_get_static_pad (self->encfilter, "src");
+	ghostpad = gst_ghost_pad_new ("src", srcpad);
+	gst_element_add_pad (GST_ELEMENT (self), ghostpad);
+	gst_object_unref (srcpad);
+
+	gst_dream_soft_video_source_apply_caps (self);
+	gst_dream_soft_video_source_apply_encoder (self);
+}
+
+enum
+{
+	SIGNAL_SIGNAL_LOST,
+	SOFT_AUDIO_SIGNAL_LAST
+};
+
+static guint gst_dream_soft_audio_source_signals[SOFT_AUDIO_SIGNAL_LAST] = { 0 };
+
+G_DEFINE_TYPE (GstDreamSoftAudioSource, gst_dream_soft_audio_source, GST_TYPE_BIN);
+
+static void gst_dream_soft_audio_source_set_property (GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec)
+{
+	GstDreamSoftAudioSource *self = GST_DREAM_SOFT_AUDIO_SOURCE (object);
+
+	switch (prop_id) {
+		case PROP_INPUT_MODE:
+			self->input_mode = g_value_get_int (value);
+			break;
+		case PROP_BITRATE:
+			self->bitrate = g_value_get_int (value);
+			soft_source_set_int (self->encoder, "bitrate", self->bitrate * 1000);
+			break;
+		default:
+			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+			break;
+	}
+}
+
+static void gst_dream_soft_audio_source_get_property (GObject *object, guint prop_id, GValue *value, GParamSpec *pspec)
+{
+	GstDreamSoftAudioSource *self = GST_DREAM_SOFT_AUDIO_SOURCE (object);
+
+	switch (prop_id) {
+		case PROP_INPUT_MODE:
+			g_value_set_int (value, self->input_mode);
+			break;
+		case PROP_BITRATE:
+			g_value_set_int (value, self->bitrate);
+			break;
+		default:
+			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+			break;
+	}
+}
+
+static GstStateChangeReturn gst_dream_soft_audio_source_change_state (GstElement *element, GstStateChange transition)
+{
+	GstDreamSoftAudioSource *self = GST_DREAM_SOFT_AUDIO_SOURCE (element);
+
+	if (transition == GST_STATE_CHANGE_NULL_TO_READY && !self->encoder)
+	{
+		GST_ELEMENT_ERROR (self, CORE, MISSING_PLUGIN, ("no AAC encoder is available"), (NULL));
+		return GST_STATE_CHANGE_FAILURE;
+	}
+	return GST_ELEMENT_CLASS (gst_dream_soft_audio_source_parent_class)->change_state (element, transition);
+}
+
+static void gst_dream_soft_audio_source_class_init (GstDreamSoftAudioSourceClass * klass)
+{
+	GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+	GstElementClass *element_class = GST_ELEMENT_CLASS (klass);
+
+	gobject_class->set_property = gst_dream_soft_audio_source_set_property;
+	gobject_class->get_property = gst_dream_soft_audio_source_get_property;
+	element_class->change_state = gst_dream_soft_audio_source_change_state;
+
+	g_object_class_install_property (gobject_class, PROP_INPUT_MODE,
+		g_param_spec_int ("input_mode", "Input mode", "Accepted for compatibility, the test tone ignores it", 0, 2, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_BITRATE,
+		g_param_spec_int ("bitrate", "Bitrate", "Audio bitrate in kbit/s", 0, G_MAXINT, SOFT_SOURCE_DEFAULT_AUDIO_BITRATE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	gst_dream_soft_audio_source_signals[SIGNAL_SIGNAL_LOST] =
+		g_signal_new ("signal-lost", G_TYPE_FROM_CLASS (klass),
+		G_SIGNAL_RUN_LAST, G_STRUCT_OFFSET(GstDreamSoftAudioSourceClass, signal_lost),
+		NULL, NULL, g_cclosure_marshal_VOID__VOID,
+		G_TYPE_NONE, 0);
+
+	gst_element_class_set_static_metadata (element_class, "Dreambox software audio source", "Source/Audio",
+		"Test tone encoded to AAC, stands in for dreamaudiosource", "Andreas Frisch <fraxinas@opendreambox.org>");
+
+	GST_DEBUG_CATEGORY_INIT (rtsp_server_debug, "dreamrtspserver",
+		GST_DEBUG_BOLD | GST_DEBUG_FG_YELLOW | GST_DEBUG_BG_BLUE,
+		"Dreambox RTSP server daemon");
+}
+
+static void gst_dream_soft_audio_source_init (GstDreamSoftAudioSource * self)
+{
+	GstPad *srcpad, *ghostpad;
+	GstCaps *rawcaps;
+	const gchar **name;
+
+	self->bitrate = SOFT_SOURCE_DEFAULT_AUDIO_BITRATE;
+
+	self->testsrc = gst_element_factory_make ("audiotestsrc", NULL);
+	self->convert = gst_element_factory_make ("audioconvert", NULL);
+	self->resample = gst_element_factory_make ("audioresample", NULL);
+	self->rawfilter = gst_element_factory_make ("capsfilter", NULL);
+	for (name = soft_source_aac_encoders; *name && !self->encoder; name++)
+		self->encoder = gst_element_factory_make (*name, NULL);
+
+	if (!(self->testsrc && self->convert && self->resample && self->rawfilter && self->encoder))
+	{
+		GST_ERROR_OBJECT (self, "missing element(s):%s%s%s%s%s", self->testsrc?"":" audiotestsrc", self->convert?"":" audioconvert",
+			self->resample?"":" audioresample", self->rawfilter?"":" capsfilter", self->encoder?"":" aac encoder");
+		if (self->testsrc)
+			gst_object_unref (self->testsrc);
+		if (self->convert)
+			gst_object_unref (self->convert);
+		if (self->resample)
+			gst_object_unref (self->resample);
+		if (self->rawfilter)
+			gst_object_unref (self->rawfilter);
+		if (self->encoder)
+			gst_object_unref (self->encoder);
+		self->testsrc = self->convert = self->resample = self->rawfilter = self->encoder = NULL;
+		return;
+	}
+
+	g_object_set (G_OBJECT (self->testsrc), "is-live", TRUE, NULL);
+	rawcaps = gst_caps_new_simple ("audio/x-raw", "rate", G_TYPE_INT, SOFT_SOURCE_AUDIO_RATE, "channels", G_TYPE_INT, 2, NULL);
+	g_object_set (G_OBJECT (self->rawfilter), "caps", rawcaps, NULL);
+	gst_caps_unref (rawcaps);
+	soft_source_set_int (self->encoder, "bitrate", self->bitrate * 1000);
+
+	gst_bin_add_many (GST_BIN (self), self->testsrc, self->convert, self->resample, self->rawfilter, self->encoder, NULL);
+	gst_element_link_many (self->testsrc, self->convert, self->resample, self->rawfilter, self->encoder, NULL);
+
+	srcpad = gst_element_get_static_pad (self->encoder, "src");
+	ghostpad = gst_ghost_pad_new ("src", srcpad);
+	gst_element_add_pad (GST_ELEMENT (self), ghostpad);
+	gst_object_unref (srcpad);
+}
+
+gboolean gst_dream_soft_source_register (void)
+{
+	return gst_element_register (NULL, "dreamsoftaudiosource", GST_RANK_NONE, GST_TYPE_DREAM_SOFT_AUDIO_SOURCE) &&
+	       gst_element_register (NULL, "dreamsoftvideosource", GST_RANK_NONE, GST_TYPE_DREAM_SOFT_VIDEO_SOURCE);
+}
+
+enum
+{
+	PROP_TCP_SINK_0,
+	PROP_TCP_HOST,
+	PROP_TCP_PORT,
+	PROP_TCP_STATS,
+	PROP_TCP_MAX_BATCH_SIZE,
+	PROP_TCP_MAX_BATCH_DELAY,
+	PROP_TCP_NOTSENT_LOWAT,
+	PROP_TCP_ZEROCOPY,
+	PROP_TCP_PREAMBLE,
+	PROP_TCP_RECONNECT,
+	PROP_TCP_RECONNECT_MIN_DELAY,
+	PROP_TCP_RECONNECT_MAX_DELAY,
+	PROP_TCP_STANDBY_HOST,
+	PROP_TCP_STANDBY_PORT,
+	PROP_TCP_STALL_TIMEOUT,
+	PROP_TCP_SPOOL_SIZE,
+	PROP_TCP_SPOOL_LOCATION,
+	PROP_TCP_SPOOL_MAX_RATE,
+	PROP_TCP_KEEPALIVE_FRAME,
+	PROP_TCP_CONTROL
+};
+
+#define TCP_CLIENT_SINK_DEFAULT_HOST "localhost"
+#define TCP_CLIENT_SINK_DEFAULT_PORT 4953
+#define TCP_CLIENT_SINK_DEFAULT_MAX_BATCH_SIZE 64*1024
+#define TCP_CLIENT_SINK_DEFAULT_MAX_BATCH_DELAY 10*GST_MSECOND
+#define TCP_CLIENT_SINK_DEFAULT_NOTSENT_LOWAT 128*1024
+#define TCP_CLIENT_SINK_MAX_VECTORS 64
+#define TCP_CLIENT_SINK_DEFAULT_RECONNECT_MIN_DELAY 250
+#define TCP_CLIENT_SINK_DEFAULT_RECONNECT_MAX_DELAY 10000
+#define TCP_CLIENT_SINK_DEFAULT_STALL_TIMEOUT 1000
+#define TCP_CLIENT_SINK_STANDBY_CHECK 1000
+#define TCP_CLIENT_SINK_CONTROL_RETRY 100
+#define TCP_CLIENT_SINK_CONTROL_MAX_LINE 256
+#define TCP_CLIENT_SINK_DEFAULT_SPOOL_MAX_RATE 0
+#define TS_PACKET_SIZE 188
+
+enum
+{
+	SIGNAL_KEEPALIVE,
+	TCP_CLIENT_SINK_SIGNAL_LAST
+};
+
+static guint gst_dream_tcp_client_sink_signals[TCP_CLIENT_SINK_SIGNAL_LAST] = { 0 };
+
+/* what the mediator may send back on the connection, anything else is skipped so it can add commands later */
+static const gchar *tcp_client_sink_control_commands[] = { "rate", "keyframe", "bitrate", "idle", "active", NULL };
+
+/* PID 0x1FFF, receivers discard it without losing sync */
+static guint8 ts_null_data[TS_PACKET_SIZE];
+static GBytes *ts_null_packet;
+
+/* a mapped buffer waiting to be sent, with zerocopy until the kernel is done with its pages */
+typedef struct {
+	GstBuffer *buffer;
+	GstMapInfo map;
+} DreamTCPChunk;
+
+typedef struct {
+	guint32 seq;
+	GArray *chunks;
+} DreamTCPZerocopySend;
+
+static GstStaticPadTemplate tcp_client_sink_template = GST_STATIC_PAD_TEMPLATE ("sink", GST_PAD_SINK, GST_PAD_ALWAYS, GST_STATIC_CAPS_ANY);
+
+G_DEFINE_TYPE (GstDreamTCPClientSink, gst_dream_tcp_client_sink, GST_TYPE_BASE_SINK);
+
+static void gst_dream_tcp_client_sink_chunks_free (GArray *chunks)
+{
+	guint i;
+	for (i = 0; i < chunks->len; i++)
+	{
+		DreamTCPChunk *chunk = &g_array_index (chunks, DreamTCPChunk, i);
+		gst_buffer_unmap (chunk->buffer, &chunk->map);
+		gst_buffer_unref (chunk->buffer);
+	}
+	g_array_free (chunks, TRUE);
+}
+
+static void gst_dream_tcp_client_sink_zerocopy_free (DreamTCPZerocopySend *send)
+{
+	gst_dream_tcp_client_sink_chunks_free (send->chunks);
+	g_free (send);
+}
+
+static void gst_dream_tcp_client_sink_batch_clear (GstDreamTCPClientSink *self)
+{
+	if (self->batch->len)
+	{
+		gst_dream_tcp_client_sink_chunks_free (self->batch);
+		self->batch = g_array_sized_new (FALSE, FALSE, sizeof (DreamTCPChunk), TCP_CLIENT_SINK_MAX_VECTORS);
+	}
+	self->batch_bytes = 0;
+	self->batch_start = GST_CLOCK_TIME_NONE;
+}
+
+/* keeps the unsent part of the kernel queue shallow so that backlog stays in the pipeline where it can be dropped frame-wise */
+static void gst_dream_tcp_client_sink_setup_socket (GstDreamTCPClientSink *self, GSocket *socket)
+{
+	gint fd = g_socket_get_fd (socket);
+	int value;
+
+#ifdef TCP_NOTSENT_LOWAT
+	value = self->notsent_lowat;
+	if (value && setsockopt (fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &value, sizeof (value)) < 0)
+		GST_WARNING_OBJECT (self, "couldn't set TCP_NOTSENT_LOWAT=%d: %s", value, g_strerror (errno));
+#endif
+	if (self->zerocopy)
+	{
+#ifdef SO_ZEROCOPY
+		value = 1;
+		if (setsockopt (fd, SOL_SOCKET, SO_ZEROCOPY, &value, sizeof (value)) < 0)
+		{
+			GST_WARNING_OBJECT (self, "couldn't enable SO_ZEROCOPY, using copying sends: %s", g_strerror (errno));
+			self->zerocopy = FALSE;
+		}
+#else
+		GST_WARNING_OBJECT (self, "built without MSG_ZEROCOPY support, using copying sends");
+		self->zerocopy = FALSE;
+#endif
+	}
+}
+
+/* collects the completion notifications of zerocopy sends from the socket error queue and releases their buffers */
+static void gst_dream_tcp_client_sink_reap_zerocopy (GstDreamTCPClientSink *self)
+{
+#ifdef SO_EE_ORIGIN_ZEROCOPY
+	gint fd = g_socket_get_fd (self->socket);
+
+	while (!g_queue_is_empty (&self->zerocopy_pending))
+	{
+		gchar control[128];
+		struct msghdr msg;
+		struct cmsghdr *cm;
+
+		memset (&msg, 0, sizeof (msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof (control);
+		if (recvmsg (fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			break;
+		for (cm = CMSG_FIRSTHDR (&msg); cm; cm = CMSG_NXTHDR (&msg, cm))
+		{
+			struct sock_extended_err *serr = (struct sock_extended_err *) CMSG_DATA (cm);
+			if (!((cm->cmsg_level == IPPROTO_IP && cm->cmsg_type == IP_RECVERR) || (cm->cmsg_level == IPPROTO_IPV6 && cm->cmsg_type == IPV6_RECVERR)) || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				GST_LOG_OBJECT (self, "kernel copied zerocopy sends %u..%u", serr->ee_info, serr->ee_data);
+			while (!g_queue_is_empty (&self->zerocopy_pending) && (gint32) (((DreamTCPZerocopySend *) g_queue_peek_head (&self->zerocopy_pending))->seq - serr->ee_data) <= 0)
+				gst_dream_tcp_client_sink_zerocopy_free (g_queue_pop_head (&self->zerocopy_pending));
+		}
+	}
+#endif
+}
+
+static GSocket *gst_dream_tcp_client_sink_open (GstDreamTCPClientSink *self, const gchar *host, gint port, GCancellable *cancellable, GError **error)
+{
+	GResolver *resolver = g_resolver_get_default ();
+	GError *err = NULL;
+	GSocket *socket = NULL;
+	GList *addresses, *l;
+
+	addresses = g_resolver_lookup_by_name (resolver, host, cancellable, error);
+	g_object_unref (resolver);
+	if (!addresses)
+		return NULL;
+
+	for (l = addresses; l && !socket; l = l->next)
+	{
+		GSocketAddress *address = g_inet_socket_address_new (l->data, port);
+		socket = g_socket_new (g_socket_address_get_family (address), G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_TCP, &err);
+		if (socket && !g_socket_connect (socket, address, cancellable, &err))
+		{
+			g_object_unref (socket);
+			socket = NULL;
+		}
+		if (err)
+		{
+			GST_DEBUG_OBJECT (self, "connecting to %s:%d failed: %s", host, port, err->message);
+			if (!l->next)
+				g_propagate_error (error, err);
+			else
+				g_clear_error (&err);
+			err = NULL;
+		}
+		g_object_unref (address);
+	}
+	g_resolver_free_addresses (addresses);
+
+	if (socket)
+	{
+		GST_DEBUG_OBJECT (self, "connected to %s:%d", host, port);
+		gst_dream_tcp_client_sink_setup_socket (self, socket);
+	}
+	return socket;
+}
+
+static void gst_dream_tcp_client_sink_post (GstDreamTCPClientSink *self, const gchar *event, guint attempt, guint64 downtime, const gchar *reason)
+{
+	GstStructure *s = gst_structure_new ("dream-tcp-client-sink", "event", G_TYPE_STRING, event, "attempt", G_TYPE_UINT, attempt, "downtime", G_TYPE_UINT64, downtime, NULL);
+	if (reason)
+		gst_structure_set (s, "reason", G_TYPE_STRING, reason, NULL);
+	gst_element_post_message (GST_ELEMENT (self), gst_message_new_element (GST_OBJECT (self), s));
+}
+
+static gboolean gst_dream_tcp_client_sink_send_all (GSocket *socket, const gchar *data, gsize len, GCancellable *cancellable, GError **err)
+{
+	gsize sent = 0;
+
+	while (sent < len)
+	{
+		gssize ret = g_socket_send (socket, data + sent, len - sent, cancellable, err);
+		if (ret < 0)
+			return FALSE;
+		sent += ret;
+	}
+	return TRUE;
+}
+
+static void gst_dream_tcp_client_sink_drop_standby (GstDreamTCPClientSink *self, GSocket *socket)
+{
+	GST_OBJECT_LOCK (self);
+	if (self->standby != socket)
+	{
+		GST_OBJECT_UNLOCK (self);
+		return;
+	}
+	self->standby = NULL;
+	GST_OBJECT_UNLOCK (self);
+	g_socket_close (socket, NULL);
+	g_object_unref (socket);
+}
+
+/* keeps an authenticated idle connection to the standby endpoint ready to take over the stream */
+static gpointer gst_dream_tcp_client_sink_standby_thread (gpointer user_data)
+{
+	GstDreamTCPClientSink *self = user_data;
+	guint delay = self->reconnect_min_delay;
+
+	g_mutex_lock (&self->reconnect_lock);
+	while (!self->standby_stop)
+	{
+		GError *err = NULL;
+		GSocket *socket;
+		gchar *host;
+		GBytes *preamble;
+		gint port;
+		gboolean backoff = FALSE;
+
+		GST_OBJECT_LOCK (self);
+		socket = self->standby ? g_object_ref (self->standby) : NULL;
+		host = g_strdup (self->standby_host);
+		port = self->standby_port;
+		preamble = self->preamble ? g_bytes_ref (self->preamble) : NULL;
+		GST_OBJECT_UNLOCK (self);
+		g_mutex_unlock (&self->reconnect_lock);
+
+		if (socket)
+		{
+			/* nothing is sent on the idle connection, it only becomes readable when the peer closes it */
+			if (g_socket_condition_timed_wait (socket, G_IO_IN | G_IO_ERR | G_IO_HUP, (gint64) TCP_CLIENT_SINK_STANDBY_CHECK * 1000, self->standby_cancellable, NULL))
+			{
+				gchar buf[256];
+				gssize len = 1;
+				/* a failover may have just made it the primary, whose input belongs to the control thread then */
+				GST_OBJECT_LOCK (self);
+				if (self->standby == socket)
+					len = g_socket_receive_with_blocking (socket, buf, sizeof (buf), FALSE, NULL, &err);
+				GST_OBJECT_UNLOCK (self);
+				if (len == 0 || (len < 0 && !g_error_matches (err, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)))
+				{
+					GST_INFO_OBJECT (self, "standby connection to %s:%d lost", host, port);
+					gst_dream_tcp_client_sink_drop_standby (self, socket);
+				}
+				g_clear_error (&err);
+			}
+			g_object_unref (socket);
+		}
+		else if (host)
+		{
+			socket = gst_dream_tcp_client_sink_open (self, host, port, self->standby_cancellable, &err);
+			if (socket && preamble && !gst_dream_tcp_client_sink_send_all (socket, g_bytes_get_data (preamble, NULL), g_bytes_get_size (preamble), self->standby_cancellable, &err))
+			{
+				g_socket_close (socket, NULL);
+				g_object_unref (socket);
+				socket = NULL;
+			}
+			if (socket)
+			{
+				GST_INFO_OBJECT (self, "standby connection to %s:%d ready", host, port);
+				GST_OBJECT_LOCK (self);
+				self->standby = socket;
+				GST_OBJECT_UNLOCK (self);
+				delay = self->reconnect_min_delay;
+			}
+			else
+			{
+				GST_DEBUG_OBJECT (self, "standby connection to %s:%d failed: %s", host, port, err ? err->message : "");
+				g_clear_error (&err);
+				backoff = TRUE;
+			}
+		}
+		else
+			backoff = TRUE;
+		g_free (host);
+		if (preamble)
+			g_bytes_unref (preamble);
+
+		g_mutex_lock (&self->reconnect_lock);
+		if (backoff)
+		{
+			gint64 deadline = g_get_monotonic_time () + (gint64) g_random_int_range (delay * 3 / 4, delay * 5 / 4 + 1) * G_TIME_SPAN_MILLISECOND;
+			while (!self->standby_stop && g_cond_wait_until (&self->reconnect_cond, &self->reconnect_lock, deadline))
+				;
+			delay = MIN (delay * 2, self->reconnect_max_delay);
+		}
+	}
+	g_mutex_unlock (&self->reconnect_lock);
+	return NULL;
+}
+
+static void gst_dream_tcp_client_sink_start_standby (GstDreamTCPClientSink *self)
+{
+	if (!self->standby_host || self->standby_thread)
+		return;
+	self->standby_stop = FALSE;
+	g_cancellable_reset (self->standby_cancellable);
+	self->standby_thread = g_thread_new ("dreamtcpstandby", gst_dream_tcp_client_sink_standby_thread, self);
+}
+
+static void gst_dream_tcp_client_sink_stop_standby (GstDreamTCPClientSink *self)
+{
+	GSocket *socket;
+
+	if (self->standby_thread)
+	{
+		g_mutex_lock (&self->reconnect_lock);
+		self->standby_stop = TRUE;
+		g_cond_broadcast (&self->reconnect_cond);
+		g_mutex_unlock (&self->reconnect_lock);
+		g_cancellable_cancel (self->standby_cancellable);
+		g_thread_join (self->standby_thread);
+		self->standby_thread = NULL;
+	}
+	GST_OBJECT_LOCK (self);
+	socket = self->standby;
+	self->standby = NULL;
+	GST_OBJECT_UNLOCK (self);
+	if (socket)
+	{
+		g_socket_close (socket, NULL);
+		g_object_unref (socket);
+	}
+}
+
+/* "<command> [value]" from the mediator, posted as a control event for the application to act on */
+static void gst_dream_tcp_client_sink_control_line (GstDreamTCPClientSink *self, gchar *line)
+{
+	gchar **words = g_strsplit (g_strstrip (line), " ", 2);
+	gchar *command = g_ascii_strdown (words[0] ? words[0] : "", -1);
+	guint value = words[0] && words[1] ? (guint) g_ascii_strtoull (words[1], NULL, 10) : 0;
+
+	if (g_strv_contains (tcp_client_sink_control_commands, command))
+	{
+		GstStructure *s = gst_structure_new ("dream-tcp-client-sink", "event", G_TYPE_STRING, "control", "command", G_TYPE_STRING, command, "value", G_TYPE_UINT, value, NULL);
+		GST_DEBUG_OBJECT (self, "control from %s:%d: %s %u", self->host, self->port, command, value);
+		GST_OBJECT_LOCK (self);
+		self->control_messages++;
+		GST_OBJECT_UNLOCK (self);
+		gst_element_post_message (GST_ELEMENT (self), gst_message_new_element (GST_OBJECT (self), s));
+	}
+	else if (*command)
+		GST_DEBUG_OBJECT (self, "skipping unknown control command '%s'", command);
+	g_free (command);
+	g_strfreev (words);
+}
+
+/* reads the mediator's commands off whichever connection currently carries the stream, the sending side stays oblivious */
+static gpointer gst_dream_tcp_client_sink_control_thread (gpointer user_data)
+{
+	GstDreamTCPClientSink *self = user_data;
+	GString *line = g_string_new (NULL);
+	GSocket *current = NULL;
+	gboolean dead = FALSE;
+
+	g_mutex_lock (&self->reconnect_lock);
+	while (!self->control_stop)
+	{
+		GError *err = NULL;
+		GSocket *socket;
+		gchar buf[TCP_CLIENT_SINK_CONTROL_MAX_LINE];
+		gssize len = 0, i;
+		guint wait = 0;
+
+		GST_OBJECT_LOCK (self);
+		socket = self->socket ? g_object_ref (self->socket) : NULL;
+		GST_OBJECT_UNLOCK (self);
+		g_mutex_unlock (&self->reconnect_lock);
+
+		/* a new connection starts with a new line */
+		if (socket != current)
+		{
+			g_clear_object (&current);
+			current = socket ? g_object_ref (socket) : NULL;
+			g_string_truncate (line, 0);
+			dead = FALSE;
+		}
+		if (socket && !dead)
+		{
+			if (g_socket_condition_timed_wait (socket, G_IO_IN | G_IO_HUP, (gint64) TCP_CLIENT_SINK_STANDBY_CHECK * 1000, self->control_cancellable, &err))
+				len = g_socket_receive_with_blocking (socket, buf, sizeof (buf), FALSE, NULL, &err);
+			/* a closed connection is noticed by the sending side, there's nothing left to read until the next one */
+			if (len == 0 && !err)
+				dead = TRUE;
+			else if (err && !g_error_matches (err, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK) && !g_error_matches (err, G_IO_ERROR, G_IO_ERROR_TIMED_OUT) && !g_error_matches (err, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+				dead = TRUE;
+			/* woken up by the zerocopy error queue rather than by data */
+			else if (g_error_matches (err, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
+				wait = TCP_CLIENT_SINK_CONTROL_RETRY;
+			g_clear_error (&err);
+		}
+		if (!socket || dead)
+			wait = TCP_CLIENT_SINK_STANDBY_CHECK;
+		if (socket)
+			g_object_unref (socket);
+
+		for (i = 0; i < len; i++)
+		{
+			if (buf[i] == '\n')
+			{
+				gst_dream_tcp_client_sink_control_line (self, line->str);
+				g_string_truncate (line, 0);
+			}
+			else if (line->len < TCP_CLIENT_SINK_CONTROL_MAX_LINE)
+				g_string_append_c (line, buf[i]);
+		}
+
+		g_mutex_lock (&self->reconnect_lock);
+		if (wait)
+		{
+			gint64 deadline = g_get_monotonic_time () + (gint64) wait * G_TIME_SPAN_MILLISECOND;
+			while (!self->control_stop && g_cond_wait_until (&self->reconnect_cond, &self->reconnect_lock, deadline))
+				;
+		}
+	}
+	g_mutex_unlock (&self->reconnect_lock);
+	g_clear_object (&current);
+	g_string_free (line, TRUE);
+	return NULL;
+}
+
+static void gst_dream_tcp_client_sink_start_control (GstDreamTCPClientSink *self)
+{
+	if (!self->control || self->control_thread)
+		return;
+	self->control_stop = FALSE;
+	g_cancellable_reset (self->control_cancellable);
+	self->control_thread = g_thread_new ("dreamtcpcontrol", gst_dream_tcp_client_sink_control_thread, self);
+}
+
+static void gst_dream_tcp_client_sink_stop_control (GstDreamTCPClientSink *self)
+{
+	if (!self->control_thread)
+		return;
+	g_mutex_lock (&self->reconnect_lock);
+	self->control_stop = TRUE;
+	g_cond_broadcast (&self->reconnect_cond);
+	g_mutex_unlock (&self->reconnect_lock);
+	g_cancellable_cancel (self->control_cancellable);
+	g_thread_join (self->control_thread);
+	self->control_thread = NULL;
+}
+
+/* a different peer can't continue mid-GOP, the spooled backlog is cut to its first keyframe */
+static void gst_dream_tcp_client_sink_spool_skip (GstDreamTCPClientSink *self)
+{
+	guint64 next = self->spool_tail;
+	guint i = 0;
+
+	while (i < self->spool_keyframes->len && g_array_index (self->spool_keyframes, guint64, i) < self->spool_head)
+		i++;
+	g_array_remove_range (self->spool_keyframes, 0, i);
+	if (self->spool_keyframes->len)
+		next = g_array_index (self->spool_keyframes, guint64, 0);
+	if (next == self->spool_head)
+		return;
+	GST_DEBUG_OBJECT (self, "skipping %" G_GUINT64_FORMAT " spooled bytes to the next keyframe", next - self->spool_head);
+	GST_OBJECT_LOCK (self);
+	self->spool_dropped += next - self->spool_head;
+	self->spool_head = next;
+	GST_OBJECT_UNLOCK (self);
+}
+
+/* hands the stream over to the standby connection, the endpoints swap roles so the lost one is re-established as the new standby */
+static gboolean gst_dream_tcp_client_sink_failover (GstDreamTCPClientSink *self, GError *reason)
+{
+	GSocket *socket, *lost;
+	gchar *host;
+	gint port;
+
+	GST_OBJECT_LOCK (self);
+	socket = self->standby;
+	if (!socket)
+	{
+		GST_OBJECT_UNLOCK (self);
+		return FALSE;
+	}
+	self->standby = NULL;
+	lost = self->socket;
+	self->socket = socket;
+	host = self->host;
+	port = self->port;
+	self->host = self->standby_host;
+	self->port = self->standby_port;
+	self->standby_host = host;
+	self->standby_port = port;
+	self->delivered = self->bytes_written;
+	self->delivered_time = 0;
+	self->failovers++;
+	GST_OBJECT_UNLOCK (self);
+
+	GST_WARNING_OBJECT (self, "connection to %s:%d failed (%s), switching over to standby %s:%d", self->standby_host, self->standby_port, reason->message, self->host, self->port);
+	if (lost)
+	{
+		g_socket_close (lost, NULL);
+		g_object_unref (lost);
+	}
+	while (!g_queue_is_empty (&self->zerocopy_pending))
+		gst_dream_tcp_client_sink_zerocopy_free (g_queue_pop_head (&self->zerocopy_pending));
+	self->zerocopy_seq = 0;
+	/* the standby got the preamble when it was connected, but the stream has to start over at a keyframe for it,
+	 * out of the spool if there is a backlog or live otherwise */
+	self->need_preamble = FALSE;
+	self->keepalive_rest = 0;
+	if (self->spool)
+		gst_dream_tcp_client_sink_spool_skip (self);
+	self->wait_keyframe = !self->spool || self->spool_tail == self->spool_head;
+	gst_dream_tcp_client_sink_post (self, "failover", 0, 0, reason->message);
+	return TRUE;
+}
+
+/* the spool is a byte ring that keeps the stream while the upstream is down, head and tail count bytes since it was set up */
+static gboolean gst_dream_tcp_client_sink_spool_alloc (GstDreamTCPClientSink *self)
+{
+	gchar *location;
+
+	if (!self->spool_size)
+		return TRUE;
+
+	GST_OBJECT_LOCK (self);
+	location = g_strdup (self->spool_location);
+	GST_OBJECT_UNLOCK (self);
+	self->spool_capacity = self->spool_size;
+	self->spool_mapped = location != NULL;
+	if (self->spool_mapped)
+	{
+		/* never reuse an existing file, the spool lives only as long as the mapping */
+		int fd = open (location, O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (fd >= 0)
+			unlink (location);
+		if (fd < 0 || ftruncate (fd, self->spool_capacity) < 0)
+		{
+			GST_ELEMENT_ERROR (self, RESOURCE, OPEN_READ_WRITE, ("couldn't create spool file %s", location), ("%s", g_strerror (errno)));
+			if (fd >= 0)
+				close (fd);
+			g_free (location);
+			return FALSE;
+		}
+		self->spool = mmap (NULL, self->spool_capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (self->spool == MAP_FAILED)
+		{
+			self->spool = NULL;
+			GST_ELEMENT_ERROR (self, RESOURCE, OPEN_READ_WRITE, ("couldn't map spool file %s", location), ("%s", g_strerror (errno)));
+			close (fd);
+			g_free (location);
+			return FALSE;
+		}
+		close (fd);
+	}
+	else if (!(self->spool = g_try_malloc (self->spool_capacity)))
+	{
+		GST_ELEMENT_ERROR (self, RESOURCE, NO_SPACE_LEFT, ("couldn't allocate %u bytes of spool", self->spool_size), (NULL));
+		return FALSE;
+	}
+	GST_OBJECT_LOCK (self);
+	self->spool_head = self->spool_tail = self->spool_dropped = 0;
+	GST_OBJECT_UNLOCK (self);
+	g_array_set_size (self->spool_keyframes, 0);
+	self->spool_wait_keyframe = FALSE;
+	GST_DEBUG_OBJECT (self, "spooling up to %" G_GSIZE_FORMAT " bytes %s%s", self->spool_capacity, self->spool_mapped ? "in " : "in memory", self->spool_mapped ? location : "");
+	g_free (location);
+	return TRUE;
+}
+
+static void gst_dream_tcp_client_sink_spool_free (GstDreamTCPClientSink *self)
+{
+	if (!self->spool)
+		return;
+	if (self->spool_mapped)
+		munmap (self->spool, self->spool_capacity);
+	else
+		g_free (self->spool);
+	self->spool = NULL;
+}
+
+static gboolean gst_dream_tcp_client_sink_spooling (GstDreamTCPClientSink *self)
+{
+	return self->spool && (!self->socket || self->spool_tail > self->spool_head);
+}
+
+/* when full, whole GOPs are dropped from the head so that the backlog always starts at a keyframe */
+static void gst_dream_tcp_client_sink_spool_push (GstDreamTCPClientSink *self, const guint8 *data, gsize size, gboolean keyframe)
+{
+	guint64 head = self->spool_head, dropped = 0;
+	gsize offset, len;
+
+	if (size > self->spool_capacity)
+	{
+		keyframe = FALSE;
+		self->spool_wait_keyframe = TRUE;
+	}
+	else if (keyframe)
+		self->spool_wait_keyframe = FALSE;
+	while (!self->spool_wait_keyframe && self->spool_tail + size - head > self->spool_capacity)
+	{
+		guint i = 0;
+		guint64 next;
+		while (i < self->spool_keyframes->len && g_array_index (self->spool_keyframes, guint64, i) <= head)
+			i++;
+		g_array_remove_range (self->spool_keyframes, 0, i);
+		next = self->spool_keyframes->len ? g_array_index (self->spool_keyframes, guint64, 0) : self->spool_tail;
+		dropped += next - head;
+		head = next;
+		if (head == self->spool_tail && !keyframe)
+			self->spool_wait_keyframe = TRUE;
+	}
+	if (dropped)
+		GST_DEBUG_OBJECT (self, "spool full, dropped %" G_GUINT64_FORMAT " bytes up to the next keyframe", dropped);
+	if (self->spool_wait_keyframe)
+	{
+		dropped += size;
+		size = 0;
+	}
+	else if (keyframe)
+		g_array_append_val (self->spool_keyframes, self->spool_tail);
+
+	offset = self->spool_tail % self->spool_capacity;
+	len = MIN (size, self->spool_capacity - offset);
+	memcpy (self->spool + offset, data, len);
+	memcpy (self->spool, data + len, size - len);
+
+	GST_OBJECT_LOCK (self);
+	self->spool_head = head;
+	self->spool_tail += size;
+	self->spool_dropped += dropped;
+	GST_OBJECT_UNLOCK (self);
+}
+
+/* reconnects in the background while the streaming thread keeps spooling */
+static gpointer gst_dream_tcp_client_sink_reconnect_thread (gpointer user_data)
+{
+	GstDreamTCPClientSink *self = user_data;
+	guint attempt = 0, delay = self->reconnect_min_delay;
+	GSocket *socket = NULL;
+	gchar *host;
+	gint port;
+
+	GST_OBJECT_LOCK (self);
+	host = g_strdup (self->host);
+	port = self->port;
+	GST_OBJECT_UNLOCK (self);
+
+	g_mutex_lock (&self->reconnect_lock);
+	while (!self->reconnect_stop)
+	{
+		GError *err = NULL;
+		gint64 deadline = g_get_monotonic_time () + (gint64) g_random_int_range (delay * 3 / 4, delay * 5 / 4 + 1) * G_TIME_SPAN_MILLISECOND;
+		while (!self->reconnect_stop && g_cond_wait_until (&self->reconnect_cond, &self->reconnect_lock, deadline))
+			;
+		if (self->reconnect_stop)
+			break;
+		g_mutex_unlock (&self->reconnect_lock);
+
+		attempt++;
+		socket = gst_dream_tcp_client_sink_open (self, host, port, self->reconnect_cancellable, &err);
+		if (!socket)
+		{
+			GST_DEBUG_OBJECT (self, "reconnect attempt %u failed: %s", attempt, err ? err->message : "");
+			gst_dream_tcp_client_sink_post (self, "reconnecting", attempt, 0, err ? err->message : NULL);
+			g_clear_error (&err);
+			delay = MIN (delay * 2, self->reconnect_max_delay);
+			g_mutex_lock (&self->reconnect_lock);
+			continue;
+		}
+		g_mutex_lock (&self->reconnect_lock);
+		break;
+	}
+	g_mutex_unlock (&self->reconnect_lock);
+	g_free (host);
+
+	if (socket)
+	{
+		GST_OBJECT_LOCK (self);
+		self->reconnected = socket;
+		self->reconnect_attempt = attempt;
+		GST_OBJECT_UNLOCK (self);
+	}
+	return NULL;
+}
+
+static void gst_dream_tcp_client_sink_stop_reconnect (GstDreamTCPClientSink *self)
+{
+	GSocket *socket;
+
+	if (!self->reconnect_thread)
+		return;
+	g_mutex_lock (&self->reconnect_lock);
+	self->reconnect_stop = TRUE;
+	g_cond_broadcast (&self->reconnect_cond);
+	g_mutex_unlock (&self->reconnect_lock);
+	g_cancellable_cancel (self->reconnect_cancellable);
+	g_thread_join (self->reconnect_thread);
+	self->reconnect_thread = NULL;
+	g_cancellable_reset (self->reconnect_cancellable);
+
+	GST_OBJECT_LOCK (self);
+	socket = self->reconnected;
+	self->reconnected = NULL;
+	GST_OBJECT_UNLOCK (self);
+	if (socket)
+	{
+		g_socket_close (socket, NULL);
+		g_object_unref (socket);
+	}
+}
+
+static GstFlowReturn gst_dream_tcp_client_sink_spool_outage (GstDreamTCPClientSink *self, GError *reason)
+{
+	GSocket *socket;
+
+	GST_WARNING_OBJECT (self, "lost connection to %s:%d (%s), spooling while reconnecting", self->host, self->port, reason->message);
+	GST_OBJECT_LOCK (self);
+	socket = self->socket;
+	self->socket = NULL;
+	GST_OBJECT_UNLOCK (self);
+	if (socket)
+	{
+		g_socket_close (socket, NULL);
+		g_object_unref (socket);
+	}
+	while (!g_queue_is_empty (&self->zerocopy_pending))
+		gst_dream_tcp_client_sink_zerocopy_free (g_queue_pop_head (&self->zerocopy_pending));
+	self->outage_start = g_get_monotonic_time ();
+	gst_dream_tcp_client_sink_post (self, "disconnected", 0, 0, reason->message);
+
+	self->reconnect_stop = FALSE;
+	self->reconnect_thread = g_thread_new ("dreamtcpreconnect", gst_dream_tcp_client_sink_reconnect_thread, self);
+	return GST_FLOW_OK;
+}
+
+/* picks up the connection the reconnect thread established, or the standby if it came up first */
+static void gst_dream_tcp_client_sink_adopt (GstDreamTCPClientSink *self)
+{
+	GSocket *socket;
+	gboolean standby;
+	guint64 downtime;
+
+	if (self->socket || !self->reconnect_thread)
+		return;
+
+	GST_OBJECT_LOCK (self);
+	socket = self->reconnected;
+	self->reconnected = NULL;
+	standby = self->standby != NULL;
+	if (socket)
+	{
+		self->socket = socket;
+		self->delivered = self->bytes_written;
+		self->delivered_time = 0;
+	}
+	GST_OBJECT_UNLOCK (self);
+
+	if (!socket)
+	{
+		if (standby)
+		{
+			GError *reason = g_error_new_literal (G_IO_ERROR, G_IO_ERROR_NOT_CONNECTED, "standby ready before the lost endpoint");
+			gst_dream_tcp_client_sink_stop_reconnect (self);
+			if (!gst_dream_tcp_client_sink_failover (self, reason))
+				gst_dream_tcp_client_sink_spool_outage (self, reason);
+			self->spool_drain_time = g_get_monotonic_time ();
+			g_error_free (reason);
+		}
+		return;
+	}
+
+	g_thread_join (self->reconnect_thread);
+	self->reconnect_thread = NULL;
+	downtime = (g_get_monotonic_time () - self->outage_start) / G_TIME_SPAN_MILLISECOND;
+	GST_INFO_OBJECT (self, "reconnected to %s:%d after %u attempts and %" G_GUINT64_FORMAT " ms, %" G_GUINT64_FORMAT " bytes spooled", self->host, self->port,
+			 self->reconnect_attempt, downtime, self->spool_tail - self->spool_head);
+	self->zerocopy_seq = 0;
+	self->need_preamble = self->preamble != NULL;
+	self->keepalive_rest = 0;
+	self->spool_drain_time = g_get_monotonic_time ();
+	gst_dream_tcp_client_sink_post (self, "reconnected", self->reconnect_attempt, downtime, NULL);
+}
+
+static gboolean gst_dream_tcp_client_sink_connect (GstDreamTCPClientSink *self)
+{
+	GError *err = NULL;
+	GSocket *socket = gst_dream_tcp_client_sink_open (self, self->host, self->port, self->cancellable, &err);
+
+	if (!socket)
+	{
+		GST_ELEMENT_ERROR (self, RESOURCE, OPEN_WRITE, ("couldn't connect to %s:%d", self->host, self->port), ("%s", err ? err->message : ""));
+		g_clear_error (&err);
+		return FALSE;
+	}
+	if (!gst_dream_tcp_client_sink_spool_alloc (self))
+	{
+		g_socket_close (socket, NULL);
+		g_object_unref (socket);
+		return FALSE;
+	}
+
+	g_mutex_lock (&self->send_lock);
+	self->zerocopy_seq = 0;
+	self->need_preamble = self->preamble != NULL;
+	self->wait_keyframe = FALSE;
+	self->keepalive_rest = 0;
+	GST_OBJECT_LOCK (self);
+	self->socket = socket;
+	self->bytes_written = self->delivered = self->sends = 0;
+	self->delivered_time = 0;
+	self->failovers = 0;
+	self->keepalives = 0;
+	self->control_messages = 0;
+	GST_OBJECT_UNLOCK (self);
+	g_mutex_unlock (&self->send_lock);
+	gst_dream_tcp_client_sink_start_standby (self);
+	gst_dream_tcp_client_sink_start_control (self);
+	return TRUE;
+}
+
+static void gst_dream_tcp_client_sink_close (GstDreamTCPClientSink *self)
+{
+	GSocket *socket;
+
+	gst_dream_tcp_client_sink_stop_control (self);
+	gst_dream_tcp_client_sink_stop_standby (self);
+	gst_dream_tcp_client_sink_stop_reconnect (self);
+	GST_OBJECT_LOCK (self);
+	socket = self->socket;
+	self->socket = NULL;
+	GST_OBJECT_UNLOCK (self);
+
+	if (socket)
+	{
+		g_socket_close (socket, NULL);
+		g_object_unref (socket);
+	}
+	gst_dream_tcp_client_sink_batch_clear (self);
+	while (!g_queue_is_empty (&self->zerocopy_pending))
+		gst_dream_tcp_client_sink_zerocopy_free (g_queue_pop_head (&self->zerocopy_pending));
+	gst_dream_tcp_client_sink_spool_free (self);
+}
+
+/* TCP_INFO and SIOCOUTQ of the connection, the delivery rate is derived from what left the send queue since the last call */
+static GstStructure *gst_dream_tcp_client_sink_get_stats (GstDreamTCPClientSink *self)
+{
+	struct tcp_info info;
+	socklen_t len = sizeof (info);
+	gint64 now = g_get_monotonic_time ();
+	guint64 written, delivered, sends;
+	guint delivery_rate = 0, failovers;
+	guint64 spooled, spool_dropped, keepalives, control_messages;
+	gboolean standby;
+	int outq = 0;
+
+	memset (&info, 0, sizeof (info));
+	GST_OBJECT_LOCK (self);
+	if (!self->socket)
+	{
+		GST_OBJECT_UNLOCK (self);
+		return NULL;
+	}
+	gint fd = g_socket_get_fd (self->socket);
+	if (getsockopt (fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0)
+		GST_WARNING_OBJECT (self, "getsockopt TCP_INFO failed: %s", g_strerror (errno));
+	if (ioctl (fd, SIOCOUTQ, &outq) < 0)
+		outq = 0;
+	written = self->bytes_written;
+	sends = self->sends;
+	failovers = self->failovers;
+	standby = self->standby != NULL;
+	spooled = self->spool_tail - self->spool_head;
+	spool_dropped = self->spool_dropped;
+	keepalives = self->keepalives;
+	control_messages = self->control_messages;
+	delivered = written > (guint64) outq ? written - outq : 0;
+	if (self->delivered_time && now > self->delivered_time && delivered >= self->delivered)
+		delivery_rate = (delivered - self->delivered) * 8 * 1000 / (now - self->delivered_time);
+	self->delivered = delivered;
+	self->delivered_time = now;
+	GST_OBJECT_UNLOCK (self);
+
+	return gst_structure_new ("dream-tcp-stats",
+		"rtt", G_TYPE_UINT, info.tcpi_rtt,
+		"rttvar", G_TYPE_UINT, info.tcpi_rttvar,
+		"cwnd", G_TYPE_UINT, info.tcpi_snd_cwnd,
+		"mss", G_TYPE_UINT, info.tcpi_snd_mss,
+		"retransmits", G_TYPE_UINT, info.tcpi_total_retrans,
+		"unacked", G_TYPE_UINT, info.tcpi_unacked,
+		"outq", G_TYPE_UINT, (guint) outq,
+		"delivery-rate", G_TYPE_UINT, delivery_rate,
+		"bytes-written", G_TYPE_UINT64, written,
+		"sends", G_TYPE_UINT64, sends,
+		"failovers", G_TYPE_UINT, failovers,
+		"standby", G_TYPE_BOOLEAN, standby,
+		"spooled", G_TYPE_UINT64, spooled,
+		"spool-dropped", G_TYPE_UINT64, spool_dropped,
+		"keepalives", G_TYPE_UINT64, keepalives,
+		"control-messages", G_TYPE_UINT64, control_messages, NULL);
+}
+
+/* reconnects from the streaming thread with exponential backoff and jitter, buffers queued in front of the sink wait meanwhile */
+static GstFlowReturn gst_dream_tcp_client_sink_reconnect (GstDreamTCPClientSink *self, GError *reason)
+{
+	gint64 lost = g_get_monotonic_time ();
+	guint attempt = 0, delay = self->reconnect_min_delay;
+	GstFlowReturn ret = GST_FLOW_FLUSHING;
+	GSocket *socket = NULL;
+
+	GST_WARNING_OBJECT (self, "lost connection to %s:%d (%s), reconnecting", self->host, self->port, reason->message);
+	GST_OBJECT_LOCK (self);
+	socket = self->socket;
+	self->socket = NULL;
+	GST_OBJECT_UNLOCK (self);
+	g_socket_close (socket, NULL);
+	g_object_unref (socket);
+	socket = NULL;
+	while (!g_queue_is_empty (&self->zerocopy_pending))
+		gst_dream_tcp_client_sink_zerocopy_free (g_queue_pop_head (&self->zerocopy_pending));
+	gst_dream_tcp_client_sink_post (self, "disconnected", 0, 0, reason->message);
+
+	g_mutex_lock (&self->reconnect_lock);
+	while (!self->flushing)
+	{
+		GError *err = NULL;
+		gint64 deadline = g_get_monotonic_time () + (gint64) g_random_int_range (delay * 3 / 4, delay * 5 / 4 + 1) * G_TIME_SPAN_MILLISECOND;
+		while (!self->flushing && g_cond_wait_until (&self->reconnect_cond, &self->reconnect_lock, deadline))
+			;
+		if (self->flushing)
+			break;
+		g_mutex_unlock (&self->reconnect_lock);
+
+		/* the standby may have come up while the lost endpoint still refuses */
+		if (gst_dream_tcp_client_sink_failover (self, reason))
+		{
+			g_mutex_lock (&self->reconnect_lock);
+			ret = GST_FLOW_OK;
+			break;
+		}
+		attempt++;
+		socket = gst_dream_tcp_client_sink_open (self, self->host, self->port, self->cancellable, &err);
+		if (!socket)
+		{
+			GST_DEBUG_OBJECT (self, "reconnect attempt %u failed: %s", attempt, err ? err->message : "");
+			gst_dream_tcp_client_sink_post (self, "reconnecting", attempt, 0, err ? err->message : NULL);
+			g_clear_error (&err);
+			delay = MIN (delay * 2, self->reconnect_max_delay);
+			g_mutex_lock (&self->reconnect_lock);
+			continue;
+		}
+		g_mutex_lock (&self->reconnect_lock);
+		break;
+	}
+	g_mutex_unlock (&self->reconnect_lock);
+
+	if (socket)
+	{
+		guint64 downtime = (g_get_monotonic_time () - lost) / G_TIME_SPAN_MILLISECOND;
+		GST_INFO_OBJECT (self, "reconnected to %s:%d after %u attempts and %" G_GUINT64_FORMAT " ms", self->host, self->port, attempt, downtime);
+		GST_OBJECT_LOCK (self);
+		self->socket = socket;
+		self->delivered = self->bytes_written;
+		self->delivered_time = 0;
+		GST_OBJECT_UNLOCK (self);
+		self->zerocopy_seq = 0;
+		self->need_preamble = self->preamble != NULL;
+		self->keepalive_rest = 0;
+		self->wait_keyframe = TRUE;
+		gst_dream_tcp_client_sink_post (self, "reconnected", attempt, downtime, NULL);
+		ret = GST_FLOW_OK;
+	}
+	return ret;
+}
+
+static gboolean gst_dream_tcp_client_sink_send_preamble (GstDreamTCPClientSink *self, GError **err)
+{
+	gsize len = g_bytes_get_size (self->preamble);
+
+	if (!gst_dream_tcp_client_sink_send_all (self->socket, g_bytes_get_data (self->preamble, NULL), len, self->cancellable, err))
+		return FALSE;
+	GST_OBJECT_LOCK (self);
+	self->bytes_written += len;
+	GST_OBJECT_UNLOCK (self);
+	self->need_preamble = FALSE;
+	return TRUE;
+}
+
+/* what has to go out ahead of the data, the preamble on a new connection and the rest of a keepalive the socket only took partly */
+static gboolean gst_dream_tcp_client_sink_send_pending (GstDreamTCPClientSink *self, GError **err)
+{
+	if (self->need_preamble && !gst_dream_tcp_client_sink_send_preamble (self, err))
+		return FALSE;
+	if (self->keepalive_rest)
+	{
+		gsize size;
+		const gchar *frame = g_bytes_get_data (self->keepalive_pending, &size);
+		if (!gst_dream_tcp_client_sink_send_all (self->socket, frame + size - self->keepalive_rest, self->keepalive_rest, self->cancellable, err))
+			return FALSE;
+		GST_OBJECT_LOCK (self);
+		self->bytes_written += self->keepalive_rest;
+		GST_OBJECT_UNLOCK (self);
+		self->keepalive_rest = 0;
+	}
+	return TRUE;
+}
+
+/* one keepalive frame (a TS null packet unless keepalive-frame says otherwise) on a connection nothing else is being sent on, written from the caller's thread without ever blocking it */
+static gboolean gst_dream_tcp_client_sink_keepalive (GstDreamTCPClientSink *self)
+{
+	GError *err = NULL;
+	GSocket *socket;
+	GBytes *frame;
+	const gchar *data;
+	gsize size;
+	gssize len;
+
+	/* the streaming thread is sending */
+	if (!g_mutex_trylock (&self->send_lock))
+		return FALSE;
+	GST_OBJECT_LOCK (self);
+	socket = self->socket && self->spool_tail == self->spool_head ? g_object_ref (self->socket) : NULL;
+	GST_OBJECT_UNLOCK (self);
+	if (!socket || self->need_preamble || self->keepalive_rest)
+	{
+		g_clear_object (&socket);
+		g_mutex_unlock (&self->send_lock);
+		return FALSE;
+	}
+
+	GST_OBJECT_LOCK (self);
+	frame = g_bytes_ref (self->keepalive_frame ? self->keepalive_frame : ts_null_packet);
+	GST_OBJECT_UNLOCK (self);
+	data = g_bytes_get_data (frame, &size);
+	len = g_socket_send_with_blocking (socket, data, size, FALSE, NULL, &err);
+	if (len > 0)
+	{
+		GST_OBJECT_LOCK (self);
+		self->bytes_written += len;
+		self->keepalives++;
+		GST_OBJECT_UNLOCK (self);
+		/* the rest is always taken from the frame it was cut from, even if the property changes meanwhile */
+		self->keepalive_rest = size - len;
+		if (self->keepalive_pending)
+			g_bytes_unref (self->keepalive_pending);
+		self->keepalive_pending = g_bytes_ref (frame);
+		GST_LOG_OBJECT (self, "sent keepalive to %s:%d (%" G_GSSIZE_FORMAT " bytes)", self->host, self->port, len);
+	}
+	else if (err && !g_error_matches (err, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
+		GST_DEBUG_OBJECT (self, "keepalive to %s:%d failed: %s", self->host, self->port, err->message);
+	g_clear_error (&err);
+	g_bytes_unref (frame);
+	g_object_unref (socket);
+	g_mutex_unlock (&self->send_lock);
+	return len > 0;
+}
+
+static GstFlowReturn gst_dream_tcp_client_sink_send_failed (GstDreamTCPClientSink *self, GError *err)
+{
+	GstFlowReturn ret = GST_FLOW_OK;
+
+	if (g_error_matches (err, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+	{
+		GST_DEBUG_OBJECT (self, "send cancelled");
+		ret = GST_FLOW_FLUSHING;
+	}
+	else if (gst_dream_tcp_client_sink_failover (self, err))
+		ret = GST_FLOW_OK;
+	else if (self->reconnect && self->spool)
+		ret = gst_dream_tcp_client_sink_spool_outage (self, err);
+	else if (self->reconnect)
+		ret = gst_dream_tcp_client_sink_reconnect (self, err);
+	else
+	{
+		GST_ELEMENT_ERROR (self, RESOURCE, WRITE, ("error while sending data to %s:%d", self->host, self->port), ("%s", err->message));
+		ret = GST_FLOW_ERROR;
+	}
+	g_error_free (err);
+	return ret;
+}
+
+/* catches up on the spooled backlog, limited to spool-max-rate so that the live stream doesn't starve the link */
+static GstFlowReturn gst_dream_tcp_client_sink_spool_drain (GstDreamTCPClientSink *self, gboolean all)
+{
+	gint64 now = g_get_monotonic_time ();
+	guint64 budget = self->spool_tail - self->spool_head;
+	GError *err = NULL;
+	guint sends = 0;
+	gsize sent = 0;
+
+	if (!self->socket || !budget)
+		return GST_FLOW_OK;
+	if (self->spool_max_rate && !all)
+	{
+		gint64 elapsed = MIN (now - self->spool_drain_time, G_USEC_PER_SEC);
+		budget = MIN (budget, (guint64) elapsed * self->spool_max_rate / 8000);
+		if (!budget)
+			return GST_FLOW_OK;
+	}
+	self->spool_drain_time = now;
+
+	gst_dream_tcp_client_sink_send_pending (self, &err);
+
+	while (!err && budget)
+	{
+		GOutputVector vectors[2];
+		gsize offset = (self->spool_head + sent) % self->spool_capacity;
+		guint n = 1;
+
+		vectors[0].buffer = self->spool + offset;
+		vectors[0].size = MIN (budget, self->spool_capacity - offset);
+		if (vectors[0].size < budget)
+		{
+			vectors[1].buffer = self->spool;
+			vectors[1].size = budget - vectors[0].size;
+			n = 2;
+		}
+		gssize ret = g_socket_send_message (self->socket, NULL, vectors, n, NULL, 0, 0, self->cancellable, &err);
+		if (ret < 0)
+			break;
+		sends++;
+		sent += ret;
+		budget -= ret;
+	}
+
+	GST_OBJECT_LOCK (self);
+	self->spool_head += sent;
+	self->bytes_written += sent;
+	self->sends += sends;
+	GST_OBJECT_UNLOCK (self);
+	while (self->spool_keyframes->len && g_array_index (self->spool_keyframes, guint64, 0) < self->spool_head)
+		g_array_remove_index (self->spool_keyframes, 0);
+	if (!err && self->spool_head == self->spool_tail)
+		GST_INFO_OBJECT (self, "spooled backlog sent, back to live");
+
+	if (err)
+		return gst_dream_tcp_client_sink_send_failed (self, err);
+	return GST_FLOW_OK;
+}
+
+/* sends the whole batch with as few vectored writes as the socket allows */
+static GstFlowReturn gst_dream_tcp_client_sink_flush (GstDreamTCPClientSink *self)
+{
+	GArray *chunks = self->batch;
+	GOutputVector *vectors;
+	GError *err = NULL;
+	guint i, first = 0, sends = 0;
+	gsize sent = 0;
+	gint flags = 0;
+
+	if (!chunks->len)
+		return GST_FLOW_OK;
+	self->batch = g_array_sized_new (FALSE, FALSE, sizeof (DreamTCPChunk), TCP_CLIENT_SINK_MAX_VECTORS);
+	self->batch_bytes = 0;
+	self->batch_start = GST_CLOCK_TIME_NONE;
+
+	vectors = g_newa (GOutputVector, chunks->len);
+	for (i = 0; i < chunks->len; i++)
+	{
+		DreamTCPChunk *chunk = &g_array_index (chunks, DreamTCPChunk, i);
+		vectors[i].buffer = chunk->map.data;
+		vectors[i].size = chunk->map.size;
+	}
+#ifdef MSG_ZEROCOPY
+	if (self->zerocopy)
+		flags = MSG_ZEROCOPY;
+#endif
+
+	gst_dream_tcp_client_sink_send_pending (self, &err);
+
+	while (!err && first < chunks->len)
+	{
+		/* with a standby at hand a peer that stops accepting data counts as failed */
+		if (self->standby && self->stall_timeout && !g_socket_condition_timed_wait (self->socket, G_IO_OUT, (gint64) self->stall_timeout * 1000, self->cancellable, &err))
+			break;
+		gssize ret = g_socket_send_message (self->socket, NULL, vectors + first, chunks->len - first, NULL, 0, flags, self->cancellable, &err);
+		if (ret < 0)
+			break;
+		sends++;
+		sent += ret;
+		while (first < chunks->len && (gsize) ret >= vectors[first].size)
+			ret -= vectors[first++].size;
+		if (first < chunks->len)
+		{
+			vectors[first].buffer = (const guint8 *) vectors[first].buffer + ret;
+			vectors[first].size -= ret;
+		}
+	}
+
+	GST_OBJECT_LOCK (self);
+	self->bytes_written += sent;
+	self->sends += sends;
+	GST_OBJECT_UNLOCK (self);
+
+	/* what didn't make it out is kept, only a partially sent buffer is lost along with the kernel's send queue */
+	if (err && self->spool && !g_error_matches (err, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+	{
+		for (i = first; i < chunks->len; i++)
+		{
+			DreamTCPChunk *chunk = &g_array_index (chunks, DreamTCPChunk, i);
+			if (i > first || vectors[i].buffer == chunk->map.data)
+				gst_dream_tcp_client_sink_spool_push (self, chunk->map.data, chunk->map.size, !GST_BUFFER_FLAG_IS_SET (chunk->buffer, GST_BUFFER_FLAG_DELTA_UNIT));
+		}
+	}
+
+	if (flags && sends)
+	{
+		DreamTCPZerocopySend *send = g_new (DreamTCPZerocopySend, 1);
+		self->zerocopy_seq += sends;
+		send->seq = self->zerocopy_seq - 1;
+		send->chunks = chunks;
+		g_queue_push_tail (&self->zerocopy_pending, send);
+		gst_dream_tcp_client_sink_reap_zerocopy (self);
+	}
+	else
+		gst_dream_tcp_client_sink_chunks_free (chunks);
+
+	if (err)
+		return gst_dream_tcp_client_sink_send_failed (self, err);
+	return GST_FLOW_OK;
+}
+
+static gboolean gst_dream_tcp_client_sink_append (GstDreamTCPClientSink *self, GstBuffer *buffer)
+{
+	DreamTCPChunk chunk;
+
+	if (gst_dream_tcp_client_sink_spooling (self))
+	{
+		GstMapInfo map;
+		if (!gst_buffer_map (buffer, &map, GST_MAP_READ))
+			return FALSE;
+		gst_dream_tcp_client_sink_spool_push (self, map.data, map.size, !GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT));
+		gst_buffer_unmap (buffer, &map);
+		return TRUE;
+	}
+
+	/* after a reconnect the receiver can only pick up again at a keyframe */
+	if (self->wait_keyframe)
+	{
+		if (GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+			return TRUE;
+		GST_DEBUG_OBJECT (self, "resuming at keyframe %" GST_TIME_FORMAT, GST_TIME_ARGS (GST_BUFFER_DTS_OR_PTS (buffer)));
+		self->wait_keyframe = FALSE;
+	}
+	if (!gst_buffer_map (buffer, &chunk.map, GST_MAP_READ))
+		return FALSE;
+	chunk.buffer = gst_buffer_ref (buffer);
+	g_array_append_val (self->batch, chunk);
+	self->batch_bytes += chunk.map.size;
+	if (!GST_CLOCK_TIME_IS_VALID (self->batch_start))
+		self->batch_start = GST_BUFFER_DTS_OR_PTS (buffer);
+	return TRUE;
+}
+
+/* small buffers are held back until max-batch-size bytes or max-batch-delay of stream time have been collected */
+static GstFlowReturn gst_dream_tcp_client_sink_render (GstBaseSink *bsink, GstBuffer *buffer)
+{
+	GstDreamTCPClientSink *self = GST_DREAM_TCP_CLIENT_SINK (bsink);
+	GstClockTime ts = GST_BUFFER_DTS_OR_PTS (buffer);
+	GstFlowReturn ret = GST_FLOW_OK;
+
+	if (!self->socket && !self->spool)
+		return GST_FLOW_ERROR;
+	g_mutex_lock (&self->send_lock);
+	gst_dream_tcp_client_sink_adopt (self);
+	if (!gst_dream_tcp_client_sink_append (self, buffer))
+		ret = GST_FLOW_ERROR;
+	else if (gst_dream_tcp_client_sink_spooling (self))
+		ret = gst_dream_tcp_client_sink_spool_drain (self, FALSE);
+	else if (self->batch_bytes >= self->max_batch_size || self->batch->len >= TCP_CLIENT_SINK_MAX_VECTORS || !GST_CLOCK_TIME_IS_VALID (ts) ||
+		 !GST_CLOCK_TIME_IS_VALID (self->batch_start) || ts >= self->batch_start + self->max_batch_delay)
+		ret = gst_dream_tcp_client_sink_flush (self);
+	g_mutex_unlock (&self->send_lock);
+	return ret;
+}
+
+static GstFlowReturn gst_dream_tcp_client_sink_render_list (GstBaseSink *bsink, GstBufferList *list)
+{
+	GstDreamTCPClientSink *self = GST_DREAM_TCP_CLIENT_SINK (bsink);
+	GstFlowReturn ret = GST_FLOW_OK;
+	guint i, len = gst_buffer_list_length (list);
+
+	if (!self->socket && !self->spool)
+		return GST_FLOW_ERROR;
+	g_mutex_lock (&self->send_lock);
+	gst_dream_tcp_client_sink_adopt (self);
+
+	for (i = 0; i < len && ret == GST_FLOW_OK; i++)
+	{
+		if (!gst_dream_tcp_client_sink_append (self, gst_buffer_list_get (list, i)))
+			ret = GST_FLOW_ERROR;
+		else if (self->batch->len >= TCP_CLIENT_SINK_MAX_VECTORS)
+			ret = gst_dream_tcp_client_sink_flush (self);
+	}
+	if (ret == GST_FLOW_OK)
+		ret = gst_dream_tcp_client_sink_flush (self);
+	if (ret == GST_FLOW_OK)
+		ret = gst_dream_tcp_client_sink_spool_drain (self, FALSE);
+	g_mutex_unlock (&self->send_lock);
+	return ret;
+}
+
+static gboolean gst_dream_tcp_client_sink_event (GstBaseSink *bsink, GstEvent *event)
+{
+	GstDreamTCPClientSink *self = GST_DREAM_TCP_CLIENT_SINK (bsink);
+
+	switch (GST_EVENT_TYPE (event)) {
+		case GST_EVENT_EOS:
+			g_mutex_lock (&self->send_lock);
+			if (self->socket && gst_dream_tcp_client_sink_flush (self) == GST_FLOW_OK)
+				gst_dream_tcp_client_sink_spool_drain (self, TRUE);
+			g_mutex_unlock (&self->send_lock);
+			break;
+		case GST_EVENT_FLUSH_STOP:
+			g_mutex_lock (&self->send_lock);
+			gst_dream_tcp_client_sink_batch_clear (self);
+			g_mutex_unlock (&self->send_lock);
+			break;
+		default:
+			break;
+	}
+	return GST_BASE_SINK_CLASS (gst_dream_tcp_client_sink_parent_class)->event (bsink, event);
+}
+
+static gboolean gst_dream_tcp_client_sink_unlock (GstBaseSink *bsink)
+{
+	GstDreamTCPClientSink *self = GST_DREAM_TCP_CLIENT_SINK (bsink);
+	g_mutex_lock (&self->reconnect_lock);
+	self->flushing = TRUE;
+	g_cond_broadcast (&self->reconnect_cond);
+	g_mutex_unlock (&self->reconnect_lock);
+	g_cancellable_cancel (self->cancellable);
+	return TRUE;
+}
+
+static gboolean gst_dream_tcp_client_sink_unlock_stop (GstBaseSink *bsink)
+{
+	GstDreamTCPClientSink *self = GST_DREAM_TCP_CLIENT_SINK (bsink);
+	g_mutex_lock (&self->reconnect_lock);
+	self->flushing = FALSE;
+	g_mutex_unlock (&self->reconnect_lock);
+	g_cancellable_reset (self->cancellable);
+	return TRUE;
+}
+
+/* like tcpclientsink, the connection is made when going to READY so that a refused connection fails the state change */
+static GstStateChangeReturn gst_dream_tcp_client_sink_change_state (GstElement *element, GstStateChange transition)
+{
+	GstDreamTCPClientSink *self = GST_DREAM_TCP_CLIENT_SINK (element);
+	GstStateChangeReturn ret;
+
+	if (transition == GST_STATE_CHANGE_NULL_TO_READY && !gst_dream_tcp_client_sink_connect (self))
+		return GST_STATE_CHANGE_FAILURE;
+
+	ret = GST_ELEMENT_CLASS (gst_dream_tcp_client_sink_parent_class)->change_state (element, transition);
+
+	if (transition == GST_STATE_CHANGE_READY_TO_NULL)
+		gst_dream_tcp_client_sink_close (self);
+	return ret;
+}
+
+static void gst_dream_tcp_client_sink_set_property (GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec)
+{
+	GstDreamTCPClientSink *self = GST_DREAM_TCP_CLIENT_SINK (object);
+
+	switch (prop_id) {
+		case PROP_TCP_HOST:
+			GST_OBJECT_LOCK (self);
+			g_free (self->host);
+			self->host = g_value_dup_string (value);
+			GST_OBJECT_UNLOCK (self);
+			break;
+		case PROP_TCP_PORT:
+			self->port = g_value_get_int (value);
+			break;
+		case PROP_TCP_MAX_BATCH_SIZE:
+			self->max_batch_size = g_value_get_uint (value);
+			break;
+		case PROP_TCP_MAX_BATCH_DELAY:
+			self->max_batch_delay = g_value_get_uint64 (value);
+			break;
+		case PROP_TCP_NOTSENT_LOWAT:
+			self->notsent_lowat = g_value_get_uint (value);
+			break;
+		case PROP_TCP_ZEROCOPY:
+			self->zerocopy = g_value_get_boolean (value);
+			break;
+		case PROP_TCP_PREAMBLE:
+			GST_OBJECT_LOCK (self);
+			if (self->preamble)
+				g_bytes_unref (self->preamble);
+			self->preamble = g_value_dup_boxed (value);
+			if (self->preamble && !g_bytes_get_size (self->preamble))
+				g_clear_pointer (&self->preamble, g_bytes_unref);
+			GST_OBJECT_UNLOCK (self);
+			break;
+		case PROP_TCP_RECONNECT:
+			self->reconnect = g_value_get_boolean (value);
+			break;
+		case PROP_TCP_RECONNECT_MIN_DELAY:
+			self->reconnect_min_delay = g_value_get_uint (value);
+			break;
+		case PROP_TCP_RECONNECT_MAX_DELAY:
+			self->reconnect_max_delay = g_value_get_uint (value);
+			break;
+		case PROP_TCP_STANDBY_HOST:
+			GST_OBJECT_LOCK (self);
+			g_free (self->standby_host);
+			self->standby_host = g_value_dup_string (value);
+			if (self->standby_host && !*self->standby_host)
+				g_clear_pointer (&self->standby_host, g_free);
+			GST_OBJECT_UNLOCK (self);
+			break;
+		case PROP_TCP_STANDBY_PORT:
+			self->standby_port = g_value_get_int (value);
+			break;
+		case PROP_TCP_STALL_TIMEOUT:
+			self->stall_timeout = g_value_get_uint (value);
+			break;
+		case PROP_TCP_SPOOL_SIZE:
+			self->spool_size = g_value_get_uint (value);
+			break;
+		case PROP_TCP_SPOOL_LOCATION:
+			GST_OBJECT_LOCK (self);
+			g_free (self->spool_location);
+			self->spool_location = g_value_dup_string (value);
+			if (self->spool_location && !*self->spool_location)
+				g_clear_pointer (&self->spool_location, g_free);
+			GST_OBJECT_UNLOCK (self);
+			break;
+		case PROP_TCP_SPOOL_MAX_RATE:
+			self->spool_max_rate = g_value_get_uint (value);
+			break;
+		case PROP_TCP_CONTROL:
+			self->control = g_value_get_boolean (value);
+			break;
+		case PROP_TCP_KEEPALIVE_FRAME:
+			GST_OBJECT_LOCK (self);
+			if (self->keepalive_frame)
+				g_bytes_unref (self->keepalive_frame);
+			self->keepalive_frame = g_value_dup_boxed (value);
+			GST_OBJECT_UNLOCK (self);
+			break;
+		default:
+			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+			break;
+	}
+}
+
+static void gst_dream_tcp_client_sink_get_property (GObject *object, guint prop_id, GValue *value, GParamSpec *pspec)
+{
+	GstDreamTCPClientSink *self = GST_DREAM_TCP_CLIENT_SINK (object);
+
+	switch (prop_id) {
+		case PROP_TCP_HOST:
+			GST_OBJECT_LOCK (self);
+			g_value_set_string (value, self->host);
+			GST_OBJECT_UNLOCK (self);
+			break;
+		case PROP_TCP_PORT:
+			g_value_set_int (value, self->port);
+			break;
+		case PROP_TCP_STATS:
+			g_value_take_boxed (value, gst_dream_tcp_client_sink_get_stats (self));
+			break;
+		case PROP_TCP_MAX_BATCH_SIZE:
+			g_value_set_uint (value, self->max_batch_size);
+			break;
+		case PROP_TCP_MAX_BATCH_DELAY:
+			g_value_set_uint64 (value, self->max_batch_delay);
+			break;
+		case PROP_TCP_NOTSENT_LOWAT:
+			g_value_set_uint (value, self->notsent_lowat);
+			break;
+		case PROP_TCP_ZEROCOPY:
+			g_value_set_boolean (value, self->zerocopy);
+			break;
+		case PROP_TCP_PREAMBLE:
+			GST_OBJECT_LOCK (self);
+			g_value_set_boxed (value, self->preamble);
+			GST_OBJECT_UNLOCK (self);
+			break;
+		case PROP_TCP_RECONNECT:
+			g_value_set_boolean (value, self->reconnect);
+			break;
+		case PROP_TCP_RECONNECT_MIN_DELAY:
+			g_value_set_uint (value, self->reconnect_min_delay);
+			break;
+		case PROP_TCP_RECONNECT_MAX_DELAY:
+			g_value_set_uint (value, self->reconnect_max_delay);
+			break;
+		case PROP_TCP_STANDBY_HOST:
+			GST_OBJECT_LOCK (self);
+			g_value_set_string (value, self->standby_host);
+			GST_OBJECT_UNLOCK (self);
+			break;
+		case PROP_TCP_STANDBY_PORT:
+			g_value_set_int (value, self->standby_port);
+			break;
+		case PROP_TCP_STALL_TIMEOUT:
+			g_value_set_uint (value, self->stall_timeout);
+			break;
+		case PROP_TCP_SPOOL_SIZE:
+			g_value_set_uint (value, self->spool_size);
+			break;
+		case PROP_TCP_SPOOL_LOCATION:
+			GST_OBJECT_LOCK (self);
+			g_value_set_string (value, self->spool_location);
+			GST_OBJECT_UNLOCK (self);
+			break;
+		case PROP_TCP_SPOOL_MAX_RATE:
+			g_value_set_uint (value, self->spool_max_rate);
+			break;
+		case PROP_TCP_CONTROL:
+			g_value_set_boolean (value, self->control);
+			break;
+		case PROP_TCP_KEEPALIVE_FRAME:
+			GST_OBJECT_LOCK (self);
+			g_value_set_boxed (value, self->keepalive_frame);
+			GST_OBJECT_UNLOCK (self);
+			break;
+		default:
+			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+			break;
+	}
+}
+
+static void gst_dream_tcp_client_sink_finalize (GObject *object)
+{
+	GstDreamTCPClientSink *self = GST_DREAM_TCP_CLIENT_SINK (object);
+	gst_dream_tcp_client_sink_close (self);
+	g_array_free (self->batch, TRUE);
+	if (self->preamble)
+		g_bytes_unref (self->preamble);
+	g_mutex_clear (&self->reconnect_lock);
+	g_cond_clear (&self->reconnect_cond);
+	g_mutex_clear (&self->send_lock);
+	g_free (self->host);
+	g_free (self->standby_host);
+	g_free (self->spool_location);
+	g_array_free (self->spool_keyframes, TRUE);
+	if (self->keepalive_frame)
+		g_bytes_unref (self->keepalive_frame);
+	if (self->keepalive_pending)
+		g_bytes_unref (self->keepalive_pending);
+	g_object_unref (self->cancellable);
+	g_object_unref (self->standby_cancellable);
+	g_object_unref (self->reconnect_cancellable);
+	g_object_unref (self->control_cancellable);
+	G_OBJECT_CLASS (gst_dream_tcp_client_sink_parent_class)->finalize (object);
+}
+
+static void gst_dream_tcp_client_sink_class_init (GstDreamTCPClientSinkClass * klass)
+{
+	GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+	GstElementClass *element_class = GST_ELEMENT_CLASS (klass);
+	GstBaseSinkClass *basesink_class = GST_BASE_SINK_CLASS (klass);
+
+	gobject_class->set_property = gst_dream_tcp_client_sink_set_property;
+	gobject_class->get_property = gst_dream_tcp_client_sink_get_property;
+	gobject_class->finalize = gst_dream_tcp_client_sink_finalize;
+	element_class->change_state = gst_dream_tcp_client_sink_change_state;
+	basesink_class->render = gst_dream_tcp_client_sink_render;
+	basesink_class->render_list = gst_dream_tcp_client_sink_render_list;
+	basesink_class->event = gst_dream_tcp_client_sink_event;
+	basesink_class->unlock = gst_dream_tcp_client_sink_unlock;
+	basesink_class->unlock_stop = gst_dream_tcp_client_sink_unlock_stop;
+	klass->keepalive = gst_dream_tcp_client_sink_keepalive;
+
+	g_object_class_install_property (gobject_class, PROP_TCP_HOST,
+		g_param_spec_string ("host", "Host", "The host/IP to send the packets to", TCP_CLIENT_SINK_DEFAULT_HOST, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_TCP_PORT,
+		g_param_spec_int ("port", "Port", "The port to send the packets to", 0, G_MAXUINT16, TCP_CLIENT_SINK_DEFAULT_PORT, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_TCP_STATS,
+		g_param_spec_boxed ("stats", "Stats", "Kernel socket state of the connection (NULL while not connected)", GST_TYPE_STRUCTURE, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_TCP_MAX_BATCH_SIZE,
+		g_param_spec_uint ("max-batch-size", "Max batch size", "Send once this many bytes have been collected", 0, G_MAXUINT, TCP_CLIENT_SINK_DEFAULT_MAX_BATCH_SIZE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_TCP_MAX_BATCH_DELAY,
+		g_param_spec_uint64 ("max-batch-delay", "Max batch delay", "Send once the collected buffers span this much stream time (0 = send every buffer)", 0, G_MAXUINT64, TCP_CLIENT_SINK_DEFAULT_MAX_BATCH_DELAY, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_TCP_NOTSENT_LOWAT,
+		g_param_spec_uint ("notsent-lowat", "Not sent low watermark", "TCP_NOTSENT_LOWAT of the socket in bytes (0 = kernel default)", 0, G_MAXINT, TCP_CLIENT_SINK_DEFAULT_NOTSENT_LOWAT, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_TCP_ZEROCOPY,
+		g_param_spec_boolean ("zerocopy", "Zerocopy", "Send with MSG_ZEROCOPY where the kernel supports it", FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_TCP_PREAMBLE,
+		g_param_spec_boxed ("preamble", "Preamble", "Sent ahead of the data on every new connection", G_TYPE_BYTES, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_TCP_RECONNECT,
+		g_param_spec_boolean ("reconnect", "Reconnect", "Reconnect after write errors instead of failing, resuming at the next keyframe", FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_TCP_RECONNECT_MIN_DELAY,
+		g_param_spec_uint ("reconnect-min-delay", "Reconnect min delay", "First reconnect backoff in ms", 1, G_MAXINT / 2, TCP_CLIENT_SINK_DEFAULT_RECONNECT_MIN_DELAY, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_TCP_RECONNECT_MAX_DELAY,
+		g_param_spec_uint ("reconnect-max-delay", "Reconnect max delay", "Upper bound of the reconnect backoff in ms", 1, G_MAXINT / 2, TCP_CLIENT_SINK_DEFAULT_RECONNECT_MAX_DELAY, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_TCP_STANDBY_HOST,
+		g_param_spec_string ("standby-host", "Standby host", "Kept connected while idle and takes over the stream when the connection to host fails (NULL = no standby)", NULL, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_TCP_STANDBY_PORT,
+		g_param_spec_int ("standby-port", "Standby port", "The port of the standby host", 0, G_MAXUINT16, TCP_CLIENT_SINK_DEFAULT_PORT, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_TCP_STALL_TIMEOUT,
+		g_param_spec_uint ("stall-timeout", "Stall timeout", "Switch over to the standby when the socket accepts no data for this many ms (0 = only on errors)", 0, G_MAXUINT, TCP_CLIENT_SINK_DEFAULT_STALL_TIMEOUT, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_TCP_SPOOL_SIZE,
+		g_param_spec_uint ("spool-size", "Spool size", "Bytes kept while reconnecting in the background and sent once the connection is back (0 = no spool, block and resume at the next keyframe)", 0, G_MAXUINT, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_TCP_SPOOL_LOCATION,
+		g_param_spec_string ("spool-location", "Spool location", "New file the spool is memory-mapped from, must not exist and is unlinked once opened (NULL = keep it in memory)", NULL, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_TCP_SPOOL_MAX_RATE,
+		g_param_spec_uint ("spool-max-rate", "Spool max rate", "Ceiling in kbit/s for sending the spooled backlog (0 = as fast as the connection allows)", 0, G_MAXUINT, TCP_CLIENT_SINK_DEFAULT_SPOOL_MAX_RATE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_TCP_KEEPALIVE_FRAME,
+		g_param_spec_boxed ("keepalive-frame", "Keepalive frame", "What the keepalive action sends, must be a no-op in the stream's framing (NULL = TS null packet)", G_TYPE_BYTES, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_TCP_CONTROL,
+		g_param_spec_boolean ("control", "Control channel", "Read line based commands the server sends back and post them as control events", FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	gst_dream_tcp_client_sink_signals[SIGNAL_KEEPALIVE] =
+		g_signal_new ("keepalive", G_TYPE_FROM_CLASS (klass),
+		G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION, G_STRUCT_OFFSET(GstDreamTCPClientSinkClass, keepalive),
+		NULL, NULL, NULL,
+		G_TYPE_BOOLEAN, 0);
+
+	memset (ts_null_data, 0xff, TS_PACKET_SIZE);
+	ts_null_data[0] = 0x47;
+	ts_null_data[1] = 0x1f;
+	ts_null_data[2] = 0xff;
+	ts_null_data[3] = 0x10;
+	ts_null_packet = g_bytes_new_static (ts_null_data, TS_PACKET_SIZE);
+
+	gst_element_class_add_pad_template (element_class, gst_static_pad_template_get (&tcp_client_sink_template));
+	gst_element_class_set_static_metadata (element_class, "Dreambox TCP client sink", "Sink/Network",
+		"Sends data to a TCP server and reports the socket state of the connection", "Andreas Frisch <fraxinas@opendreambox.org>");
+
+	GST_DEBUG_CATEGORY_INIT (rtsp_server_debug, "dreamrtspserver",
+		GST_DEBUG_BOLD | GST_DEBUG_FG_YELLOW | GST_DEBUG_BG_BLUE,
+		"Dreambox RTSP server daemon");
+}
+
+static void gst_dream_tcp_client_sink_init (GstDreamTCPClientSink * self)
+{
+	self->host = g_strdup (TCP_CLIENT_SINK_DEFAULT_HOST);
+	self->port = TCP_CLIENT_SINK_DEFAULT_PORT;
+	self->socket = NULL;
+	self->cancellable = g_cancellable_new ();
+	self->bytes_written = self->delivered = self->sends = 0;
+	self->delivered_time = 0;
+	self->batch = g_array_sized_new (FALSE, FALSE, sizeof (DreamTCPChunk), TCP_CLIENT_SINK_MAX_VECTORS);
+	self->batch_bytes = 0;
+	self->batch_start = GST_CLOCK_TIME_NONE;
+	self->max_batch_size = TCP_CLIENT_SINK_DEFAULT_MAX_BATCH_SIZE;
+	self->max_batch_delay = TCP_CLIENT_SINK_DEFAULT_MAX_BATCH_DELAY;
+	self->notsent_lowat = TCP_CLIENT_SINK_DEFAULT_NOTSENT_LOWAT;
+	self->zerocopy = FALSE;
+	self->zerocopy_seq = 0;
+	g_queue_init (&self->zerocopy_pending);
+	self->preamble = NULL;
+	self->need_preamble = self->wait_keyframe = FALSE;
+	self->reconnect = self->flushing = FALSE;
+	self->reconnect_min_delay = TCP_CLIENT_SINK_DEFAULT_RECONNECT_MIN_DELAY;
+	self->reconnect_max_delay = TCP_CLIENT_SINK_DEFAULT_RECONNECT_MAX_DELAY;
+	g_mutex_init (&self->reconnect_lock);
+	g_cond_init (&self->reconnect_cond);
+	self->standby_host = NULL;
+	self->standby_port = TCP_CLIENT_SINK_DEFAULT_PORT;
+	self->standby = NULL;
+	self->standby_cancellable = g_cancellable_new ();
+	self->standby_thread = NULL;
+	self->standby_stop = FALSE;
+	self->stall_timeout = TCP_CLIENT_SINK_DEFAULT_STALL_TIMEOUT;
+	self->failovers = 0;
+	self->spool_location = NULL;
+	self->spool_size = 0;
+	self->spool_max_rate = TCP_CLIENT_SINK_DEFAULT_SPOOL_MAX_RATE;
+	self->spool = NULL;
+	self->spool_capacity = 0;
+	self->spool_mapped = self->spool_wait_keyframe = FALSE;
+	self->spool_head = self->spool_tail = self->spool_dropped = 0;
+	self->spool_keyframes = g_array_new (FALSE, FALSE, sizeof (guint64));
+	self->spool_drain_time = self->outage_start = 0;
+	self->reconnected = NULL;
+	self->reconnect_cancellable = g_cancellable_new ();
+	self->reconnect_thread = NULL;
+	self->reconnect_stop = FALSE;
+	self->reconnect_attempt = 0;
+	g_mutex_init (&self->send_lock);
+	self->keepalive_rest = 0;
+	self->keepalives = 0;
+	self->keepalive_frame = self->keepalive_pending = NULL;
+	self->control = self->control_stop = FALSE;
+	self->control_thread = NULL;
+	self->control_cancellable = g_cancellable_new ();
+	self->control_messages = 0;
+}
+
+gboolean gst_dream_tcp_client_sink_register (void)
+{
+	return gst_element_register (NULL, "dreamtcpclientsink", GST_RANK_NONE, GST_TYPE_DREAM_TCP_CLIENT_SINK);
+}
+
+enum
+{
+	PROP_RTP_0,
+	PROP_RTP_HOST,
+	PROP_RTP_PORT,
+	PROP_RTP_TOKEN,
+	PROP_RTP_FEC_PERCENTAGE,
+	PROP_RTP_RTX_TIME,
+	PROP_RTP_MAX_LATENESS,
+	PROP_RTP_STATS
+};
+
+#define RTP_CLIENT_SINK_DEFAULT_PORT 4953
+#define RTP_CLIENT_SINK_DEFAULT_FEC_PERCENTAGE 0
+#define RTP_CLIENT_SINK_DEFAULT_RTX_TIME 500
+#define RTP_CLIENT_SINK_MP2T_PT 33
+#define RTP_CLIENT_SINK_RTX_PT 97
+#define RTP_CLIENT_SINK_FEC_PT 122
+
+enum
+{
+	RTP_SIGNAL_KEEPALIVE,
+	RTP_CLIENT_SINK_SIGNAL_LAST
+};
+
+static guint gst_dream_rtp_client_sink_signals[RTP_CLIENT_SINK_SIGNAL_LAST] = { 0 };
+
+static GstStaticPadTemplate rtp_client_sink_template = GST_STATIC_PAD_TEMPLATE ("sink", GST_PAD_SINK, GST_PAD_ALWAYS, GST_STATIC_CAPS ("video/mpegts"));
+
+G_DEFINE_TYPE (GstDreamRTPClientSink, gst_dream_rtp_client_sink, GST_TYPE_BIN);
+
+/* rtpbin asks for it when the session is created, the percentage can still change afterwards */
+static GstElement *gst_dream_rtp_client_sink_request_fec_encoder (GstElement *rtpbin, guint session, gpointer user_data)
+{
+	GstDreamRTPClientSink *self = user_data;
+	GstElement *fec = gst_element_factory_make ("rtpulpfecenc", NULL);
+
+	if (!fec)
+	{
+		GST_WARNING_OBJECT (self, "rtpulpfecenc is not available, sending without FEC");
+		return NULL;
+	}
+	g_object_set (fec, "pt", RTP_CLIENT_SINK_FEC_PT, "percentage", self->fec_percentage, "multipacket", TRUE, NULL);
+	GST_OBJECT_LOCK (self);
+	self->fecenc = gst_object_ref (fec);
+	GST_OBJECT_UNLOCK (self);
+	return fec;
+}
+
+/* retransmits what the receiver NACKs, for no longer than rtx-time so late packets don't hold up the link */
+static GstElement *gst_dream_rtp_client_sink_request_aux_sender (GstElement *rtpbin, guint session, gpointer user_data)
+{
+	GstDreamRTPClientSink *self = user_data;
+	GstElement *bin, *rtx = gst_element_factory_make ("rtprtxsend", NULL);
+	GstStructure *pt_map;
+	GstPad *pad;
+	gchar *name;
+
+	if (!rtx)
+	{
+		GST_WARNING_OBJECT (self, "rtprtxsend is not available, sending without retransmission");
+		return NULL;
+	}
+	pt_map = gst_structure_new ("application/x-rtp-pt-map", G_STRINGIFY (RTP_CLIENT_SINK_MP2T_PT), G_TYPE_UINT, RTP_CLIENT_SINK_RTX_PT, NULL);
+	g_object_set (rtx, "payload-type-map", pt_map, "max-size-time", self->rtx_time, NULL);
+	gst_structure_free (pt_map);
+
+	bin = gst_bin_new (NULL);
+	gst_bin_add (GST_BIN (bin), rtx);
+	pad = gst_element_get_static_pad (rtx, "src");
+	name = g_strdup_printf ("src_%u", session);
+	gst_element_add_pad (bin, gst_ghost_pad_new (name, pad));
+	g_free (name);
+	gst_object_unref (pad);
+	pad = gst_element_get_static_pad (rtx, "sink");
+	name = g_strdup_printf ("sink_%u", session);
+	gst_element_add_pad (bin, gst_ghost_pad_new (name, pad));
+	g_free (name);
+	gst_object_unref (pad);
+
+	GST_OBJECT_LOCK (self);
+	self->rtxsend = gst_object_ref (rtx);
+	GST_OBJECT_UNLOCK (self);
+	return bin;
+}
+
+/* the session is only created once, so that the FEC encoder and the retransmitter are requested with the configured settings */
+static gboolean gst_dream_rtp_client_sink_link (GstDreamRTPClientSink *self)
+{
+	if (self->linked)
+		return TRUE;
+	g_signal_connect (self->rtpbin, "request-fec-encoder", G_CALLBACK (gst_dream_rtp_client_sink_request_fec_encoder), self);
+	g_signal_connect (self->rtpbin, "request-aux-sender", G_CALLBACK (gst_dream_rtp_client_sink_request_aux_sender), self);
+	self->linked = gst_element_link_pads (self->payloader, "src", self->rtpbin, "send_rtp_sink_0") &&
+		gst_element_link_pads (self->rtpbin, "send_rtp_src_0", self->rtpsink, "sink") &&
+		gst_element_link_pads (self->rtpbin, "send_rtcp_src_0", self->rtcpsink, "sink") &&
+		gst_element_link_pads (self->rtcpsrc, "src", self->rtpbin, "recv_rtcp_sink_0");
+	if (!self->linked)
+		GST_ELEMENT_ERROR (self, CORE, NEGOTIATION, ("couldn't link the RTP session"), (NULL));
+	return self->linked;
+}
+
+static gboolean gst_dream_rtp_client_sink_setup (GstDreamRTPClientSink *self)
+{
+	GError *err = NULL;
+	GSocketFamily family = self->host && strchr (self->host, ':') ? G_SOCKET_FAMILY_IPV6 : G_SOCKET_FAMILY_IPV4;
+
+	if (!self->payloader || !self->rtpbin || !self->rtpsink || !self->rtcpsink || !self->rtcpsrc)
+	{
+		GST_ELEMENT_ERROR (self, CORE, MISSING_PLUGIN, ("rtpmp2tpay, rtpbin, udpsink or udpsrc is not available"), (NULL));
+		return FALSE;
+	}
+
+	/* RTCP goes out and comes back on one socket, so receiver reports and NACKs find their way back through NAT */
+	self->rtcp_socket = g_socket_new (family, G_SOCKET_TYPE_DATAGRAM, G_SOCKET_PROTOCOL_UDP, &err);
+	if (self->rtcp_socket)
+	{
+		GInetAddress *any = g_inet_address_new_any (family);
+		GSocketAddress *local = g_inet_socket_address_new (any, 0);
+		if (!g_socket_bind (self->rtcp_socket, local, FALSE, &err))
+			g_clear_object (&self->rtcp_socket);
+		g_object_unref (local);
+		g_object_unref (any);
+	}
+	if (!self->rtcp_socket)
+	{
+		GST_ELEMENT_ERROR (self, RESOURCE, OPEN_READ_WRITE, ("couldn't create the RTCP socket"), ("%s", err ? err->message : ""));
+		g_clear_error (&err);
+		return FALSE;
+	}
+
+	g_object_set (self->rtpsink, "host", self->host, "port", self->port, "max-lateness", self->max_lateness, NULL);
+	g_object_set (self->rtcpsink, "host", self->host, "port", self->port + 1, "socket", self->rtcp_socket, "close-socket", FALSE, "sync", FALSE, "async", FALSE, NULL);
+	g_object_set (self->rtcpsrc, "socket", self->rtcp_socket, "close-socket", FALSE, NULL);
+
+	/* there's no handshake on UDP, the receiver finds the token in the RTCP SDES */
+	if (self->token)
+	{
+		GstStructure *sdes = NULL;
+		g_object_get (self->rtpbin, "sdes", &sdes, NULL);
+		if (sdes)
+		{
+			gst_structure_set (sdes, "note", G_TYPE_STRING, self->token, NULL);
+			g_object_set (self->rtpbin, "sdes", sdes, NULL);
+			gst_structure_free (sdes);
+		}
+	}
+	return gst_dream_rtp_client_sink_link (self);
+}
+
+static GstStateChangeReturn gst_dream_rtp_client_sink_change_state (GstElement *element, GstStateChange transition)
+{
+	GstDreamRTPClientSink *self = GST_DREAM_RTP_CLIENT_SINK (element);
+	GstStateChangeReturn ret;
+
+	if (transition == GST_STATE_CHANGE_NULL_TO_READY && !gst_dream_rtp_client_sink_setup (self))
+		return GST_STATE_CHANGE_FAILURE;
+
+	ret = GST_ELEMENT_CLASS (gst_dream_rtp_client_sink_parent_class)->change_state (element, transition);
+
+	if (transition == GST_STATE_CHANGE_READY_TO_NULL && self->rtcp_socket)
+	{
+		g_socket_close (self->rtcp_socket, NULL);
+		g_clear_object (&self->rtcp_socket);
+	}
+	return ret;
+}
+
+/* the receiver reports of the session in place of TCP_INFO, retransmits are the packets resent on NACK */
+static GstStructure *gst_dream_rtp_client_sink_get_stats (GstDreamRTPClientSink *self)
+{
+	GObject *session = NULL;
+	GstStructure *session_stats = NULL;
+	guint rtt = 0, retransmits = 0, delivery_rate = 0, fraction_lost = 0;
+	gint lost = 0;
+	guint64 served = 0;
+	gint64 now = g_get_monotonic_time ();
+
+	if (!self->linked || GST_STATE (self) < GST_STATE_PAUSED)
+		return NULL;
+
+	g_signal_emit_by_name (self->rtpbin, "get-internal-session", 0, &session);
+	if (session)
+	{
+		g_object_get (session, "stats", &session_stats, NULL);
+		g_object_unref (session);
+	}
+	if (session_stats)
+	{
+G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+		const GValue *value = gst_structure_get_value (session_stats, "source-stats");
+		GValueArray *sources = value ? g_value_get_boxed (value) : NULL;
+		guint i;
+
+		/* the reports the receiver sends about us end up with our own source */
+		for (i = 0; sources && i < sources->n_values; i++)
+		{
+			const GstStructure *s = g_value_get_boxed (&sources->values[i]);
+			gboolean internal = FALSE, have_rb = FALSE;
+			guint round_trip = 0;
+
+			gst_structure_get_boolean (s, "internal", &internal);
+			gst_structure_get_boolean (s, "have-rb", &have_rb);
+			if (!internal || !have_rb)
+				continue;
+			gst_structure_get_uint (s, "rb-round-trip", &round_trip);
+			gst_structure_get_int (s, "rb-packetslost", &lost);
+			gst_structure_get_uint (s, "rb-fractionlost", &fraction_lost);
+			/* compact NTP, 1/65536 s */
+			rtt = (guint64) round_trip * G_USEC_PER_SEC / 65536;
+		}
+G_GNUC_END_IGNORE_DEPRECATIONS
+		gst_structure_free (session_stats);
+	}
+
+	GST_OBJECT_LOCK (self);
+	if (self->rtxsend)
+		g_object_get (self->rtxsend, "num-rtx-packets", &retransmits, NULL);
+	g_object_get (self->rtpsink, "bytes-served", &served, NULL);
+	if (self->delivered_time && now > self->delivered_time && served >= self->delivered)
+		delivery_rate = (served - self->delivered) * 8 * 1000 / (now - self->delivered_time);
+	self->delivered = served;
+	self->delivered_time = now;
+	GST_OBJECT_UNLOCK (self);
+
+	return gst_structure_new ("dream-rtp-stats",
+		"rtt", G_TYPE_UINT, rtt,
+		"rttvar", G_TYPE_UINT, 0,
+		"cwnd", G_TYPE_UINT, 0,
+		"mss", G_TYPE_UINT, 0,
+		"retransmits", G_TYPE_UINT, retransmits,
+		"unacked", G_TYPE_UINT, 0,
+		"outq", G_TYPE_UINT, 0,
+		"delivery-rate", G_TYPE_UINT, delivery_rate,
+		"bytes-written", G_TYPE_UINT64, served,
+		"spooled", G_TYPE_UINT64, G_GUINT64_CONSTANT (0),
+		"spool-dropped", G_TYPE_UINT64, G_GUINT64_CONSTANT (0),
+		"packets-lost", G_TYPE_INT, lost,
+		"fraction-lost", G_TYPE_UINT, fraction_lost,
+		"fec-percentage", G_TYPE_UINT, self->fec_percentage, NULL);
+}
+
+/* RTCP keeps going while the encoder is paused, that keeps NAT bindings open without anything extra */
+static gboolean gst_dream_rtp_client_sink_keepalive (GstDreamRTPClientSink *self)
+{
+	return FALSE;
+}
+
+static void gst_dream_rtp_client_sink_set_property (GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec)
+{
+	GstDreamRTPClientSink *self = GST_DREAM_RTP_CLIENT_SINK (object);
+
+	switch (prop_id) {
+		case PROP_RTP_HOST:
+			g_free (self->host);
+			self->host = g_value_dup_string (value);
+			break;
+		case PROP_RTP_PORT:
+			self->port = g_value_get_int (value);
+			break;
+		case PROP_RTP_TOKEN:
+			g_free (self->token);
+			self->token = g_value_dup_string (value);
+			if (self->token && !*self->token)
+				g_clear_pointer (&self->token, g_free);
+			break;
+		case PROP_RTP_FEC_PERCENTAGE:
+			GST_OBJECT_LOCK (self);
+			self->fec_percentage = g_value_get_uint (value);
+			if (self->fecenc)
+				g_object_set (self->fecenc, "percentage", self->fec_percentage, NULL);
+			GST_OBJECT_UNLOCK (self);
+			break;
+		case PROP_RTP_RTX_TIME:
+			GST_OBJECT_LOCK (self);
+			self->rtx_time = g_value_get_uint (value);
+			if (self->rtxsend)
+				g_object_set (self->rtxsend, "max-size-time", self->rtx_time, NULL);
+			GST_OBJECT_UNLOCK (self);
+			break;
+		case PROP_RTP_MAX_LATENESS:
+			self->max_lateness = g_value_get_int64 (value);
+			if (self->rtpsink)
+				g_object_set (self->rtpsink, "max-lateness", self->max_lateness, NULL);
+			break;
+		default:
+			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+			break;
+	}
+}
+
+static void gst_dream_rtp_client_sink_get_property (GObject *object, guint prop_id, GValue *value, GParamSpec *pspec)
+{
+	GstDreamRTPClientSink *self = GST_DREAM_RTP_CLIENT_SINK (object);
+
+	switch (prop_id) {
+		case PROP_RTP_HOST:
+			g_value_set_string (value, self->host);
+			break;
+		case PROP_RTP_PORT:
+			g_value_set_int (value, self->port);
+			break;
+		case PROP_RTP_TOKEN:
+			g_value_set_string (value, self->token);
+			break;
+		case PROP_RTP_FEC_PERCENTAGE:
+			g_value_set_uint (value, self->fec_percentage);
+			break;
+		case PROP_RTP_RTX_TIME:
+			g_value_set_uint (value, self->rtx_time);
+			break;
+		case PROP_RTP_MAX_LATENESS:
+			g_value_set_int64 (value, self->max_lateness);
+			break;
+		case PROP_RTP_STATS:
+			g_value_take_boxed (value, gst_dream_rtp_client_sink_get_stats (self));
+			break;
+		default:
+			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+			break;
+	}
+}
+
+static void gst_dream_rtp_client_sink_finalize (GObject *object)
+{
+	GstDreamRTPClientSink *self = GST_DREAM_RTP_CLIENT_SINK (object);
+	g_free (self->host);
+	g_free (self->token);
+	if (self->fecenc)
+		gst_object_unref (self->fecenc);
+	if (self->rtxsend)
+		gst_object_unref (self->rtxsend);
+	g_clear_object (&self->rtcp_socket);
+	G_OBJECT_CLASS (gst_dream_rtp_client_sink_parent_class)->finalize (object);
+}
+
+static void gst_dream_rtp_client_sink_class_init (GstDreamRTPClientSinkClass * klass)
+{
+	GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+	GstElementClass *element_class = GST_ELEMENT_CLASS (klass);
+
+	gobject_class->set_property = gst_dream_rtp_client_sink_set_property;
+	gobject_class->get_property = gst_dream_rtp_client_sink_get_property;
+	gobject_class->finalize = gst_dream_rtp_client_sink_finalize;
+	element_class->change_state = gst_dream_rtp_client_sink_change_state;
+	klass->keepalive = gst_dream_rtp_client_sink_keepalive;
+
+	g_object_class_install_property (gobject_class, PROP_RTP_HOST,
+		g_param_spec_string ("host", "Host", "The host/IP to send the packets to", TCP_CLIENT_SINK_DEFAULT_HOST, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_RTP_PORT,
+		g_param_spec_int ("port", "Port", "The RTP port to send the packets to, RTCP goes to the next one", 0, 65534, RTP_CLIENT_SINK_DEFAULT_PORT, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_RTP_TOKEN,
+		g_param_spec_string ("token", "Token", "Sent as the SDES note of the RTCP packets to authenticate the stream", NULL, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_RTP_FEC_PERCENTAGE,
+		g_param_spec_uint ("fec-percentage", "FEC percentage", "ULPFEC overhead in percent of the media packets (0 = no FEC)", 0, 100, RTP_CLIENT_SINK_DEFAULT_FEC_PERCENTAGE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_RTP_RTX_TIME,
+		g_param_spec_uint ("rtx-time", "Retransmission time", "How long in ms sent packets are kept for retransmission on NACK", 0, G_MAXUINT, RTP_CLIENT_SINK_DEFAULT_RTX_TIME, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_RTP_MAX_LATENESS,
+		g_param_spec_int64 ("max-lateness", "Max lateness", "Maximum number of nanoseconds that a buffer can be late before it is dropped (-1 unlimited)", -1, G_MAXINT64, -1, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_RTP_STATS,
+		g_param_spec_boxed ("stats", "Stats", "Receiver report figures in the same layout as dreamtcpclientsink's stats", GST_TYPE_STRUCTURE, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+	gst_dream_rtp_client_sink_signals[RTP_SIGNAL_KEEPALIVE] =
+		g_signal_new ("keepalive", G_TYPE_FROM_CLASS (klass),
+		G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION, G_STRUCT_OFFSET(GstDreamRTPClientSinkClass, keepalive),
+		NULL, NULL, NULL,
+		G_TYPE_BOOLEAN, 0);
+
+	gst_element_class_add_pad_template (element_class, gst_static_pad_template_get (&rtp_client_sink_template));
+	gst_element_class_set_static_metadata (element_class, "Dreambox RTP client sink", "Sink/Network",
+		"Sends a transport stream as RTP over UDP with forward error correction and retransmission", "Andreas Frisch <fraxinas@opendreambox.org>");
+
+	GST_DEBUG_CATEGORY_INIT (rtsp_server_debug, "dreamrtspserver",
+		GST_DEBUG_BOLD | GST_DEBUG_FG_YELLOW | GST_DEBUG_BG_BLUE,
+		"Dreambox RTSP server daemon");
+}
+
+static void gst_dream_rtp_client_sink_init (GstDreamRTPClientSink * self)
+{
+	GstPad *ghostpad, *pad;
+	GstCaps *caps;
+
+	self->host = g_strdup (TCP_CLIENT_SINK_DEFAULT_HOST);
+	self->port = RTP_CLIENT_SINK_DEFAULT_PORT;
+	self->token = NULL;
+	self->fec_percentage = RTP_CLIENT_SINK_DEFAULT_FEC_PERCENTAGE;
+	self->rtx_time = RTP_CLIENT_SINK_DEFAULT_RTX_TIME;
+	self->max_lateness = -1;
+	self->fecenc = self->rtxsend = NULL;
+	self->rtcp_socket = NULL;
+	self->linked = FALSE;
+	self->delivered = 0;
+	self->delivered_time = 0;
+
+	self->payloader = gst_element_factory_make ("rtpmp2tpay", NULL);
+	self->rtpbin = gst_element_factory_make ("rtpbin", NULL);
+	self->rtpsink = gst_element_factory_make ("udpsink", NULL);
+	self->rtcpsink = gst_element_factory_make ("udpsink", NULL);
+	self->rtcpsrc = gst_element_factory_make ("udpsrc", NULL);
+
+	ghostpad = gst_ghost_pad_new_no_target_from_template ("sink", gst_static_pad_template_get (&rtp_client_sink_template));
+	gst_element_add_pad (GST_ELEMENT (self), ghostpad);
+
+	if (!self->payloader || !self->rtpbin || !self->rtpsink || !self->rtcpsink || !self->rtcpsrc)
+		return;
+
+	/* NACKs are only acted on right away with the AVPF profile */
+	g_object_set (self->payloader, "pt", RTP_CLIENT_SINK_MP2T_PT, NULL);
+	gst_util_set_object_arg (G_OBJECT (self->rtpbin), "rtp-profile", "avpf");
+	caps = gst_caps_new_empty_simple ("application/x-rtcp");
+	g_object_set (self->rtcpsrc, "caps", caps, NULL);
+	gst_caps_unref (caps);
+	gst_bin_add_many (GST_BIN (self), self->payloader, self->rtpbin, self->rtpsink, self->rtcpsink, self->rtcpsrc, NULL);
+
+	pad = gst_element_get_static_pad (self->payloader, "sink");
+	gst_ghost_pad_set_target (GST_GHOST_PAD (ghostpad), pad);
+	gst_object_unref (pad);
+}
+
+gboolean gst_dream_rtp_client_sink_register (void)
+{
+	return gst_element_register (NULL, "dreamrtpclientsink", GST_RANK_NONE, GST_TYPE_DREAM_RTP_CLIENT_SINK);
+}
+
+static GstStaticPadTemplate compact_mux_audio_template = GST_STATIC_PAD_TEMPLATE ("audio", GST_PAD_SINK, GST_PAD_ALWAYS, GST_STATIC_CAPS ("audio/mpeg, mpegversion=(int)4"));
+static GstStaticPadTemplate compact_mux_video_template = GST_STATIC_PAD_TEMPLATE ("video", GST_PAD_SINK, GST_PAD_ALWAYS, GST_STATIC_CAPS ("video/x-h264"));
+static GstStaticPadTemplate compact_mux_src_template = GST_STATIC_PAD_TEMPLATE ("src", GST_PAD_SRC, GST_PAD_ALWAYS, GST_STATIC_CAPS ("application/x-dream-compact"));
+
+G_DEFINE_TYPE (GstDreamCompactMux, gst_dream_compact_mux, GST_TYPE_ELEMENT);
+
+/* timestamps are 90 kHz like in the TS and wrap after 32 bits, receivers unwrap them the same way */
+static GstMemory *gst_dream_compact_mux_header (guint8 type, guint8 flags, gsize size, GstClockTime pts, GstClockTime dts)
+{
+	GstMemory *mem = gst_allocator_alloc (NULL, DREAM_COMPACT_HEADER_SIZE, NULL);
+	GstMapInfo map;
+	gint32 cts = 0;
+
+	if (GST_CLOCK_TIME_IS_VALID (pts) && GST_CLOCK_TIME_IS_VALID (dts))
+		cts = pts >= dts ? (gint32) gst_util_uint64_scale (pts - dts, 90000, GST_SECOND) : -(gint32) gst_util_uint64_scale (dts - pts, 90000, GST_SECOND);
+	gst_memory_map (mem, &map, GST_MAP_WRITE);
+	map.data[0] = type;
+	map.data[1] = flags;
+	GST_WRITE_UINT32_BE (map.data + 2, size);
+	GST_WRITE_UINT32_BE (map.data + 6, GST_CLOCK_TIME_IS_VALID (pts) ? (guint32) gst_util_uint64_scale (pts, 90000, GST_SECOND) : 0);
+	GST_WRITE_UINT32_BE (map.data + 10, (guint32) cts);
+	gst_memory_unmap (mem, &map);
+	return mem;
+}
+
+static void gst_dream_compact_mux_store_event (GstDreamCompactMux *self, GstEvent *event)
+{
+	if (gst_pad_store_sticky_event (self->srcpad, event) != GST_FLOW_OK)
+		GST_WARNING_OBJECT (self, "couldn't store %" GST_PTR_FORMAT, event);
+	gst_event_unref (event);
+}
+
+static GstBuffer *gst_dream_compact_mux_caps_frame (guint8 type, GstCaps *caps)
+{
+	gchar *str = gst_caps_to_string (caps);
+	gsize len = strlen (str);
+	GstBuffer *frame = gst_buffer_new ();
+
+	gst_buffer_append_memory (frame, gst_dream_compact_mux_header (type, 0, len, GST_CLOCK_TIME_NONE, GST_CLOCK_TIME_NONE));
+	gst_buffer_append_memory (frame, gst_memory_new_wrapped (0, str, len, 0, len, str, g_free));
+	return frame;
+}
+
+/* the two inputs are merged into a single stream, so the src pad gets its own sticky events once the first frame is there.
+ * they are only stored here and go out ahead of the next push, nothing is pushed while the lock is held */
+static void gst_dream_compact_mux_start (GstDreamCompactMux *self)
+{
+	GstCaps *caps;
+	GstSegment segment;
+	gchar *stream_id;
+
+	if (self->started)
+		return;
+	stream_id = gst_pad_create_stream_id (self->srcpad, GST_ELEMENT_CAST (self), NULL);
+	gst_dream_compact_mux_store_event (self, gst_event_new_stream_start (stream_id));
+	g_free (stream_id);
+	caps = gst_static_pad_template_get_caps (&compact_mux_src_template);
+	gst_dream_compact_mux_store_event (self, gst_event_new_caps (caps));
+	gst_caps_unref (caps);
+	if (!self->segment)
+	{
+		gst_segment_init (&segment, GST_FORMAT_TIME);
+		self->segment = gst_event_new_segment (&segment);
+	}
+	gst_dream_compact_mux_store_event (self, gst_event_ref (self->segment));
+	self->started = TRUE;
+}
+
+static GstFlowReturn gst_dream_compact_mux_chain (GstPad *pad, GstObject *parent, GstBuffer *buffer)
+{
+	GstDreamCompactMux *self = GST_DREAM_COMPACT_MUX (parent);
+	gboolean video = pad == self->videopad;
+	gboolean keyframe = video && !GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+	GstBuffer *frame = gst_buffer_new ();
+	GstFlowReturn ret;
+
+	g_mutex_lock (&self->lock);
+	gst_dream_compact_mux_start (self);
+	/* the stream configuration goes ahead of every keyframe, so a receiver can join at any of them */
+	if (keyframe)
+	{
+		if (self->video_caps)
+			gst_buffer_copy_into (frame, self->video_caps, GST_BUFFER_COPY_MEMORY, 0, -1);
+		if (self->audio_caps)
+			gst_buffer_copy_into (frame, self->audio_caps, GST_BUFFER_COPY_MEMORY, 0, -1);
+	}
+	gst_buffer_append_memory (frame, gst_dream_compact_mux_header (video ? DREAM_COMPACT_VIDEO : DREAM_COMPACT_AUDIO, keyframe ? DREAM_COMPACT_FLAG_KEY : 0,
+		gst_buffer_get_size (buffer), GST_BUFFER_PTS (buffer), GST_BUFFER_DTS (buffer)));
+	gst_buffer_copy_into (frame, buffer, GST_BUFFER_COPY_MEMORY, 0, -1);
+	GST_BUFFER_PTS (frame) = GST_BUFFER_PTS (buffer);
+	GST_BUFFER_DTS (frame) = GST_BUFFER_DTS (buffer);
+	GST_BUFFER_DURATION (frame) = GST_BUFFER_DURATION (buffer);
+	/* only video keyframes are points the sink may resume at */
+	if (!keyframe)
+		GST_BUFFER_FLAG_SET (frame, GST_BUFFER_FLAG_DELTA_UNIT);
+	gst_buffer_unref (buffer);
+	g_mutex_unlock (&self->lock);
+
+	/* pushing unlocked, a probe downstream may take the mux down from within the push */
+	ret = gst_pad_push (self->srcpad, frame);
+	return ret;
+}
+
+static gboolean gst_dream_compact_mux_sink_event (GstPad *pad, GstObject *parent, GstEvent *event)
+{
+	GstDreamCompactMux *self = GST_DREAM_COMPACT_MUX (parent);
+	gboolean video = pad == self->videopad;
+	gboolean ret = TRUE;
+
+	switch (GST_EVENT_TYPE (event)) {
+		case GST_EVENT_CAPS:
+		{
+			GstCaps *caps;
+			GstBuffer **config = video ? &self->video_caps : &self->audio_caps;
+
+			gst_event_parse_caps (event, &caps);
+			GST_DEBUG_OBJECT (self, "%s config %" GST_PTR_FORMAT, video ? "video" : "audio", caps);
+			g_mutex_lock (&self->lock);
+			if (*config)
+				gst_buffer_unref (*config);
+			*config = gst_dream_compact_mux_caps_frame (video ? DREAM_COMPACT_VIDEO_CAPS : DREAM_COMPACT_AUDIO_CAPS, caps);
+			g_mutex_unlock (&self->lock);
+			gst_event_unref (event);
+			break;
+		}
+		case GST_EVENT_SEGMENT:
+			g_mutex_lock (&self->lock);
+			if (!self->segment)
+				self->segment = gst_event_ref (event);
+			g_mutex_unlock (&self->lock);
+			gst_event_unref (event);
+			break;
+		case GST_EVENT_EOS:
+			g_mutex_lock (&self->lock);
+			if (video)
+				self->video_eos = TRUE;
+			else
+				self->audio_eos = TRUE;
+			if (self->video_eos && self->audio_eos)
+				gst_dream_compact_mux_start (self);
+			else
+				g_clear_pointer (&event, gst_event_unref);
+			g_mutex_unlock (&self->lock);
+			if (event)
+				ret = gst_pad_push_event (self->srcpad, event);
+			break;
+		case GST_EVENT_FLUSH_STOP:
+			g_mutex_lock (&self->lock);
+			if (video)
+				self->video_eos = FALSE;
+			else
+				self->audio_eos = FALSE;
+			g_mutex_unlock (&self->lock);
+			ret = gst_pad_push_event (self->srcpad, event);
+			break;
+		case GST_EVENT_FLUSH_START:
+			ret = gst_pad_push_event (self->srcpad, event);
+			break;
+		default:
+			gst_event_unref (event);
+			break;
+	}
+	return ret;
+}
+
+static gboolean gst_dream_compact_mux_sink_query (GstPad *pad, GstObject *parent, GstQuery *query)
+{
+	if (GST_QUERY_TYPE (query) == GST_QUERY_CAPS)
+	{
+		GstCaps *filter, *caps = gst_pad_get_pad_template_caps (pad);
+
+		gst_query_parse_caps (query, &filter);
+		if (filter)
+		{
+			GstCaps *intersection = gst_caps_intersect_full (filter, caps, GST_CAPS_INTERSECT_FIRST);
+			gst_caps_unref (caps);
+			caps = intersection;
+		}
+		gst_query_set_caps_result (query, caps);
+		gst_caps_unref (caps);
+		return TRUE;
+	}
+	return gst_pad_query_default (pad, parent, query);
+}
+
+static void gst_dream_compact_mux_reset (GstDreamCompactMux *self)
+{
+	g_mutex_lock (&self->lock);
+	self->started = self->audio_eos = self->video_eos = FALSE;
+	g_clear_pointer (&self->segment, gst_event_unref);
+	g_clear_pointer (&self->audio_caps, gst_buffer_unref);
+	g_clear_pointer (&self->video_caps, gst_buffer_unref);
+	g_mutex_unlock (&self->lock);
+}
+
+static GstStateChangeReturn gst_dream_compact_mux_change_state (GstElement *element, GstStateChange transition)
+{
+	GstDreamCompactMux *self = GST_DREAM_COMPACT_MUX (element);
+	GstStateChangeReturn ret;
+
+	ret = GST_ELEMENT_CLASS (gst_dream_compact_mux_parent_class)->change_state (element, transition);
+
+	if (transition == GST_STATE_CHANGE_PAUSED_TO_READY)
+		gst_dream_compact_mux_reset (self);
+	return ret;
+}
+
+static void gst_dream_compact_mux_finalize (GObject *object)
+{
+	GstDreamCompactMux *self = GST_DREAM_COMPACT_MUX (object);
+	gst_dream_compact_mux_reset (self);
+	g_mutex_clear (&self->lock);
+	G_OBJECT_CLASS (gst_dream_compact_mux_parent_class)->finalize (object);
+}
+
+static void gst_dream_compact_mux_class_init (GstDreamCompactMuxClass * klass)
+{
+	GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+	GstElementClass *element_class = GST_ELEMENT_CLASS (klass);
+
+	gobject_class->finalize = gst_dream_compact_mux_finalize;
+	element_class->change_state = gst_dream_compact_mux_change_state;
+
+	gst_element_class_add_pad_template (element_class, gst_static_pad_template_get (&compact_mux_audio_template));
+	gst_element_class_add_pad_template (element_class, gst_static_pad_template_get (&compact_mux_video_template));
+	gst_element_class_add_pad_template (element_class, gst_static_pad_template_get (&compact_mux_src_template));
+	gst_element_class_set_static_metadata (element_class, "Dreambox compact upstream muxer", "Codec/Muxer",
+		"Frames H.264 and AAC with length and timestamp headers instead of a transport stream", "Andreas Frisch <fraxinas@opendreambox.org>");
+
+	GST_DEBUG_CATEGORY_INIT (rtsp_server_debug, "dreamrtspserver",
+		GST_DEBUG_BOLD | GST_DEBUG_FG_YELLOW | GST_DEBUG_BG_BLUE,
+		"Dreambox RTSP server daemon");
+}
+
+static void gst_dream_compact_mux_init (GstDreamCompactMux * self)
+{
+	self->audiopad = gst_pad_new_from_static_template (&compact_mux_audio_template, "audio");
+	gst_pad_set_chain_function (self->audiopad, gst_dream_compact_mux_chain);
+	gst_pad_set_event_function (self->audiopad, gst_dream_compact_mux_sink_event);
+	gst_pad_set_query_function (self->audiopad, gst_dream_compact_mux_sink_query);
+	gst_element_add_pad (GST_ELEMENT (self), self->audiopad);
+
+	self->videopad = gst_pad_new_from_static_template (&compact_mux_video_template, "video");
+	gst_pad_set_chain_function (self->videopad, gst_dream_compact_mux_chain);
+	gst_pad_set_event_function (self->videopad, gst_dream_compact_mux_sink_event);
+	gst_pad_set_query_function (self->videopad, gst_dream_compact_mux_sink_query);
+	gst_element_add_pad (GST_ELEMENT (self), self->videopad);
+
+	self->srcpad = gst_pad_new_from_static_template (&compact_mux_src_template, "src");
+	gst_element_add_pad (GST_ELEMENT (self), self->srcpad);
+
+	g_mutex_init (&self->lock);
+	self->started = self->audio_eos = self->video_eos = FALSE;
+	self->segment = NULL;
+	self->audio_caps = self->video_caps = NULL;
+}
+
+GBytes *gst_dream_compact_mux_keepalive_frame (void)
+{
+	guint8 *frame = g_malloc0 (DREAM_COMPACT_HEADER_SIZE);
+	frame[0] = DREAM_COMPACT_KEEPALIVE;
+	return g_bytes_new_take (frame, DREAM_COMPACT_HEADER_SIZE);
+}
+
+gboolean gst_dream_compact_mux_register (void)
+{
+	return gst_element_register (NULL, "dreamcompactmux", GST_RANK_NONE, GST_TYPE_DREAM_COMPACT_MUX);
+}
@@ -17,6 +17,8 @@
  */
 
 #include <gst/gst.h>
+#include <gst/base/gstbasesink.h>
+#include <gio/gio.h>
 #include <gst/rtsp-server/rtsp-client.h>
 #include <gst/rtsp-server/rtsp-media.h>
 
@@ -34,6 +36,13 @@ G_BEGIN_DECLS
 #define GST_DREAM_RTSP_CLIENT_CAST(obj)         ((GstDreamRTSPClient*)(obj))
 #define GST_DREAM_RTSP_CLIENT_CLASS_CAST(klass) ((GstDreamRTSPClientClass*)(klass))
 
+#define DREAM_RTSP_CLIENT_SEND_TIMEOUT (5*G_USEC_PER_SEC)
+
+typedef enum {
+	DREAM_RTSP_CLIENT_POLICY_SKIP = 0,
+	DREAM_RTSP_CLIENT_POLICY_DISCONNECT = 1
+} GstDreamRTSPClientPolicy;
+
 typedef struct _GstDreamRTSPClient GstDreamRTSPClient;
 typedef struct _GstDreamRTSPClientClass GstDreamRTSPClientClass;
 typedef struct _GstDreamRTSPClientPrivate GstDreamRTSPClientPrivate;
@@ -60,6 +69,33 @@ GType   gst_dream_rtsp_client_get_type (void);
 /* creating the factory */
 GstDreamRTSPClient * gst_dream_rtsp_client_new (void);
 
+#define DREAM_RTSP_PACER_BURST 3000
+#define DREAM_RTSP_PACER_FRAME_INTERVAL (40*GST_MSECOND)
+#define DREAM_RTSP_PACER_HEADROOM 1.25
+#define DREAM_RTSP_PACER_RATE_WINDOW (500*G_TIME_SPAN_MILLISECOND)
+
+typedef struct _GstDreamRTSPPacer GstDreamRTSPPacer;
+
+/* spreads the packets of every access unit a payloader sends over one frame interval, never faster than the peak rate.
+ * without a frame interval (GST_CLOCK_TIME_NONE) packets just leave at the measured stream rate plus headroom */
+struct _GstDreamRTSPPacer {
+	gint refcount;
+	GMutex lock;
+	guint peak_rate;
+	GstClockTime frame_interval, au_pts;
+	gdouble rate, stream_rate, tokens;
+	gint64 refill, frame_arrival, window_start;
+	guint64 au_bytes, window_bytes;
+	guint64 paced_bytes, paced_packets, delay_sum, delay_max;
+};
+
+GstDreamRTSPPacer * gst_dream_rtsp_pacer_new (guint peak_rate, GstClockTime frame_interval);
+GstDreamRTSPPacer * gst_dream_rtsp_pacer_ref (GstDreamRTSPPacer *pacer);
+void gst_dream_rtsp_pacer_unref (GstDreamRTSPPacer *pacer);
+void gst_dream_rtsp_pacer_set_peak_rate (GstDreamRTSPPacer *pacer, guint peak_rate);
+gboolean gst_dream_rtsp_pacer_attach (GstDreamRTSPPacer *pacer, GstElement *payloader);
+void gst_dream_rtsp_pacer_get_stats (GstDreamRTSPPacer *pacer, guint64 *paced_bytes, guint64 *paced_packets, guint64 *queue_delay, guint64 *max_queue_delay);
+
 #define GST_TYPE_DREAM_RTSP_SERVER              (gst_dream_rtsp_server_get_type())
 #define GST_IS_DREAM_RTSP_SERVER(obj)           (G_TYPE_CHECK_INSTANCE_TYPE((obj), GST_TYPE_DREAM_RTSP_SERVER))
 #define GST_IS_DREAM_RTSP_SERVER_CLASS(cls)     (G_TYPE_CHECK_CLASS_TYPE((cls), GST_TYPE_DREAM_RTSP_SERVER))
@@ -131,6 +167,221 @@ GType                      gst_dream_rtsp_media_factory_get_type (void);
 /* creating the factory */
 GstDreamRTSPMediaFactory * gst_dream_rtsp_media_factory_new      (void);
 
+#define GST_TYPE_DREAM_SOFT_VIDEO_SOURCE              (gst_dream_soft_video_source_get_type ())
+#define GST_IS_DREAM_SOFT_VIDEO_SOURCE(obj)           (G_TYPE_CHECK_INSTANCE_TYPE ((obj), GST_TYPE_DREAM_SOFT_VIDEO_SOURCE))
+#define GST_DREAM_SOFT_VIDEO_SOURCE(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj), GST_TYPE_DREAM_SOFT_VIDEO_SOURCE, GstDreamSoftVideoSource))
+#define GST_DREAM_SOFT_VIDEO_SOURCE_CAST(obj)         ((GstDreamSoftVideoSource*)(obj))
+
+typedef struct _GstDreamSoftVideoSource GstDreamSoftVideoSource;
+typedef struct _GstDreamSoftVideoSourceClass GstDreamSoftVideoSourceClass;
+
+/* software stand-in for dreamvideosource: videotestsrc ! x264enc with the same property interface */
+struct _GstDreamSoftVideoSource {
+	GstBin parent;
+
+	GstElement *testsrc, *rawfilter, *encoder, *encfilter;
+	GstCaps *caps;
+	gint input_mode;
+	gint bitrate, gop_length, bframes, pframes, slices, level;
+	gboolean gop_scene, open_gop;
+};
+
+struct _GstDreamSoftVideoSourceClass {
+	GstBinClass parent_class;
+};
+
+GType gst_dream_soft_video_source_get_type (void);
+
+#define GST_TYPE_DREAM_SOFT_AUDIO_SOURCE              (gst_dream_soft_audio_source_get_type ())
+#define GST_IS_DREAM_SOFT_AUDIO_SOURCE(obj)           (G_TYPE_CHECK_INSTANCE_TYPE ((obj), GST_TYPE_DREAM_SOFT_AUDIO_SOURCE))
+#define GST_DREAM_SOFT_AUDIO_SOURCE(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj), GST_TYPE_DREAM_SOFT_AUDIO_SOURCE, GstDreamSoftAudioSource))
+#define GST_DREAM_SOFT_AUDIO_SOURCE_CAST(obj)         ((GstDreamSoftAudioSource*)(obj))
+
+typedef struct _GstDreamSoftAudioSource GstDreamSoftAudioSource;
+typedef struct _GstDreamSoftAudioSourceClass GstDreamSoftAudioSourceClass;
+
+/* software stand-in for dreamaudiosource: audiotestsrc ! aac encoder */
+struct _GstDreamSoftAudioSource {
+	GstBin parent;
+
+	GstElement *testsrc, *convert, *resample, *rawfilter, *encoder;
+	gint input_mode;
+	gint bitrate;
+};
+
+struct _GstDreamSoftAudioSourceClass {
+	GstBinClass parent_class;
+
+	/* signals */
+	void (*signal_lost) (GstElement *element);
+};
+
+GType gst_dream_soft_audio_source_get_type (void);
+
+/* registers dreamsoftaudiosource and dreamsoftvideosource as static elements */
+gboolean gst_dream_soft_source_register (void);
+
+#define GST_TYPE_DREAM_TCP_CLIENT_SINK              (gst_dream_tcp_client_sink_get_type ())
+#define GST_IS_DREAM_TCP_CLIENT_SINK(obj)           (G_TYPE_CHECK_INSTANCE_TYPE ((obj), GST_TYPE_DREAM_TCP_CLIENT_SINK))
+#define GST_DREAM_TCP_CLIENT_SINK(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj), GST_TYPE_DREAM_TCP_CLIENT_SINK, GstDreamTCPClientSink))
+#define GST_DREAM_TCP_CLIENT_SINK_CAST(obj)         ((GstDreamTCPClientSink*)(obj))
+
+typedef struct _GstDreamTCPClientSink GstDreamTCPClientSink;
+typedef struct _GstDreamTCPClientSinkClass GstDreamTCPClientSinkClass;
+
+/* follows the token in the preamble when the server may send commands back, one "<command> [value]" per line */
+#define DREAM_CONTROL_MAGIC "DCC1"
+
+/* tcpclientsink replacement that owns its GSocket, so the kernel's view of the connection can be sampled */
+struct _GstDreamTCPClientSink {
+	GstBaseSink parent;
+
+	gchar *host;
+	gint port;
+	GSocket *socket;
+	GCancellable *cancellable;
+	guint64 bytes_written, delivered, sends;
+	gint64 delivered_time;
+
+	GArray *batch;
+	gsize batch_bytes;
+	GstClockTime batch_start;
+	guint max_batch_size, notsent_lowat;
+	GstClockTime max_batch_delay;
+	gboolean zerocopy;
+	guint32 zerocopy_seq;
+	GQueue zerocopy_pending;
+
+	GBytes *preamble;
+	gboolean need_preamble, wait_keyframe;
+	gboolean reconnect, flushing;
+	guint reconnect_min_delay, reconnect_max_delay;
+	GMutex reconnect_lock;
+	GCond reconnect_cond;
+
+	gchar *standby_host;
+	gint standby_port;
+	GSocket *standby;
+	GCancellable *standby_cancellable;
+	GThread *standby_thread;
+	gboolean standby_stop;
+	guint stall_timeout, failovers;
+
+	gchar *spool_location;
+	guint spool_size, spool_max_rate;
+	guint8 *spool;
+	gsize spool_capacity;
+	gboolean spool_mapped, spool_wait_keyframe;
+	guint64 spool_head, spool_tail, spool_dropped;
+	GArray *spool_keyframes;
+	gint64 spool_drain_time, outage_start;
+	GSocket *reconnected;
+	GCancellable *reconnect_cancellable;
+	GThread *reconnect_thread;
+	gboolean reconnect_stop;
+	guint reconnect_attempt;
+
+	GMutex send_lock;
+	GBytes *keepalive_frame, *keepalive_pending;
+	guint keepalive_rest;
+	guint64 keepalives;
+
+	gboolean control, control_stop;
+	GThread *control_thread;
+	GCancellable *control_cancellable;
+	guint64 control_messages;
+};
+
+struct _GstDreamTCPClientSinkClass {
+	GstBaseSinkClass parent_class;
+
+	/* actions */
+	gboolean (*keepalive) (GstDreamTCPClientSink *sink);
+};
+
+GType gst_dream_tcp_client_sink_get_type (void);
+
+/* registers dreamtcpclientsink as static element */
+gboolean gst_dream_tcp_client_sink_register (void);
+
+#define GST_TYPE_DREAM_RTP_CLIENT_SINK              (gst_dream_rtp_client_sink_get_type ())
+#define GST_IS_DREAM_RTP_CLIENT_SINK(obj)           (G_TYPE_CHECK_INSTANCE_TYPE ((obj), GST_TYPE_DREAM_RTP_CLIENT_SINK))
+#define GST_DREAM_RTP_CLIENT_SINK(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj), GST_TYPE_DREAM_RTP_CLIENT_SINK, GstDreamRTPClientSink))
+#define GST_DREAM_RTP_CLIENT_SINK_CAST(obj)         ((GstDreamRTPClientSink*)(obj))
+
+typedef struct _GstDreamRTPClientSink GstDreamRTPClientSink;
+typedef struct _GstDreamRTPClientSinkClass GstDreamRTPClientSinkClass;
+
+/* sends the transport stream as RTP over UDP with ULPFEC and NACK retransmission, with the same stats and actions as dreamtcpclientsink */
+struct _GstDreamRTPClientSink {
+	GstBin parent;
+
+	gchar *host, *token;
+	gint port;
+	guint fec_percentage, rtx_time;
+	gint64 max_lateness;
+	GstElement *payloader, *rtpbin, *rtpsink, *rtcpsink, *rtcpsrc;
+	GstElement *fecenc, *rtxsend;
+	GSocket *rtcp_socket;
+	gboolean linked;
+	guint64 delivered;
+	gint64 delivered_time;
+};
+
+struct _GstDreamRTPClientSinkClass {
+	GstBinClass parent_class;
+
+	/* actions */
+	gboolean (*keepalive) (GstDreamRTPClientSink *sink);
+};
+
+GType gst_dream_rtp_client_sink_get_type (void);
+
+/* registers dreamrtpclientsink as static element */
+gboolean gst_dream_rtp_client_sink_register (void);
+
+#define GST_TYPE_DREAM_COMPACT_MUX              (gst_dream_compact_mux_get_type ())
+#define GST_IS_DREAM_COMPACT_MUX(obj)           (G_TYPE_CHECK_INSTANCE_TYPE ((obj), GST_TYPE_DREAM_COMPACT_MUX))
+#define GST_DREAM_COMPACT_MUX(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj), GST_TYPE_DREAM_COMPACT_MUX, GstDreamCompactMux))
+#define GST_DREAM_COMPACT_MUX_CAST(obj)         ((GstDreamCompactMux*)(obj))
+
+/* compact upstream framing, every frame is a 14 byte big endian header
+ * (type, flags, payload size, pts and pts-dts in 90 kHz ticks) followed by the payload */
+#define DREAM_COMPACT_MAGIC       "DCF1"
+#define DREAM_COMPACT_HEADER_SIZE 14
+#define DREAM_COMPACT_VIDEO       'V'
+#define DREAM_COMPACT_AUDIO       'A'
+#define DREAM_COMPACT_VIDEO_CAPS  'v'
+#define DREAM_COMPACT_AUDIO_CAPS  'a'
+#define DREAM_COMPACT_KEEPALIVE   'K'
+#define DREAM_COMPACT_FLAG_KEY    0x01
+
+typedef struct _GstDreamCompactMux GstDreamCompactMux;
+typedef struct _GstDreamCompactMuxClass GstDreamCompactMuxClass;
+
+/* length prefixed H.264 access units and AAC frames for upstream links that don't need a transport stream */
+struct _GstDreamCompactMux {
+	GstElement parent;
+
+	GstPad *audiopad, *videopad, *srcpad;
+	GMutex lock;
+	gboolean started, audio_eos, video_eos;
+	GstEvent *segment;
+	GstBuffer *audio_caps, *video_caps;
+};
+
+struct _GstDreamCompactMuxClass {
+	GstElementClass parent_class;
+};
+
+GType gst_dream_compact_mux_get_type (void);
+
+/* an empty frame receivers skip, for the sink's keepalive-frame */
+GBytes *gst_dream_compact_mux_keepalive_frame (void);
+
+/* registers dreamcompactmux as static element */
+gboolean gst_dream_compact_mux_register (void);
+
 G_END_DECLS
 
 #endif /* __GSTDREAMRTSP_H__ */
\ No newline at end of file
@@ -0,0 +1,139 @@
+#!/usr/bin/python
+# Drives the RTP upstream into a local receiver through netem packet loss and checks that the
+# rate controller backs off on the losses the receiver reports. Needs root for tc and a running
+# dreamrtspserver built with upstream support.
+#
+#   rtpupstreamlosstest.py [loss percent] [rtp port]
+import dbus
+import select
+import socket
+import struct
+import subprocess
+import sys
+import time
+
+INTERFACE = 'com.dreambox.RTSPserver'
+OBJECT = '/com/dreambox/RTSPserver'
+UPSTREAM_INTERFACE = INTERFACE + '.Upstream'
+UPSTREAM_OBJECT = OBJECT + '/upstream0'
+TRANSPORT_RTP = 1
+
+LOSS = int(sys.argv[1]) if len(sys.argv) > 1 else 5
+PORT = int(sys.argv[2]) if len(sys.argv) > 2 else 5004
+SETTLE = 10
+LOSSY = 20
+REPORT_INTERVAL = 1.0
+RECEIVER_SSRC = 0x5eed1055
+
+class LossReceiver(object):
+	"""counts the media packets of the sender reports' source and answers with receiver reports, like a mediator would"""
+
+	def __init__(self, port):
+		self.rtp = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+		self.rtp.bind(('127.0.0.1', port))
+		self.rtcp = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+		self.rtcp.bind(('127.0.0.1', port + 1))
+		self.peer = None
+		self.ssrc = None
+		self.base = self.max_seq = None
+		self.cycles = 0
+		self.received = 0
+		self.expected_prior = self.received_prior = 0
+		self.lsr = 0
+		self.lsr_time = 0
+		self.last_report = time.time()
+
+	def run(self, seconds):
+		end = time.time() + seconds
+		while time.time() < end:
+			readable, _, _ = select.select([self.rtp, self.rtcp], [], [], 0.1)
+			if self.rtp in readable:
+				self.on_rtp(self.rtp.recv(2048))
+			if self.rtcp in readable:
+				data, self.peer = self.rtcp.recvfrom(2048)
+				self.on_rtcp(data)
+			if self.peer and self.ssrc is not None and time.time() - self.last_report >= REPORT_INTERVAL:
+				self.send_report()
+
+	def on_rtp(self, data):
+		if len(data) < 12 or self.ssrc is None:
+			return
+		seq, ssrc = struct.unpack('!H4xI', data[2:12])
+		if ssrc != self.ssrc:
+			return
+		if self.base is None:
+			self.base = self.max_seq = seq
+		elif 0 < (seq - self.max_seq) & 0xffff < 0x8000:
+			if seq < self.max_seq:
+				self.cycles += 0x10000
+			self.max_seq = seq
+		self.received += 1
+
+	def on_rtcp(self, data):
+		# the first packet of a compound from the sender is its sender report
+		if len(data) < 28 or ord(data[1:2]) != 200:
+			return
+		ssrc, ntp_sec, ntp_frac = struct.unpack('!III', data[4:16])
+		self.ssrc = ssrc
+		self.lsr = ((ntp_sec & 0xffff) << 16) | (ntp_frac >> 16)
+		self.lsr_time = time.time()
+
+	def send_report(self):
+		self.last_report = time.time()
+		if self.base is None:
+			return
+		extended = self.cycles + self.max_seq
+		expected = extended - self.base + 1
+		lost = expected - self.received
+		expected_interval = expected - self.expected_prior
+		lost_interval = expected_interval - (self.received - self.received_prior)
+		self.expected_prior = expected
+		self.received_prior = self.received
+		fraction = (lost_interval << 8) // expected_interval if expected_interval > 0 and lost_interval > 0 else 0
+		lost = max(-0x800000, min(lost, 0x7fffff)) & 0xffffff
+		dlsr = int((time.time() - self.lsr_time) * 65536) if self.lsr else 0
+		rr = struct.pack('!BBHI', 0x81, 201, 7, RECEIVER_SSRC)
+		rr += struct.pack('!III', self.ssrc, (fraction << 24) | lost, extended & 0xffffffff)
+		rr += struct.pack('!III', 0, self.lsr, dlsr)
+		cname = b'losstest'
+		item = struct.pack('!BB', 1, len(cname)) + cname + b'\0'
+		item += b'\0' * (-len(item) % 4)
+		sdes = struct.pack('!BBHI', 0x81, 202, 1 + len(item) // 4, RECEIVER_SSRC) + item
+		self.rtcp.sendto(rr + sdes, self.peer)
+
+def netem(loss):
+	subprocess.call(['tc', 'qdisc', 'del', 'dev', 'lo', 'root'], stderr=open('/dev/null', 'w'))
+	if loss:
+		subprocess.check_call(['tc', 'qdisc', 'add', 'dev', 'lo', 'root', 'netem', 'loss', '%d%%' % loss])
+
+def get(proxy, interface, prop):
+	return proxy.Get(interface, prop, dbus_interface=dbus.PROPERTIES_IFACE)
+
+bus = dbus.SystemBus()
+server = dbus.Interface(bus.get_object(INTERFACE, OBJECT), INTERFACE)
+upstream = bus.get_object(INTERFACE, UPSTREAM_OBJECT)
+upstream.Set(UPSTREAM_INTERFACE, 'transport', dbus.Int32(TRANSPORT_RTP), dbus_interface=dbus.PROPERTIES_IFACE)
+upstream.Set(UPSTREAM_INTERFACE, 'autoBitrate', True, dbus_interface=dbus.PROPERTIES_IFACE)
+
+receiver = LossReceiver(PORT)
+netem(0)
+if not server.enableUpstream(True, '127.0.0.1', dbus.UInt32(PORT), 'losstest'):
+	sys.exit('enableUpstream failed')
+try:
+	receiver.run(SETTLE)
+	before = get(upstream, UPSTREAM_INTERFACE, 'rateControl')
+	print('clean link: %s' % dict(before))
+	netem(LOSS)
+	receiver.run(LOSSY)
+	after = get(upstream, UPSTREAM_INTERFACE, 'rateControl')
+	stats = get(upstream, UPSTREAM_INTERFACE, 'socketStats')
+	print('%d%% loss: %s' % (LOSS, dict(after)))
+	print('receiver reports: packetsLost=%d fractionLost=%d' % (stats['packetsLost'], stats['fractionLost']))
+finally:
+	netem(0)
+	server.enableUpstream(False, '', dbus.UInt32(0), '')
+
+if after['decreases'] > before['decreases'] and after['current'] < before['current']:
+	print('PASS: the rate controller backed off under loss')
+else:
+	sys.exit('FAIL: no decrease under %d%% loss' % LOSS)